@@ -43,6 +43,13 @@ enum {
     NO_SAVE_ARGS,
     SHOW_LAST_ARGS,
     RESOLVE_URL,
+    BULK_COUNT,
+    BULK_RATE,
+    BULK_WORKERS,
+    CYCLE_USERS,
+    CYCLE_KEYS,
+    CYCLE_SPOOF_SRC,
+    KEY_ID_HINT,
     /* Put GPG-related items below the following line */
     GPG_ENCRYPTION      = 0x200,
     GPG_RECIP_KEY,
@@ -67,6 +74,10 @@ static struct option cmd_opts[] =
     {"save-packet",         1, NULL, 'B'},
     {"no-save-args",        0, NULL, NO_SAVE_ARGS},
     {"server-cmd",          1, NULL, 'C'},
+    {"count",               1, NULL, BULK_COUNT},
+    {"cycle-users",         1, NULL, CYCLE_USERS},
+    {"cycle-keys",          1, NULL, CYCLE_KEYS},
+    {"cycle-spoof-src",     1, NULL, CYCLE_SPOOF_SRC},
     {"digest-type",         1, NULL, FKO_DIGEST_NAME},
     {"destination",         1, NULL, 'D'},
     {"fw-timeout",          1, NULL, 'f'},
@@ -78,6 +89,7 @@ static struct option cmd_opts[] =
     {"get-key",             1, NULL, 'G'},
     {"help",                0, NULL, 'h'},
     {"http-proxy",          1, NULL, 'H'},
+    {"key-id",              0, NULL, KEY_ID_HINT},
     {"last-cmd",            0, NULL, 'l'},
     {"nat-access",          1, NULL, 'N'},
     {"named-config",        1, NULL, 'n'},
@@ -88,12 +100,14 @@ static struct option cmd_opts[] =
     {"server-proto",        1, NULL, 'P'},
     {"spoof-src",           1, NULL, 'Q'},
     {"rand-port",           0, NULL, 'r'},
+    {"rate",                1, NULL, BULK_RATE},
     {"resolve-ip-http",     0, NULL, 'R'},
     {"resolve-url",         1, NULL, RESOLVE_URL},
     {"show-last",           0, NULL, SHOW_LAST_ARGS},
     {"source-ip",           0, NULL, 's'},
     {"source-port",         1, NULL, 'S'},
     {"test",                0, NULL, 'T'},
+    {"threads",             1, NULL, BULK_WORKERS},
     {"time-offset-plus",    1, NULL, TIME_OFFSET_PLUS},
     {"time-offset-minus",   1, NULL, TIME_OFFSET_MINUS},
     {"user-agent",          1, NULL, 'u'},
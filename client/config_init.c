@@ -180,6 +180,7 @@ create_fwknoprc(char *rcfile)
         "#SPOOF_USER          <username>\n"
         "#SPOOF_SOURCE_IP     <IPaddr>\n"
         "#TIME_OFFSET         0\n"
+        "#KEY_ID              N\n"
         "#USE_GPG             N\n"
         "#GPG_HOMEDIR         /path/to/.gnupg\n"
         "#GPG_SIGNER          <signer ID>\n"
@@ -288,6 +289,12 @@ parse_rc_param(fko_cli_options_t *options, char *var, char * val)
         else
             options->time_offset_plus = parse_time_offset(val);
     }
+    /* Lead the SPA data with the key ID ? */
+    else if(CONF_VAR_IS(var, "KEY_ID"))
+    {
+        if(val[0] == 'y' || val[0] == 'Y')
+            options->key_id_hint = 1;
+    }
     /* Use GPG ? */
     else if(CONF_VAR_IS(var, "USE_GPG"))
     {
@@ -599,6 +606,42 @@ validate_options(fko_cli_options_t *options)
         exit(EXIT_FAILURE);
     }
 
+    /* The bulk mode options only make sense with --count.
+    */
+    if(options->bulk_count == 0
+      && (options->bulk_rate > 0 || options->bulk_workers > 0
+        || options->bulk_users[0] != 0x0 || options->bulk_key_file[0] != 0x0
+        || options->bulk_spoof_src[0] != 0x0))
+    {
+        fprintf(stderr,
+            "--rate, --threads and --cycle-* require --count.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(options->bulk_spoof_src[0] != 0x0
+      && options->spa_proto != FKO_PROTO_TCP_RAW
+      && options->spa_proto != FKO_PROTO_ICMP)
+    {
+        fprintf(stderr,
+            "--cycle-spoof-src requires the tcpraw or icmp protocol.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(options->bulk_key_file[0] != 0x0 && options->use_gpg)
+    {
+        fprintf(stderr,
+            "--cycle-keys only applies to Rijndael encryption.\n");
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef WIN32
+    if(options->bulk_count > 0)
+    {
+        fprintf(stderr, "--count is not supported on Win32.\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
     /* If we are using gpg, we must at least have the recipient set.
     */
     if(options->use_gpg)
@@ -690,6 +733,39 @@ config_init(fko_cli_options_t *options, int argc, char **argv)
             case 'C':
                 strlcpy(options->server_command, optarg, MAX_LINE_LEN);
                 break;
+            case BULK_COUNT:
+                if((options->bulk_count = atoi(optarg)) <= 0)
+                {
+                    fprintf(stderr, "--count must be > 0\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case BULK_RATE:
+                if((options->bulk_rate = atof(optarg)) <= 0)
+                {
+                    fprintf(stderr, "--rate must be > 0\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case BULK_WORKERS:
+                options->bulk_workers = atoi(optarg);
+                if(options->bulk_workers < 1
+                  || options->bulk_workers > MAX_BULK_WORKERS)
+                {
+                    fprintf(stderr, "--threads must be between 1 and %i\n",
+                        MAX_BULK_WORKERS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case CYCLE_USERS:
+                strlcpy(options->bulk_users, optarg, MAX_LINE_LEN);
+                break;
+            case CYCLE_KEYS:
+                strlcpy(options->bulk_key_file, optarg, MAX_PATH_LEN);
+                break;
+            case CYCLE_SPOOF_SRC:
+                strlcpy(options->bulk_spoof_src, optarg, MAX_LINE_LEN);
+                break;
             case 'D':
                 strlcpy(options->spa_server_str, optarg, MAX_SERVER_STR_LEN);
                 break;
@@ -728,6 +804,9 @@ config_init(fko_cli_options_t *options, int argc, char **argv)
             case NO_SAVE_ARGS:
                 options->no_save_args = 1;
                 break;
+            case KEY_ID_HINT:
+                options->key_id_hint = 1;
+                break;
             case 'n':
                 /* We already handled this earlier, so we do nothing here
                 */
@@ -903,11 +982,30 @@ usage(void)
       "                             line args as the last time it was executed\n"
       "                             (args are read from the ~/.fwknop.run file).\n"
       " -G, --get-key               Load an encryption key/password from a file.\n"
+      "     --key-id                Put the ID of the Rijndael key in front of\n"
+      "                             the SPA data so a server with many keys can\n"
+      "                             tell which one to use.\n"
       " -r, --rand-port             Send the SPA packet over a randomly assigned\n"
       "                             port (requires a broader pcap filter on the\n"
       "                             server side than the default of udp 62201).\n"
       " -T, --test                  Build the SPA packet but do not send it over\n"
       "                             the network.\n"
+      "     --count                 Bulk mode (for load testing): generate this\n"
+      "                             many SPA packets, each with a fresh random\n"
+      "                             value and timestamp.  They are sent to the\n"
+      "                             server and/or written to the --save-packet\n"
+      "                             file (one per line).  Use with --test to only\n"
+      "                             write them.\n"
+      "     --rate                  Bulk mode: total packets per second to send\n"
+      "                             (default is as fast as possible).\n"
+      "     --threads               Bulk mode: number of worker processes to\n"
+      "                             generate and send with (default 1).\n"
+      "     --cycle-users           Bulk mode: comma separated list of usernames\n"
+      "                             to cycle through.\n"
+      "     --cycle-keys            Bulk mode: file of Rijndael keys (one per\n"
+      "                             line) to cycle through.\n"
+      "     --cycle-spoof-src       Bulk mode: comma separated list of source IPs\n"
+      "                             to cycle through (tcpraw and icmp only).\n"
       " -v, --verbose               Set verbose mode.\n"
       " -V, --version               Print version number.\n"
       " -m, --digest-type           Specify the message digest algorithm to use.\n"
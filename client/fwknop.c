@@ -33,18 +33,17 @@
 #include "spa_comm.h"
 #include "utils.h"
 #include "getpasswd.h"
+#include "spa_bulk.h"
 
 /* prototypes
 */
 char* get_user_pw(fko_cli_options_t *options, int crypt_op);
 static void display_ctx(fko_ctx_t ctx);
-void errmsg(char *msg, int err);
 static void show_last_command(void);
 static void save_args(int argc, char **argv);
 static void run_last_args(fko_cli_options_t *options);
 static int set_message_type(fko_ctx_t ctx, fko_cli_options_t *options);
 static int set_nat_access(fko_ctx_t ctx, fko_cli_options_t *options);
-static int get_rand_port(fko_ctx_t ctx);
 static void dump_transmit_options(fko_cli_options_t *options);
 
 int resolve_ip_http(fko_cli_options_t *options);
@@ -55,7 +54,7 @@ main(int argc, char **argv)
 {
     fko_ctx_t           ctx, ctx2;
     int                 res;
-    char               *spa_data, *version;
+    char               *spa_data, *version, *key;
     char                access_buf[MAX_LINE_LEN];
 
     fko_cli_options_t   options;
@@ -105,6 +104,18 @@ main(int argc, char **argv)
         }
     }
 
+    /* Lead the SPA data with the key ID if so requested
+    */
+    if(options.key_id_hint)
+    {
+        res = fko_set_spa_key_id_hint(ctx, 1);
+        if(res != FKO_SUCCESS)
+        {
+            errmsg("fko_set_spa_key_id_hint", res);
+            return(EXIT_FAILURE);
+        }
+    }
+
     /* Set the SPA packet message type based on command line options
     */
     res = set_message_type(ctx, &options);
@@ -250,7 +261,9 @@ main(int argc, char **argv)
 
     /* Finalize the context data (encrypt and encode the SPA data)
     */
-    res = fko_spa_data_final(ctx, get_user_pw(&options, CRYPT_OP_ENCRYPT));
+    key = get_user_pw(&options, CRYPT_OP_ENCRYPT);
+
+    res = fko_spa_data_final(ctx, key);
     if(res != FKO_SUCCESS)
     {
         errmsg("fko_spa_data_final", res);
@@ -261,6 +274,18 @@ main(int argc, char **argv)
         return(EXIT_FAILURE);
     }
 
+    /* In bulk mode, generate and send (or save) --count packets based on
+     * this one, and we are done.
+    */
+    if(options.bulk_count > 0)
+    {
+        res = spa_bulk(ctx, &options, key);
+
+        fko_destroy(ctx);
+
+        return((res == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
     /* Display the context data.
     */
     if (options.verbose || options.test)
@@ -393,7 +418,7 @@ print_proto(int proto)
     return;
 }
 
-static int
+int
 get_rand_port(fko_ctx_t ctx)
 {
     char *rand_val = NULL;
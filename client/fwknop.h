@@ -39,4 +39,9 @@
 #define CRYPT_OP_ENCRYPT 1
 #define CRYPT_OP_DECRYPT 2
 
+/* Prototypes
+*/
+void errmsg(char *msg, int err);
+int get_rand_port(fko_ctx_t ctx);
+
 #endif  /* FWKNOP_H */
@@ -71,6 +71,10 @@
 #define MAX_URL_HOST_LEN            256
 #define MAX_URL_PATH_LEN            1024
 
+/* Bulk mode limits
+*/
+#define MAX_BULK_WORKERS            64
+
 /* fwknop client configuration parameters and values
 */
 typedef struct fko_cli_options
@@ -124,10 +128,20 @@ typedef struct fko_cli_options
     unsigned char   test;
     unsigned char   use_gpg;
     unsigned char   use_gpg_agent;
+    unsigned char   key_id_hint;
     int             time_offset_plus;
     int             time_offset_minus;
     int             fw_timeout;
 
+    /* Bulk (load testing) mode
+    */
+    int             bulk_count;
+    double          bulk_rate;
+    int             bulk_workers;
+    char            bulk_users[MAX_LINE_LEN];
+    char            bulk_key_file[MAX_PATH_LEN];
+    char            bulk_spoof_src[MAX_LINE_LEN];
+
     char            use_rc_stanza[MAX_LINE_LEN];
     unsigned char   got_named_stanza;
 
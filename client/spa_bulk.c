@@ -0,0 +1,423 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_bulk.c
+ *
+ * Purpose: Bulk SPA packet generation (--count) for load testing fwknopd.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknop.h"
+#include "spa_bulk.h"
+#include "spa_comm.h"
+#include "utils.h"
+#include "netinet_common.h"
+
+#include <fcntl.h>
+
+#ifndef WIN32
+  #include <sys/time.h>
+  #include <sys/wait.h>
+  #include <sys/uio.h>
+#endif
+
+/* A list of values to cycle through.
+*/
+struct bulk_list {
+    char  **vals;
+    int     count;
+};
+
+#ifndef WIN32
+
+/* Add a copy of val to the list.
+*/
+static void
+bulk_list_add(struct bulk_list *list, const char *val)
+{
+    char  **new_vals;
+
+    new_vals = realloc(list->vals, (list->count + 1) * sizeof(char *));
+    if(new_vals == NULL || (new_vals[list->count] = strdup(val)) == NULL)
+    {
+        fprintf(stderr, "Memory allocation error in bulk_list_add.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    list->vals = new_vals;
+    list->count++;
+}
+
+/* Split a comma separated string into a list.
+*/
+static void
+bulk_list_split(struct bulk_list *list, const char *str)
+{
+    char    buf[MAX_LINE_LEN];
+    char   *tok, *last = NULL;
+
+    strlcpy(buf, str, MAX_LINE_LEN);
+
+    for(tok = strtok_r(buf, ",", &last); tok != NULL;
+      tok = strtok_r(NULL, ",", &last))
+    {
+        while(isspace(*tok))
+            tok++;
+
+        if(*tok != '\0')
+            bulk_list_add(list, tok);
+    }
+}
+
+/* Read a list of keys, one per line.
+*/
+static void
+bulk_list_read(struct bulk_list *list, const char *file)
+{
+    FILE   *fp;
+    char    line[MAX_LINE_LEN];
+    char   *ndx;
+
+    if((fp = fopen(file, "r")) == NULL)
+    {
+        perror("Could not open --cycle-keys file: ");
+        exit(EXIT_FAILURE);
+    }
+
+    while(fgets(line, MAX_LINE_LEN, fp) != NULL)
+    {
+        if((ndx = strpbrk(line, "\r\n")) != NULL)
+            *ndx = '\0';
+
+        if(line[0] != '\0' && line[0] != '#')
+            bulk_list_add(list, line);
+    }
+
+    fclose(fp);
+
+    if(list->count == 0)
+    {
+        fprintf(stderr, "No keys found in '%s'.\n", file);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static double
+elapsed_secs(struct timeval *start)
+{
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+
+    return((now.tv_sec - start->tv_sec)
+        + (now.tv_usec - start->tv_usec) / 1000000.0);
+}
+
+/* For UDP we set up one socket per worker instead of creating one (and
+ * resolving the server) for every packet.
+*/
+static int
+bulk_udp_socket(fko_cli_options_t *options, struct sockaddr_storage *dst,
+    socklen_t *dst_len)
+{
+    struct addrinfo    *result, hints;
+    char                port_str[MAX_PORT_STR_LEN];
+    int                 sock, error;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+
+    snprintf(port_str, MAX_PORT_STR_LEN, "%d", options->spa_dst_port);
+
+    error = getaddrinfo(options->spa_server_str, port_str, &hints, &result);
+    if(error != 0)
+    {
+        fprintf(stderr, "error in getaddrinfo: %s\n", gai_strerror(error));
+        return(-1);
+    }
+
+    sock = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if(sock < 0)
+    {
+        perror("bulk_udp_socket: Could not create socket: ");
+        freeaddrinfo(result);
+        return(-1);
+    }
+
+    memcpy(dst, result->ai_addr, result->ai_addrlen);
+    *dst_len = result->ai_addrlen;
+
+    freeaddrinfo(result);
+
+    return(sock);
+}
+
+/* Generate (and send and/or save) this worker's share of the packets.
+ * Packet numbers are interleaved between workers so that the cycled
+ * values are spread the same way regardless of the number of workers.
+ * Returns the number of packets that failed.
+*/
+static int
+bulk_worker(fko_ctx_t ctx, fko_cli_options_t *options, char *key,
+    int worker, struct bulk_list *users, struct bulk_list *keys,
+    struct bulk_list *srcs)
+{
+    struct sockaddr_storage dst;
+    socklen_t               dst_len = 0;
+    struct timeval          start;
+    double                  rate, ahead;
+    char                   *spa_data;
+    struct iovec            iov[2];
+    int                     n, res, len, sock = -1, fd = -1, failed = 0;
+    int                     offset = options->time_offset_plus
+                                        - options->time_offset_minus;
+
+    if(options->save_packet_file[0] != 0x0)
+    {
+        fd = open(options->save_packet_file, O_WRONLY|O_APPEND|O_CREAT, 0600);
+        if(fd < 0)
+        {
+            perror("bulk_worker: Could not open save packet file: ");
+            return(options->bulk_count);
+        }
+    }
+
+    if(!options->test && options->spa_proto == FKO_PROTO_UDP)
+    {
+        if((sock = bulk_udp_socket(options, &dst, &dst_len)) < 0)
+            return(options->bulk_count);
+    }
+
+    rate = options->bulk_rate / options->bulk_workers;
+
+    gettimeofday(&start, NULL);
+
+    for(n = worker; n < options->bulk_count; n += options->bulk_workers)
+    {
+        /* Pace ourselves if a rate was given.
+        */
+        if(rate > 0)
+        {
+            ahead = (n / options->bulk_workers) / rate - elapsed_secs(&start);
+            if(ahead > 0)
+                usleep(ahead * 1000000);
+        }
+
+        /* Each packet gets a new random value and timestamp (and the next
+         * user and key if we are cycling them).
+        */
+        if((res = fko_set_rand_value(ctx, NULL)) != FKO_SUCCESS
+          || (res = fko_set_timestamp(ctx, offset)) != FKO_SUCCESS)
+        {
+            errmsg("bulk_worker", res);
+            failed++;
+            continue;
+        }
+
+        if(users->count > 0
+          && (res = fko_set_username(ctx, users->vals[n % users->count])) != FKO_SUCCESS)
+        {
+            errmsg("fko_set_username", res);
+            failed++;
+            continue;
+        }
+
+        res = fko_spa_data_final(ctx,
+            (keys->count > 0) ? keys->vals[n % keys->count] : key);
+
+        if(res != FKO_SUCCESS || fko_get_spa_data(ctx, &spa_data) != FKO_SUCCESS)
+        {
+            errmsg("fko_spa_data_final", res);
+
+            if(IS_GPG_ERROR(res))
+                fprintf(stderr, "GPG ERR: %s\n", fko_gpg_errstr(ctx));
+
+            failed++;
+            continue;
+        }
+
+        /* One writev() per line, so lines from different workers are
+         * not interleaved.
+        */
+        if(fd >= 0)
+        {
+            iov[0].iov_base = spa_data;
+            iov[0].iov_len  = strlen(spa_data);
+            iov[1].iov_base = "\n";
+            iov[1].iov_len  = 1;
+
+            len = iov[0].iov_len + 1;
+
+            if(writev(fd, iov, 2) != len)
+            {
+                perror("bulk_worker: write error: ");
+                failed++;
+                continue;
+            }
+        }
+
+        if(options->test)
+            continue;
+
+        if(options->rand_port)
+            options->spa_dst_port = get_rand_port(ctx);
+
+        if(sock >= 0)
+        {
+            if(options->rand_port)
+            {
+                if(dst.ss_family == AF_INET)
+                    ((struct sockaddr_in *)&dst)->sin_port
+                        = htons(options->spa_dst_port);
+                else
+                    ((struct sockaddr_in6 *)&dst)->sin6_port
+                        = htons(options->spa_dst_port);
+            }
+
+            len = strlen(spa_data);
+            res = sendto(sock, spa_data, len, 0, (struct sockaddr *)&dst, dst_len);
+        }
+        else
+        {
+            if(srcs->count > 0)
+                strlcpy(options->spoof_ip_src_str,
+                    srcs->vals[n % srcs->count], MAX_IP_STR_LEN);
+
+            res = send_spa_packet(ctx, options);
+        }
+
+        if(res < 0)
+        {
+            if(sock >= 0)
+                perror("bulk_worker: sendto error: ");
+            failed++;
+        }
+    }
+
+    if(sock >= 0)
+        close(sock);
+
+    if(fd >= 0)
+        close(fd);
+
+    return(failed);
+}
+
+/* Generate options->bulk_count SPA packets from ctx (which has already
+ * been finalized once) using options->bulk_workers forked processes.
+*/
+int
+spa_bulk(fko_ctx_t ctx, fko_cli_options_t *options, char *key)
+{
+    struct bulk_list    users, keys, srcs;
+    struct timeval      start;
+    pid_t               pids[MAX_BULK_WORKERS];
+    int                 i, status, failed = 0, workers_failed = 0;
+    double              secs;
+
+    memset(&users, 0x0, sizeof(users));
+    memset(&keys, 0x0, sizeof(keys));
+    memset(&srcs, 0x0, sizeof(srcs));
+
+    if(options->bulk_workers < 1)
+        options->bulk_workers = 1;
+
+    if(options->bulk_workers > options->bulk_count)
+        options->bulk_workers = options->bulk_count;
+
+    if(options->bulk_users[0] != 0x0)
+        bulk_list_split(&users, options->bulk_users);
+
+    if(options->bulk_key_file[0] != 0x0)
+        bulk_list_read(&keys, options->bulk_key_file);
+
+    if(options->bulk_spoof_src[0] != 0x0)
+        bulk_list_split(&srcs, options->bulk_spoof_src);
+
+    /* Start with an empty save file unless we are appending.
+    */
+    if(options->save_packet_file[0] != 0x0 && !options->save_packet_file_append)
+        unlink(options->save_packet_file);
+
+    if(options->verbose)
+        fprintf(stderr, "Generating %i SPA packets with %i worker(s)%s.\n",
+            options->bulk_count, options->bulk_workers,
+            options->test ? " (not sending)" : "");
+
+    fflush(stdout);
+    fflush(stderr);
+
+    gettimeofday(&start, NULL);
+
+    for(i=0; i<options->bulk_workers; i++)
+    {
+        pids[i] = fork();
+
+        if(pids[i] == 0)
+        {
+            failed = bulk_worker(ctx, options, key, i, &users, &keys, &srcs);
+            _exit(failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+        else if(pids[i] < 0)
+        {
+            perror("spa_bulk: fork error: ");
+            break;
+        }
+    }
+
+    while(--i >= 0)
+    {
+        while(waitpid(pids[i], &status, 0) < 0 && errno == EINTR)
+            ;
+
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            workers_failed++;
+    }
+
+    secs = elapsed_secs(&start);
+
+    fprintf(stderr, "%s %i SPA packets in %.3f seconds (%.1f packets/s).\n",
+        options->test ? "Generated" : "Sent",
+        options->bulk_count, secs, (secs > 0) ? options->bulk_count / secs : 0.0);
+
+    if(workers_failed > 0)
+    {
+        fprintf(stderr, "%i worker(s) reported errors.\n", workers_failed);
+        return(-1);
+    }
+
+    return(0);
+}
+
+#else
+
+int
+spa_bulk(fko_ctx_t ctx, fko_cli_options_t *options, char *key)
+{
+    fprintf(stderr, "--count is not supported on Win32.\n");
+    return(-1);
+}
+
+#endif /* WIN32 */
+
+/***EOF***/
@@ -0,0 +1,38 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_bulk.h
+ *
+ * Purpose: Header file for spa_bulk.c.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_BULK_H
+#define SPA_BULK_H
+
+#include "fwknop_common.h"
+
+/* Function Prototypes
+*/
+int spa_bulk(fko_ctx_t ctx, fko_cli_options_t *options, char *key);
+
+#endif  /* SPA_BULK_H */
+
+/***EOF***/
@@ -28,83 +28,227 @@
  *
  *****************************************************************************
 */
+#ifdef WIN32
+  /* For rand_s().
+  */
+  #define _CRT_RAND_S
+#endif
+
 #include <stdio.h>
 #include <string.h>
 
 #ifdef WIN32
-  #include <sys/timeb.h>
-  #include <time.h>
   #include <stdlib.h>
 #else
   #include <sys/time.h>
+  #include <fcntl.h>
+  #include <errno.h>
 #endif
 
 #include "cipher_funcs.h"
 #include "digest.h"
 
+#ifndef WIN32
+  #if HAVE_SYS_RANDOM_H
+    #include <sys/random.h>
+  #endif
+  #if HAVE_PTHREAD_H
+    #include <pthread.h>
+  #endif
+#endif
+
 #ifndef WIN32
   #ifndef RAND_FILE
     #define RAND_FILE "/dev/urandom"
   #endif
+
+  #ifndef O_CLOEXEC
+    #define O_CLOEXEC 0
+  #endif
+
+  /* Size of the buffered randomness pool.  Requests of at least half
+   * this size bypass the pool and go straight to the kernel.
+  */
+  #define RAND_POOL_SIZE  4096
+#endif
+
+#ifndef WIN32
+/* Last resort if RAND_FILE cannot be read: hash whatever varies between
+ * calls (time, pid, a stack address and a block counter).  This keeps no
+ * state between calls, so it is safe to use from several threads.
+*/
+static void
+get_fallback_random_data(unsigned char *data, size_t len)
+{
+    struct {
+        struct timeval  tv;
+        clock_t         clk;
+        pid_t           pid;
+        void           *stack;
+        size_t          block;
+    } seed;
+
+    unsigned char   md[SHA256_DIGEST_LENGTH];
+    size_t          n;
+
+    memset(&seed, 0x0, sizeof(seed));
+
+    seed.pid   = getpid();
+    seed.stack = &seed;
+
+    while(len > 0)
+    {
+        gettimeofday(&(seed.tv), NULL);
+        seed.clk = clock();
+        seed.block++;
+
+        sha256(md, (unsigned char *)&seed, sizeof(seed));
+
+        n = (len < sizeof(md)) ? len : sizeof(md);
+
+        memcpy(data, md, n);
+
+        data += n;
+        len  -= n;
+    }
+}
+
+/* Pull len bytes from the kernel.  getrandom() is used when available
+ * (no file descriptor, works in a chroot), otherwise RAND_FILE is read.
+ * Returns the number of bytes actually obtained.
+*/
+static size_t
+get_kernel_random_data(unsigned char *data, size_t len)
+{
+    ssize_t         n;
+    size_t          got = 0;
+    int             fd;
+
+#if HAVE_GETRANDOM
+    while(got < len)
+    {
+        n = getrandom(data + got, len - got, 0);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n <= 0)
+            break;
+
+        got += n;
+    }
+
+    if(got == len)
+        return(got);
+#endif
+
+    if((fd = open(RAND_FILE, O_RDONLY|O_CLOEXEC)) >= 0)
+    {
+        while(got < len)
+        {
+            n = read(fd, data + got, len - got);
+
+            if(n < 0 && errno == EINTR)
+                continue;
+
+            if(n <= 0)
+                break;
+
+            got += n;
+        }
+
+        close(fd);
+    }
+
+    return(got);
+}
+
+/* The pool itself.  Bytes are handed out from the top down and wiped as
+ * they are consumed.  rand_pool_pid records which process filled it so a
+ * forked child never reuses bytes its parent has (or will) hand out.
+*/
+static unsigned char    rand_pool[RAND_POOL_SIZE];
+static size_t           rand_pool_avail = 0;
+static pid_t            rand_pool_pid   = 0;
+
+#if HAVE_PTHREAD_H
+static pthread_mutex_t  rand_pool_lock  = PTHREAD_MUTEX_INITIALIZER;
 #endif
+#endif /* !WIN32 */
 
-/* Get random data.
+/* Fill data with len random bytes.  Small requests (salts, rand values)
+ * are served from a buffered pool that is refilled from the kernel in
+ * RAND_POOL_SIZE chunks.  The pool is guarded by a mutex when pthreads
+ * are available, so this remains safe to call from several threads.
 */
 void
 get_random_data(unsigned char *data, size_t len)
 {
-	uint32_t		i;
 #ifdef WIN32
-	int				rnum;
-	struct _timeb	tb;
-
-	_ftime_s(&tb);
-
-	srand((uint32_t)(tb.time*1000)+tb.millitm);
+    unsigned int    rnum;
+    size_t          i;
 
-	for(i=0; i<len; i++)
-	{
-		rnum = rand();
-        *(data+i) = rnum % 0xff;
-	}
-#else
-	FILE           *rfd;
-    struct timeval  tv;
-    int             do_time = 0;
-    size_t          amt_read;
-
-    /* Attempt to read seed data from /dev/urandom.  If that does not
-     * work, then fall back to a time-based method (less secure, but
-     * probably more portable).
+    /* rand_s() goes to the system CSPRNG and keeps no state of its own.
     */
-    if((rfd = fopen(RAND_FILE, "r")) == NULL)
+    for(i=0; i<len; i++)
     {
-        do_time = 1;
+        rand_s(&rnum);
+        *(data+i) = rnum & 0xff;
     }
-    else
+#else
+    size_t          got, n;
+    pid_t           pid;
+
+    if(len >= RAND_POOL_SIZE / 2)
     {
-        /* Read seed from /dev/urandom
-        */
-        amt_read = fread(data, len, 1, rfd);
-        fclose(rfd);
+        got = get_kernel_random_data(data, len);
+
+        if(got < len)
+            get_fallback_random_data(data + got, len - got);
 
-        if (amt_read != 1)
-            do_time = 1;
+        return;
     }
 
-    if (do_time)
+    pid = getpid();
+
+#if HAVE_PTHREAD_H
+    pthread_mutex_lock(&rand_pool_lock);
+#endif
+
+    if(rand_pool_pid != pid)
     {
-        /* Seed based on time (current usecs).
-        */
-        gettimeofday(&tv, NULL);
-        srand(tv.tv_usec);
+        memset(rand_pool, 0x0, sizeof(rand_pool));
+        rand_pool_avail = 0;
+        rand_pool_pid   = pid;
+    }
 
-        for(i=0; i<len; i++)
-            *(data+i) = rand() % 0xff;
+    while(len > 0)
+    {
+        if(rand_pool_avail == 0)
+        {
+            got = get_kernel_random_data(rand_pool, RAND_POOL_SIZE);
+
+            if(got < RAND_POOL_SIZE)
+                get_fallback_random_data(rand_pool + got, RAND_POOL_SIZE - got);
+
+            rand_pool_avail = RAND_POOL_SIZE;
+        }
+
+        n = (len < rand_pool_avail) ? len : rand_pool_avail;
+
+        rand_pool_avail -= n;
+
+        memcpy(data, rand_pool + rand_pool_avail, n);
+        memset(rand_pool + rand_pool_avail, 0x0, n);
+
+        data += n;
+        len  -= n;
     }
 
+#if HAVE_PTHREAD_H
+    pthread_mutex_unlock(&rand_pool_lock);
+#endif
 #endif
-
 }
 
 
@@ -252,6 +396,25 @@ rij_encrypt(unsigned char *in, size_t in_len, char *pass, unsigned char *out)
     return(ondx - out);
 }
 
+/* Decrypt only the first block of the given (salted) data into out, which
+ * must have room for 16 bytes.  in must hold at least 32 bytes (the salt
+ * header and one block).
+*/
+void
+rij_decrypt_first_block(unsigned char *in, char *pass, unsigned char *out)
+{
+    RIJNDAEL_context    ctx;
+    unsigned char       mixtext[16];
+    int                 i;
+
+    rijndael_init(&ctx, pass, in);
+
+    block_decrypt(&ctx, in+16, 16, mixtext, ctx.iv);
+
+    for(i=0; i<sizeof(mixtext); i++)
+        out[i] = mixtext[i] ^ ctx.iv[i];
+}
+
 /* Decrypt the given data.
 */
 size_t
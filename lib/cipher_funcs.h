@@ -47,8 +47,10 @@
 */
 #define PREDICT_ENCSIZE(x) (1+(x>>4)+(x&0xf?1:0))<<4
 
+void get_random_data(unsigned char *data, size_t len);
 size_t rij_encrypt(unsigned char *in, size_t len, char *key, unsigned char *out);
 size_t rij_decrypt(unsigned char *in, size_t len, char *key, unsigned char *out);
+void rij_decrypt_first_block(unsigned char *in, char *key, unsigned char *out);
 
 #endif /* CIPHER_FUNCS_H */
 
@@ -55,6 +55,11 @@ extern "C" {
 */
 #define FKO_PROTOCOL_VERSION "1.9.12" /* The fwknop protocol version */
 
+/* Length of the (optional) key ID that can lead Rijndael SPA data so a
+ * server with many keys knows which one to use.
+*/
+#define FKO_KEY_ID_SIZE     8
+
 /* Supported FKO Message types...
 */
 typedef enum {
@@ -168,6 +173,13 @@ typedef enum {
 struct fko_context;
 typedef struct fko_context *fko_ctx_t;
 
+/* A gpgme context and recipient key that can be set up once and then
+ * shared by many SPA contexts (see fko_gpg_cache_new()).  This is also
+ * an opaque pointer.
+*/
+struct fko_gpg_cache;
+typedef struct fko_gpg_cache *fko_gpg_cache_t;
+
 /* Some gpg-specifc data types and constants.
 */
 #if HAVE_LIBGPGME
@@ -188,6 +200,7 @@ enum {
 
 /* General api calls
 */
+DLL_API int fko_global_init(void);
 DLL_API int fko_new(fko_ctx_t *ctx);
 DLL_API int fko_new_with_data(fko_ctx_t *ctx, char *enc_msg, char *dec_key);
 DLL_API void fko_destroy(fko_ctx_t ctx);
@@ -207,12 +220,17 @@ DLL_API int fko_set_spa_client_timeout(fko_ctx_t ctx, int timeout);
 DLL_API int fko_set_spa_digest_type(fko_ctx_t ctx, short digest_type);
 DLL_API int fko_set_spa_digest(fko_ctx_t ctx);
 DLL_API int fko_set_spa_encryption_type(fko_ctx_t ctx, short encrypt_type);
+DLL_API int fko_set_spa_key_id_hint(fko_ctx_t ctx, unsigned char val);
 DLL_API int fko_set_spa_data(fko_ctx_t ctx, char *enc_msg);
 
 /* Data processing and misc utility functions
 */
 DLL_API const char* fko_errstr(int err_code);
 DLL_API int fko_encryption_type(char *enc_data);
+DLL_API int fko_key_id(const char *key, char *key_id);
+DLL_API int fko_spa_data_key_id(const char *spa_data, char *key_id);
+DLL_API int fko_spa_data_len(const char *spa_data);
+DLL_API int fko_rijndael_key_check(const char *spa_data, const char *key);
 
 DLL_API int fko_encode_spa_data(fko_ctx_t ctx);
 DLL_API int fko_decode_spa_data(fko_ctx_t ctx);
@@ -235,6 +253,7 @@ DLL_API int fko_get_spa_client_timeout(fko_ctx_t ctx, int *client_timeout);
 DLL_API int fko_get_spa_digest_type(fko_ctx_t ctx, short *spa_digest_type);
 DLL_API int fko_get_spa_digest(fko_ctx_t ctx, char **spa_digest);
 DLL_API int fko_get_spa_encryption_type(fko_ctx_t ctx, short *spa_enc_type);
+DLL_API int fko_get_spa_key_id_hint(fko_ctx_t ctx, unsigned char *val);
 DLL_API int fko_get_spa_data(fko_ctx_t ctx, char **spa_data);
 
 DLL_API int fko_get_version(fko_ctx_t ctx, char **version);
@@ -265,6 +284,10 @@ DLL_API int fko_get_gpg_signature_status(fko_ctx_t ctx, int *sigstat);
 DLL_API int fko_gpg_signature_id_match(fko_ctx_t ctx, const char *id, unsigned char *result);
 DLL_API int fko_gpg_signature_fpr_match(fko_ctx_t ctx, const char *fpr, unsigned char *result);
 
+DLL_API int fko_gpg_cache_new(fko_gpg_cache_t *cache, const char *gpg_exe, const char *gpg_home_dir, const char *recip);
+DLL_API void fko_gpg_cache_destroy(fko_gpg_cache_t cache);
+DLL_API int fko_set_gpg_cache(fko_ctx_t ctx, fko_gpg_cache_t cache);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,582 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fko_bench.c
+ *
+ * Purpose: Micro-benchmarks for libfko (built and run with 'make bench').
+ *
+ *          Each benchmark is run repeatedly for a minimum amount of time and
+ *          the results (ops/s and ns/op) are written as JSON.  Given a saved
+ *          baseline (-c), the results are compared against it and any
+ *          benchmark that got slower by more than the threshold is flagged.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fko_common.h"
+#include "fko.h"
+#include "base64.h"
+#include "cipher_funcs.h"
+#include "digest.h"
+
+#include <sys/time.h>
+#include <time.h>
+
+#define BENCH_KEY               "fko_bench_key"
+#define BENCH_MAX_DATA_SIZE     4096
+#define BENCH_MAX_RESULTS       128
+#define BENCH_NAME_LEN          64
+#define BENCH_DEF_MIN_MS        500
+#define BENCH_DEF_THRESHOLD     10.0
+
+/* Buffer sizes used for the digest, base64 and rijndael benchmarks.
+*/
+static const size_t data_sizes[] = { 16, 64, 256, 1024, BENCH_MAX_DATA_SIZE };
+
+#define NUM_DATA_SIZES  (sizeof(data_sizes) / sizeof(data_sizes[0]))
+
+/* SPA access messages of increasing length for the fko_* benchmarks.  The
+ * longest is kept short enough that the Rijndael SPA data stays under
+ * MIN_GNUPG_MSG_SIZE (or fko_encryption_type() would take it for GPG).
+*/
+static const char *spa_msgs[] = {
+    "127.0.0.2,tcp/22",
+    "127.0.0.2,tcp/22,tcp/80,tcp/443,udp/53",
+    "127.0.0.2,tcp/22,tcp/25,tcp/80,tcp/143,tcp/443,tcp/993,udp/53,udp/123"
+};
+
+#define NUM_SPA_MSGS    (sizeof(spa_msgs) / sizeof(spa_msgs[0]))
+
+static const struct {
+    const char  *name;
+    short        type;
+    void       (*raw)(unsigned char *out, unsigned char *in, size_t size);
+    void       (*b64)(char *out, unsigned char *in, size_t size);
+} digests[] = {
+    { "md5",    FKO_DIGEST_MD5,    md5,    md5_base64 },
+    { "sha1",   FKO_DIGEST_SHA1,   sha1,   sha1_base64 },
+    { "sha256", FKO_DIGEST_SHA256, sha256, sha256_base64 },
+    { "sha384", FKO_DIGEST_SHA384, sha384, sha384_base64 },
+    { "sha512", FKO_DIGEST_SHA512, sha512, sha512_base64 }
+};
+
+#define NUM_DIGESTS     (sizeof(digests) / sizeof(digests[0]))
+
+/* Everything a single benchmark iteration needs.
+*/
+struct bench_arg {
+    int             idx;        /* digests[] index */
+    size_t          size;       /* Input size */
+    size_t          len;        /* Length of prepared input (in or str) */
+    unsigned char  *in;
+    unsigned char  *out;
+    char           *str;
+    const char     *msg;
+    short           enc_type;
+    short           digest_type;
+};
+
+struct bench_result {
+    char            name[BENCH_NAME_LEN];
+    size_t          size;
+    unsigned long   iterations;
+    double          ns_per_op;
+};
+
+static struct bench_result  results[BENCH_MAX_RESULTS];
+static int                  num_results = 0;
+
+static int          min_ms      = BENCH_DEF_MIN_MS;
+static const char  *gpg_recip   = NULL;
+static const char  *gpg_home    = NULL;
+static char        *gpg_pw      = NULL;
+
+static unsigned char    in_buf[BENCH_MAX_DATA_SIZE * 2];
+static unsigned char    out_buf[BENCH_MAX_DATA_SIZE * 2 + 64];
+static char             str_buf[BENCH_MAX_DATA_SIZE * 2 + 64];
+
+static double
+now_ns(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return(ts.tv_sec * 1e9 + ts.tv_nsec);
+#else
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+
+    return(tv.tv_sec * 1e9 + tv.tv_usec * 1e3);
+#endif
+}
+
+static void
+bench_fail(const char *what, int res)
+{
+    fprintf(stderr, "[*] %s failed: %s\n", what, fko_errstr(res));
+    exit(EXIT_FAILURE);
+}
+
+/* Run fn() in doubling batches until at least min_ms has gone by, and
+ * record the result.
+*/
+static void
+run_bench(const char *name, size_t size,
+    void (*fn)(struct bench_arg *), struct bench_arg *arg)
+{
+    struct bench_result    *r;
+    unsigned long           i, batch = 1, total = 0;
+    double                  start, elapsed = 0;
+
+    if(num_results >= BENCH_MAX_RESULTS)
+    {
+        fprintf(stderr, "[*] Too many benchmarks (max %i).\n", BENCH_MAX_RESULTS);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Warm up (and make sure it works at all).
+    */
+    fn(arg);
+
+    while(elapsed < min_ms * 1e6)
+    {
+        start = now_ns();
+
+        for(i=0; i<batch; i++)
+            fn(arg);
+
+        elapsed += now_ns() - start;
+        total   += batch;
+
+        if(batch < (1UL << 20))
+            batch *= 2;
+    }
+
+    r = &(results[num_results++]);
+
+    strlcpy(r->name, name, BENCH_NAME_LEN);
+    r->size       = size;
+    r->iterations = total;
+    r->ns_per_op  = elapsed / total;
+
+    fprintf(stderr, "%-36s %6lu %14.1f ns/op %14.1f ops/s\n",
+        r->name, (unsigned long)r->size, r->ns_per_op, 1e9 / r->ns_per_op);
+}
+
+/* The benchmarks themselves.
+*/
+static void
+bm_fko_new(struct bench_arg *arg)
+{
+    fko_ctx_t   ctx;
+    int         res;
+
+    if((res = fko_new(&ctx)) != FKO_SUCCESS)
+        bench_fail("fko_new", res);
+
+    fko_destroy(ctx);
+}
+
+/* Builds a complete SPA message, as the client does.  Calling
+ * fko_spa_data_final() more than once on a context is not supported, so
+ * this includes creating the context.  Subtract fko_new for the encode and
+ * encrypt cost alone.
+*/
+static void
+bm_fko_spa_data_final(struct bench_arg *arg)
+{
+    fko_ctx_t   ctx;
+    int         res;
+
+    if((res = fko_new(&ctx)) != FKO_SUCCESS)
+        bench_fail("fko_new", res);
+
+    if((res = fko_set_spa_message(ctx, arg->msg)) != FKO_SUCCESS)
+        bench_fail("fko_set_spa_message", res);
+
+    if((res = fko_set_spa_digest_type(ctx, arg->digest_type)) != FKO_SUCCESS)
+        bench_fail("fko_set_spa_digest_type", res);
+
+    if(arg->enc_type == FKO_ENCRYPTION_GPG)
+    {
+        if((res = fko_set_spa_encryption_type(ctx, FKO_ENCRYPTION_GPG)) != FKO_SUCCESS)
+            bench_fail("fko_set_spa_encryption_type", res);
+
+        if(gpg_home != NULL
+          && (res = fko_set_gpg_home_dir(ctx, gpg_home)) != FKO_SUCCESS)
+            bench_fail("fko_set_gpg_home_dir", res);
+
+        if((res = fko_set_gpg_recipient(ctx, gpg_recip)) != FKO_SUCCESS)
+            bench_fail("fko_set_gpg_recipient", res);
+    }
+
+    res = fko_spa_data_final(ctx,
+        (arg->enc_type == FKO_ENCRYPTION_GPG) ? gpg_pw : BENCH_KEY);
+
+    if(res != FKO_SUCCESS)
+        bench_fail("fko_spa_data_final", res);
+
+    /* Keep a copy of the first one for the fko_new_with_data benchmarks.
+    */
+    if(arg->str == NULL)
+    {
+        if(fko_get_spa_data(ctx, &(arg->str)) != FKO_SUCCESS
+          || (arg->str = strdup(arg->str)) == NULL)
+            bench_fail("fko_get_spa_data", FKO_ERROR_MEMORY_ALLOCATION);
+    }
+
+    fko_destroy(ctx);
+}
+
+static void
+bm_fko_new_with_data(struct bench_arg *arg)
+{
+    fko_ctx_t   ctx;
+    int         res;
+
+    if(arg->enc_type == FKO_ENCRYPTION_GPG)
+    {
+        /* Same sequence the server uses for GPG data.
+        */
+        if((res = fko_new_with_data(&ctx, arg->str, NULL)) != FKO_SUCCESS)
+            bench_fail("fko_new_with_data", res);
+
+        if(gpg_home != NULL
+          && (res = fko_set_gpg_home_dir(ctx, gpg_home)) != FKO_SUCCESS)
+            bench_fail("fko_set_gpg_home_dir", res);
+
+        fko_set_gpg_signature_verify(ctx, 0);
+
+        if((res = fko_decrypt_spa_data(ctx, gpg_pw)) != FKO_SUCCESS)
+            bench_fail("fko_decrypt_spa_data", res);
+    }
+    else if((res = fko_new_with_data(&ctx, arg->str, BENCH_KEY)) != FKO_SUCCESS)
+        bench_fail("fko_new_with_data", res);
+
+    fko_destroy(ctx);
+}
+
+static void
+bm_digest(struct bench_arg *arg)
+{
+    digests[arg->idx].raw(arg->out, arg->in, arg->size);
+}
+
+static void
+bm_digest_b64(struct bench_arg *arg)
+{
+    digests[arg->idx].b64((char *)arg->out, arg->in, arg->size);
+}
+
+static void
+bm_b64_encode(struct bench_arg *arg)
+{
+    b64_encode(arg->in, (char *)arg->out, arg->size);
+}
+
+static void
+bm_b64_decode(struct bench_arg *arg)
+{
+    b64_decode(arg->str, arg->out, arg->len);
+}
+
+static void
+bm_rij_encrypt(struct bench_arg *arg)
+{
+    rij_encrypt(arg->in, arg->size, BENCH_KEY, arg->out);
+}
+
+static void
+bm_rij_decrypt(struct bench_arg *arg)
+{
+    rij_decrypt((unsigned char *)arg->str, arg->len, BENCH_KEY, arg->out);
+}
+
+/* Run the fko_* benchmarks for one encryption type.
+*/
+static void
+run_fko_benches(short enc_type, const char *enc_name)
+{
+    struct bench_arg    arg;
+    char                name[BENCH_NAME_LEN];
+    size_t              i, d;
+
+    memset(&arg, 0x0, sizeof(arg));
+
+    arg.enc_type = enc_type;
+
+    for(i=0; i<NUM_SPA_MSGS; i++)
+    {
+        arg.msg = spa_msgs[i];
+
+        if(arg.str != NULL)
+        {
+            free(arg.str);
+            arg.str = NULL;
+        }
+
+        for(d=0; d<NUM_DIGESTS; d++)
+        {
+            arg.digest_type = digests[d].type;
+
+            snprintf(name, BENCH_NAME_LEN, "fko_spa_data_final/%s/%s",
+                enc_name, digests[d].name);
+            run_bench(name, strlen(arg.msg), bm_fko_spa_data_final, &arg);
+        }
+
+        /* arg.str now holds SPA data for this message.
+        */
+        snprintf(name, BENCH_NAME_LEN, "fko_new_with_data/%s", enc_name);
+        run_bench(name, strlen(arg.msg), bm_fko_new_with_data, &arg);
+    }
+
+    if(arg.str != NULL)
+        free(arg.str);
+}
+
+static void
+run_all_benches(void)
+{
+    struct bench_arg    arg;
+    char                name[BENCH_NAME_LEN];
+    size_t              i, d;
+
+    memset(&arg, 0x0, sizeof(arg));
+
+    run_bench("fko_new", 0, bm_fko_new, &arg);
+
+    run_fko_benches(FKO_ENCRYPTION_RIJNDAEL, "rijndael");
+
+#if HAVE_LIBGPGME
+    if(gpg_recip != NULL)
+        run_fko_benches(FKO_ENCRYPTION_GPG, "gpg");
+    else
+        fprintf(stderr, "(Skipping GPG benchmarks, no -r <recipient> given)\n");
+#endif
+
+    for(i=0; i<sizeof(in_buf); i++)
+        in_buf[i] = (unsigned char)(i * 31 + 7);
+
+    arg.in  = in_buf;
+    arg.out = out_buf;
+
+    for(i=0; i<NUM_DATA_SIZES; i++)
+    {
+        arg.size = data_sizes[i];
+
+        for(d=0; d<NUM_DIGESTS; d++)
+        {
+            arg.idx = d;
+
+            snprintf(name, BENCH_NAME_LEN, "digest/%s", digests[d].name);
+            run_bench(name, arg.size, bm_digest, &arg);
+
+            snprintf(name, BENCH_NAME_LEN, "digest/%s_base64", digests[d].name);
+            run_bench(name, arg.size, bm_digest_b64, &arg);
+        }
+
+        run_bench("b64_encode", arg.size, bm_b64_encode, &arg);
+
+        arg.str = str_buf;
+        arg.len = b64_encode(in_buf, str_buf, arg.size);
+        run_bench("b64_decode", arg.size, bm_b64_decode, &arg);
+
+        run_bench("rij_encrypt", arg.size, bm_rij_encrypt, &arg);
+
+        arg.len = rij_encrypt(in_buf, arg.size, BENCH_KEY, (unsigned char *)str_buf);
+        run_bench("rij_decrypt", arg.size, bm_rij_decrypt, &arg);
+
+        arg.str = NULL;
+    }
+}
+
+static void
+write_json(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "{\n  \"version\": \"%s\",\n  \"min_ms\": %i,\n  \"results\": [\n",
+        VERSION, min_ms);
+
+    /* Keep one result per line - the compare mode relies on it.
+    */
+    for(i=0; i<num_results; i++)
+        fprintf(fp,
+            "    {\"name\": \"%s\", \"size\": %lu, \"iterations\": %lu, "
+            "\"ns_per_op\": %.1f, \"ops_per_sec\": %.1f}%s\n",
+            results[i].name, (unsigned long)results[i].size,
+            results[i].iterations, results[i].ns_per_op,
+            1e9 / results[i].ns_per_op,
+            (i < num_results - 1) ? "," : ""
+        );
+
+    fprintf(fp, "  ]\n}\n");
+}
+
+/* Compare our results with a baseline file written by an earlier run.
+ * Returns the number of regressions.
+*/
+static int
+compare_baseline(const char *file, double threshold)
+{
+    FILE           *fp;
+    char            line[512], name[BENCH_NAME_LEN];
+    unsigned long   size, iter;
+    double          base_ns, change;
+    int             i, matched, regressions = 0;
+
+    if((fp = fopen(file, "r")) == NULL)
+    {
+        fprintf(stderr, "[*] Could not open baseline file '%s'.\n", file);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "\nComparison with '%s' (threshold %.1f%%):\n", file, threshold);
+
+    while(fgets(line, sizeof(line), fp) != NULL)
+    {
+        if(sscanf(line,
+                " {\"name\": \"%63[^\"]\", \"size\": %lu, \"iterations\": %lu, "
+                "\"ns_per_op\": %lf", name, &size, &iter, &base_ns) != 4)
+            continue;
+
+        matched = 0;
+
+        for(i=0; i<num_results; i++)
+        {
+            if(strcmp(results[i].name, name) != 0 || results[i].size != size)
+                continue;
+
+            matched = 1;
+            change  = (results[i].ns_per_op - base_ns) * 100.0 / base_ns;
+
+            if(change > threshold)
+                regressions++;
+
+            fprintf(stderr, "%-36s %6lu %12.1f -> %12.1f ns/op %+7.1f%%%s\n",
+                name, size, base_ns, results[i].ns_per_op, change,
+                (change > threshold) ? "  REGRESSION" : "");
+            break;
+        }
+
+        if(!matched)
+            fprintf(stderr, "%-36s %6lu (not in this run)\n", name, size);
+    }
+
+    fclose(fp);
+
+    fprintf(stderr, "%i regression(s).\n", regressions);
+
+    return(regressions);
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+      "Usage: fko_bench [options]\n\n"
+      " -o <file>    - Write the JSON results to <file> instead of stdout.\n"
+      " -c <file>    - Compare the results against a baseline JSON file and\n"
+      "                exit non-zero if anything regressed.\n"
+      " -t <pct>     - Slowdown (in percent) counted as a regression\n"
+      "                (default %.0f).\n"
+      " -m <ms>      - Minimum run time for each benchmark (default %i).\n"
+      " -r <id>      - GPG recipient key; enables the GPG benchmarks.\n"
+      " -p <pw>      - GPG signing/decryption key password.\n"
+      " -g <dir>     - GPG home directory.\n"
+      " -h           - Print this usage message and exit.\n",
+      BENCH_DEF_THRESHOLD, BENCH_DEF_MIN_MS
+    );
+}
+
+int
+main(int argc, char **argv)
+{
+    FILE           *fp = stdout;
+    const char     *out_file = NULL, *base_file = NULL;
+    double          threshold = BENCH_DEF_THRESHOLD;
+    int             i;
+
+    for(i=1; i<argc; i++)
+    {
+        if(strcmp(argv[i], "-h") == 0)
+        {
+            usage();
+            exit(EXIT_SUCCESS);
+        }
+
+        if(argv[i][0] != '-' || argv[i][2] != '\0' || i+1 >= argc)
+        {
+            usage();
+            exit(EXIT_FAILURE);
+        }
+
+        switch(argv[i++][1])
+        {
+            case 'o':
+                out_file = argv[i];
+                break;
+            case 'c':
+                base_file = argv[i];
+                break;
+            case 't':
+                threshold = atof(argv[i]);
+                break;
+            case 'm':
+                if((min_ms = atoi(argv[i])) <= 0)
+                    min_ms = BENCH_DEF_MIN_MS;
+                break;
+            case 'r':
+                gpg_recip = argv[i];
+                break;
+            case 'p':
+                gpg_pw = argv[i];
+                break;
+            case 'g':
+                gpg_home = argv[i];
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    run_all_benches();
+
+    if(out_file != NULL && (fp = fopen(out_file, "w")) == NULL)
+    {
+        fprintf(stderr, "[*] Could not write to '%s'.\n", out_file);
+        exit(EXIT_FAILURE);
+    }
+
+    write_json(fp);
+
+    if(fp != stdout)
+        fclose(fp);
+
+    if(base_file != NULL && compare_baseline(base_file, threshold) > 0)
+        exit(EXIT_FAILURE);
+
+    return(0);
+}
+
+/***EOF***/
@@ -45,6 +45,19 @@ struct fko_gpg_sig {
 };
 
 typedef struct fko_gpg_sig *fko_gpg_sig_t;
+
+/* A long-lived gpgme context plus the resolved recipient key.  SPA
+ * contexts that are handed one of these borrow the gpgme context
+ * instead of creating (and keylisting into) a new one every time.
+*/
+struct fko_gpg_cache {
+    char           *gpg_exe;
+    char           *gpg_home_dir;
+    char           *gpg_recipient;
+
+    gpgme_ctx_t     gpg_ctx;
+    gpgme_key_t     recipient_key;
+};
 #endif /* HAVE_LIBGPGME */
 
 /* The pieces we need to make an FKO  SPA data packet.
@@ -64,6 +77,9 @@ struct fko_context {
     short  digest_type;
     short  encryption_type;
 
+    /* Lead Rijndael SPA data with the key ID */
+    unsigned char   key_id_hint;
+
     /* Computed or predefined data */
     char           *version;
     char           *digest;
@@ -89,12 +105,18 @@ struct fko_context {
     gpgme_key_t     recipient_key;
     gpgme_key_t     signer_key;
 
+    /* Set if gpg_ctx is borrowed from a cache (and so is not ours to
+     * release).
+    */
+    struct fko_gpg_cache *gpg_cache;
+
     unsigned char   verify_gpg_sigs;
     unsigned char   ignore_gpg_sig_error;
 
     fko_gpg_sig_t   gpg_sigs;
 
     gpgme_error_t   gpg_err;
+    char            gpg_errstr[MAX_FKO_ERR_MSG_SIZE];
 #endif /* HAVE_LIBGPGME */
 };
 
@@ -32,6 +32,12 @@
 #include "fko.h"
 #include "cipher_funcs.h"
 #include "base64.h"
+#include "digest.h"
+
+/* Base64 characters needed to decode the salt header and first block of
+ * Rijndael data (32 bytes).
+*/
+#define RIJ_CHECK_B64_LEN   44
 
 #if HAVE_LIBGPGME
   #include "gpgme_funcs.h"
@@ -78,7 +84,29 @@ _rijndael_encrypt(fko_ctx_t ctx, char *enc_key)
     b64_encode(cipher, b64cipher, cipher_len);
     strip_b64_eq(b64cipher);
 
-    ctx->encrypted_msg = strdup(b64cipher);
+    /* Replace any previous encrypted data.
+    */
+    if(ctx->encrypted_msg != NULL)
+        free(ctx->encrypted_msg);
+
+    /* If asked to, we lead with the key ID (see fko_spa_data_key_id()).
+    */
+    if(ctx->key_id_hint)
+    {
+        ctx->encrypted_msg = malloc(FKO_KEY_ID_SIZE + strlen(b64cipher) + 1);
+        if(ctx->encrypted_msg != NULL)
+        {
+            if(fko_key_id(enc_key, ctx->encrypted_msg) == FKO_SUCCESS)
+                strcat(ctx->encrypted_msg, b64cipher);
+            else
+            {
+                free(ctx->encrypted_msg);
+                ctx->encrypted_msg = NULL;
+            }
+        }
+    }
+    else
+        ctx->encrypted_msg = strdup(b64cipher);
     
     /* Clean-up
     */
@@ -104,6 +132,17 @@ _rijndael_decrypt(fko_ctx_t ctx, char *dec_key)
 
     int             b64_len = strlen(ctx->encrypted_msg);
 
+    /* Drop the key ID if the data leads with one.  The key itself is the
+     * real test of whether it belongs to this data.
+    */
+    if(b64_len > FKO_KEY_ID_SIZE && strncmp(ctx->encrypted_msg + FKO_KEY_ID_SIZE,
+      B64_RIJNDAEL_SALT, strlen(B64_RIJNDAEL_SALT)) == 0)
+    {
+        b64_len -= FKO_KEY_ID_SIZE;
+        memmove(ctx->encrypted_msg, ctx->encrypted_msg + FKO_KEY_ID_SIZE,
+            b64_len + 1);
+    }
+
     /* Now see if we need to add the "Salted__" string to the front of the
      * encrypted data.
     */
@@ -226,6 +265,11 @@ gpg_encrypt(fko_ctx_t ctx, char *enc_key)
     b64_encode(cipher, b64cipher, cipher_len);
     strip_b64_eq(b64cipher);
 
+    /* Replace any previous encrypted data.
+    */
+    if(ctx->encrypted_msg != NULL)
+        free(ctx->encrypted_msg);
+
     ctx->encrypted_msg = strdup(b64cipher);
 
     /* Clean-up
@@ -351,6 +395,38 @@ fko_get_spa_encryption_type(fko_ctx_t ctx, short *enc_type)
     return(FKO_SUCCESS);
 }
 
+/* Set whether Rijndael SPA data should lead with the key ID.
+*/
+int
+fko_set_spa_key_id_hint(fko_ctx_t ctx, unsigned char val)
+{
+    /* Must be initialized
+    */
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
+
+    ctx->key_id_hint = (val != 0);
+
+    ctx->state |= FKO_ENCRYPT_TYPE_MODIFIED;
+
+    return(FKO_SUCCESS);
+}
+
+/* Return whether Rijndael SPA data leads with the key ID.
+*/
+int
+fko_get_spa_key_id_hint(fko_ctx_t ctx, unsigned char *val)
+{
+    /* Must be initialized
+    */
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
+
+    *val = ctx->key_id_hint;
+
+    return(FKO_SUCCESS);
+}
+
 /* Encrypt the encoded SPA data.
 */
 int
@@ -451,7 +527,7 @@ fko_encryption_type(char *enc_data)
      * XXX: We will want to come up with a more reliable method of
      *      identifying the encryption type.
     */
-    enc_data_len = strlen(enc_data);
+    enc_data_len = fko_spa_data_len(enc_data);
 
     if(enc_data_len >= MIN_GNUPG_MSG_SIZE)
         return(FKO_ENCRYPTION_GPG);
@@ -464,6 +540,137 @@ fko_encryption_type(char *enc_data)
         return(FKO_ENCRYPTION_UNKNOWN);
 }
 
+/* Compute the key ID of a Rijndael key: the start of the base64-encoded
+ * SHA256 digest of a fixed label and the key.  key_id must have room for
+ * FKO_KEY_ID_SIZE characters plus the terminating NULL.
+*/
+int
+fko_key_id(const char *key, char *key_id)
+{
+    char           *buf;
+    char            digest[SHA256_B64_LENGTH+2];
+    size_t          len;
+
+    if(key == NULL || key_id == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    len = strlen(FKO_KEY_ID_LABEL) + strlen(key);
+
+    buf = malloc(len + 1);
+    if(buf == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    sprintf(buf, "%s%s", FKO_KEY_ID_LABEL, key);
+
+    sha256_base64(digest, (unsigned char *)buf, len);
+
+    memset(buf, 0x0, len);
+    free(buf);
+
+    strlcpy(key_id, digest, FKO_KEY_ID_SIZE+1);
+
+    return(FKO_SUCCESS);
+}
+
+/* Whether (Rijndael) SPA data as sent on the wire leads with a key ID.
+ * Such data keeps the base64 "Salted__" string right after the key ID,
+ * which untagged data never has there.
+*/
+static int
+has_key_id(const char *spa_data)
+{
+    return(strlen(spa_data) > FKO_KEY_ID_SIZE + strlen(B64_RIJNDAEL_SALT)
+      && strncmp(spa_data + FKO_KEY_ID_SIZE, B64_RIJNDAEL_SALT,
+        strlen(B64_RIJNDAEL_SALT)) == 0);
+}
+
+/* Pull the key ID from the front of (Rijndael) SPA data as sent on the
+ * wire.  key_id is set to an empty string if there is no key ID.
+*/
+int
+fko_spa_data_key_id(const char *spa_data, char *key_id)
+{
+    if(spa_data == NULL || key_id == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    key_id[0] = '\0';
+
+    if(has_key_id(spa_data))
+        strlcpy(key_id, spa_data, FKO_KEY_ID_SIZE+1);
+
+    return(FKO_SUCCESS);
+}
+
+/* The length of SPA data not counting a leading key ID or the base64
+ * "Salted__" string the client normally strips, which is the length the
+ * message size checks are based on.
+*/
+int
+fko_spa_data_len(const char *spa_data)
+{
+    int     len;
+
+    if(spa_data == NULL)
+        return(0);
+
+    if(has_key_id(spa_data))
+        spa_data += FKO_KEY_ID_SIZE;
+
+    len = strlen(spa_data);
+
+    if(strncmp(spa_data, B64_RIJNDAEL_SALT, strlen(B64_RIJNDAEL_SALT)) == 0)
+        len -= strlen(B64_RIJNDAEL_SALT);
+
+    return(len);
+}
+
+/* Check whether key could be the Rijndael key for the given SPA data (as
+ * received, with or without a key ID) by decrypting only its first block.
+ * That block is the start of the random value, so it must be all digits.
+ * This rules out a wrong key for a fraction of the cost of a full
+ * decryption.  Returns FKO_ERROR_DECRYPTION_FAILURE if key is wrong.
+*/
+int
+fko_rijndael_key_check(const char *spa_data, const char *key)
+{
+    char            b64_buf[RIJ_CHECK_B64_LEN+1];
+    unsigned char   cipher[RIJ_CHECK_B64_LEN];
+    unsigned char   plain[16];
+    size_t          salt_len = strlen(B64_RIJNDAEL_SALT);
+    int             i;
+
+    if(spa_data == NULL || key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(has_key_id(spa_data))
+        spa_data += FKO_KEY_ID_SIZE;
+
+    /* Put the "Salted__" string back (if needed) so the salt and first
+     * block decode from the right bit offset.
+    */
+    if(strncmp(spa_data, B64_RIJNDAEL_SALT, salt_len) == 0)
+        salt_len = 0;
+    else
+        memcpy(b64_buf, B64_RIJNDAEL_SALT, salt_len);
+
+    if(strlen(spa_data) < RIJ_CHECK_B64_LEN - salt_len)
+        return(FKO_ERROR_INVALID_DATA);
+
+    memcpy(b64_buf + salt_len, spa_data, RIJ_CHECK_B64_LEN - salt_len);
+    b64_buf[RIJ_CHECK_B64_LEN] = '\0';
+
+    if(b64_decode(b64_buf, cipher, sizeof(cipher)) < 32)
+        return(FKO_ERROR_INVALID_DATA);
+
+    rij_decrypt_first_block(cipher, (char *)key, plain);
+
+    for(i=0; i<sizeof(plain); i++)
+        if(!isdigit(plain[i]))
+            return(FKO_ERROR_DECRYPTION_FAILURE);
+
+    return(FKO_SUCCESS);
+}
+
 /* Set the GPG recipient key name.
 */
 int
@@ -950,4 +1157,156 @@ fko_gpg_signature_fpr_match(fko_ctx_t ctx, const char *id, unsigned char *result
 #endif  /* HAVE_LIBGPGME */
 }
 
+/* Set up a gpgme context (and, if recip is given, look up its key) that
+ * can then be shared by any number of SPA contexts via fko_set_gpg_cache().
+ * This does the engine setup and keylisting once instead of per message.
+*/
+int
+fko_gpg_cache_new(fko_gpg_cache_t *cache, const char *gpg_exe,
+    const char *gpg_home_dir, const char *recip)
+{
+#if HAVE_LIBGPGME
+    struct fko_context  tmp_ctx;
+    fko_gpg_cache_t     new_cache;
+    gpgme_key_t         key     = NULL;
+    int                 res;
+
+    new_cache = calloc(1, sizeof(struct fko_gpg_cache));
+    if(new_cache == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    if((gpg_exe != NULL && (new_cache->gpg_exe = strdup(gpg_exe)) == NULL)
+      || (gpg_home_dir != NULL
+        && (new_cache->gpg_home_dir = strdup(gpg_home_dir)) == NULL)
+      || (recip != NULL && (new_cache->gpg_recipient = strdup(recip)) == NULL))
+    {
+        fko_gpg_cache_destroy(new_cache);
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+    }
+
+    /* Borrow the regular context setup and key lookup code by way of a
+     * bare context that carries only the gpg settings.
+    */
+    memset(&tmp_ctx, 0x0, sizeof(tmp_ctx));
+
+    tmp_ctx.initval         = FKO_CTX_INITIALIZED;
+    tmp_ctx.encryption_type = FKO_ENCRYPTION_GPG;
+    tmp_ctx.gpg_exe         = new_cache->gpg_exe;
+    tmp_ctx.gpg_home_dir    = new_cache->gpg_home_dir;
+    tmp_ctx.gpg_recipient   = new_cache->gpg_recipient;
+
+    res = init_gpgme(&tmp_ctx);
+
+    if(res == FKO_SUCCESS && recip != NULL)
+        res = get_gpg_key(&tmp_ctx, &key, 0);
+
+    if(res != FKO_SUCCESS)
+    {
+        if(tmp_ctx.gpg_ctx != NULL)
+            gpgme_release(tmp_ctx.gpg_ctx);
+
+        fko_gpg_cache_destroy(new_cache);
+        return(res);
+    }
+
+    new_cache->gpg_ctx          = tmp_ctx.gpg_ctx;
+    new_cache->recipient_key    = key;
+
+    *cache = new_cache;
+
+    return(FKO_SUCCESS);
+#else
+    return(FKO_ERROR_UNSUPPORTED_FEATURE);
+#endif  /* HAVE_LIBGPGME */
+}
+
+/* Release a cache made by fko_gpg_cache_new().  Any SPA context using it
+ * must be destroyed first.
+*/
+void
+fko_gpg_cache_destroy(fko_gpg_cache_t cache)
+{
+#if HAVE_LIBGPGME
+    if(cache == NULL)
+        return;
+
+    if(cache->recipient_key != NULL)
+        gpgme_key_unref(cache->recipient_key);
+
+    if(cache->gpg_ctx != NULL)
+        gpgme_release(cache->gpg_ctx);
+
+    if(cache->gpg_exe != NULL)
+        free(cache->gpg_exe);
+
+    if(cache->gpg_home_dir != NULL)
+        free(cache->gpg_home_dir);
+
+    if(cache->gpg_recipient != NULL)
+        free(cache->gpg_recipient);
+
+    free(cache);
+#endif  /* HAVE_LIBGPGME */
+}
+
+/* Have this context use the gpgme context and recipient key held in the
+ * given cache.  This takes the place of fko_set_gpg_exe(),
+ * fko_set_gpg_home_dir() and fko_set_gpg_recipient().  A gpgme context
+ * can only be used by one thread at a time, so neither can the cache.
+*/
+int
+fko_set_gpg_cache(fko_ctx_t ctx, fko_gpg_cache_t cache)
+{
+#if HAVE_LIBGPGME
+    /* Must be initialized
+    */
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
+
+    if(ctx->encryption_type != FKO_ENCRYPTION_GPG)
+        return(FKO_ERROR_WRONG_ENCRYPTION_TYPE);
+
+    if(cache == NULL || cache->gpg_ctx == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(cache->gpg_home_dir != NULL && ctx->gpg_home_dir == NULL)
+    {
+        ctx->gpg_home_dir = strdup(cache->gpg_home_dir);
+        if(ctx->gpg_home_dir == NULL)
+            return(FKO_ERROR_MEMORY_ALLOCATION);
+    }
+
+    if(cache->recipient_key != NULL)
+    {
+        if(ctx->gpg_recipient != NULL)
+            free(ctx->gpg_recipient);
+
+        ctx->gpg_recipient = strdup(cache->gpg_recipient);
+        if(ctx->gpg_recipient == NULL)
+            return(FKO_ERROR_MEMORY_ALLOCATION);
+
+        if(ctx->recipient_key != NULL)
+            gpgme_key_unref(ctx->recipient_key);
+
+        gpgme_key_ref(cache->recipient_key);
+        ctx->recipient_key = cache->recipient_key;
+    }
+
+    /* Drop any gpgme context of our own in favor of the cached one.
+    */
+    if(ctx->gpg_ctx != NULL && ctx->gpg_cache == NULL)
+        gpgme_release(ctx->gpg_ctx);
+
+    ctx->gpg_ctx            = cache->gpg_ctx;
+    ctx->gpg_cache          = cache;
+    ctx->have_gpgme_context = 1;
+
+    ctx->state |= FKO_DATA_MODIFIED;
+
+    return(FKO_SUCCESS);
+#else
+    return(FKO_ERROR_UNSUPPORTED_FEATURE);
+#endif  /* HAVE_LIBGPGME */
+}
+
 /***EOF***/
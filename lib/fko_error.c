@@ -198,8 +198,14 @@ const char*
 fko_gpg_errstr(fko_ctx_t ctx)
 {
 #if HAVE_LIBGPGME
+    /* gpgme_strerror() is not thread safe, so the message goes in a
+     * buffer in the context.
+    */
     if(ctx->gpg_err)
-        return(gpgme_strerror(ctx->gpg_err));
+    {
+        gpgme_strerror_r(ctx->gpg_err, ctx->gpg_errstr, MAX_FKO_ERR_MSG_SIZE);
+        return(ctx->gpg_errstr);
+    }
 #endif /* HAVE_LIBGPGME */
 
     return("");
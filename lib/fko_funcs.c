@@ -32,6 +32,25 @@
 #include "fko.h"
 #include "cipher_funcs.h"
 
+/* One-time, process-wide library setup (currently just gpgme).  Contexts
+ * themselves share no state, so libfko can be used from several threads
+ * as long as each context is only used by one thread at a time.  A
+ * threaded program should call this before starting its threads; single
+ * threaded ones need not bother, as it is done on first use.  Calling it
+ * more than once is harmless.  FKO_ERROR_GPGME_NO_OPENPGP only matters if
+ * GPG encryption is going to be used.
+*/
+int
+fko_global_init(void)
+{
+#if HAVE_LIBGPGME
+    if(gpg_err_code(gpgme_global_init()) != GPG_ERR_NO_ERROR)
+        return(FKO_ERROR_GPGME_NO_OPENPGP);
+#endif
+
+    return(FKO_SUCCESS);
+}
+
 /* Initialize an fko context.
 */
 int
@@ -267,7 +286,7 @@ fko_destroy(fko_ctx_t ctx)
             gpgme_key_unref(ctx->signer_key);
         }
         
-        if(ctx->gpg_ctx != NULL)
+        if(ctx->gpg_ctx != NULL && ctx->gpg_cache == NULL)
             gpgme_release(ctx->gpg_ctx);
 
         gsig = ctx->gpg_sigs;
@@ -340,9 +359,10 @@ fko_get_spa_data(fko_ctx_t ctx, char **spa_data)
     /* Notice we omit the first 10 bytes if Rijndael encryption is
      * used (to eliminate the consistent 'Salted__' string), and
      * in GnuPG mode we eliminate the consistent 'hQ' base64 encoded
-     * prefix
+     * prefix.  Rijndael data that leads with a key ID keeps the
+     * 'Salted__' string since that is how the server tells the two apart.
     */
-    if(ctx->encryption_type == FKO_ENCRYPTION_RIJNDAEL)
+    if(ctx->encryption_type == FKO_ENCRYPTION_RIJNDAEL && !ctx->key_id_hint)
         *spa_data += strlen(B64_RIJNDAEL_SALT);
     else if(ctx->encryption_type == FKO_ENCRYPTION_GPG)
         *spa_data += strlen(B64_GPG_PREFIX);
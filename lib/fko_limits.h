@@ -48,6 +48,10 @@
 #define FKO_ENCODE_TMP_BUF_SIZE    1024
 #define FKO_RAND_VAL_SIZE            16
 
+/* Hashed along with the key to make its key ID (see fko_key_id()).
+*/
+#define FKO_KEY_ID_LABEL            "fwknop key id:"
+
 #endif /* FKO_LIMITS_H */
 
 /***EOF***/
@@ -30,35 +30,15 @@
 */
 #include "fko_common.h"
 #include "fko.h"
-
-#ifdef WIN32
-  #include <sys/timeb.h>
-  #include <time.h>
-#else
-  #ifdef HAVE_SYS_TIME_H
-    #include <sys/time.h>
-    #ifdef TIME_WITH_SYS_TIME
-      #include <time.h>
-    #endif
-  #endif
-
-  #define RAND_FILE "/dev/urandom"
-#endif
+#include "cipher_funcs.h"
 
 /* Set/Generate the SPA data random value string.
 */
 int
 fko_set_rand_value(fko_ctx_t ctx, const char *new_val)
 {
-#ifdef WIN32
-	struct _timeb	tb;
-#else
-    FILE           *rfd;
-    struct timeval  tv;
-    size_t          amt_read;
-#endif
-    unsigned long   seed;
-	char           *tmp_buf;
+    unsigned char   rbytes[FKO_RAND_VAL_SIZE * 2];
+    size_t          i, r;
 
     /* Context must be initialized.
     */
@@ -72,6 +52,9 @@ fko_set_rand_value(fko_ctx_t ctx, const char *new_val)
         if(strlen(new_val) != FKO_RAND_VAL_SIZE)
             return(FKO_ERROR_INVALID_DATA);
 
+        if(ctx->rand_val != NULL)
+            free(ctx->rand_val);
+
         ctx->rand_val = strdup(new_val);
         if(ctx->rand_val == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
@@ -81,53 +64,35 @@ fko_set_rand_value(fko_ctx_t ctx, const char *new_val)
         return(FKO_SUCCESS);
     }
 
-#ifdef WIN32
-	_ftime_s(&tb);
-	seed = ((tb.time * 1000) + tb.millitm) & 0xFFFFFFFF;
-#else
-    /* Attempt to read seed data from /dev/urandom.  If that does not
-     * work, then fall back to a time-based method (less secure, but
-     * probably more portable).
-    */
-    if((rfd = fopen(RAND_FILE, "r")) != NULL)
-    {
-        /* Read seed from /dev/urandom
-        */
-        amt_read = fread(&seed, 4, 1, rfd);
-        fclose(rfd);
-
-        if (amt_read != 1)
-            return(FKO_ERROR_FILESYSTEM_OPERATION);
-    }
-    else
-    {
-        /* Seed based on time (current usecs).
-        */
-        gettimeofday(&tv, NULL);
-
-        seed = tv.tv_usec;
-    }
-#endif
-
-    srand(seed);
+    if(ctx->rand_val != NULL)
+        free(ctx->rand_val);
 
     ctx->rand_val = malloc(FKO_RAND_VAL_SIZE+1);
     if(ctx->rand_val == NULL)
             return(FKO_ERROR_MEMORY_ALLOCATION);
 
-    tmp_buf = malloc(FKO_RAND_VAL_SIZE+1);
-    if(tmp_buf == NULL)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
-
-    sprintf(ctx->rand_val, "%u", rand());
+    /* Build the value one decimal digit per random byte.  Bytes of 250
+     * and up are skipped so each digit is equally likely.  There is no
+     * srand()/rand() state involved, so this is safe across threads.
+    */
+    i = 0;
+    r = sizeof(rbytes);
 
-    while(strlen(ctx->rand_val) < FKO_RAND_VAL_SIZE)
+    while(i < FKO_RAND_VAL_SIZE)
     {
-        sprintf(tmp_buf, "%u", rand());
-        strlcat(ctx->rand_val, tmp_buf, FKO_RAND_VAL_SIZE+1);
+        if(r == sizeof(rbytes))
+        {
+            get_random_data(rbytes, sizeof(rbytes));
+            r = 0;
+        }
+
+        if(rbytes[r] < 250)
+            ctx->rand_val[i++] = '0' + (rbytes[r] % 10);
+
+        r++;
     }
 
-    free(tmp_buf);
+    ctx->rand_val[FKO_RAND_VAL_SIZE] = '\0';
 
     ctx->state |= FKO_DATA_MODIFIED;
 
@@ -40,6 +40,8 @@
 int
 fko_set_username(fko_ctx_t ctx, const char *spoof_user)
 {
+    char    sys_user[256] = {0};
+    char    name_buf[MAX_SPA_USERNAME_SIZE+1];
     char   *username = NULL;
 
     /* Must be initialized
@@ -59,10 +61,17 @@ fko_set_username(fko_ctx_t ctx, const char *spoof_user)
     */
     if(username == NULL)
     {
+        /* Use our own buffer rather than the static storage that
+         * cuserid(NULL) and getlogin() return, so concurrent callers do
+         * not trample each other.
+        */
 #ifdef _XOPEN_SOURCE
         /* cuserid will return the effective user (i.e. su or setuid).
         */
-        username = cuserid(NULL);
+        username = cuserid(sys_user);
+#elif HAVE_GETLOGIN_R
+        if(getlogin_r(sys_user, sizeof(sys_user)) == 0 && sys_user[0] != '\0')
+            username = sys_user;
 #else
         username = getlogin();
 #endif
@@ -74,13 +83,13 @@ fko_set_username(fko_ctx_t ctx, const char *spoof_user)
         if(username == NULL)
             if((username = getenv("LOGNAME")) == NULL)
                 if((username = getenv("USER")) == NULL)
-                    username = strdup("NO_USER");
+                    username = "NO_USER";
     }
 
-    /* Truncate the username if it is too long.
+    /* Truncate the username if it is too long (in our copy, not in the
+     * caller's or the environment's string).
     */
-    if(strlen(username) > MAX_SPA_USERNAME_SIZE)
-        *(username + MAX_SPA_USERNAME_SIZE) = '\0';
+    strlcpy(name_buf, username, sizeof(name_buf));
 
     /* Just in case this is a subsquent call to this function.  We
      * do not want to be leaking memory.
@@ -88,7 +97,7 @@ fko_set_username(fko_ctx_t ctx, const char *spoof_user)
     if(ctx->username != NULL)
         free(ctx->username);
 
-    ctx->username = strdup(username);
+    ctx->username = strdup(name_buf);
 
     ctx->state |= FKO_DATA_MODIFIED;
 
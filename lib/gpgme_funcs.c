@@ -35,6 +35,65 @@
 #if HAVE_LIBGPGME
 #include "gpgme_funcs.h"
 
+#if HAVE_PTHREAD_H
+  #include <pthread.h>
+#endif
+
+/* Result of the OpenPGP engine check done by gpgme_global_init().
+*/
+static gpgme_error_t    gpgme_init_err;
+
+static void
+gpgme_init_once(void)
+{
+    /* Because the gpgme manual says you should (once, before anything
+     * else, and before there are other threads using gpgme).
+    */
+    gpgme_check_version(NULL);
+
+    /* Check for OpenPGP support
+    */
+    gpgme_init_err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
+}
+
+/* Process-wide gpgme setup.  This is run exactly once no matter how many
+ * contexts or threads call it, and returns the OpenPGP engine check result.
+*/
+gpgme_error_t
+gpgme_global_init(void)
+{
+#if HAVE_PTHREAD_H
+    static pthread_once_t   once = PTHREAD_ONCE_INIT;
+
+    pthread_once(&once, gpgme_init_once);
+#else
+    static int              done = 0;
+
+    if(!done)
+    {
+        gpgme_init_once();
+        done = 1;
+    }
+#endif
+
+    return(gpgme_init_err);
+}
+
+/* Drop the gpgme context after a failed operation so the next one starts
+ * clean.  A context borrowed from an fko_gpg_cache belongs to the cache,
+ * so it is only detached here, not released.
+*/
+static void
+release_gpgme_ctx(fko_ctx_t fko_ctx)
+{
+    if(fko_ctx->gpg_ctx != NULL && fko_ctx->gpg_cache == NULL)
+        gpgme_release(fko_ctx->gpg_ctx);
+
+    fko_ctx->gpg_ctx            = NULL;
+    fko_ctx->gpg_cache          = NULL;
+    fko_ctx->have_gpgme_context = 0;
+}
+
 int
 init_gpgme(fko_ctx_t fko_ctx)
 {
@@ -45,13 +104,7 @@ init_gpgme(fko_ctx_t fko_ctx)
     if(fko_ctx->have_gpgme_context)
         return(FKO_SUCCESS);
 
-    /* Because the gpgme manual says you should.
-    */
-    gpgme_check_version(NULL);
-
-    /* Check for OpenPGP support
-    */
-    err = gpgme_engine_check_version(GPGME_PROTOCOL_OpenPGP);
+    err = gpgme_global_init();
     if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
     {
         /* GPG engine is not available.
@@ -60,19 +113,28 @@ init_gpgme(fko_ctx_t fko_ctx)
         return(FKO_ERROR_GPGME_NO_OPENPGP);
     }
 
-    /* Extract the current gpgme engine information.
+    /* Create our gpgme context
+    */
+    err = gpgme_new(&(fko_ctx->gpg_ctx));
+    if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
+    {
+        fko_ctx->gpg_err = err;
+        return(FKO_ERROR_GPGME_CONTEXT);
+    }
+
+    /* Set the engine (gpg executable and home dir) on this context only.
+     * gpgme_set_engine_info() would change it for every context in the
+     * process.
     */
-    gpgme_set_engine_info(
+    err = gpgme_ctx_set_engine_info(
+            fko_ctx->gpg_ctx,
             GPGME_PROTOCOL_OpenPGP,
             (fko_ctx->gpg_exe != NULL) ? fko_ctx->gpg_exe : GPG_EXE,
             fko_ctx->gpg_home_dir   /* If this is NULL, the default is used */
     );
-
-    /* Create our gpgme context
-    */
-    err = gpgme_new(&(fko_ctx->gpg_ctx));
     if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
     {
+        release_gpgme_ctx(fko_ctx);
         fko_ctx->gpg_err = err;
         return(FKO_ERROR_GPGME_CONTEXT);
     }
@@ -213,7 +275,7 @@ get_gpg_key(fko_ctx_t fko_ctx, gpgme_key_t *mykey, int signer)
     err = gpgme_op_keylist_start(list_ctx, name, signer);
     if (err)
     {
-        gpgme_release(list_ctx);
+        release_gpgme_ctx(fko_ctx);
 
         fko_ctx->gpg_err = err;
 
@@ -293,8 +355,7 @@ gpgme_encrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
     err = gpgme_data_new_from_mem(&plaintext, (char*)indata, in_len, 1);
     if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
     {
-        gpgme_release(gpg_ctx);
-        fko_ctx->gpg_ctx = NULL;
+        release_gpgme_ctx(fko_ctx);
         fko_ctx->gpg_err = err;
 
         return(FKO_ERROR_GPGME_PLAINTEXT_DATA_OBJ);
@@ -306,8 +367,7 @@ gpgme_encrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
     if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
     {
         gpgme_data_release(plaintext);
-        gpgme_release(gpg_ctx);
-        fko_ctx->gpg_ctx = NULL;
+        release_gpgme_ctx(fko_ctx);
 
         fko_ctx->gpg_err = err;
 
@@ -330,8 +390,7 @@ gpgme_encrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
     if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
     {
         gpgme_data_release(plaintext);
-        gpgme_release(gpg_ctx);
-        fko_ctx->gpg_ctx = NULL;
+        release_gpgme_ctx(fko_ctx);
 
         fko_ctx->gpg_err = err;
 
@@ -347,8 +406,7 @@ gpgme_encrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
         {
             gpgme_data_release(plaintext);
             gpgme_data_release(cipher);
-            gpgme_release(gpg_ctx);
-            fko_ctx->gpg_ctx = NULL;
+            release_gpgme_ctx(fko_ctx);
 
             fko_ctx->gpg_err = err;
 
@@ -375,8 +433,7 @@ gpgme_encrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
     {
         gpgme_data_release(plaintext);
         gpgme_data_release(cipher);
-        gpgme_release(gpg_ctx);
-        fko_ctx->gpg_ctx = NULL;
+        release_gpgme_ctx(fko_ctx);
 
         fko_ctx->gpg_err = err;
 
@@ -435,8 +492,7 @@ gpgme_decrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
     err = gpgme_data_new(&plaintext);
     if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
     {
-        gpgme_release(gpg_ctx);
-        fko_ctx->gpg_ctx = NULL;
+        release_gpgme_ctx(fko_ctx);
 
         fko_ctx->gpg_err = err;
 
@@ -449,8 +505,7 @@ gpgme_decrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
     if(gpg_err_code(err) != GPG_ERR_NO_ERROR)
     {
         gpgme_data_release(plaintext);
-        gpgme_release(gpg_ctx);
-        fko_ctx->gpg_ctx = NULL;
+        release_gpgme_ctx(fko_ctx);
 
         fko_ctx->gpg_err = err;
 
@@ -468,8 +523,7 @@ gpgme_decrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
     {
         gpgme_data_release(plaintext);
         gpgme_data_release(cipher);
-        gpgme_release(gpg_ctx);
-        fko_ctx->gpg_ctx = NULL;
+        release_gpgme_ctx(fko_ctx);
 
         fko_ctx->gpg_err = err;
 
@@ -487,8 +541,7 @@ gpgme_decrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
     if(decrypt_res->unsupported_algorithm)
     {
         gpgme_data_release(plaintext);
-        gpgme_release(gpg_ctx);
-        fko_ctx->gpg_ctx = NULL;
+        release_gpgme_ctx(fko_ctx);
 
         return(FKO_ERROR_GPGME_DECRYPT_UNSUPPORTED_ALGORITHM);
     }
@@ -504,8 +557,7 @@ gpgme_decrypt(fko_ctx_t fko_ctx, unsigned char *indata, size_t in_len, const cha
         if(res != FKO_SUCCESS)
         {
             gpgme_data_release(plaintext);
-            gpgme_release(gpg_ctx);
-            fko_ctx->gpg_ctx = NULL;
+            release_gpgme_ctx(fko_ctx);
 
             return(res);
         }
@@ -37,6 +37,8 @@
 int gpgme_encrypt(fko_ctx_t ctx, unsigned char *in, size_t len, const char *pw, unsigned char **out, size_t *out_len);
 int gpgme_decrypt(fko_ctx_t ctx, unsigned char *in, size_t len, const char *pw, unsigned char **out, size_t *out_len);
 #if HAVE_LIBGPGME
+  gpgme_error_t gpgme_global_init(void);
+  int init_gpgme(fko_ctx_t fko_ctx);
   int get_gpg_key(fko_ctx_t fko_ctx, gpgme_key_t *mykey, int signer);
 #endif
 
@@ -41,6 +41,18 @@
 #include "utils.h"
 #include "log_msg.h"
 
+/* Stanzas with a KEY, hashed by the ID of that key so SPA data that leads
+ * with a key ID can be matched to its stanza directly.  Stanzas sharing a
+ * key get an entry each.
+*/
+typedef struct key_id_ent {
+    char            key_id[FKO_KEY_ID_SIZE+1];
+    acc_stanza_t   *acc;
+} key_id_ent_t;
+
+static key_id_ent_t    *key_id_tbl  = NULL;
+static unsigned int     key_id_size = 0;
+
 /* Add an access string entry
 */
 void
@@ -482,6 +494,12 @@ free_acc_stanza_data(acc_stanza_t *acc)
         free(acc->gpg_remote_id);
         free_acc_string_list(acc->gpg_remote_id_list);
     }
+
+    /* The cached gpgme context goes with the stanza, so a SIGHUP (which
+     * re-reads access.conf) also refreshes the keys.
+    */
+    if(acc->gpg_cache != NULL)
+        fko_gpg_cache_destroy(acc->gpg_cache);
 }
 
 /* Expand any access entries that may be multi-value.
@@ -541,6 +559,68 @@ acc_stanza_init(fko_srv_options_t *opts)
     return;
 }
 
+/* Hash a key ID to its home slot in the key ID table.
+*/
+static unsigned int
+key_id_hash(const char *key_id)
+{
+    unsigned int    h = 0;
+
+    while(*key_id != '\0')
+        h = h * 31 + (unsigned char)*key_id++;
+
+    return(h & (key_id_size - 1));
+}
+
+/* (Re)build the key ID table from the (expanded) access stanzas.
+*/
+static void
+key_id_table_init(fko_srv_options_t *opts)
+{
+    acc_stanza_t   *acc;
+    unsigned int    n = 0, slot;
+    char            key_id[FKO_KEY_ID_SIZE+1];
+
+    if(key_id_tbl != NULL)
+    {
+        free(key_id_tbl);
+        key_id_tbl  = NULL;
+        key_id_size = 0;
+    }
+
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+        if(acc->key != NULL)
+            n++;
+
+    if(n == 0)
+        return;
+
+    /* Keep the table no more than half full so probes stay short.
+    */
+    for(key_id_size = 16; key_id_size < n * 2; key_id_size <<= 1);
+
+    key_id_tbl = calloc(key_id_size, sizeof(key_id_ent_t));
+    if(key_id_tbl == NULL)
+    {
+        log_msg(LOG_ERR,
+            "Fatal memory allocation error building the key ID table"
+        );
+        exit(EXIT_FAILURE);
+    }
+
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+    {
+        if(acc->key == NULL || fko_key_id(acc->key, key_id) != FKO_SUCCESS)
+            continue;
+
+        for(slot = key_id_hash(key_id); key_id_tbl[slot].acc != NULL;
+          slot = (slot + 1) & (key_id_size - 1));
+
+        strlcpy(key_id_tbl[slot].key_id, key_id, sizeof(key_id));
+        key_id_tbl[slot].acc = acc;
+    }
+}
+
 /* Add a new stanza bay allocating the required memory at the required
  * location, yada-yada-yada.
 */
@@ -596,6 +676,11 @@ set_acc_defaults(fko_srv_options_t *opts)
         if(acc->fw_access_timeout < 1)
             acc->fw_access_timeout = DEF_FW_ACCESS_TIMEOUT;
 
+        /* set default cmd_exec_max_running if necessary
+        */
+        if(acc->cmd_exec_max_running < 1)
+            acc->cmd_exec_max_running = DEF_CMD_EXEC_MAX_RUNNING;
+
         /* set default gpg keyring path if necessary
         */
         if(acc->gpg_decrypt_pw != NULL && acc->gpg_home_dir == NULL)
@@ -779,6 +864,10 @@ parse_access_file(fko_srv_options_t *opts)
 
             curr_acc->cmd_exec_uid = pw->pw_uid;
         }
+        else if(CONF_VAR_IS(var, "CMD_EXEC_MAX_RUNNING"))
+        {
+            add_acc_int(&(curr_acc->cmd_exec_max_running), val);
+        }
         else if(CONF_VAR_IS(var, "REQUIRE_USERNAME"))
         {
             add_acc_string(&(curr_acc->require_username), val);
@@ -870,6 +959,8 @@ parse_access_file(fko_srv_options_t *opts)
     */
     set_acc_defaults(opts);
 
+    key_id_table_init(opts);
+
     return;
 }
 
@@ -901,6 +992,62 @@ acc_check_source(fko_srv_options_t *opts, uint32_t ip)
     return(acc);
 }
 
+/* Find the stanza whose KEY has the given key ID and whose SOURCE allows
+ * the IP address (in network byte order).  Return NULL if there is none.
+*/
+acc_stanza_t*
+acc_check_key_id(fko_srv_options_t *opts, const char *key_id, uint32_t ip)
+{
+    unsigned int     slot;
+
+    if(key_id_tbl == NULL)
+        return(NULL);
+
+    for(slot = key_id_hash(key_id); key_id_tbl[slot].acc != NULL;
+      slot = (slot + 1) & (key_id_size - 1))
+    {
+        if(strcmp(key_id_tbl[slot].key_id, key_id) == 0
+          && acc_stanza_allows_source(key_id_tbl[slot].acc, ip))
+            return(key_id_tbl[slot].acc);
+    }
+
+    return(NULL);
+}
+
+/* Whether any entry in the SOURCE of a stanza allows the IP address (in
+ * network byte order).
+*/
+int
+acc_stanza_allows_source(acc_stanza_t *acc, uint32_t ip)
+{
+    acc_int_list_t  *sle;
+    uint32_t         hip = ntohl(ip);
+
+    for(sle = acc->source_list; sle != NULL; sle = sle->next)
+        if((hip & sle->mask) == sle->maddr)
+            return(1);
+
+    return(0);
+}
+
+/* Whether an IP address (in network byte order) is named by the SOURCE of
+ * any stanza as an address or subnet (that is, other than by "ANY").
+*/
+int
+acc_source_is_specific(fko_srv_options_t *opts, uint32_t ip)
+{
+    acc_stanza_t    *acc;
+    acc_int_list_t  *sle;
+    uint32_t         hip = ntohl(ip);
+
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+        for(sle = acc->source_list; sle != NULL; sle = sle->next)
+            if(sle->mask != 0 && (hip & sle->mask) == sle->maddr)
+                return(1);
+
+    return(0);
+}
+
 /* Compare the contents of 2 port lists.  Return true on a match.
  * Match depends on the match_any flag.  if match_any is 1 then any
  * entry in the incoming data need only match one item to return true.
@@ -1042,6 +1189,7 @@ dump_access_list(fko_srv_options_t *opts)
             "          FW_ACCESS_TIMEOUT:  %i\n"
             "            ENABLE_CMD_EXEC:  %s\n"
             "              CMD_EXEC_USER:  %s\n"
+            "       CMD_EXEC_MAX_RUNNING:  %i\n"
             "           REQUIRE_USERNAME:  %s\n"
             "     REQUIRE_SOURCE_ADDRESS:  %s\n"
             "               GPG_HOME_DIR:  %s\n"
@@ -1058,6 +1206,7 @@ dump_access_list(fko_srv_options_t *opts)
             acc->fw_access_timeout,
             acc->enable_cmd_exec ? "Yes" : "No",
             (acc->cmd_exec_user == NULL) ? "<not set>" : acc->cmd_exec_user,
+            acc->cmd_exec_max_running,
             (acc->require_username == NULL) ? "<not set>" : acc->require_username,
             acc->require_source_address ? "Yes" : "No",
             (acc->gpg_home_dir == NULL) ? "<not set>" : acc->gpg_home_dir,
@@ -38,6 +38,9 @@
 */
 void parse_access_file(fko_srv_options_t *opts);
 acc_stanza_t* acc_check_source(fko_srv_options_t *opts, uint32_t ip);
+acc_stanza_t* acc_check_key_id(fko_srv_options_t *opts, const char *key_id, uint32_t ip);
+int acc_stanza_allows_source(acc_stanza_t *acc, uint32_t ip);
+int acc_source_is_specific(fko_srv_options_t *opts, uint32_t ip);
 int acc_check_port_access(acc_stanza_t *acc, char *port_str);
 int acc_check_gpg_remote_id(acc_stanza_t *acc, char *gpg_id);
 void dump_access_list(fko_srv_options_t *opts);
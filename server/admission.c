@@ -0,0 +1,322 @@
+/*
+ *****************************************************************************
+ *
+ * File:    admission.c
+ *
+ * Purpose: Admission control for SPA packets.  Captured packets wait in a
+ *          bounded queue, classed by how likely they are to come from one
+ *          of our users, and are processed best class first.  When the
+ *          queue is full or packets have waited too long, the lowest
+ *          classes are dropped first.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "admission.h"
+#include "access.h"
+#include "src_limit.h"
+#include "metrics.h"
+#include "fwknopd_errors.h"
+#include "log_msg.h"
+
+#include <stddef.h>
+
+typedef struct admit_entry
+{
+    spa_pkt_info_t  pkt;
+    struct timeval  arrived;
+    int             next;
+} admit_entry_t;
+
+static admit_entry_t   *entries     = NULL;
+static int              free_head   = -1;
+static int              queue_limit = 0;
+static int              max_delay   = 0;
+static int              depth       = 0;
+
+/* A FIFO per class (as indexes into entries).
+*/
+static int              q_head[ADMIT_PRIO_COUNT];
+static int              q_tail[ADMIT_PRIO_COUNT];
+
+/* Packets dropped since we last logged about it.
+*/
+static unsigned long    dropped[ADMIT_PRIO_COUNT];
+static time_t           last_drop_log = 0;
+
+static const char *prio_names[ADMIT_PRIO_COUNT] = {
+    "low",
+    "sized",
+    "stanza",
+    "known"
+};
+
+/* Set up the queue (with room for ADMIT_QUEUE_LIMIT packets).  Packets
+ * read from a capture file are always processed as they are read.
+*/
+void
+admit_init(fko_srv_options_t *opts)
+{
+    int     i;
+
+    admit_shutdown();
+
+    queue_limit = atoi(opts->config[CONF_ADMIT_QUEUE_LIMIT]);
+    max_delay   = atoi(opts->config[CONF_ADMIT_MAX_DELAY]);
+
+    if(queue_limit <= 0 || opts->pcap_file[0] != '\0')
+    {
+        queue_limit = 0;
+        return;
+    }
+
+    if((entries = calloc(queue_limit, sizeof(admit_entry_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error in admit_init.");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < queue_limit; i++)
+        entries[i].next = i + 1;
+    entries[queue_limit - 1].next = -1;
+
+    free_head = 0;
+
+    for(i = 0; i < ADMIT_PRIO_COUNT; i++)
+    {
+        q_head[i]  = -1;
+        q_tail[i]  = -1;
+        dropped[i] = 0;
+    }
+
+    if(opts->verbose)
+        log_msg(LOG_INFO, "Admission queue: %i packets, max delay %i ms.",
+            queue_limit, max_delay);
+}
+
+int
+admit_active(void)
+{
+    return(queue_limit > 0);
+}
+
+/* The number of packets waiting.
+*/
+int
+admit_pending(void)
+{
+    return(depth);
+}
+
+/* Whether SPA data looks like what the client sends for Rijndael: the
+ * base64 encoding (minus '=' padding, any key ID, and the 10 characters
+ * that encode the "Salted__" prefix) of a 16 byte salt header and whole
+ * 16 byte cipher blocks.
+*/
+static int
+rijndael_sized(spa_pkt_info_t *pkt)
+{
+    unsigned int    b64_len, bytes;
+
+    if(fko_encryption_type((char *)pkt->packet_data) != FKO_ENCRYPTION_RIJNDAEL)
+        return(0);
+
+    b64_len = fko_spa_data_len((char *)pkt->packet_data) + 10;
+    bytes   = b64_len * 3 / 4;
+
+    return(bytes % 16 == 0 && (bytes * 4 + 2) / 3 == b64_len);
+}
+
+static int
+classify(fko_srv_options_t *opts, spa_pkt_info_t *pkt)
+{
+    if(src_limit_recent_ok(pkt->packet_src_ip, ADMIT_KNOWN_TIME))
+        return(ADMIT_PRIO_KNOWN);
+
+    if(acc_source_is_specific(opts, pkt->packet_src_ip))
+        return(ADMIT_PRIO_STANZA);
+
+    if(rijndael_sized(pkt))
+        return(ADMIT_PRIO_SIZED);
+
+    return(ADMIT_PRIO_LOW);
+}
+
+/* Count a dropped packet of the given class, and every so often log how
+ * many we have dropped.
+*/
+static void
+count_drop(int prio)
+{
+    time_t  now = time(NULL);
+
+    dropped[prio]++;
+    metrics_spa_result(NULL, SPA_MSG_OVERLOAD);
+
+    if(now - last_drop_log < ADMIT_LOG_INTERVAL)
+        return;
+
+    log_msg(LOG_WARNING,
+        "Overloaded: dropped %lu %s, %lu %s, %lu %s and %lu %s packet(s).",
+        dropped[ADMIT_PRIO_LOW], prio_names[ADMIT_PRIO_LOW],
+        dropped[ADMIT_PRIO_SIZED], prio_names[ADMIT_PRIO_SIZED],
+        dropped[ADMIT_PRIO_STANZA], prio_names[ADMIT_PRIO_STANZA],
+        dropped[ADMIT_PRIO_KNOWN], prio_names[ADMIT_PRIO_KNOWN]);
+
+    memset(dropped, 0x0, sizeof(dropped));
+    last_drop_log = now;
+}
+
+/* Take the oldest packet of a class off its queue.
+*/
+static int
+pop_head(int prio)
+{
+    int     i = q_head[prio];
+
+    q_head[prio] = entries[i].next;
+    if(q_head[prio] == -1)
+        q_tail[prio] = -1;
+
+    depth--;
+
+    return(i);
+}
+
+static void
+release(int i)
+{
+    entries[i].next = free_head;
+    free_head       = i;
+}
+
+/* Queue the packet in opts->spa_pkt.  If the queue is full, the oldest
+ * packet of the lowest class waiting makes room for it - unless that
+ * class is above this packet's, in which case this one is dropped.
+*/
+void
+admit_enqueue(fko_srv_options_t *opts)
+{
+    spa_pkt_info_t *pkt = &(opts->spa_pkt);
+    int             prio, low, i;
+
+    prio = classify(opts, pkt);
+
+    if(free_head == -1)
+    {
+        for(low = 0; low < ADMIT_PRIO_COUNT && q_head[low] == -1; low++)
+            ;
+
+        if(low > prio)
+        {
+            count_drop(prio);
+            pkt->packet_data_len = 0;
+            return;
+        }
+
+        release(pop_head(low));
+        count_drop(low);
+    }
+
+    i = free_head;
+    free_head = entries[i].next;
+
+    memcpy(&(entries[i].pkt), pkt,
+        offsetof(spa_pkt_info_t, packet_data) + pkt->packet_data_len + 1);
+    gettimeofday(&(entries[i].arrived), NULL);
+    entries[i].next = -1;
+
+    if(q_tail[prio] == -1)
+        q_head[prio] = i;
+    else
+        entries[q_tail[prio]].next = i;
+    q_tail[prio] = i;
+
+    depth++;
+
+    /* The packet is ours now.
+    */
+    pkt->packet_data_len = 0;
+}
+
+/* Put the next packet to process (the oldest of the best class waiting)
+ * in opts->spa_pkt.  Packets below the stanza class that have waited more
+ * than ADMIT_MAX_DELAY milliseconds are dropped instead.  Returns 0 when
+ * there is nothing (left) to process.
+*/
+int
+admit_next(fko_srv_options_t *opts)
+{
+    struct timeval  now;
+    long            waited;
+    int             prio, i;
+
+    if(depth == 0)
+        return(0);
+
+    gettimeofday(&now, NULL);
+
+    for(prio = ADMIT_PRIO_COUNT - 1; prio >= 0; prio--)
+    {
+        while((i = q_head[prio]) != -1)
+        {
+            waited = (now.tv_sec - entries[i].arrived.tv_sec) * 1000000L
+                + (now.tv_usec - entries[i].arrived.tv_usec);
+
+            if(prio < ADMIT_PRIO_STANZA && max_delay > 0
+              && waited > max_delay * 1000L)
+            {
+                release(pop_head(prio));
+                count_drop(prio);
+                continue;
+            }
+
+            pop_head(prio);
+
+            memcpy(&(opts->spa_pkt), &(entries[i].pkt),
+                offsetof(spa_pkt_info_t, packet_data)
+                + entries[i].pkt.packet_data_len + 1);
+
+            release(i);
+
+            metrics_observe(METRIC_STAGE_QUEUE, waited);
+
+            return(1);
+        }
+    }
+
+    return(0);
+}
+
+/* Free the queue (dropping anything still in it).
+*/
+void
+admit_shutdown(void)
+{
+    if(entries != NULL)
+        free(entries);
+
+    entries     = NULL;
+    free_head   = -1;
+    queue_limit = 0;
+    depth       = 0;
+}
+
+/***EOF***/
@@ -0,0 +1,66 @@
+/*
+ *****************************************************************************
+ *
+ * File:    admission.h
+ *
+ * Purpose: Header file for admission.c.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+/* Packet classes, from the first to be dropped under load to the last.
+*/
+enum {
+    ADMIT_PRIO_LOW = 0,     /* Nothing known about it */
+    ADMIT_PRIO_SIZED,       /* Sized like Rijndael SPA data */
+    ADMIT_PRIO_STANZA,      /* Source named by a (non-ANY) access stanza */
+    ADMIT_PRIO_KNOWN,       /* Source had a packet accepted recently */
+    ADMIT_PRIO_COUNT
+};
+
+/* How long (in seconds) a source counts as known after one of its packets
+ * was accepted.
+*/
+#define ADMIT_KNOWN_TIME    3600
+
+/* The most packets we read from pcap in one pass of the main loop, and
+ * how long (in milliseconds) we spend processing queued packets in one.
+*/
+#define ADMIT_READ_BATCH    256
+#define ADMIT_PASS_TIME     10
+
+/* Dropped packet counts are logged at most this often (in seconds).
+*/
+#define ADMIT_LOG_INTERVAL  10
+
+/* Prototypes
+*/
+void admit_init(fko_srv_options_t *opts);
+int admit_active(void);
+int admit_pending(void);
+void admit_enqueue(fko_srv_options_t *opts);
+int admit_next(fko_srv_options_t *opts);
+void admit_shutdown(void);
+
+#endif /* ADMISSION_H */
+
+/***EOF***/
@@ -44,18 +44,40 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "PCAP_INTF",
     "ENABLE_PCAP_PROMISC",
     "PCAP_FILTER",
+    "ENABLE_PCAP_AUTO_FILTER",
     "MAX_SNIFF_BYTES",
     "ENABLE_SPA_PACKET_AGING",
     "MAX_SPA_PACKET_AGE",
     "ENABLE_DIGEST_PERSISTENCE",
     "CMD_EXEC_TIMEOUT",
+    "CMD_EXEC_QUEUE_LIMIT",
+    "GPG_WORKERS",
+    "GPG_QUEUE_LIMIT",
+    "GPG_QUEUE_DROP",
+    "GPG_JOB_TIMEOUT",
+    "SRC_RATE_LIMIT",
+    "SRC_RATE_BURST",
+    "SRC_FAIL_LIMIT",
+    "SRC_BLOCK_TIME",
+    "SRC_BLOCK_CMD",
+    "ADMIT_QUEUE_LIMIT",
+    "ADMIT_MAX_DELAY",
     //"BLACKLIST",
     "ENABLE_SPA_OVER_HTTP",
     "ENABLE_TCP_SERVER",
     "TCPSERV_PORT",
+    "TCPSERV_READ_TIMEOUT",
+    "TCPSERV_MAX_CONN",
+    "ENABLE_METRICS_SOCKET",
+    "METRICS_SOCKET",
     "LOCALE",
     "SYSLOG_IDENTITY",
     "SYSLOG_FACILITY",
+    "LOG_FILE",
+    "ENABLE_ASYNC_LOGGING",
+    "LOG_RATE_LIMIT",
+    "LOG_RATE_BURST",
+    "FW_BATCH_WINDOW",
     //"ENABLE_EXTERNAL_CMDS",
     //"EXTERNAL_CMD_OPEN",
     //"EXTERNAL_CMD_CLOSE",
@@ -86,6 +108,7 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
 #elif FIREWALL_PF
     "PF_ANCHOR_NAME",
     "PF_EXPIRE_INTERVAL",
+    "PF_USE_TABLES",
 #elif FIREWALL_IPF
     /* --DSS Place-holder */
 #endif /* FIREWALL type */
@@ -109,6 +132,8 @@ enum {
     FW_LIST         = 0x200,
     GPG_HOME_DIR,
     ROTATE_DIGEST_CACHE,
+    PCAP_FILE,
+    REPLAY_SPEED,
     NOOP /* Just to be a marker for the end */
 };
 
@@ -134,6 +159,8 @@ static struct option cmd_opts[] =
     {"rotate-digest-cache", 0, NULL, ROTATE_DIGEST_CACHE },
     {"override-config",     1, NULL, 'O' },
     {"pcap-filter",         1, NULL, 'P'},
+    {"pcap-file",           1, NULL, PCAP_FILE },
+    {"replay-speed",        1, NULL, REPLAY_SPEED },
     {"restart",             0, NULL, 'R'},
     {"status",              0, NULL, 'S'},
     {"verbose",             0, NULL, 'v'},
@@ -248,6 +248,18 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_FWKNOP_PID_FILE, tmp_path);
     }
 
+    if(opts->config[CONF_METRICS_SOCKET] == NULL)
+    {
+        strlcpy(tmp_path, opts->config[CONF_FWKNOP_RUN_DIR], MAX_PATH_LEN);
+
+        if(tmp_path[strlen(tmp_path)-1] != '/')
+            strlcat(tmp_path, "/", MAX_PATH_LEN);
+
+        strlcat(tmp_path, DEF_METRICS_SOCKET_FILENAME, MAX_PATH_LEN);
+
+        set_config_entry(opts, CONF_METRICS_SOCKET, tmp_path);
+    }
+
 #if USE_FILE_CACHE
     if(opts->config[CONF_DIGEST_FILE] == NULL)
 #else
@@ -287,6 +299,12 @@ validate_options(fko_srv_options_t *opts)
     if(opts->config[CONF_PCAP_FILTER] == NULL)
         set_config_entry(opts, CONF_PCAP_FILTER, DEF_PCAP_FILTER);
 
+    /* Tighten the PCAP filter based on access.conf.
+    */
+    if(opts->config[CONF_ENABLE_PCAP_AUTO_FILTER] == NULL)
+        set_config_entry(opts, CONF_ENABLE_PCAP_AUTO_FILTER,
+            DEF_ENABLE_PCAP_AUTO_FILTER);
+
     /* Enable SPA packet aging.
     */
     if(opts->config[CONF_ENABLE_SPA_PACKET_AGING] == NULL)
@@ -432,6 +450,12 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_PF_EXPIRE_INTERVAL,
             DEF_PF_EXPIRE_INTERVAL);
 
+    /* Set PF table-based access mode.
+    */
+    if(opts->config[CONF_PF_USE_TABLES] == NULL)
+        set_config_entry(opts, CONF_PF_USE_TABLES,
+            DEF_PF_USE_TABLES);
+
 #elif FIREWALL_IPF
     /* --DSS Place-holder */
 
@@ -458,6 +482,23 @@ validate_options(fko_srv_options_t *opts)
     if(opts->config[CONF_TCPSERV_PORT] == NULL)
         set_config_entry(opts, CONF_TCPSERV_PORT, DEF_TCPSERV_PORT);
 
+    /* TCP Server read deadline (in milliseconds).
+    */
+    if(opts->config[CONF_TCPSERV_READ_TIMEOUT] == NULL)
+        set_config_entry(opts, CONF_TCPSERV_READ_TIMEOUT,
+            DEF_TCPSERV_READ_TIMEOUT);
+
+    /* TCP Server concurrent connection limit.
+    */
+    if(opts->config[CONF_TCPSERV_MAX_CONN] == NULL)
+        set_config_entry(opts, CONF_TCPSERV_MAX_CONN, DEF_TCPSERV_MAX_CONN);
+
+    /* Enable the metrics socket.
+    */
+    if(opts->config[CONF_ENABLE_METRICS_SOCKET] == NULL)
+        set_config_entry(opts, CONF_ENABLE_METRICS_SOCKET,
+            DEF_ENABLE_METRICS_SOCKET);
+
     /* Syslog identity.
     */
     if(opts->config[CONF_SYSLOG_IDENTITY] == NULL)
@@ -468,6 +509,67 @@ validate_options(fko_srv_options_t *opts)
     if(opts->config[CONF_SYSLOG_FACILITY] == NULL)
         set_config_entry(opts, CONF_SYSLOG_FACILITY, DEF_SYSLOG_FACILITY);
 
+    /* Asynchronous logging and log rate limiting.
+    */
+    if(opts->config[CONF_ENABLE_ASYNC_LOGGING] == NULL)
+        set_config_entry(opts, CONF_ENABLE_ASYNC_LOGGING,
+            DEF_ENABLE_ASYNC_LOGGING);
+
+    if(opts->config[CONF_LOG_RATE_LIMIT] == NULL)
+        set_config_entry(opts, CONF_LOG_RATE_LIMIT, DEF_LOG_RATE_LIMIT);
+
+    if(opts->config[CONF_LOG_RATE_BURST] == NULL)
+        set_config_entry(opts, CONF_LOG_RATE_BURST, DEF_LOG_RATE_BURST);
+
+    /* Firewall command batch window.
+    */
+    if(opts->config[CONF_FW_BATCH_WINDOW] == NULL)
+        set_config_entry(opts, CONF_FW_BATCH_WINDOW, DEF_FW_BATCH_WINDOW);
+
+    /* SPA command message timeout and queue limit.
+    */
+    if(opts->config[CONF_CMD_EXEC_TIMEOUT] == NULL)
+        set_config_entry(opts, CONF_CMD_EXEC_TIMEOUT, DEF_CMD_EXEC_TIMEOUT);
+
+    if(opts->config[CONF_CMD_EXEC_QUEUE_LIMIT] == NULL)
+        set_config_entry(opts, CONF_CMD_EXEC_QUEUE_LIMIT, DEF_CMD_EXEC_QUEUE_LIMIT);
+
+    /* GPG decryption worker pool.
+    */
+    if(opts->config[CONF_GPG_WORKERS] == NULL)
+        set_config_entry(opts, CONF_GPG_WORKERS, DEF_GPG_WORKERS);
+
+    if(opts->config[CONF_GPG_QUEUE_LIMIT] == NULL)
+        set_config_entry(opts, CONF_GPG_QUEUE_LIMIT, DEF_GPG_QUEUE_LIMIT);
+
+    if(opts->config[CONF_GPG_QUEUE_DROP] == NULL)
+        set_config_entry(opts, CONF_GPG_QUEUE_DROP, DEF_GPG_QUEUE_DROP);
+
+    if(opts->config[CONF_GPG_JOB_TIMEOUT] == NULL)
+        set_config_entry(opts, CONF_GPG_JOB_TIMEOUT, DEF_GPG_JOB_TIMEOUT);
+
+    /* Per-source packet and failed decryption limits.
+    */
+    if(opts->config[CONF_SRC_RATE_LIMIT] == NULL)
+        set_config_entry(opts, CONF_SRC_RATE_LIMIT, DEF_SRC_RATE_LIMIT);
+
+    if(opts->config[CONF_SRC_RATE_BURST] == NULL)
+        set_config_entry(opts, CONF_SRC_RATE_BURST, DEF_SRC_RATE_BURST);
+
+    if(opts->config[CONF_SRC_FAIL_LIMIT] == NULL)
+        set_config_entry(opts, CONF_SRC_FAIL_LIMIT, DEF_SRC_FAIL_LIMIT);
+
+    if(opts->config[CONF_SRC_BLOCK_TIME] == NULL)
+        set_config_entry(opts, CONF_SRC_BLOCK_TIME, DEF_SRC_BLOCK_TIME);
+
+    /* Admission queue size and delay limit.
+    */
+    if(opts->config[CONF_ADMIT_QUEUE_LIMIT] == NULL)
+        set_config_entry(opts, CONF_ADMIT_QUEUE_LIMIT, DEF_ADMIT_QUEUE_LIMIT);
+
+    if(opts->config[CONF_ADMIT_MAX_DELAY] == NULL)
+        set_config_entry(opts, CONF_ADMIT_MAX_DELAY, DEF_ADMIT_MAX_DELAY);
+
     /* Some options just trigger some output of information, or trigger an
      * external function, but do not actually start fwknopd.  If any of those
      * are set, we can return here an skip the validation routines as all
@@ -681,6 +783,23 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
             case 'P':
                 set_config_entry(opts, CONF_PCAP_FILTER, optarg);
                 break; 
+            case PCAP_FILE:
+                strlcpy(opts->pcap_file, optarg, MAX_PATH_LEN);
+                opts->foreground = 1;
+                break;
+            case REPLAY_SPEED:
+                if(strcasecmp(optarg, "realtime") == 0)
+                    opts->replay_realtime = 1;
+                else if(strcasecmp(optarg, "max") == 0)
+                    opts->replay_realtime = 0;
+                else
+                {
+                    fprintf(stderr,
+                        "[*] Invalid --replay-speed '%s' (must be 'max' or 'realtime').\n",
+                        optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case ROTATE_DIGEST_CACHE:
                 opts->rotate_digest_cache = 1;
                 break;
@@ -756,6 +875,13 @@ usage(void)
       "                           overide those in fwknopd.conf\n"
       " -P, --pcap-filter       - Specify a Berkeley packet filter statement to\n"
       "                           override the PCAP_FILTER variable in fwknopd.conf.\n"
+      "     --pcap-file         - Replay the packets in a pcap capture file through\n"
+      "                           SPA processing, print throughput and per-stage\n"
+      "                           latency figures, and exit.  Build with\n"
+      "                           --enable-fw-mem to leave the real firewall alone.\n"
+      "     --replay-speed      - With --pcap-file, 'max' (default) to replay as\n"
+      "                           fast as possible or 'realtime' to follow the\n"
+      "                           capture timestamps.\n"
       " -R, --restart           - Force the currently running fwknopd to restart.\n"
       "     --rotate-digest-cache\n"
       "                         - Rotate the digest cache file by renaming it to\n"
@@ -33,348 +33,853 @@
 #include "log_msg.h"
 #include "utils.h"
 
-/*
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/select.h>
-*/
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #if HAVE_SYS_WAIT_H
   #include <sys/wait.h>
 #endif
 
-/*
-static sig_atomic_t got_sigalrm; 
+#if HAVE_SPAWN_H
+  #include <spawn.h>
+#endif
+
+extern char **environ;
+
+/* Characters that mean a command needs a shell to run as intended.  Such
+ * commands (SPA command messages, for instance) are run via "/bin/sh -c",
+ * everything else is exec'd directly from an argv array.
+*/
+#define EXTCMD_SHELL_META   "|&;()<>$`\\*?[#~\n"
+
+/* How the stderr of a child is handled.
 */
+enum {
+    EXTCMD_STDERR_PIPE,         /* Captured on its own pipe */
+    EXTCMD_STDERR_MERGE,        /* Sent down the stdout pipe ("2>&1") */
+    EXTCMD_STDERR_DISCARD       /* Sent to /dev/null ("2>/dev/null") */
+};
 
-/* Takes a file descriptor and makes it non-blocking.
+/* A running external command.
+*/
+typedef struct extcmd {
+    pid_t           pid;
+    int             in_fd;
+    const char     *in_data;
+    size_t          in_len;
+    int             so_fd;
+    int             se_fd;
+    char           *so_buf;
+    size_t          so_buf_sz;
+    size_t          so_len;
+    char            se_buf[IO_READ_BUF_LEN];
+    size_t          se_len;
+    time_t          deadline;
+    int             killed;
+    int             reaped;
+    int             status;
+    char           *cmd;
+    void           *owner;
+    struct extcmd  *next;
+} extcmd_t;
+
+/* A command waiting in the queue for its owner to drop below its limit of
+ * running commands.
+*/
+typedef struct extcmd_job {
+    void               *owner;
+    int                 max_running;
+    uid_t               user_uid;
+    char               *cmd;
+    int                 timeout;
+    struct extcmd_job  *next;
+} extcmd_job_t;
+
+/* Commands started without an output buffer run in the background and are
+ * looked after by extcmd_service() from the main loop.
+*/
+static extcmd_t     *bg_cmds    = NULL;
+static extcmd_job_t *cmd_queue  = NULL;
+static int           queue_len  = 0;
+
+/* Takes a file descriptor and makes it non-blocking (and close-on-exec so
+ * it does not leak into other children).
+*/
 static int
 set_nonblock(int fd)
 {
     int val;
 
     if((val = fcntl(fd, F_GETFL, 0)) < 0)
-    {
-        perror("fcntl F_GETFL error:");
         return(-1);
-    }
 
-    val |= O_NONBLOCK;
-
-    if(fcntl(fd, F_SETFL, val) < 0)
-    {
-        perror("fcntl F_SETFL error setting O_NONBLOCK");
+    if(fcntl(fd, F_SETFL, val | O_NONBLOCK) < 0)
         return(-1);
-    }
 
-    return(0);
+    return(fcntl(fd, F_SETFD, FD_CLOEXEC));
 }
 
-static void 
-alarm_handler(int sig)
+/* Returns 1 if str starts with the whole word tok.
+*/
+static int
+is_token(const char *str, const char *tok)
 {
-    got_sigalrm = 1;
+    size_t  len = strlen(tok);
+
+    return(strncmp(str, tok, len) == 0
+        && (str[len] == '\0' || isspace(str[len])));
 }
-*/
 
-/* Run en external command returning exit status, and optionally filling
- * provided  buffer with STDOUT output up to the size provided.
- *
- * Note: XXX: We are not using the timeout parameter at present. We still need
- *       to implement a reliable timeout mechanism.
+/* Split the command in buf (in place) into argv, stripping simple quotes.
+ * A trailing "2>&1" or "2>/dev/null" sets se_mode.  Returns the argument
+ * count, or 0 if the command needs a shell.
 */
-int
-_run_extcmd(uid_t user_uid, char *cmd, char *so_buf, size_t so_buf_sz, int timeout)
+static int
+parse_cmd_args(char *buf, char **argv, int *se_mode)
 {
-    FILE   *ipt;
-    int     retval = 0;
-    char    so_read_buf[IO_READ_BUF_LEN];
-    pid_t   pid;
-    int     res;
+    char   *r = buf, *w, c, quote;
+    int     argc = 0;
+
+    *se_mode = EXTCMD_STDERR_PIPE;
 
-    if(so_buf == NULL)
+    while(*r != '\0')
     {
+        while(isspace(*r))
+            r++;
 
-        /* Since we do not have to capture output, we will fork here (which we
-         * would have to do anyway if we are running as another user as well).
-        */
-        pid = fork();
-        if(pid == -1)
+        if(*r == '\0')
+            break;
+
+        if(is_token(r, "2>&1"))
         {
-            log_msg(LOG_ERR, "run_extcmd: fork failed: %s", strerror(errno));
-            return(EXTCMD_FORK_ERROR);
+            *se_mode = EXTCMD_STDERR_MERGE;
+            r += 4;
+            continue;
         }
-        else if (pid == 0)
+
+        if(is_token(r, "2>/dev/null"))
+        {
+            *se_mode = EXTCMD_STDERR_DISCARD;
+            r += 11;
+            continue;
+        }
+
+        if(argc >= EXTCMD_MAX_ARGS)
+            return(0);
+
+        argv[argc++] = w = r;
+        quote = 0;
+
+        while(*r != '\0' && (quote || !isspace(*r)))
         {
-            /* We are the child */
-            /* If user is not null, then we setuid to that user before running the
-            * command.
-            */
-            if(user_uid > 0)
+            if(quote)
             {
-                if(setuid(user_uid) < 0)
+                if(*r == quote)
                 {
-                    exit(EXTCMD_SETUID_ERROR);
+                    quote = 0;
+                    r++;
+                    continue;
                 }
+
+                if(quote == '"' && strchr("$`\\", *r) != NULL)
+                    return(0);
             }
-            res = system(cmd);
-            exit(WEXITSTATUS(res));
+            else if(*r == '\'' || *r == '"')
+            {
+                quote = *r++;
+                continue;
+            }
+            else if(strchr(EXTCMD_SHELL_META, *r) != NULL)
+                return(0);
+
+            *w++ = *r++;
         }
 
-        /* Retval is forced to 0 as we don't care about the exit status of
-         * the child (for now)>
-        */
-        retval = 0;
+        if(quote)
+            return(0);
+
+        c  = *r;
+        *w = '\0';
+
+        if(c != '\0')
+            r++;
     }
-    else
+
+    argv[argc] = NULL;
+
+    return(argc);
+}
+
+/* Start the child with stdin on the given pipe read end (or /dev/null if
+ * there is none) and its stdout (and stderr, according to se_mode) on the
+ * given pipe write ends.  The child gets its own process group so a
+ * timeout can take down anything it started too.  Returns the pid, or -1
+ * on error.
+*/
+static pid_t
+spawn_child(uid_t user_uid, char **argv, int in_rd, int so_wr, int se_wr,
+    int se_mode)
+{
+    pid_t       pid;
+    int         fd;
+    sigset_t    no_sigs;
+#if HAVE_SPAWN_H
+    posix_spawn_file_actions_t  fa;
+    posix_spawnattr_t           attr;
+    int                         res;
+#endif
+
+    sigemptyset(&no_sigs);
+
+#if HAVE_SPAWN_H
+    /* posix_spawn() cannot change the uid, so running as another user
+     * takes the fork() path below.
+    */
+    if(user_uid == 0)
     {
-        /* Looking for output use popen and fill the buffer to its limit.
-        */
-        ipt = popen(cmd, "r");
+        posix_spawn_file_actions_init(&fa);
 
-        if(ipt == NULL)
-        {
-            log_msg(LOG_ERR, "Got popen error %i:  %s", errno, strerror(errno));
-            retval = -1;
-        }
+        if(in_rd >= 0)
+            posix_spawn_file_actions_adddup2(&fa, in_rd, STDIN_FILENO);
         else
-        {
-            memset(so_buf, 0x0, so_buf_sz);
+            posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
 
-            while((fgets(so_read_buf, IO_READ_BUF_LEN, ipt)) != NULL)
-            {
-                if(so_buf == NULL)
-                    continue;
+        posix_spawn_file_actions_adddup2(&fa, so_wr, STDOUT_FILENO);
 
-                strlcat(so_buf, so_read_buf, so_buf_sz);
+        if(se_mode == EXTCMD_STDERR_MERGE)
+            posix_spawn_file_actions_adddup2(&fa, so_wr, STDERR_FILENO);
+        else if(se_mode == EXTCMD_STDERR_DISCARD)
+            posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+        else
+            posix_spawn_file_actions_adddup2(&fa, se_wr, STDERR_FILENO);
 
-                if(strlen(so_buf) >= so_buf_sz-1)
-                    break;
-            }
+        if(in_rd > STDERR_FILENO)
+            posix_spawn_file_actions_addclose(&fa, in_rd);
+        if(so_wr > STDERR_FILENO)
+            posix_spawn_file_actions_addclose(&fa, so_wr);
+        if(se_wr > STDERR_FILENO)
+            posix_spawn_file_actions_addclose(&fa, se_wr);
+
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &no_sigs);
+        posix_spawnattr_setpgroup(&attr, 0);
+        posix_spawnattr_setflags(&attr,
+            POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+        res = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&fa);
 
-            pclose(ipt);
+        if(res != 0)
+        {
+            errno = res;
+            return(-1);
         }
+
+        return(pid);
     }
+#endif
 
-    return(retval);
+    pid = fork();
+    if(pid != 0)
+        return(pid);
+
+    /* We are the child.
+    */
+    setpgid(0, 0);
+
+    fd = open("/dev/null", O_RDWR);
+
+    if(in_rd >= 0)
+        dup2(in_rd, STDIN_FILENO);
+    else if(fd >= 0)
+        dup2(fd, STDIN_FILENO);
+
+    dup2(so_wr, STDOUT_FILENO);
+
+    if(se_mode == EXTCMD_STDERR_MERGE)
+        dup2(so_wr, STDERR_FILENO);
+    else if(se_mode == EXTCMD_STDERR_DISCARD && fd >= 0)
+        dup2(fd, STDERR_FILENO);
+    else if(se_wr >= 0)
+        dup2(se_wr, STDERR_FILENO);
+
+    if(fd > STDERR_FILENO)
+        close(fd);
+    if(in_rd > STDERR_FILENO)
+        close(in_rd);
+    if(so_wr > STDERR_FILENO)
+        close(so_wr);
+    if(se_wr > STDERR_FILENO)
+        close(se_wr);
+
+    sigprocmask(SIG_SETMASK, &no_sigs, NULL);
+
+    /* If a user was given, we setuid to that user before running the
+     * command.  The exit codes follow the shell convention for "could not
+     * run" and "not found".
+    */
+    if(user_uid > 0 && setuid(user_uid) < 0)
+        _exit(126);
+
+    execvp(argv[0], argv);
+    _exit(127);
 }
 
+/* Start cmd and return its tracking struct, or NULL (with *err set) if it
+ * could not be started.  If in_data is given, it is fed to the command's
+ * stdin (by extcmd_check(), so it must stay around until the command is
+ * done).
+*/
+static extcmd_t *
+extcmd_start(uid_t user_uid, char *cmd, const char *in_data, char *so_buf,
+    size_t so_buf_sz, int timeout, int *err)
+{
+    extcmd_t   *ec;
+    char       *args;
+    char       *argv[EXTCMD_MAX_ARGS+1];
+    int         in[2] = {-1, -1}, so[2], se[2] = {-1, -1};
+    int         se_mode, spawn_errno;
+
+    if((ec = calloc(1, sizeof(extcmd_t))) == NULL
+      || (ec->cmd = strdup(cmd)) == NULL
+      || (args = strdup(cmd)) == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error in extcmd_start.");
+        exit(EXIT_FAILURE);
+    }
 
-#if 0 /* --DSS the original method that did not work on some systems */
+    if(parse_cmd_args(args, argv, &se_mode) == 0)
+    {
+        argv[0] = "/bin/sh";
+        argv[1] = "-c";
+        argv[2] = cmd;
+        argv[3] = NULL;
+        se_mode = EXTCMD_STDERR_PIPE;
+    }
 
-    /* Create the pipes we will use for getting stdout and stderr
-     * from the child process.
-    */
-    if(pipe(so) != 0)
-        return(EXTCMD_PIPE_ERROR);
+    if(in_data != NULL && pipe(in) != 0)
+    {
+        *err = EXTCMD_PIPE_ERROR;
+        goto start_failed;
+    }
 
-    if(pipe(se) != 0)
-        return(EXTCMD_PIPE_ERROR);
+    if(pipe(so) != 0)
+    {
+        if(in[0] >= 0)
+        {
+            close(in[0]);
+            close(in[1]);
+        }
+        *err = EXTCMD_PIPE_ERROR;
+        goto start_failed;
+    }
 
-    /* Fork off a child process to run the command and provide its outputs.
-    */
-    pid = fork();
-    if(pid == -1)
+    if(se_mode == EXTCMD_STDERR_PIPE && pipe(se) != 0)
     {
-        return(EXTCMD_FORK_ERROR);
+        if(in[0] >= 0)
+        {
+            close(in[0]);
+            close(in[1]);
+        }
+        close(so[0]);
+        close(so[1]);
+        *err = EXTCMD_PIPE_ERROR;
+        goto start_failed;
     }
-    else if (pid == 0)
+
+    if(in[1] >= 0)
+        set_nonblock(in[1]);
+    set_nonblock(so[0]);
+    if(se[0] >= 0)
+        set_nonblock(se[0]);
+
+    ec->pid     = spawn_child(user_uid, argv, in[0], so[1], se[1], se_mode);
+    spawn_errno = errno;
+
+    /* The child's ends of the pipes belong to it alone.
+    */
+    if(in[0] >= 0)
+        close(in[0]);
+    close(so[1]);
+    if(se[1] >= 0)
+        close(se[1]);
+
+    if(ec->pid < 0)
     {
-        /* We are the child, so we dup stdout and stderr to our respective
-         * write-end of the pipes, close stdin and the read-end of the pipes
-         * (since we don't need them here).  Then use system() to run the
-         * command and exit with the exit status of that command so we can
-         * grab it from the waitpid call in the parent.
-        */
-        close(fileno(stdin));
-        dup2(so[1], fileno(stdout));
-        dup2(se[1], fileno(stderr));
+        log_msg(LOG_ERR, "run_extcmd: unable to start '%s': %s",
+            cmd, strerror(spawn_errno));
+
+        if(in[1] >= 0)
+            close(in[1]);
         close(so[0]);
-        close(se[0]);
+        if(se[0] >= 0)
+            close(se[0]);
 
-        /* If user is not null, then we setuid to that user before running the
-         * command.
-        */
-        if(user_uid > 0)
+        *err = EXTCMD_FORK_ERROR;
+        goto start_failed;
+    }
+
+    free(args);
+
+    ec->in_fd     = in[1];
+    ec->in_data   = in_data;
+    ec->in_len    = (in_data != NULL) ? strlen(in_data) : 0;
+    ec->so_fd     = so[0];
+    ec->se_fd     = se[0];
+    ec->so_buf    = so_buf;
+    ec->so_buf_sz = so_buf_sz;
+    ec->deadline  = time(NULL) + ((timeout > 0) ? timeout : EXTCMD_DEF_TIMEOUT);
+
+    if(so_buf != NULL && so_buf_sz > 0)
+        so_buf[0] = '\0';
+
+    return(ec);
+
+start_failed:
+    free(args);
+    free(ec->cmd);
+    free(ec);
+    return(NULL);
+}
+
+/* Read whatever is waiting on *fd into buf.  Anything beyond the end of
+ * buf is read and dropped so the child never blocks on a full pipe.  The
+ * descriptor is closed (and set to -1) at EOF.
+*/
+static void
+drain_fd(int *fd, char *buf, size_t buf_sz, size_t *len)
+{
+    char        scratch[IO_READ_BUF_LEN];
+    ssize_t     n;
+
+    while(1)
+    {
+        if(buf != NULL && *len + 1 < buf_sz)
         {
-            if(setuid(user_uid) < 0)
+            n = read(*fd, buf + *len, buf_sz - *len - 1);
+            if(n > 0)
             {
-                exit(EXTCMD_SETUID_ERROR);
+                *len += n;
+                buf[*len] = '\0';
             }
         }
+        else
+            n = read(*fd, scratch, sizeof(scratch));
 
-        /* --DSS XXX: Would it be more efficient to use one of the exec()
-         *            calls (i.e. 'return(execvp(ext_cmd, &argv[1]));')?
-         *            For now, we use system() and exit with the external
-         *            command exit status.
+        if(n > 0 || (n < 0 && errno == EINTR))
+            continue;
+
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        /* EOF or a read error - either way we are done with this pipe.
         */
-        exit(WEXITSTATUS(system(cmd)));
+        close(*fd);
+        *fd = -1;
+        return;
     }
+}
 
-    /* Parent from here */
+/* Write as much of the pending stdin data as the pipe takes, and close it
+ * once it has all gone (or the command has stopped reading).  SIGPIPE is
+ * held off while we write, and one that a closed pipe raises is taken
+ * off the pending set again, so we just see EPIPE.
+*/
+static void
+feed_stdin(extcmd_t *ec)
+{
+    sigset_t    pipe_mask, old_mask, pending;
+    ssize_t     n;
+    int         sig, err = 0;
 
-    /* Give the exit status an initial value of -1.
-    */
-    *status = -1;
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipe_mask, &old_mask);
 
-    /* Close the write-end of the pipes (we are only reading).
-    */
-    close(so[1]);
-    close(se[1]);
+    while(ec->in_len > 0)
+    {
+        n = write(ec->in_fd, ec->in_data, ec->in_len);
 
-    /* Set our pipes to non-blocking
-    */
-    set_nonblock(so[0]);
-    set_nonblock(se[0]);
+        if(n > 0)
+        {
+            ec->in_data += n;
+            ec->in_len  -= n;
+            continue;
+        }
 
-    tv.tv_sec = EXTCMD_DEF_TIMEOUT;
-    tv.tv_usec = 0;
+        if(n < 0 && errno == EINTR)
+            continue;
 
-    /* Initialize and setup our file descriptor sets for select.
-    */
-    FD_ZERO(&rfds);
-    FD_ZERO(&efds);
-    FD_SET(so[0], &rfds);
-    FD_SET(se[0], &rfds);
-    FD_SET(so[0], &efds);
-    FD_SET(se[0], &efds);
-
-    /* Start with fully clear buffers.
-    */
-    memset(so_buf, 0x0, so_buf_sz);
-    memset(se_buf, 0x0, se_buf_sz);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
 
-    /* Read both stdout and stderr piped from the child until we get eof,
-     * fill the buffers, or error out.
-    */
-    while(so_buf_remaining > 0 || se_buf_remaining > 0)
+        err = errno;
+        ec->in_len = 0;
+    }
+
+    if(err == EPIPE && !sigismember(&old_mask, SIGPIPE)
+      && sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE))
+        sigwait(&pipe_mask, &sig);
+
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    if(ec->in_len == 0)
+    {
+        close(ec->in_fd);
+        ec->in_fd = -1;
+    }
+}
+
+/* Collect any output from the command (waiting up to wait_ms for some),
+ * feed it any stdin data, reap it if it has exited, and deal with the
+ * timeout: SIGTERM first, then SIGKILL a second later.  Returns 1 once the
+ * command is finished.
+*/
+static int
+extcmd_check(extcmd_t *ec, const int wait_ms)
+{
+    struct pollfd   pfd[3];
+    int             nfds = 0;
+    pid_t           pid;
+
+    if(ec->in_fd >= 0)
+    {
+        pfd[nfds].fd     = ec->in_fd;
+        pfd[nfds].events = POLLOUT;
+        nfds++;
+    }
+
+    if(ec->so_fd >= 0)
+    {
+        pfd[nfds].fd     = ec->so_fd;
+        pfd[nfds].events = POLLIN;
+        nfds++;
+    }
+
+    if(ec->se_fd >= 0)
+    {
+        pfd[nfds].fd     = ec->se_fd;
+        pfd[nfds].events = POLLIN;
+        nfds++;
+    }
+
+    if(nfds > 0 && poll(pfd, nfds, wait_ms) > 0)
     {
-        selval = select(8, &rfds, NULL, &efds, &tv);
+        if(ec->in_fd >= 0)
+            feed_stdin(ec);
+        if(ec->so_fd >= 0)
+            drain_fd(&ec->so_fd, ec->so_buf, ec->so_buf_sz, &ec->so_len);
+        if(ec->se_fd >= 0)
+            drain_fd(&ec->se_fd, ec->se_buf, sizeof(ec->se_buf), &ec->se_len);
+    }
+
+    if(!ec->reaped)
+    {
+        pid = waitpid(ec->pid, &ec->status, WNOHANG);
 
-        if(selval == -1)
+        if(pid == ec->pid)
+            ec->reaped = 1;
+        else if(pid < 0 && errno != EINTR)
         {
-            /* Select error - so kill the child and bail.
-            */
-            kill(pid, SIGTERM);
-            retval |= EXTCMD_SELECT_ERROR;
-            break;
+            ec->status = -1;
+            ec->reaped = 1;
         }
+        else if(nfds == 0 && wait_ms > 0)
+            poll(NULL, 0, 1);
+    }
 
-        if(selval == 0)
+    if(ec->reaped && ec->so_fd < 0 && ec->se_fd < 0)
+        return(1);
+
+    if(time(NULL) < ec->deadline)
+        return(0);
+
+    if(!ec->reaped)
+    {
+        if(ec->killed++ == 0)
         {
-            /* Timeout - so kill the child and bail
-            */
-            kill(pid, SIGTERM);
-            retval |= EXTCMD_EXECUTION_TIMEOUT;
-            break;
+            log_msg(LOG_WARNING, "Command '%s' (pid %i) timed out, terminating it.",
+                ec->cmd, ec->pid);
+            kill(-ec->pid, SIGTERM);
         }
+        else
+            kill(-ec->pid, SIGKILL);
 
-        /* The stdout pipe...
-        */
-        bytes_read = read(so[0], so_read_buf, IO_READ_BUF_LEN);
-        if(so_buf_remaining > 0)
-        {
-            if(bytes_read > 0)
-            {
-                /* We have data, so process it...
-                */
-                if(bytes_read > so_buf_remaining)
-                {
-                    bytes_read = so_buf_remaining;
-                    retval |= EXTCMD_SUCCESS_PARTIAL_STDOUT;
-                }
+        ec->deadline = time(NULL) + 1;
 
-                memcpy(so_buf, so_read_buf, bytes_read);
-                so_buf += bytes_read;
-                so_buf_remaining -= bytes_read;
-            }
-            else if(bytes_read < 0)
-            {
-                /* Anything other than EAGAIN or EWOULDBLOCK is conisdered
-                 * error enough to bail.  We are done here so we force the
-                 * buf_remaining value to 0.
-                */
-                if(errno != EAGAIN && errno != EWOULDBLOCK)
-                {
-                    retval |= EXTCMD_STDOUT_READ_ERROR;
-                    so_buf_remaining = 0;
-                }
-            }
-            else
-            {
-                /* Bytes read was 0 which indicate end of file. So we are
-                 * done.
-                */
-                so_buf_remaining = 0;
-            }
+        if(ec->killed <= 2)
+            return(0);
+
+        while(waitpid(ec->pid, &ec->status, 0) < 0 && errno == EINTR)
+            ;
+        ec->reaped = 1;
+    }
+
+    /* The child is gone, but something it left behind still holds the
+     * pipes open.  We are not waiting on that.
+    */
+    if(ec->in_fd >= 0)
+    {
+        close(ec->in_fd);
+        ec->in_fd = -1;
+    }
+    if(ec->so_fd >= 0)
+    {
+        close(ec->so_fd);
+        ec->so_fd = -1;
+    }
+    if(ec->se_fd >= 0)
+    {
+        close(ec->se_fd);
+        ec->se_fd = -1;
+    }
+
+    return(1);
+}
+
+/* Map the outcome of a finished command to an EXTCMD_* status.
+*/
+static int
+extcmd_result(extcmd_t *ec)
+{
+    if(ec->killed)
+        return(EXTCMD_EXECUTION_TIMEOUT);
+
+    if(WIFEXITED(ec->status) && WEXITSTATUS(ec->status) == 0)
+        return(EXTCMD_SUCCESS_ALL_OUTPUT);
+
+    return(EXTCMD_EXECUTION_ERROR);
+}
+
+static void
+extcmd_free(extcmd_t *ec)
+{
+    if(ec->in_fd >= 0)
+        close(ec->in_fd);
+    if(ec->so_fd >= 0)
+        close(ec->so_fd);
+    if(ec->se_fd >= 0)
+        close(ec->se_fd);
+
+    free(ec->cmd);
+    free(ec);
+}
+
+/* Run an external command returning its EXTCMD_* status, and optionally
+ * filling the provided buffer with STDOUT output up to the size provided.
+ * The command is killed if it runs longer than timeout seconds (0 means
+ * EXTCMD_DEF_TIMEOUT).  If in_data is given, it is written to the
+ * command's stdin.  If exit_status is given, it is set to the command's
+ * exit status (or -1 if it did not exit normally).
+ *
+ * If there is neither a buffer nor stdin data, nobody is waiting on the
+ * result, so the command is left to run in the background and
+ * extcmd_service() reaps it later.
+*/
+static int
+extcmd_run(uid_t user_uid, char *cmd, const char *in_data, char *so_buf,
+    size_t so_buf_sz, int timeout, int *exit_status)
+{
+    extcmd_t   *ec;
+    int         retval = 0;
+
+    if(exit_status != NULL)
+        *exit_status = -1;
+
+    ec = extcmd_start(user_uid, cmd, in_data, so_buf, so_buf_sz, timeout, &retval);
+    if(ec == NULL)
+        return(retval);
+
+    if(so_buf == NULL && in_data == NULL)
+    {
+        ec->next = bg_cmds;
+        bg_cmds  = ec;
+        return(EXTCMD_SUCCESS_ALL_OUTPUT);
+    }
+
+    while(!extcmd_check(ec, 100))
+        ;
+
+    retval = extcmd_result(ec);
+
+    if(exit_status != NULL && !ec->killed && WIFEXITED(ec->status))
+        *exit_status = WEXITSTATUS(ec->status);
+
+    if(retval != EXTCMD_SUCCESS_ALL_OUTPUT && ec->se_len > 0)
+        log_msg(LOG_ERR, "Command '%s' stderr: %s", cmd, ec->se_buf);
+
+    extcmd_free(ec);
+
+    return(retval);
+}
+
+int
+_run_extcmd(uid_t user_uid, char *cmd, char *so_buf, size_t so_buf_sz, int timeout)
+{
+    return(extcmd_run(user_uid, cmd, NULL, so_buf, so_buf_sz, timeout, NULL));
+}
+
+/* The number of background commands running for owner.
+*/
+static int
+owner_running(void *owner)
+{
+    extcmd_t   *ec;
+    int         count = 0;
+
+    for(ec = bg_cmds; ec != NULL; ec = ec->next)
+        if(ec->owner == owner)
+            count++;
+
+    return(count);
+}
+
+/* The number of commands waiting in the queue for owner.
+*/
+static int
+owner_queued(void *owner)
+{
+    extcmd_job_t   *job;
+    int             count = 0;
+
+    for(job = cmd_queue; job != NULL; job = job->next)
+        if(job->owner == owner)
+            count++;
+
+    return(count);
+}
+
+/* Start each queued command whose owner is below its limit, oldest first.
+*/
+static void
+start_queued(void)
+{
+    extcmd_job_t  **jp = &cmd_queue;
+    extcmd_job_t   *job;
+    extcmd_t       *ec;
+    int             err;
+
+    while((job = *jp) != NULL)
+    {
+        if(owner_running(job->owner) >= job->max_running)
+        {
+            jp = &job->next;
+            continue;
         }
-        else
-            break;
 
-        /* The stderr pipe...
-        */
-        bytes_read = read(se[0], se_read_buf, IO_READ_BUF_LEN);
-        if(se_buf_remaining > 0)
+        *jp = job->next;
+        queue_len--;
+
+        ec = extcmd_start(job->user_uid, job->cmd, NULL, NULL, 0,
+            job->timeout, &err);
+        if(ec != NULL)
         {
-            if(bytes_read > 0)
-            {
-                /* We have data, so process it...
-                */
-                if(bytes_read > se_buf_remaining)
-                {
-                    bytes_read = se_buf_remaining;
-                    retval |= EXTCMD_SUCCESS_PARTIAL_STDERR;
-                }
+            ec->owner = job->owner;
+            ec->next  = bg_cmds;
+            bg_cmds   = ec;
+        }
 
-                memcpy(se_buf, se_read_buf, bytes_read);
-                se_buf += bytes_read;
-                se_buf_remaining -= bytes_read;
-            }
-            else if(bytes_read < 0)
-            {
-                /* Anything other than EAGAIN or EWOULDBLOCK is conisdered
-                 * error enough to bail.  We are done here so we force the
-                 * buf_remaining value to 0.
-                */
-                if(errno != EAGAIN && errno != EWOULDBLOCK)
-                {
-                    retval |= EXTCMD_STDERR_READ_ERROR;
-                    se_buf_remaining = 0;
-                }
-            }
-            else
-            {
-                /* Bytes read was 0 which indicate end of file. So we are
-                 * done.
-                */
-                se_buf_remaining = 0;
-            }
+        free(job->cmd);
+        free(job);
+    }
+}
+
+/* Run cmd in the background on behalf of owner (an access stanza), with no
+ * more than max_running of the owner's commands running at once.  Commands
+ * over that limit wait in a queue of at most queue_limit entries; beyond
+ * that they are dropped and EXTCMD_QUEUE_FULL is returned.  This never
+ * waits for the command itself - extcmd_service() logs how it went.
+*/
+int
+extcmd_queue(void *owner, int max_running, int queue_limit, uid_t user_uid,
+    char *cmd, int timeout)
+{
+    extcmd_job_t  **jp = &cmd_queue;
+    extcmd_job_t   *job;
+
+    if(max_running < 1)
+        max_running = 1;
+
+    if(owner_running(owner) >= max_running || owner_queued(owner) > 0)
+    {
+        if(queue_len >= queue_limit)
+        {
+            log_msg(LOG_WARNING,
+                "Command queue is full (%i waiting), dropping command '%s'.",
+                queue_len, cmd);
+            return(EXTCMD_QUEUE_FULL);
         }
-        else
-            break;
+
+        log_msg(LOG_INFO, "Queueing command '%s' (%i already running).",
+            cmd, owner_running(owner));
     }
 
-    close(so[0]);
-    close(se[0]);
+    if((job = calloc(1, sizeof(extcmd_job_t))) == NULL
+      || (job->cmd = strdup(cmd)) == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error in extcmd_queue.");
+        exit(EXIT_FAILURE);
+    }
 
-    /* Wait for the external command to finish and capture its exit status.
-    */
-    waitpid(pid, status, 0);
+    job->owner       = owner;
+    job->max_running = max_running;
+    job->user_uid    = user_uid;
+    job->timeout     = timeout;
 
-    if(*status != 0)
-        retval != EXTCMD_EXECUTION_ERROR;
+    while(*jp != NULL)
+        jp = &((*jp)->next);
 
-    /* Return the our status of this operation command.
-    */
-    return(retval);
+    *jp = job;
+    queue_len++;
+
+    start_queued();
+
+    return(EXTCMD_SUCCESS_ALL_OUTPUT);
+}
+
+/* Check on any commands running in the background, reaping (and logging
+ * the outcome of) those that are done and killing those that have run out
+ * of time, then start any queued commands that now may.  Called from the
+ * main loop, so this never blocks.
+*/
+void
+extcmd_service(void)
+{
+    extcmd_t  **ecp = &bg_cmds;
+    extcmd_t   *ec;
+
+    while((ec = *ecp) != NULL)
+    {
+        if(!extcmd_check(ec, 0))
+        {
+            ecp = &ec->next;
+            continue;
+        }
+
+        *ecp = ec->next;
+
+        if(ec->killed)
+            log_msg(LOG_WARNING, "Command '%s' was killed after timing out.",
+                ec->cmd);
+        else if(extcmd_result(ec) != EXTCMD_SUCCESS_ALL_OUTPUT)
+            log_msg(LOG_WARNING, "Command '%s' exited with status %i.",
+                ec->cmd, WIFEXITED(ec->status) ? WEXITSTATUS(ec->status) : -1);
+        else if(ec->owner != NULL)
+            log_msg(LOG_INFO, "Command '%s' completed.", ec->cmd);
+
+        if(ec->se_len > 0)
+            log_msg(LOG_WARNING, "Command '%s' stderr: %s", ec->cmd, ec->se_buf);
+
+        extcmd_free(ec);
+    }
+
+    if(cmd_queue != NULL)
+        start_queued();
 }
-#endif
 
 /* Run an external command.  This is wrapper around _run_extcmd()
 */
@@ -392,3 +897,26 @@ run_extcmd_as(uid_t user_uid, char *cmd, char *so_buf, size_t so_buf_sz, int tim
     return _run_extcmd(user_uid, cmd, so_buf, so_buf_sz, timeout);
 }
 
+/* Run an external command with the given data on its stdin, and wait for
+ * it (up to timeout seconds).  Its output is captured in so_buf if one is
+ * given.
+*/
+int
+run_extcmd_stdin(char *cmd, const char *in_data, char *so_buf,
+    size_t so_buf_sz, int timeout)
+{
+    return(extcmd_run(0, cmd, in_data, so_buf, so_buf_sz, timeout, NULL));
+}
+
+/* Run an external command as run_extcmd() does, and also return its exit
+ * status in *exit_status (-1 if it did not exit normally), for commands
+ * whose status means more than success or failure.
+*/
+int
+run_extcmd_status(char *cmd, char *so_buf, size_t so_buf_sz, int timeout,
+    int *exit_status)
+{
+    return(extcmd_run(0, cmd, NULL, so_buf, so_buf_sz, timeout, exit_status));
+}
+
+/***EOF***/
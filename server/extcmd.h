@@ -33,11 +33,13 @@
 
 #define IO_READ_BUF_LEN     256
 #define EXTCMD_DEF_TIMEOUT  15
+#define EXTCMD_MAX_ARGS     64
 
 /* The various return status states in which an external command result
  * may end up in.
 */
 enum {
+    EXTCMD_QUEUE_FULL               =   -5,
     EXTCMD_SETUID_ERROR             =   -4,
     EXTCMD_SELECT_ERROR             =   -3,
     EXTCMD_PIPE_ERROR               =   -2,
@@ -73,6 +75,13 @@ enum {
 */
 int run_extcmd(char *cmd, char *so_buf, size_t so_buf_sz, int timeout);
 int run_extcmd_as(uid_t uid, char *cmd, char *so_buf, size_t so_buf_sz, int timeout);
+int run_extcmd_stdin(char *cmd, const char *in_data, char *so_buf,
+    size_t so_buf_sz, int timeout);
+int run_extcmd_status(char *cmd, char *so_buf, size_t so_buf_sz, int timeout,
+    int *exit_status);
+int extcmd_queue(void *owner, int max_running, int queue_limit, uid_t uid,
+    char *cmd, int timeout);
+void extcmd_service(void);
 
 #endif /* EXTCMD_H */
 
@@ -34,9 +34,439 @@
 #include "log_msg.h"
 #include "extcmd.h"
 #include "access.h"
+#include "tcp_server.h"
+#include "metrics.h"
 
-/* --DSS This is a place holder for now.  We may put the generalized external
- *       firewall script code here ( or not).
+#include <stdarg.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#if HAVE_SYS_WAIT_H
+  #include <sys/wait.h>
+#endif
+
+/* Firewall command batching.
+ *
+ * The firewall backends queue their rule changes in a fw_batch instead of
+ * running a command for each one.  Once the first queued entry is older
+ * than the FW_BATCH_WINDOW, the whole batch is handed to a forked executor
+ * process that applies it with a single firewall command, so the capture
+ * loop never waits on fork/exec.  Only one executor runs at a time; entries
+ * that arrive while it is busy simply wait for the next batch.
+ *
+ * The apply function reports each entry it could not apply with
+ * fw_batch_failed().  The executor writes those back over a pipe, and once
+ * it has been reaped, fw_batch_done() lets the backend see which of its
+ * queued changes did not make it.
+*/
+
+#define FW_BATCH_INIT_SIZE  4096
+
+/* Where fw_batch_failed() sends its reports: the pipe back to the main
+ * process in the executor, or the batch itself when applying inline.
+*/
+static int              exec_report_fd = -1;
+static struct fw_batch *inline_batch   = NULL;
+
+/* Append raw data to the failed entries of a batch.
+*/
+static void
+failed_append(struct fw_batch *b, const char *data, const size_t len)
+{
+    char   *new_buf;
+    size_t  new_size;
+
+    if(b->failed_size - b->failed_len <= len)
+    {
+        new_size = (b->failed_size == 0) ? FW_BATCH_INIT_SIZE : b->failed_size;
+
+        while(new_size - b->failed_len <= len)
+            new_size *= 2;
+
+        if((new_buf = realloc(b->failed, new_size)) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory allocation error in failed_append.");
+            exit(EXIT_FAILURE);
+        }
+
+        b->failed      = new_buf;
+        b->failed_size = new_size;
+    }
+
+    memcpy(b->failed + b->failed_len, data, len);
+    b->failed_len += len;
+    b->failed[b->failed_len] = '\0';
+}
+
+/* Append a formatted entry to the batch.
+*/
+void
+fw_batch_add(struct fw_batch *b, const char *fmt, ...)
+{
+    va_list ap;
+    int     n;
+    char   *new_buf;
+    size_t  new_size;
+
+    while(1)
+    {
+        if(b->size - b->len > 1)
+        {
+            va_start(ap, fmt);
+            n = vsnprintf(b->buf + b->len, b->size - b->len, fmt, ap);
+            va_end(ap);
+
+            if(n >= 0 && (size_t)n < b->size - b->len)
+            {
+                if(b->entries++ == 0)
+                    gettimeofday(&(b->started), NULL);
+
+                b->len += n;
+                return;
+            }
+        }
+
+        /* Not enough room, so grow the buffer and try again.
+        */
+        new_size = (b->size == 0) ? FW_BATCH_INIT_SIZE : b->size * 2;
+
+        if((new_buf = realloc(b->buf, new_size)) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory allocation error in fw_batch_add.");
+            exit(EXIT_FAILURE);
+        }
+
+        new_buf[b->len] = '\0';
+
+        b->buf  = new_buf;
+        b->size = new_size;
+    }
+}
+
+/* Drop any queued entries (the buffer is kept for reuse).
 */
+void
+fw_batch_reset(struct fw_batch *b)
+{
+    if(b->buf != NULL)
+        b->buf[0] = '\0';
+
+    b->len     = 0;
+    b->entries = 0;
+}
+
+/* Wait for any running executor, then release the batch.
+*/
+void
+fw_batch_free(struct fw_batch *b)
+{
+    fw_batch_wait(b);
+
+    if(b->buf != NULL)
+        free(b->buf);
+
+    if(b->exec_buf != NULL)
+        free(b->exec_buf);
+
+    if(b->failed != NULL)
+        free(b->failed);
+
+    memset(b, 0x0, sizeof(struct fw_batch));
+}
+
+/* Read what the executor has reported so far.  With block set, keep going
+ * until it closes its end of the pipe.
+*/
+static void
+collect_results(struct fw_batch *b, const int block)
+{
+    char            buf[1024];
+    ssize_t         n;
+    struct pollfd   pfd;
+
+    if(b->result_fd < 0)
+        return;
+
+    while(1)
+    {
+        n = read(b->result_fd, buf, sizeof(buf));
+
+        if(n > 0)
+        {
+            failed_append(b, buf, n);
+            continue;
+        }
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n < 0 && errno == EAGAIN && block)
+        {
+            pfd.fd     = b->result_fd;
+            pfd.events = POLLIN;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        break;
+    }
+
+    if(n == 0 || errno != EAGAIN)
+    {
+        close(b->result_fd);
+        b->result_fd = -1;
+    }
+}
+
+/* The executor is gone.  Unless it exited on its own (with either result),
+ * we cannot tell what it applied, so every entry it was given is counted
+ * as failed.
+*/
+static void
+executor_done(struct fw_batch *b, const int status, const int have_status)
+{
+    collect_results(b, 1);
+
+    if(have_status && (!WIFEXITED(status)
+      || (WEXITSTATUS(status) != EXIT_SUCCESS
+        && WEXITSTATUS(status) != EXIT_FAILURE)))
+    {
+        log_msg(LOG_WARNING,
+            "Firewall batch executor (pid %i) did not complete cleanly.",
+            b->exec_pid);
+
+        b->failed_len = 0;
+        failed_append(b, b->exec_buf, strlen(b->exec_buf));
+    }
+
+    b->exec_pid = 0;
+    b->done     = 1;
+}
+
+/* Returns 1 if an executor for this batch is still running.  We reap it
+ * ourselves if it has finished.
+*/
+int
+fw_batch_busy(struct fw_batch *b)
+{
+    int     status;
+    pid_t   pid;
+
+    if(b->exec_pid <= 0)
+        return(0);
+
+    /* Keep the pipe drained so a long report cannot stall the executor.
+    */
+    collect_results(b, 0);
+
+    pid = waitpid(b->exec_pid, &status, WNOHANG);
+
+    if(pid == 0)
+        return(1);
+
+    executor_done(b, status, pid == b->exec_pid);
+
+    return(0);
+}
+
+/* Block until any running executor for this batch is done.
+*/
+void
+fw_batch_wait(struct fw_batch *b)
+{
+    int     status;
+    pid_t   pid;
+
+    if(b->exec_pid <= 0)
+        return;
+
+    collect_results(b, 1);
+
+    while((pid = waitpid(b->exec_pid, &status, 0)) < 0 && errno == EINTR)
+        ;
+
+    executor_done(b, status, pid == b->exec_pid);
+}
+
+/* Returns 1 (once) when the last batch handed to fw_batch_exec() has been
+ * applied, in which case the entries that failed, one per line, are in
+ * b->failed (an empty string if there were none).  Since fw_batch_exec()
+ * starts over, check this right before handing it the next batch.
+*/
+int
+fw_batch_done(struct fw_batch *b)
+{
+    if(fw_batch_busy(b) || ! b->done)
+        return(0);
+
+    b->done = 0;
+
+    if(b->failed == NULL)
+        failed_append(b, "", 0);
+
+    return(1);
+}
+
+/* Called by the apply function for each entry that could not be applied.
+*/
+void
+fw_batch_failed(const char *entry)
+{
+    size_t  len = strlen(entry);
+    ssize_t n;
+
+    if(inline_batch != NULL)
+    {
+        failed_append(inline_batch, entry, len);
+        failed_append(inline_batch, "\n", 1);
+        return;
+    }
+
+    if(exec_report_fd < 0)
+        return;
+
+    while(len > 0)
+    {
+        if((n = write(exec_report_fd, entry, len)) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+
+        entry += n;
+        len   -= n;
+    }
+
+    while(write(exec_report_fd, "\n", 1) < 0 && errno == EINTR)
+        ;
+}
+
+/* Returns 1 if there are queued entries, the oldest one has waited at
+ * least window_ms milliseconds, and no executor is currently running.
+*/
+int
+fw_batch_ready(struct fw_batch *b, const int window_ms)
+{
+    struct timeval  now;
+    long            elapsed_ms;
+
+    if(fw_batch_busy(b) || b->entries == 0)
+        return(0);
+
+    gettimeofday(&now, NULL);
+
+    elapsed_ms = (now.tv_sec - b->started.tv_sec) * 1000
+        + (now.tv_usec - b->started.tv_usec) / 1000;
+
+    return(elapsed_ms >= window_ms);
+}
+
+/* Hand the queued entries to a forked executor which runs apply() on them,
+ * and reset the queue.  If we cannot fork, the batch is applied here.
+*/
+void
+fw_batch_exec(struct fw_batch *b, int (*apply)(char *batch))
+{
+    pid_t   pid;
+    int     pfd[2];
+    char   *tmp_buf;
+    size_t  tmp_size;
+
+    if(b->entries == 0)
+        return;
+
+    fw_batch_wait(b);
+
+    /* Keep the entries we hand over (apply() may modify them) so we still
+     * know what they were if the executor dies.
+    */
+    tmp_buf      = b->exec_buf;
+    tmp_size     = b->exec_size;
+    b->exec_buf  = b->buf;
+    b->exec_size = b->size;
+    b->buf       = tmp_buf;
+    b->size      = tmp_size;
+
+    b->done       = 0;
+    b->failed_len = 0;
+    if(b->failed != NULL)
+        b->failed[0] = '\0';
+
+    if(b->entries > 1)
+        log_msg(LOG_INFO, "Applying %i queued firewall rule changes.",
+            b->entries);
+
+    b->entries = 0;
+    b->len     = 0;
+    if(b->buf != NULL)
+        b->buf[0] = '\0';
+
+    if(pipe(pfd) != 0)
+        pid = -1;
+    else
+    {
+        fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+
+        if((pid = fork()) < 0)
+        {
+            close(pfd[0]);
+            close(pfd[1]);
+        }
+    }
+
+    if(pid == 0)
+    {
+        /* The executor.  Let go of the TCP server and metrics sockets so
+         * client connections close when the main process is done with them.
+        */
+        stop_tcp_server();
+        metrics_close_fds();
+
+        close(pfd[0]);
+        exec_report_fd = pfd[1];
+
+        _exit(apply(b->exec_buf) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    else if(pid < 0)
+    {
+        log_msg(LOG_WARNING,
+            "fork() error %i for firewall batch executor, applying it inline.",
+            errno);
+
+        inline_batch = b;
+        apply(b->exec_buf);
+        inline_batch = NULL;
+
+        b->done = 1;
+    }
+    else
+    {
+        close(pfd[1]);
+        fcntl(pfd[0], F_SETFL, fcntl(pfd[0], F_GETFL, 0) | O_NONBLOCK);
+
+        b->result_fd = pfd[0];
+        b->exec_pid  = pid;
+    }
+}
+
+/* Run cmd with data fed to its stdin, and return its EXTCMD_* status
+ * (EXTCMD_SUCCESS_ALL_OUTPUT, which is 0, if it exited cleanly).  The
+ * command is killed if it takes longer than FW_CMD_TIMEOUT.  Its output
+ * goes to out (if given).
+*/
+int
+fw_batch_pipe(const char *cmd, const char *data, char *out, const size_t out_sz)
+{
+    int     res;
+
+    res = run_extcmd_stdin((char *)cmd, data, out, out_sz, FW_CMD_TIMEOUT);
+
+    if(! EXTCMD_IS_SUCCESS(res))
+        log_msg(LOG_WARNING, "Command '%s' failed (status %i).", cmd, res);
+
+    return(res);
+}
 
 /***EOF***/
@@ -38,6 +38,12 @@
 
 #define EXPIRE_COMMENT_PREFIX "_exp_"
 
+/* How long (in seconds) a firewall command may run before it is killed.
+ * These normally take milliseconds, and the caller waits on them, so we
+ * do not give them the full EXTCMD_DEF_TIMEOUT.
+*/
+#define FW_CMD_TIMEOUT              3
+
 #if FIREWALL_IPTABLES
   #include "fw_util_iptables.h"
 #elif FIREWALL_IPFW
@@ -46,6 +52,8 @@
   #include "fw_util_pf.h"
 #elif FIREWALL_IPF
   #include "fw_util_ipf.h"
+#elif FIREWALL_MEM
+  #include "fw_util_mem.h"
 #endif
 
 #if HAVE_TIME_H
@@ -65,6 +73,20 @@ void check_firewall_rules(fko_srv_options_t *opts);
 int fw_dump_rules(fko_srv_options_t *opts);
 int process_spa_request(fko_srv_options_t *opts, spa_data_t *spdat);
 
+/* Firewall command batching (fw_util.c).
+*/
+void fw_batch_add(struct fw_batch *b, const char *fmt, ...);
+void fw_batch_reset(struct fw_batch *b);
+void fw_batch_free(struct fw_batch *b);
+int fw_batch_busy(struct fw_batch *b);
+void fw_batch_wait(struct fw_batch *b);
+int fw_batch_ready(struct fw_batch *b, const int window_ms);
+int fw_batch_done(struct fw_batch *b);
+void fw_batch_failed(const char *entry);
+void fw_batch_exec(struct fw_batch *b, int (*apply)(char *batch));
+int fw_batch_pipe(const char *cmd, const char *data, char *out,
+    const size_t out_sz);
+
 #endif /* FW_UTIL_H */
 
 /***EOF***/
@@ -43,18 +43,29 @@ static char   cmd_buf[CMD_BUFSIZE];
 static char   err_buf[CMD_BUFSIZE];
 static char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
 
+/* Pull the next free rule number off of the free list (0 if there are
+ * none left).
+*/
 static unsigned short
 get_next_rule_num(void)
 {
-    unsigned short i;
+    if(fwc.free_count == 0)
+        return(0);
 
-    for(i=0; i < fwc.max_rules; i++)
-    {
-        if(fwc.rule_map[i] == RULE_FREE)
-            return(fwc.start_rule_num + i);
-    }
+    return(fwc.start_rule_num + fwc.free_list[--fwc.free_count]);
+}
 
-    return(0);
+/* Put a rule number back on the free list.
+*/
+static void
+release_rule_num(const unsigned short rule_num)
+{
+    unsigned short  offset = rule_num - fwc.start_rule_num;
+
+    fwc.rule_map[offset]    = RULE_FREE;
+    fwc.rule_expire[offset] = 0;
+
+    fwc.free_list[fwc.free_count++] = offset;
 }
 
 static void
@@ -65,6 +76,208 @@ zero_cmd_buffers(void)
     memset(cmd_out, 0x0, STANDARD_CMD_OUT_BUFSIZE);
 }
 
+/* Run an ipfw command (given its args), or queue it for the firewall
+ * executor if batching is enabled.
+*/
+static int
+ipfw_cmd(const char *args)
+{
+    int     res;
+
+    if(fwc.batch_window > 0)
+    {
+        fw_batch_add(&fwc.batch, "%s\n", args);
+        return(EXTCMD_SUCCESS_ALL_OUTPUT);
+    }
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s %s", fwc.fw_command, args);
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
+    if(! EXTCMD_IS_SUCCESS(res))
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+
+    return(res);
+}
+
+/* Apply a batch of queued ipfw commands in one ipfw run (this runs in the
+ * executor process).  ipfw stops at the first command that fails, and
+ * names it ("Line <n>: ...") in its error message.  The commands before
+ * it are in place, and the rest are run one at a time so one bad entry
+ * does not lose them.  Failed commands are reported back with
+ * fw_batch_failed().
+*/
+static int
+ipfw_apply_batch(char *batch)
+{
+    int     res, got_err = 0, line_num = 0, bad_line = 0;
+    char   *line, *eol, *ndx;
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_BATCH_ARGS " 2>&1", fwc.fw_command);
+
+    res = fw_batch_pipe(cmd_buf, batch, err_buf, CMD_BUFSIZE);
+    if(res == 0)
+        return(0);
+
+    for(ndx = err_buf; ndx != NULL && *ndx != '\0'; ndx = strchr(ndx, '\n'))
+    {
+        if(*ndx == '\n')
+            ndx++;
+
+        if(sscanf(ndx, "Line %d:", &bad_line) == 1)
+            break;
+
+        bad_line = 0;
+    }
+
+    for(line = batch; *line != '\0'; line = eol + 1)
+    {
+        if((eol = strchr(line, '\n')) == NULL)
+            break;
+
+        *eol = '\0';
+
+        line_num++;
+
+        /* Without knowing where ipfw stopped (it may have timed out),
+         * nothing can be taken as done, and a command that hangs would
+         * only hang again.
+        */
+        if(res == EXTCMD_EXECUTION_TIMEOUT && bad_line == 0)
+        {
+            fw_batch_failed(line);
+            got_err++;
+            continue;
+        }
+
+        if(line_num < bad_line)
+            continue;
+
+        if(line_num == bad_line)
+        {
+            log_msg(LOG_ERR, "Error from cmd:'%s %s': %s",
+                fwc.fw_command, line, err_buf);
+            fw_batch_failed(line);
+            got_err++;
+            continue;
+        }
+
+        zero_cmd_buffers();
+
+        snprintf(cmd_buf, CMD_BUFSIZE-1, "%s %s", fwc.fw_command, line);
+
+        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
+        if(! EXTCMD_IS_SUCCESS(res))
+        {
+            log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+            fw_batch_failed(line);
+            got_err++;
+        }
+    }
+
+    return(got_err);
+}
+
+/* Change the state of every rule number in the from state to the to state.
+*/
+static void
+set_rules_state(const int from, const int to)
+{
+    int     i;
+
+    for(i=0; i<fwc.max_rules; i++)
+        if(fwc.rule_map[i] == from)
+            fwc.rule_map[i] = to;
+}
+
+/* The firewall executor is done with the last batch.  A rule that could
+ * not be added is dropped (along with whatever part of it did make it in)
+ * so the next SPA packet asking for the same access adds it again.  A
+ * rule that could not be moved to the expire set is still granting
+ * access, so it goes back to the active set to be moved again.  The rest
+ * of the moves are done.
+*/
+static void
+batch_applied(void)
+{
+    char            args[CMD_BUFSIZE];
+    char           *line, *eol;
+    unsigned int    rule_num, set_num;
+    int             i;
+
+    for(line = fwc.batch.failed; (eol = strchr(line, '\n')) != NULL; line = eol + 1)
+    {
+        *eol = '\0';
+
+        if(sscanf(line, IPFW_MOVE_RULE_ARGS, &rule_num, &set_num) == 2)
+        {
+            if(rule_num < fwc.start_rule_num
+              || rule_num >= fwc.start_rule_num + fwc.max_rules)
+                continue;
+
+            i = rule_num - fwc.start_rule_num;
+
+            if(fwc.rule_map[i] != RULE_MOVING)
+                continue;
+
+            log_msg(LOG_WARNING, "Could not move rule %u to set %u, trying again.",
+                rule_num, set_num);
+
+            fwc.rule_map[i] = RULE_ACTIVE;
+
+            if(fwc.next_expire == 0 || fwc.rule_expire[i] < fwc.next_expire)
+                fwc.next_expire = fwc.rule_expire[i];
+        }
+        else if(sscanf(line, "add %u ", &rule_num) == 1)
+        {
+            if(rule_num < fwc.start_rule_num
+              || rule_num >= fwc.start_rule_num + fwc.max_rules)
+                continue;
+
+            i = rule_num - fwc.start_rule_num;
+
+            if(fwc.rule_map[i] != RULE_ACTIVE)
+                continue;
+
+            log_msg(LOG_ERR, "Could not add Rule %u, dropping it.", rule_num);
+
+            snprintf(args, CMD_BUFSIZE-1, IPFW_DEL_RULE_ARGS,
+                fwc.active_set_num,
+                rule_num
+            );
+
+            ipfw_cmd(args);
+
+            if(fwc.active_rules > 0)
+                fwc.active_rules--;
+            if(fwc.total_rules > 0)
+                fwc.total_rules--;
+
+            release_rule_num(rule_num);
+        }
+    }
+
+    for(i=0; i<fwc.max_rules; i++)
+    {
+        if(fwc.rule_map[i] != RULE_MOVING)
+            continue;
+
+        log_msg(LOG_INFO, "Moved rule %u with expire time of %u to set %u.",
+            fwc.start_rule_num + i, (unsigned int)fwc.rule_expire[i],
+            fwc.expire_set_num
+        );
+
+        if (fwc.active_rules > 0)
+            fwc.active_rules--;
+
+        fwc.rule_map[i]    = RULE_EXPIRED;
+        fwc.rule_expire[i] = 0;
+    }
+}
+
 static int
 ipfw_set_exists(const char *fw_command, const unsigned short set_num)
 {
@@ -77,7 +290,7 @@ ipfw_set_exists(const char *fw_command, const unsigned short set_num)
         set_num
     );
 
-    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
+    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
 
     if(!EXTCMD_IS_SUCCESS(res))
         return(0);
@@ -140,6 +353,9 @@ fw_dump_rules(fko_srv_options_t *opts)
 void
 fw_config_init(fko_srv_options_t *opts)
 {
+    /* In case this is a re-config, let any running executor finish.
+    */
+    fw_batch_free(&fwc.batch);
 
     memset(&fwc, 0x0, sizeof(struct fw_config));
 
@@ -152,6 +368,7 @@ fw_config_init(fko_srv_options_t *opts)
     fwc.active_set_num = atoi(opts->config[CONF_IPFW_ACTIVE_SET_NUM]);
     fwc.expire_set_num = atoi(opts->config[CONF_IPFW_EXPIRE_SET_NUM]);
     fwc.purge_interval = atoi(opts->config[CONF_IPFW_EXPIRE_PURGE_INTERVAL]);
+    fwc.batch_window   = atoi(opts->config[CONF_FW_BATCH_WINDOW]);
 
     /* Let us find it via our opts struct as well.
     */
@@ -160,12 +377,76 @@ fw_config_init(fko_srv_options_t *opts)
     return;
 }
 
-void
-fw_initialize(fko_srv_options_t *opts)
+/* Read the expire set in case there are existing rules to track.
+*/
+static void
+load_expired_rules(fko_srv_options_t *opts)
 {
-    int             res = 0;
     unsigned short  curr_rule;
     char           *ndx;
+    int             res;
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_LIST_EXP_SET_RULES_ARGS,
+        opts->fw_config->fw_command,
+        fwc.expire_set_num
+    );
+
+    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
+
+    if(!EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, cmd_out); 
+        return;
+    }
+
+    if(opts->verbose > 2)
+        log_msg(LOG_INFO, "RES=%i, CMD_BUF: %s\nRULES LIST: %s", res, cmd_buf, cmd_out);
+
+    /* Find the first "# DISABLED" string (if any).
+    */
+    ndx = strstr(cmd_out, "# DISABLED ");
+
+    /* Assume no disabled rules if we did not see the string.
+    */
+    if(ndx == NULL)
+        return;
+
+    /* Otherwise we walk each line to pull the rule number and
+     * set the appropriate rule map entries.
+    */
+    while(ndx != NULL)
+    {
+        /* Skip over the DISABLED string to the rule num.
+        */
+        ndx += 11;
+
+        if(isdigit(*ndx))
+        {
+            curr_rule = atoi(ndx);
+
+            if(curr_rule >= fwc.start_rule_num
+              && curr_rule < fwc.start_rule_num + fwc.max_rules
+              && fwc.rule_map[curr_rule - fwc.start_rule_num] == RULE_FREE)
+            {
+                fwc.rule_map[curr_rule - fwc.start_rule_num] = RULE_EXPIRED;
+                fwc.total_rules++;
+            }
+        }
+        else
+            log_msg(LOG_WARNING, "fw_initialize: No rule number found where expected.");
+
+        /* Find the next "# DISABLED" string (if any).
+        */
+        ndx = strstr(ndx, "# DISABLED ");
+    }
+}
+
+void
+fw_initialize(fko_srv_options_t *opts)
+{
+    int             i, res = 0;
 
     /* For now, we just call fw_cleanup to start with clean slate.
     */
@@ -177,11 +458,15 @@ fw_initialize(fko_srv_options_t *opts)
         exit(EXIT_FAILURE);
     }
 
-    /* Allocate our rule_map array for tracking active (and expired) rules.
+    /* Allocate our rule_map array for tracking active (and expired) rules,
+     * along with the expire time of each active rule and the list of free
+     * rule numbers.
     */
-    fwc.rule_map = calloc(fwc.max_rules, sizeof(char));
+    fwc.rule_map    = calloc(fwc.max_rules, sizeof(char));
+    fwc.rule_expire = calloc(fwc.max_rules, sizeof(time_t));
+    fwc.free_list   = calloc(fwc.max_rules, sizeof(unsigned short));
 
-    if(fwc.rule_map == NULL)
+    if(fwc.rule_map == NULL || fwc.rule_expire == NULL || fwc.free_list == NULL)
     {
         fprintf(stderr, "Fatal: Memory allocation error in fw_initialize.\n");
         exit(EXIT_FAILURE);
@@ -199,7 +484,7 @@ fw_initialize(fko_srv_options_t *opts)
             fwc.active_set_num
         );
 
-        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
+        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
 
         if(EXTCMD_IS_SUCCESS(res))
         {
@@ -223,7 +508,7 @@ fw_initialize(fko_srv_options_t *opts)
         fwc.expire_set_num
     );
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
 
     if(EXTCMD_IS_SUCCESS(res))
         log_msg(LOG_INFO, "Set ipfw set %u to disabled.",
@@ -234,68 +519,26 @@ fw_initialize(fko_srv_options_t *opts)
     /* Now read the expire set in case there are existing
      * rules to track.
     */
-    zero_cmd_buffers();
+    load_expired_rules(opts);
 
-    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_LIST_EXP_SET_RULES_ARGS,
-        opts->fw_config->fw_command,
-        fwc.expire_set_num
-    );
-
-    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
-
-    if(!EXTCMD_IS_SUCCESS(res))
-    {
-        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, cmd_out); 
-        return;
-    }
-
-    if(opts->verbose > 2)
-        log_msg(LOG_INFO, "RES=%i, CMD_BUF: %s\nRULES LIST: %s", res, cmd_buf, cmd_out);
-
-    /* Find the first "# DISABLED" string (if any).
-    */
-    ndx = strstr(cmd_out, "# DISABLED ");
-
-    /* Assume no disabled rules if we did not see the string.
+    /* Everything else goes on the free list (in reverse so the lowest
+     * rule numbers are handed out first).
     */
-    if(ndx == NULL)
-        return;
-
-    /* Otherwise we walk each line to pull the rule number and
-     * set the appropriate rule map entries.
-    */
-    while(ndx != NULL)
-    {
-        /* Skip over the DISABLED string to the rule num.
-        */
-        ndx += 11;
-
-        if(isdigit(*ndx))
-        {
-            curr_rule = atoi(ndx);
-
-            if(curr_rule >= fwc.start_rule_num
-              && curr_rule < fwc.start_rule_num + fwc.max_rules)
-            {
-                fwc.rule_map[curr_rule - fwc.start_rule_num] = RULE_EXPIRED;
-                fwc.total_rules++;
-            }
-        }
-        else
-            log_msg(LOG_WARNING, "fw_initialize: No rule number found where expected.");
-
-        /* Find the next "# DISABLED" string (if any).
-        */
-        ndx = strstr(ndx, "# DISABLED ");
-    }
+    for(i = fwc.max_rules; i > 0; i--)
+        if(fwc.rule_map[i-1] == RULE_FREE)
+            fwc.free_list[fwc.free_count++] = i-1;
 }
 
-
 int
 fw_cleanup(void)
 {
     int     res, got_err = 0;
 
+    /* Let a running executor finish, and drop anything still queued since
+     * the active set is going away.
+    */
+    fw_batch_free(&fwc.batch);
+
     zero_cmd_buffers();
 
     if(fwc.active_set_num > 0
@@ -344,11 +587,22 @@ fw_cleanup(void)
     }
 #endif
 
-    /* Free the rule map.
+    /* Free the rule map, expire times, and free list.
     */
     if(fwc.rule_map != NULL)
         free(fwc.rule_map);
 
+    if(fwc.rule_expire != NULL)
+        free(fwc.rule_expire);
+
+    if(fwc.free_list != NULL)
+        free(fwc.free_list);
+
+    fwc.rule_map    = NULL;
+    fwc.rule_expire = NULL;
+    fwc.free_list   = NULL;
+    fwc.free_count  = 0;
+
     return(got_err);
 }
 
@@ -360,6 +614,7 @@ int
 process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
 {
     unsigned short   rule_num;
+    char             args[CMD_BUFSIZE];
 
     acc_port_list_t *port_list = NULL;
     acc_port_list_t *ple;
@@ -413,10 +668,7 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
         */
         while(ple != NULL)
         {
-            zero_cmd_buffers();
-
-            snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_ADD_RULE_ARGS,
-                fwc.fw_command,
+            snprintf(args, CMD_BUFSIZE-1, IPFW_ADD_RULE_ARGS,
                 rule_num,
                 fwc.active_set_num,
                 ple->proto,
@@ -425,9 +677,7 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                 exp_ts
             );
 
-//--DSS tmp
-//fprintf(stderr, "ADD CMD: %s\n", cmd_buf);
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
+            res = ipfw_cmd(args);
             if(EXTCMD_IS_SUCCESS(res))
             {
                 log_msg(LOG_INFO, "Added Rule %u for %s, %s expires at %u",
@@ -436,10 +686,17 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                     spadat->spa_message_remain, exp_ts
                 );
 
-                fwc.rule_map[rule_num - fwc.start_rule_num] = RULE_ACTIVE;
+                /* All of the rules for this request share the rule number
+                 * (and its expire time), so count it just once.
+                */
+                if(fwc.rule_map[rule_num - fwc.start_rule_num] != RULE_ACTIVE)
+                {
+                    fwc.rule_map[rule_num - fwc.start_rule_num] = RULE_ACTIVE;
+                    fwc.rule_expire[rule_num - fwc.start_rule_num] = exp_ts;
 
-                fwc.active_rules++;
-                fwc.total_rules++;
+                    fwc.active_rules++;
+                    fwc.total_rules++;
+                }
 
                 /* Reset the next expected expire time for this chain if it
                  * is warranted.
@@ -447,12 +704,15 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                 if(fwc.next_expire < now || exp_ts < fwc.next_expire)
                     fwc.next_expire = exp_ts;
             }
-            else
-                log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
 
             ple = ple->next;
         }
 
+        /* If none of the rules made it in, the rule number is still free.
+        */
+        if(fwc.rule_map[rule_num - fwc.start_rule_num] != RULE_ACTIVE)
+            release_rule_num(rule_num);
+
     }
     else
     {
@@ -475,20 +735,37 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
     return(res);
 }
 
-/* Iterate over the current rule set and purge expired
- * firewall rules.
+/* Move the rules that have expired to the expire set.  The expire time of
+ * each active rule is tracked in rule_expire, so we do not need to list and
+ * parse the active set to find them.
 */
 void
 check_firewall_rules(fko_srv_options_t *opts)
 {
-    char            exp_str[12];
-    char            rule_num_str[6];
-    char           *ndx, *rn_start, *rn_end, *tmp_mark;
+    char            args[CMD_BUFSIZE];
 
-    int             i=0, res=0;
-    time_t          now, rule_exp, min_exp = 0;
+    int             i, res;
+    time_t          now, min_exp = 0;
     unsigned short  curr_rule;
 
+    /* Hand any queued rule changes to the firewall executor once the
+     * batch window has passed, after catching up with the results of the
+     * last batch.
+    */
+    if(fwc.batch_window > 0)
+    {
+        res = fw_batch_ready(&fwc.batch, fwc.batch_window);
+
+        if(fw_batch_done(&fwc.batch))
+            batch_applied();
+
+        if(res)
+        {
+            set_rules_state(RULE_MOVE_QUEUED, RULE_MOVING);
+            fw_batch_exec(&fwc.batch, ipfw_apply_batch);
+        }
+    }
+
     /* Just in case we somehow lose track and fall out-of-whack.
     */
     if(fwc.active_rules > fwc.max_rules)
@@ -505,147 +782,59 @@ check_firewall_rules(fko_srv_options_t *opts)
     if (fwc.next_expire > now)
         return;
 
-    zero_cmd_buffers();
-
-    /* There should be a rule to delete.  Get the current list of
-     * rules for this chain and delete the ones that are expired.
-    */
-    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_LIST_SET_RULES_ARGS,
-        opts->fw_config->fw_command,
-        fwc.active_set_num
-    );
-
-    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
-
-    if(!EXTCMD_IS_SUCCESS(res))
-    {
-        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, cmd_out); 
-        return;
-    }
-
-    if(opts->verbose > 2)
-        log_msg(LOG_INFO, "RES=%i, CMD_BUF: %s\nRULES LIST: %s", res, cmd_buf, cmd_out);
-
-    /* Find the first _exp_ string (if any).
-    */
-    ndx = strstr(cmd_out, EXPIRE_COMMENT_PREFIX);
-
-    if(ndx == NULL)
+    for(i=0; i<fwc.max_rules; i++)
     {
-        /* we did not find an expected rule.
-        */
-        log_msg(LOG_ERR,
-            "Did not find expire comment in rules list %i.\n", i);
-
-        if (fwc.active_rules > 0)
-            fwc.active_rules--;
-
-        return;
-    }
-
-    /* Walk the list and process rules as needed.
-    */
-    while (ndx != NULL) {
-        /* Jump forward and extract the timestamp
-        */
-        ndx += strlen(EXPIRE_COMMENT_PREFIX);
-
-        /* remember this spot for when we look for the next
-         * rule.
+        /* The check-state rule (if any) has no expire time.
         */
-        tmp_mark = ndx;
-
-        strlcpy(exp_str, ndx, 11);
-        rule_exp = (time_t)atoll(exp_str);
+        if(fwc.rule_map[i] != RULE_ACTIVE || fwc.rule_expire[i] == 0)
+            continue;
 
-//fprintf(stderr, "RULE_EXP=%u, NOW=%u\n", rule_exp, now);
-        if(rule_exp <= now)
+        if(fwc.rule_expire[i] > now)
         {
-            /* Backtrack and get the rule number and delete it.
+            /* Track the minimum future rule expire time.
             */
-            rn_start = ndx;
-            while(--rn_start > cmd_out)
-            {
-                if(*rn_start == '\n')
-                    break;
-            }
-            
-            if(*rn_start == '\n')
-            {
-                rn_start++;
-            }
-            else if(rn_start > cmd_out)
-            {
-                /* This should not happen. But if it does, complain,
-                 * decrement the active rule value, and go on.
-                */
-                log_msg(LOG_ERR,
-                    "Rule parse error while finding rule line start.");
-
-                if (fwc.active_rules > 0)
-                    fwc.active_rules--;
-
-                break;
-            }
-
-            rn_end = strchr(rn_start, ' ');
+            if(min_exp == 0 || fwc.rule_expire[i] < min_exp)
+                min_exp = fwc.rule_expire[i];
 
-            if(rn_end == NULL)
-            {
-                /* This should not happen. But if it does, complain,
-                 * decrement the active rule value, and go on.
-                */
-                log_msg(LOG_ERR,
-                    "Rule parse error while finding rule number.");
-
-                if (fwc.active_rules > 0)
-                    fwc.active_rules--;
-
-                break;
-            }
-             
-            strlcpy(rule_num_str, rn_start, (rn_end - rn_start)+1);
+            continue;
+        }
 
-            curr_rule = atoi(rule_num_str);
+        curr_rule = fwc.start_rule_num + i;
 
-            zero_cmd_buffers();
+        /* Move the rule to the expired rules set.
+        */
+        snprintf(args, CMD_BUFSIZE-1, IPFW_MOVE_RULE_ARGS,
+            curr_rule,
+            fwc.expire_set_num
+        );
 
-            /* Move the rule to the expired rules set.
+        res = ipfw_cmd(args);
+        if(EXTCMD_IS_SUCCESS(res) && fwc.batch_window > 0)
+        {
+            /* The rule stays in force until batch_applied() knows the
+             * move has been made.
             */
-            snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPFW_MOVE_RULE_ARGS,
-                opts->fw_config->fw_command,
-                curr_rule,
-                fwc.expire_set_num
+            fwc.rule_map[i] = RULE_MOVE_QUEUED;
+        }
+        else if(EXTCMD_IS_SUCCESS(res))
+        {
+            log_msg(LOG_INFO, "Moved rule %u with expire time of %u to set %u.",
+                curr_rule, (unsigned int)fwc.rule_expire[i], fwc.expire_set_num
             );
 
-//fprintf(stderr, "MOVE RULE CMD: %s\n", cmd_buf);
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
-            if(EXTCMD_IS_SUCCESS(res))
-            {
-                log_msg(LOG_INFO, "Moved rule %s with expire time of %u to set %u.",
-                    rule_num_str, rule_exp, fwc.expire_set_num
-                );
+            if (fwc.active_rules > 0)
+                fwc.active_rules--;
 
-                if (fwc.active_rules > 0)
-                    fwc.active_rules--;
-
-                fwc.rule_map[curr_rule - fwc.start_rule_num] = RULE_EXPIRED;
-            }
-            else
-                log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
+            fwc.rule_map[i]    = RULE_EXPIRED;
+            fwc.rule_expire[i] = 0;
         }
         else
         {
-            /* Track the minimum future rule expire time.
+            /* Try again in a second.
             */
-            if(rule_exp > now)
-                min_exp = (min_exp < rule_exp) ? min_exp : rule_exp;
+            if(min_exp == 0 || now + 1 < min_exp)
+                min_exp = now + 1;
         }
-
-        /* Push our tracking index forward beyond (just processed) _exp_
-         * string so we can continue to the next rule in the list.
-        */
-        ndx = strstr(tmp_mark, EXPIRE_COMMENT_PREFIX);
     }
 
     /* Set the next pending expire time accordingly. 0 if there are no
@@ -669,6 +858,17 @@ ipfw_purge_expired_rules(fko_srv_options_t *opts)
 
     unsigned short  curr_rule;
 
+    /* Nothing to do if there are no expired rules.
+    */
+    if(fwc.total_rules <= fwc.active_rules)
+        return;
+
+    /* Hold off while there are rule moves that have not been applied yet
+     * (their dynamic rules would not show up in the expired set).
+    */
+    if(fwc.batch.entries > 0 || fw_batch_busy(&fwc.batch))
+        return;
+
     /* First, we get the current active dynamic rules for the expired rule
      * set. Then we compare it to the expired rules in the rule_map. Any
      * rules in the map that do not have a dynamic rule, can be deleted.
@@ -680,7 +880,7 @@ ipfw_purge_expired_rules(fko_srv_options_t *opts)
         fwc.expire_set_num
     );
 
-    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
+    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
 
     if(!EXTCMD_IS_SUCCESS(res))
     {
@@ -780,7 +980,7 @@ ipfw_purge_expired_rules(fko_srv_options_t *opts)
             curr_rule
         );
 
-        res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
+        res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
 
         if(!EXTCMD_IS_SUCCESS(res))
         {
@@ -790,7 +990,7 @@ ipfw_purge_expired_rules(fko_srv_options_t *opts)
 
         log_msg(LOG_INFO, "Purged rule %u from set %u", curr_rule, fwc.expire_set_num); 
 
-        fwc.rule_map[curr_rule - fwc.start_rule_num] = RULE_FREE;
+        release_rule_num(curr_rule);
 
         fwc.total_rules--;
     }
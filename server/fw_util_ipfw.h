@@ -35,7 +35,9 @@ enum {
     RULE_FREE = 0,
     RULE_ACTIVE,
     RULE_EXPIRED,
-    RULE_TMP_MARKED
+    RULE_TMP_MARKED,
+    RULE_MOVE_QUEUED,   /* Its move to the expire set is queued */
+    RULE_MOVING         /* ...and is being applied by the executor */
 };
 
 /* ipfw command args
@@ -51,6 +53,7 @@ enum {
 #define IPFW_LIST_SET_RULES_ARGS     "set %u list"
 #define IPFW_LIST_EXP_SET_RULES_ARGS "-S set %u list"
 #define IPFW_LIST_SET_DYN_RULES_ARGS "-d set %u list"
+#define IPFW_BATCH_ARGS              "-q /dev/stdin"
 
 void ipfw_purge_expired_rules(fko_srv_options_t *opts);
 
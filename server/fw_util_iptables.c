@@ -39,6 +39,12 @@
 #include "extcmd.h"
 #include "access.h"
 
+#include <stdarg.h>
+
+#if HAVE_SYS_WAIT_H
+  #include <sys/wait.h>
+#endif
+
 static struct fw_config fwc;
 static char   cmd_buf[CMD_BUFSIZE];
 static char   err_buf[CMD_BUFSIZE];
@@ -68,12 +74,16 @@ add_jump_rule(int chain_num)
     );
 
     //printf("(%i) CMD: '%s'\n", i, cmd_buf);
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
 
     if(EXTCMD_IS_SUCCESS(res))
+    {
         log_msg(LOG_INFO, "Added jump rule from chain: %s to chain: %s",
             fwc.chain[chain_num].from_chain,
             fwc.chain[chain_num].to_chain);
+
+        fwc.chain[chain_num].jump_ok = 1;
+    }
     else
         log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
 
@@ -127,6 +137,31 @@ jump_rule_exists(int chain_num)
     return(pos);
 }
 
+/* Returns 1 if the chain exists, 0 if it does not, and -1 if we could not
+ * tell.  iptables -S exits with 1 when there is no such chain.
+*/
+static int
+chain_exists(int chain_num)
+{
+    int     res, status;
+
+    zero_cmd_buffers();
+
+    if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_LIST_CHAIN_SPEC_ARGS,
+        fwc.fw_command,
+        fwc.chain[chain_num].table,
+        fwc.chain[chain_num].to_chain) >= CMD_BUFSIZE-1)
+        return(-1);
+
+    res = run_extcmd_status(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT,
+        &status);
+
+    if(EXTCMD_IS_SUCCESS(res))
+        return(1);
+
+    return((status == 1) ? 0 : -1);
+}
+
 /* Print all firewall rules currently instantiated by the running fwknopd
  * daemon to stdout.
 */
@@ -169,6 +204,171 @@ fw_dump_rules(fko_srv_options_t *opts)
     return(got_err);
 }
 
+/* Find an existing grant in the given chain that matches the given fields.
+*/
+static struct ipt_grant *
+find_grant(struct fw_chain *ch, unsigned int proto, const char *ip,
+    unsigned int port, const char *nat_ip, unsigned int nat_port)
+{
+    struct ipt_grant *g;
+
+    for(g = ch->grants; g != NULL; g = g->next)
+    {
+        if(g->pending >= IPT_GRANT_DEL_QUEUED)
+            continue;
+
+        if(g->proto == proto && g->port == port && g->nat_port == nat_port
+          && strcmp(g->ip, ip) == 0 && strcmp(g->nat_ip, nat_ip) == 0)
+            return(g);
+    }
+
+    return(NULL);
+}
+
+/* Free the grant list for a chain.
+*/
+static void
+free_grants(struct fw_chain *ch)
+{
+    struct ipt_grant *g, *next;
+
+    for(g = ch->grants; g != NULL; g = next)
+    {
+        next = g->next;
+        free(g);
+    }
+
+    ch->grants = NULL;
+}
+
+/* Drop the grants in a chain that have reached their expire time.  When
+ * del_rules is set, the removal of their rules is queued for the firewall
+ * executor instead, and the grants are kept (being deleted) until
+ * batch_applied() knows their rules are gone.  Otherwise
+ * check_firewall_rules has just removed them.  Returns the earliest expire
+ * time of the grants that remain in force (or 0).
+*/
+static time_t
+purge_expired_grants(struct fw_chain *ch, time_t now, int del_rules)
+{
+    struct ipt_grant *g, *prev = NULL, *next;
+    time_t            min_exp = 0;
+
+    for(g = ch->grants; g != NULL; g = next)
+    {
+        next = g->next;
+
+        if(g->pending >= IPT_GRANT_DEL_QUEUED)
+        {
+            prev = g;
+            continue;
+        }
+
+        if(g->expires > now)
+        {
+            if(min_exp == 0 || g->expires < min_exp)
+                min_exp = g->expires;
+
+            prev = g;
+            continue;
+        }
+
+        if(del_rules)
+        {
+            fw_batch_add(&fwc.batch, "%s -D %s %s\n",
+                ch->table, ch->to_chain, g->rule_spec);
+
+            g->pending = IPT_GRANT_DEL_QUEUED;
+
+            prev = g;
+            continue;
+        }
+
+        if(prev == NULL)
+            ch->grants = next;
+        else
+            prev->next = next;
+
+        free(g);
+    }
+
+    return(min_exp);
+}
+
+/* Make sure the jump rule to this chain is in place.  Once we have seen
+ * (or put) it there, that is remembered in jump_ok so an access request
+ * costs no iptables calls at all.  The cached state is checked again by
+ * audit_chains() and whenever adding a rule to the chain fails.
+*/
+static void
+ensure_jump_rule(int chain_num)
+{
+    struct fw_chain *ch = &(fwc.chain[chain_num]);
+    int              res;
+
+    if(ch->jump_ok || ch->target[0] == '\0')
+        return;
+
+    res = jump_rule_exists(chain_num);
+    if(res > 0)
+    {
+        ch->jump_ok = 1;
+        return;
+    }
+    else if(res < 0)
+        return;
+
+    if(EXTCMD_IS_SUCCESS(add_jump_rule(chain_num)))
+        return;
+
+    /* No jump rule and we could not add one, most likely because the
+     * chain itself is gone.  Recreate it (any rules it held went with it)
+     * and try once more.
+    */
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_NEW_CHAIN_ARGS,
+        fwc.fw_command,
+        ch->table,
+        ch->to_chain
+    );
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+        return;
+    }
+
+    log_msg(LOG_WARNING, "Recreated missing chain %s in table %s.",
+        ch->to_chain, ch->table);
+
+    free_grants(ch);
+    ch->active_rules = 0;
+
+    add_jump_rule(chain_num);
+}
+
+/* Re-verify the cached jump rule state of each configured chain against
+ * the live ruleset.
+*/
+static void
+audit_chains(time_t now)
+{
+    int     i;
+
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+    {
+        if(fwc.chain[i].target[0] == '\0')
+            continue;
+
+        fwc.chain[i].jump_ok = 0;
+        ensure_jump_rule(i);
+    }
+
+    fwc.last_audit = now;
+}
+
 /* Quietly flush and delete all fwknop custom chains.
 */
 static void
@@ -182,6 +382,9 @@ delete_all_chains(void)
         if(fwc.chain[i].target[0] == '\0')
             continue;
 
+        free_grants(&(fwc.chain[i]));
+        fwc.chain[i].jump_ok = 0;
+
         /* First look for a jump rule to this chain and remove it if it
          * is there.
         */
@@ -197,29 +400,45 @@ delete_all_chains(void)
             );
 
             //printf("CMD: '%s'\n", cmd_buf);
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
+            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
             /* Expect full success on this */
             if(! EXTCMD_IS_SUCCESS(res))
                 log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
         }
 
+        /* Now flush and remove the chain (if it is there - it will not be
+         * the first time we run, or if someone removed it by hand).
+        */
+        if(chain_exists(i) == 0)
+            continue;
+
         zero_cmd_buffers();
 
-        /* Now flush and remove the chain.
-        */
-        snprintf(cmd_buf, CMD_BUFSIZE-1,
-            "(%s " IPT_FLUSH_CHAIN_ARGS "; %s " IPT_DEL_CHAIN_ARGS ")", // > /dev/null 2>&1",
+        if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_FLUSH_CHAIN_ARGS,
             fwc.fw_command,
             fwc.chain[i].table,
-            fwc.chain[i].to_chain,
+            fwc.chain[i].to_chain) >= CMD_BUFSIZE-1)
+        {
+            log_msg(LOG_ERR, "iptables command to remove chain %s is too long.",
+                fwc.chain[i].to_chain);
+            continue;
+        }
+
+        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
+        if(! EXTCMD_IS_SUCCESS(res))
+            log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
+
+        zero_cmd_buffers();
+
+        /* This fits if the flush command did.
+        */
+        if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_DEL_CHAIN_ARGS,
             fwc.fw_command,
             fwc.chain[i].table,
-            fwc.chain[i].to_chain
-        );
+            fwc.chain[i].to_chain) >= CMD_BUFSIZE-1)
+            continue;
 
-        //printf("CMD: '%s'\n", cmd_buf);
-        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
-        /* Expect full success on this */
+        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
         if(! EXTCMD_IS_SUCCESS(res))
             log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
     }
@@ -249,7 +468,7 @@ create_fw_chains(void)
         );
 
         //printf("(%i) CMD: '%s'\n", i, cmd_buf);
-        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
+        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
 
         /* Expect full success on this */
         if(! EXTCMD_IS_SUCCESS(res))
@@ -258,19 +477,388 @@ create_fw_chains(void)
             got_err++;
         }
 
-        /* Then create the jump rule to that chain.
-        */
-        res = add_jump_rule(i);
+        /* Then create the jump rule to that chain.
+        */
+        res = add_jump_rule(i);
+
+        /* Expect full success on this */
+        if(! EXTCMD_IS_SUCCESS(res))
+            got_err++;
+    }
+
+    return(got_err);
+}
+
+/* Append a formatted line to an iptables-restore batch buffer.  Returns
+ * non-zero if the line did not fit.
+*/
+static int
+batch_append(char *batch, const size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    size_t  len = strlen(batch);
+    int     n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(batch + len, size - len, fmt, ap);
+    va_end(ap);
+
+    if(n < 0 || (size_t)n >= size - len)
+    {
+        batch[len] = '\0';
+        return(1);
+    }
+
+    return(0);
+}
+
+/* Run iptables-save once and count the fwknop jump rules that are already
+ * present for each configured chain so they can be removed as part of the
+ * same transaction.  Returns 0 on success.
+*/
+static int
+scan_jump_rules(int *jump_count)
+{
+    int         i, status, in_line = 0;
+    char        cmd_buf[CMD_BUFSIZE] = {0};
+    char        line_buf[MAX_LINE_LEN] = {0};
+    char        jump_buf[MAX_LINE_LEN] = {0};
+    char        table[MAX_TABLE_NAME_LEN] = {0};
+    FILE       *ipt;
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_SAVE_ARGS,
+        fwc.fw_save_command);
+
+    ipt = popen(cmd_buf, "r");
+
+    if(ipt == NULL)
+    {
+        log_msg(LOG_ERR, "Got error %i trying to run '%s'.", errno, cmd_buf);
+        return(-1);
+    }
+
+    while((fgets(line_buf, MAX_LINE_LEN, ipt)) != NULL)
+    {
+        /* Skip the tail end of any line too long for our buffer (these
+         * are never our jump rules).
+        */
+        if(in_line)
+        {
+            in_line = (strchr(line_buf, '\n') == NULL);
+            continue;
+        }
+        in_line = (strchr(line_buf, '\n') == NULL);
+
+        if(line_buf[0] == '*')
+        {
+            strlcpy(table, line_buf+1, MAX_TABLE_NAME_LEN);
+            table[strcspn(table, "\r\n")] = '\0';
+            continue;
+        }
+
+        if(line_buf[0] != '-')
+            continue;
+
+        for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+        {
+            if(fwc.chain[i].target[0] == '\0'
+              || strcmp(table, fwc.chain[i].table) != 0)
+                continue;
+
+            snprintf(jump_buf, MAX_LINE_LEN, "-A %s -j %s\n",
+                fwc.chain[i].from_chain, fwc.chain[i].to_chain);
+
+            if(strcmp(line_buf, jump_buf) == 0)
+                jump_count[i]++;
+        }
+    }
+
+    status = pclose(ipt);
+
+    if(status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        log_msg(LOG_WARNING, "Unable to read current rules via '%s'.", cmd_buf);
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* Feed a complete transaction to iptables-restore in one exec.  Returns 0
+ * if iptables-restore committed it, or else its EXTCMD_* status.
+*/
+static int
+run_ipt_restore(const char *batch)
+{
+    char    cmd_buf[CMD_BUFSIZE] = {0};
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_RESTORE_ARGS,
+        fwc.fw_restore_command);
+
+    return(fw_batch_pipe(cmd_buf, batch, NULL, 0));
+}
+
+/* A queued delete ("<table> -D <chain> <rule spec>") failed.  Returns 1 if
+ * the rule is not there at all (it may have been removed by hand, or gone
+ * with its chain), in which case there is nothing left to delete.
+ * iptables -C exits with 1 when it does not find the rule.
+*/
+static int
+rule_is_gone(const char *entry)
+{
+    int     res, status;
+    size_t  tlen = strcspn(entry, " ");
+
+    if(strncmp(entry + tlen, " -D ", 4) != 0)
+        return(0);
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_CHK_RULE_SPEC_ARGS,
+        fwc.fw_command, (int)tlen, entry, entry + tlen + 4);
+
+    res = run_extcmd_status(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT,
+        &status);
+
+    return(! EXTCMD_IS_SUCCESS(res) && status == 1);
+}
+
+/* Apply a batch of queued rule changes (this runs in the executor process).
+ * Each entry is "<table> <iptables-restore line>", so we group the entries
+ * by table into a single iptables-restore transaction.  If that fails, the
+ * entries are run one at a time so one bad entry does not lose the rest,
+ * and the ones that still fail are reported back with fw_batch_failed().
+*/
+static int
+ipt_apply_batch(char *batch)
+{
+    int     i, j, dup, res, got_err = 0;
+    size_t  tlen, restore_size;
+    char   *restore, *line, *eol;
+
+    restore_size = strlen(batch) + (NUM_FWKNOP_ACCESS_TYPES * (MAX_TABLE_NAME_LEN + 16)) + 1;
+
+    if((restore = calloc(1, restore_size)) == NULL)
+    {
+        log_msg(LOG_ERR, "Memory allocation error in ipt_apply_batch.");
+        goto one_at_a_time;
+    }
+
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+    {
+        if(fwc.chain[i].target[0] == '\0')
+            continue;
+
+        for(dup=0, j=0; j<i; j++)
+            if(fwc.chain[j].target[0] != '\0'
+              && strcmp(fwc.chain[j].table, fwc.chain[i].table) == 0)
+                dup = 1;
+
+        if(dup)
+            continue;
+
+        tlen = strlen(fwc.chain[i].table);
+
+        strlcat(restore, "*", restore_size);
+        strlcat(restore, fwc.chain[i].table, restore_size);
+        strlcat(restore, "\n", restore_size);
+
+        for(line = batch; *line != '\0'; line = eol + 1)
+        {
+            if((eol = strchr(line, '\n')) == NULL)
+                break;
+
+            if(strncmp(line, fwc.chain[i].table, tlen) == 0 && line[tlen] == ' ')
+                strncat(restore, line + tlen + 1, eol - (line + tlen));
+        }
+
+        strlcat(restore, "COMMIT\n", restore_size);
+    }
+
+    res = run_ipt_restore(restore);
+
+    free(restore);
+
+    if(res == 0)
+        return(0);
+
+    /* If iptables-restore hung, the individual commands would most likely
+     * hang as well (on the xtables lock, say), so report everything.
+    */
+    if(res == EXTCMD_EXECUTION_TIMEOUT)
+    {
+        for(line = batch; (eol = strchr(line, '\n')) != NULL; line = eol + 1)
+        {
+            *eol = '\0';
+            fw_batch_failed(line);
+            got_err++;
+        }
+
+        return(got_err);
+    }
+
+one_at_a_time:
+    for(line = batch; *line != '\0'; line = eol + 1)
+    {
+        if((eol = strchr(line, '\n')) == NULL)
+            break;
+
+        *eol = '\0';
+
+        zero_cmd_buffers();
+
+        tlen = strcspn(line, " ");
+
+        snprintf(cmd_buf, CMD_BUFSIZE-1, "%s -t %.*s %s 2>&1",
+            fwc.fw_command, (int)tlen, line, line + tlen + 1);
+
+        res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
+        if(! EXTCMD_IS_SUCCESS(res))
+        {
+            log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+
+            if(rule_is_gone(line))
+                continue;
+
+            fw_batch_failed(line);
+            got_err++;
+        }
+    }
+
+    return(got_err);
+}
+
+/* Build a single iptables-restore transaction that either (re)creates all
+ * of the configured fwknop chains along with their jump rules (create != 0),
+ * or removes them (create == 0), and apply it in one exec.  Declaring a
+ * chain in a --noflush restore creates it if needed and flushes it
+ * otherwise, so no state is left half-built if the transaction fails.
+ * Returns non-zero if the caller should fall back to the individual
+ * iptables commands.
+*/
+static int
+ipt_chain_batch(const int create)
+{
+    int     i, j, k, dup;
+    int     got_err = 0;
+    int     jump_count[NUM_FWKNOP_ACCESS_TYPES];
+    int     table_done[NUM_FWKNOP_ACCESS_TYPES];
+    char    batch[IPT_BATCH_BUFSIZE];
+
+    if(fwc.fw_restore_command[0] == '\0' || fwc.fw_save_command[0] == '\0')
+        return(-1);
+
+    memset(jump_count, 0x0, sizeof(jump_count));
+    memset(table_done, 0x0, sizeof(table_done));
+    memset(batch, 0x0, IPT_BATCH_BUFSIZE);
+
+    if(scan_jump_rules(jump_count) != 0)
+        return(-1);
+
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+    {
+        if(fwc.chain[i].target[0] == '\0' || table_done[i])
+            continue;
+
+        got_err += batch_append(batch, IPT_BATCH_BUFSIZE, "*%s\n",
+            fwc.chain[i].table);
+
+        /* Chain declarations (one per distinct chain in this table).
+        */
+        for(j=i; j<(NUM_FWKNOP_ACCESS_TYPES); j++)
+        {
+            if(fwc.chain[j].target[0] == '\0'
+              || strcmp(fwc.chain[j].table, fwc.chain[i].table) != 0)
+                continue;
+
+            table_done[j] = 1;
+
+            for(dup=0, k=i; k<j; k++)
+                if(fwc.chain[k].target[0] != '\0'
+                  && strcmp(fwc.chain[k].table, fwc.chain[j].table) == 0
+                  && strcmp(fwc.chain[k].to_chain, fwc.chain[j].to_chain) == 0)
+                    dup = 1;
+
+            if(! dup)
+                got_err += batch_append(batch, IPT_BATCH_BUFSIZE,
+                    ":%s - [0:0]\n", fwc.chain[j].to_chain);
+        }
+
+        /* Remove any existing jump rules, then either put them back at
+         * their configured positions or delete the chains.
+        */
+        for(j=i; j<(NUM_FWKNOP_ACCESS_TYPES); j++)
+        {
+            if(fwc.chain[j].target[0] == '\0'
+              || strcmp(fwc.chain[j].table, fwc.chain[i].table) != 0)
+                continue;
+
+            for(k=0; k<jump_count[j]; k++)
+                got_err += batch_append(batch, IPT_BATCH_BUFSIZE,
+                    "-D %s -j %s\n",
+                    fwc.chain[j].from_chain, fwc.chain[j].to_chain);
+        }
+
+        for(j=i; j<(NUM_FWKNOP_ACCESS_TYPES); j++)
+        {
+            if(fwc.chain[j].target[0] == '\0'
+              || strcmp(fwc.chain[j].table, fwc.chain[i].table) != 0)
+                continue;
+
+            if(create)
+            {
+                got_err += batch_append(batch, IPT_BATCH_BUFSIZE,
+                    "-I %s %i -j %s\n", fwc.chain[j].from_chain,
+                    fwc.chain[j].jump_rule_pos, fwc.chain[j].to_chain);
+            }
+            else
+            {
+                for(dup=0, k=i; k<j; k++)
+                    if(fwc.chain[k].target[0] != '\0'
+                      && strcmp(fwc.chain[k].table, fwc.chain[j].table) == 0
+                      && strcmp(fwc.chain[k].to_chain, fwc.chain[j].to_chain) == 0)
+                        dup = 1;
+
+                if(! dup)
+                    got_err += batch_append(batch, IPT_BATCH_BUFSIZE,
+                        "-X %s\n", fwc.chain[j].to_chain);
+            }
+        }
+
+        got_err += batch_append(batch, IPT_BATCH_BUFSIZE, "COMMIT\n");
+    }
+
+    if(got_err)
+    {
+        log_msg(LOG_WARNING,
+            "iptables-restore chain transaction exceeds %i bytes.",
+            IPT_BATCH_BUFSIZE);
+        return(-1);
+    }
+
+    if(batch[0] == '\0')
+        return(0);
+
+    if(run_ipt_restore(batch) != 0)
+        return(-1);
+
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+    {
+        if(fwc.chain[i].target[0] == '\0')
+            continue;
 
-        /* Expect full success on this */
-        if(! EXTCMD_IS_SUCCESS(res))
-            got_err++;
+        free_grants(&(fwc.chain[i]));
+        fwc.chain[i].jump_ok = create;
+
+        if(create)
+            log_msg(LOG_INFO, "Added jump rule from chain: %s to chain: %s",
+                fwc.chain[i].from_chain,
+                fwc.chain[i].to_chain);
     }
 
-    return(got_err);
+    return(0);
 }
 
-
 static void
 set_fw_chain_conf(int type, char *conf_str)
 {
@@ -338,6 +926,14 @@ set_fw_chain_conf(int type, char *conf_str)
 void
 fw_config_init(fko_srv_options_t *opts)
 {
+    int i;
+
+    /* In case this is a re-config, release any grants we were tracking.
+    */
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+        free_grants(&(fwc.chain[i]));
+
+    fw_batch_free(&fwc.batch);
 
     memset(&fwc, 0x0, sizeof(struct fw_config));
 
@@ -345,6 +941,28 @@ fw_config_init(fko_srv_options_t *opts)
     */
     strlcpy(fwc.fw_command, opts->config[CONF_FIREWALL_EXE], MAX_PATH_LEN);
 
+    /* The chain setup and teardown transactions use the iptables-restore
+     * and iptables-save that live alongside the iptables binary.  If they
+     * are not there (or their paths would be too long) we just run the
+     * individual iptables commands instead.
+    */
+    if(strlen(fwc.fw_command) + strlen("-restore") >= MAX_PATH_LEN
+      || snprintf(fwc.fw_restore_command, MAX_PATH_LEN, "%s-restore",
+        fwc.fw_command) >= MAX_PATH_LEN
+      || snprintf(fwc.fw_save_command, MAX_PATH_LEN, "%s-save",
+        fwc.fw_command) >= MAX_PATH_LEN
+      || access(fwc.fw_restore_command, X_OK) != 0
+      || access(fwc.fw_save_command, X_OK) != 0)
+    {
+        fwc.fw_restore_command[0] = '\0';
+        fwc.fw_save_command[0]    = '\0';
+    }
+
+    /* Rule changes are only batched when we have iptables-restore.
+    */
+    if(fwc.fw_restore_command[0] != '\0')
+        fwc.batch_window = atoi(opts->config[CONF_FW_BATCH_WINDOW]);
+
     /* Pull the fwknop chain config info and setup our internal
      * config struct.  The IPT_INPUT is the only one that is
      * required. The rest are optional.
@@ -396,7 +1014,15 @@ fw_initialize(fko_srv_options_t *opts)
 {
     int res;
 
-    /* Flush the chains (just in case) so we can start fresh.
+    time(&fwc.last_audit);
+
+    /* Flush (or create) the chains and their jump rules in a single
+     * iptables-restore transaction.
+    */
+    if(ipt_chain_batch(1) == 0)
+        return;
+
+    /* Otherwise flush the chains (just in case) so we can start fresh.
     */
     delete_all_chains();
 
@@ -414,12 +1040,354 @@ fw_initialize(fko_srv_options_t *opts)
 int
 fw_cleanup(void)
 {
-    delete_all_chains();
+    /* Let a running executor finish, and drop anything still queued since
+     * the chains are going away.
+    */
+    fw_batch_free(&fwc.batch);
+
+    if(ipt_chain_batch(0) != 0)
+        delete_all_chains();
     return(0);
 }
 
 /****************************************************************************/
 
+/* Add (add != 0) or delete the rule with the given specification in a
+ * chain.  If batching is enabled, the change is queued for the firewall
+ * executor instead.
+*/
+static int
+rule_spec_cmd(struct fw_chain *ch, const int add, const char *rule_spec)
+{
+    int     res;
+
+    if(fwc.batch_window > 0)
+    {
+        fw_batch_add(&fwc.batch, "%s %s %s %s\n", ch->table,
+            add ? "-A" : "-D",
+            ch->to_chain, rule_spec);
+
+        return(EXTCMD_SUCCESS_ALL_OUTPUT);
+    }
+
+    zero_cmd_buffers();
+
+    snprintf(cmd_buf, CMD_BUFSIZE-1,
+        add ? "%s " IPT_ADD_RULE_ARGS : "%s " IPT_DEL_RULE_SPEC_ARGS,
+        fwc.fw_command,
+        ch->table,
+        ch->to_chain,
+        rule_spec
+    );
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
+    if(! EXTCMD_IS_SUCCESS(res))
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+
+    return(res);
+}
+
+/* Add the rule given by rule_spec to the chain unless an equivalent grant
+ * is already in place.  If there is one that would expire before exp_ts,
+ * the new rule is added and the old one removed so the chain only ever
+ * holds one rule per grant.  The label is used for log messages.
+*/
+static int
+grant_rule(struct fw_chain *ch, const char *label, spa_data_t *spadat,
+    unsigned int proto, const char *ip, unsigned int port,
+    const char *nat_ip, unsigned int nat_port, const char *rule_spec,
+    time_t now, unsigned int exp_ts)
+{
+    struct ipt_grant *g;
+    int               res;
+
+    g = find_grant(ch, proto, ip, port, nat_ip, nat_port);
+
+    /* An existing grant that lasts at least as long is good enough.
+    */
+    if(g != NULL && g->expires >= exp_ts)
+    {
+        log_msg(LOG_INFO, "%sRule in %s for %s, %s already in place until %u",
+            label, ch->to_chain, spadat->use_src_ip,
+            spadat->spa_message_remain, (unsigned int)g->expires
+        );
+        return(EXTCMD_SUCCESS_ALL_OUTPUT);
+    }
+
+    res = rule_spec_cmd(ch, 1, rule_spec);
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        /* Our cached view of the chain may be stale (someone may have
+         * removed it), so check it again and retry once.  A queued add
+         * cannot fail here; batch_applied() does this for those.
+        */
+        ch->jump_ok = 0;
+        ensure_jump_rule(ch - fwc.chain);
+
+        res = rule_spec_cmd(ch, 1, rule_spec);
+        if(! EXTCMD_IS_SUCCESS(res))
+            return(res);
+
+        g = find_grant(ch, proto, ip, port, nat_ip, nat_port);
+    }
+
+    if(g == NULL)
+    {
+        if((g = calloc(1, sizeof(struct ipt_grant))) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory allocation error adding grant.");
+            exit(EXIT_FAILURE);
+        }
+
+        g->proto    = proto;
+        g->port     = port;
+        g->nat_port = nat_port;
+        strlcpy(g->ip, ip, MAX_IP_STR_LEN);
+        strlcpy(g->nat_ip, nat_ip, MAX_IP_STR_LEN);
+
+        g->next     = ch->grants;
+        ch->grants  = g;
+
+        ch->active_rules++;
+
+        if(fwc.batch_window > 0)
+        {
+            g->pending  = IPT_GRANT_QUEUED;
+            g->label    = label;
+            g->action   = "Added";
+        }
+        else
+            log_msg(LOG_INFO, "Added %sRule to %s for %s, %s expires at %u",
+                label, ch->to_chain, spadat->use_src_ip,
+                spadat->spa_message_remain, exp_ts
+            );
+    }
+    else
+    {
+        /* Now that the replacement rule is in, remove the old one.
+        */
+        res = rule_spec_cmd(ch, 0, g->rule_spec);
+        if(! EXTCMD_IS_SUCCESS(res))
+        {
+            /* The old rule is left for check_firewall_rules to expire.
+            */
+            ch->active_rules++;
+            res = EXTCMD_SUCCESS_ALL_OUTPUT;
+        }
+
+        if(fwc.batch_window > 0)
+        {
+            /* A grant that was never confirmed is still reported as added.
+            */
+            if(g->pending == IPT_GRANT_APPLIED)
+                g->action = "Refreshed";
+
+            g->pending  = IPT_GRANT_QUEUED;
+            g->label    = label;
+        }
+        else
+            log_msg(LOG_INFO, "Refreshed %sRule in %s for %s, %s expires at %u",
+                label, ch->to_chain, spadat->use_src_ip,
+                spadat->spa_message_remain, exp_ts
+            );
+    }
+
+    g->expires = exp_ts;
+    strlcpy(g->rule_spec, rule_spec, MAX_IPT_RULE_SPEC_LEN);
+
+    /* Reset the next expected expire time for this chain if it
+     * is warranted.
+    */
+    if(ch->next_expire < now || exp_ts < ch->next_expire)
+        ch->next_expire = exp_ts;
+
+    return(res);
+}
+
+/* Set the state of every grant that is in the given pending state.  If log
+ * is set, the grants are now in place and are logged as such.
+*/
+static void
+set_grants_pending(const int from, const int to, const int log)
+{
+    struct ipt_grant *g;
+    int               i;
+
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+    {
+        for(g = fwc.chain[i].grants; g != NULL; g = g->next)
+        {
+            if(g->pending != from)
+                continue;
+
+            if(log)
+                log_msg(LOG_INFO, "%s %sRule in %s for %s, %u/%u expires at %u",
+                    g->action, g->label, fwc.chain[i].to_chain, g->ip,
+                    g->proto, g->port, (unsigned int)g->expires
+                );
+
+            g->pending = to;
+        }
+    }
+}
+
+/* A queued entry could not be applied.  For a failed add ("-A"), drop the
+ * grant it belongs to so the next SPA packet asking for the same access
+ * adds the rule again instead of finding it "already in place".  A failed
+ * delete ("-D") is queued again (its grant, if any, stays in the being
+ * deleted state), since the rule would otherwise keep granting access.
+ * Returns the number of the chain a failed add was for (or -1).
+*/
+static int
+batch_entry_failed(const char *entry)
+{
+    struct fw_chain  *ch;
+    struct ipt_grant *g, *prev;
+    const char       *chain, *spec;
+    size_t            tlen, clen;
+    int               i, add;
+
+    tlen = strcspn(entry, " ");
+
+    if(strncmp(entry + tlen, " -A ", 4) == 0)
+        add = 1;
+    else if(strncmp(entry + tlen, " -D ", 4) == 0)
+        add = 0;
+    else
+        return(-1);
+
+    chain = entry + tlen + 4;
+    clen  = strcspn(chain, " ");
+    spec  = chain + clen + (chain[clen] == ' ');
+
+    if(! add)
+    {
+        log_msg(LOG_WARNING, "Could not remove rule from %.*s, trying again.",
+            (int)clen, chain);
+
+        fw_batch_add(&fwc.batch, "%s\n", entry);
+    }
+
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+    {
+        ch = &(fwc.chain[i]);
+
+        if(ch->target[0] == '\0'
+          || strlen(ch->table) != tlen || strncmp(ch->table, entry, tlen) != 0
+          || strlen(ch->to_chain) != clen || strncmp(ch->to_chain, chain, clen) != 0)
+            continue;
+
+        for(prev = NULL, g = ch->grants; g != NULL; prev = g, g = g->next)
+        {
+            if(strcmp(g->rule_spec, spec) != 0)
+                continue;
+
+            if(! add && g->pending == IPT_GRANT_DELETING)
+            {
+                g->pending = IPT_GRANT_DEL_QUEUED;
+                break;
+            }
+
+            if(! add || g->pending != IPT_GRANT_APPLYING)
+                continue;
+
+            log_msg(LOG_ERR, "Could not add %sRule to %s for %s, dropping it.",
+                g->label, ch->to_chain, g->ip);
+
+            if(prev == NULL)
+                ch->grants = g->next;
+            else
+                prev->next = g->next;
+
+            free(g);
+
+            if(ch->active_rules > 0)
+                ch->active_rules--;
+
+            break;
+        }
+
+        return(add ? i : -1);
+    }
+
+    return(-1);
+}
+
+/* Release the grants whose rules the firewall executor has now removed.
+*/
+static void
+free_deleted_grants(void)
+{
+    struct fw_chain  *ch;
+    struct ipt_grant *g, *prev, *next;
+    int               i;
+
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+    {
+        ch = &(fwc.chain[i]);
+
+        for(prev = NULL, g = ch->grants; g != NULL; g = next)
+        {
+            next = g->next;
+
+            if(g->pending != IPT_GRANT_DELETING)
+            {
+                prev = g;
+                continue;
+            }
+
+            log_msg(LOG_INFO, "Removed rule from %s with expire time of %u.",
+                ch->to_chain, (unsigned int)g->expires
+            );
+
+            if(prev == NULL)
+                ch->grants = next;
+            else
+                prev->next = next;
+
+            free(g);
+
+            if(ch->active_rules > 0)
+                ch->active_rules--;
+        }
+    }
+}
+
+/* The firewall executor is done with the last batch: drop the grants it
+ * could not add, queue the deletes it could not do again, and log the
+ * rest as done.  As with a failed add in grant_rule(), our cached view of
+ * a chain that refused a rule may be stale, so its jump rule (and the
+ * chain itself) is checked again.
+*/
+static void
+batch_applied(void)
+{
+    char   *line, *eol;
+    int     i, recheck[NUM_FWKNOP_ACCESS_TYPES];
+
+    memset(recheck, 0x0, sizeof(recheck));
+
+    for(line = fwc.batch.failed; (eol = strchr(line, '\n')) != NULL; line = eol + 1)
+    {
+        *eol = '\0';
+
+        if((i = batch_entry_failed(line)) >= 0)
+            recheck[i] = 1;
+    }
+
+    for(i=0; i<(NUM_FWKNOP_ACCESS_TYPES); i++)
+    {
+        if(! recheck[i])
+            continue;
+
+        fwc.chain[i].jump_ok = 0;
+        ensure_jump_rule(i);
+    }
+
+    set_grants_pending(IPT_GRANT_APPLYING, IPT_GRANT_APPLIED, 1);
+    free_deleted_grants();
+}
+
 /* Rule Processing - Create an access request...
 */
 int
@@ -427,6 +1395,7 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
 {
     char             nat_ip[16] = {0};
     char             snat_target[SNAT_TARGET_BUFSIZE] = {0};
+    char             rule_spec[MAX_IPT_RULE_SPEC_LEN];
     char            *ndx;
 
     unsigned int     nat_port = 0;
@@ -474,25 +1443,18 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
     {
 
         /* Check to make sure that the jump rules exist for each
-         * required chain
+         * required chain (normally just a look at our cached state).
         */
-        if(jump_rule_exists(IPT_INPUT_ACCESS) == 0)
-            add_jump_rule(IPT_INPUT_ACCESS);
+        ensure_jump_rule(IPT_INPUT_ACCESS);
 
         if(out_chain->to_chain != NULL && strlen(out_chain->to_chain))
-            if(jump_rule_exists(IPT_OUTPUT_ACCESS) == 0)
-                add_jump_rule(IPT_OUTPUT_ACCESS);
+            ensure_jump_rule(IPT_OUTPUT_ACCESS);
 
         /* Create an access command for each proto/port for the source ip.
         */
         while(ple != NULL)
         {
-            zero_cmd_buffers();
-
-            snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_ADD_RULE_ARGS,
-                opts->fw_config->fw_command,
-                in_chain->table,
-                in_chain->to_chain,
+            snprintf(rule_spec, MAX_IPT_RULE_SPEC_LEN-1, IPT_RULE_SPEC,
                 ple->proto,
                 spadat->use_src_ip,
                 ple->port,
@@ -500,38 +1462,15 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                 in_chain->target
             );
 
-//--DSS tmp
-//fprintf(stderr, "ADD CMD: %s\n", cmd_buf);
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
-            if(EXTCMD_IS_SUCCESS(res))
-            {
-                log_msg(LOG_INFO, "Added Rule to %s for %s, %s expires at %u",
-                    in_chain->to_chain, spadat->use_src_ip,
-                    spadat->spa_message_remain, exp_ts
-                );
-
-                in_chain->active_rules++;
-
-                /* Reset the next expected expire time for this chain if it
-                * is warranted.
-                */
-                if(in_chain->next_expire < now || exp_ts < in_chain->next_expire)
-                    in_chain->next_expire = exp_ts;
-            }
-            else
-                log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
+            res = grant_rule(in_chain, "", spadat, ple->proto,
+                spadat->use_src_ip, ple->port, "", 0, rule_spec, now, exp_ts);
 
             /* If we have to make an corresponding OUTPUT rule if out_chain target
             * is not NULL.
             */
             if(out_chain->to_chain != NULL && strlen(out_chain->to_chain))
             {
-                zero_cmd_buffers();
-
-                snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_ADD_OUT_RULE_ARGS,
-                    opts->fw_config->fw_command,
-                    out_chain->table,
-                    out_chain->to_chain,
+                snprintf(rule_spec, MAX_IPT_RULE_SPEC_LEN-1, IPT_OUT_RULE_SPEC,
                     ple->proto,
                     spadat->use_src_ip,
                     ple->port,
@@ -539,27 +1478,8 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                     out_chain->target
                 );
 
-//--DSS tmp
-//fprintf(stderr, "ADD OUTPUT CMD: %s\n", cmd_buf);
-                res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
-                if(EXTCMD_IS_SUCCESS(res))
-                {
-                    log_msg(LOG_INFO, "Added OUTPUT Rule to %s for %s, %s expires at %u",
-                        out_chain->to_chain, spadat->use_src_ip,
-                        spadat->spa_message_remain, exp_ts
-                    );
-
-                    out_chain->active_rules++;
-
-                    /* Reset the next expected expire time for this chain if it
-                    * is warranted.
-                    */
-                    if(out_chain->next_expire < now || exp_ts < out_chain->next_expire)
-                        out_chain->next_expire = exp_ts;
-                }
-                else
-                    log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
-
+                res = grant_rule(out_chain, "OUTPUT ", spadat, ple->proto,
+                    spadat->use_src_ip, ple->port, "", 0, rule_spec, now, exp_ts);
             }
 
             ple = ple->next;
@@ -595,15 +1515,9 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
 
             /* Make sure the required jump rule exists
             */
-            if (jump_rule_exists(IPT_FORWARD_ACCESS) == 0)
-                add_jump_rule(IPT_FORWARD_ACCESS);
-
-            zero_cmd_buffers();
+            ensure_jump_rule(IPT_FORWARD_ACCESS);
 
-            snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_ADD_FWD_RULE_ARGS,
-                opts->fw_config->fw_command,
-                fwd_chain->table,
-                fwd_chain->to_chain,
+            snprintf(rule_spec, MAX_IPT_RULE_SPEC_LEN-1, IPT_FWD_RULE_SPEC,
                 fst_proto,
                 spadat->use_src_ip,
                 nat_ip,
@@ -612,26 +1526,9 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                 fwd_chain->target
             );
 
-//--DSS tmp
-//fprintf(stderr, "ADD OUTPUT CMD: %s\n", cmd_buf);
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
-            if(EXTCMD_IS_SUCCESS(res))
-            {
-                log_msg(LOG_INFO, "Added FORWARD Rule to %s for %s, %s expires at %u",
-                    fwd_chain->to_chain, spadat->use_src_ip,
-                    spadat->spa_message_remain, exp_ts
-                );
-
-                fwd_chain->active_rules++;
-
-                /* Reset the next expected expire time for this chain if it
-                * is warranted.
-                */
-                if(fwd_chain->next_expire < now || exp_ts < fwd_chain->next_expire)
-                    fwd_chain->next_expire = exp_ts;
-            }
-            else
-                log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
+            res = grant_rule(fwd_chain, "FORWARD ", spadat, fst_proto,
+                spadat->use_src_ip, nat_port, nat_ip, nat_port, rule_spec,
+                now, exp_ts);
         }
 
         if(dnat_chain->to_chain != NULL && strlen(dnat_chain->to_chain))
@@ -639,15 +1536,9 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
 
             /* Make sure the required jump rule exists
             */
-            if (jump_rule_exists(IPT_DNAT_ACCESS) == 0)
-                add_jump_rule(IPT_DNAT_ACCESS);
-
-            zero_cmd_buffers();
+            ensure_jump_rule(IPT_DNAT_ACCESS);
 
-            snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_ADD_DNAT_RULE_ARGS,
-                opts->fw_config->fw_command,
-                dnat_chain->table,
-                dnat_chain->to_chain,
+            snprintf(rule_spec, MAX_IPT_RULE_SPEC_LEN-1, IPT_DNAT_RULE_SPEC,
                 fst_proto,
                 spadat->use_src_ip,
                 fst_port,
@@ -657,34 +1548,15 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                 nat_port
             );
 
-//--DSS tmp
-//fprintf(stderr, "ADD DNAT CMD: %s\n", cmd_buf);
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
-            if(EXTCMD_IS_SUCCESS(res))
-            {
-                log_msg(LOG_INFO, "Added DNAT Rule to %s for %s, %s expires at %u",
-                    dnat_chain->to_chain, spadat->use_src_ip,
-                    spadat->spa_message_remain, exp_ts
-                );
-
-                dnat_chain->active_rules++;
-
-                /* Reset the next expected expire time for this chain if it
-                * is warranted.
-                */
-                if(dnat_chain->next_expire < now || exp_ts < dnat_chain->next_expire)
-                    dnat_chain->next_expire = exp_ts;
-            }
-            else
-                log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
+            res = grant_rule(dnat_chain, "DNAT ", spadat, fst_proto,
+                spadat->use_src_ip, fst_port, nat_ip, nat_port, rule_spec,
+                now, exp_ts);
         }
 
         /* If SNAT (or MASQUERADE) is wanted, then we add those rules here as well.
         */
         if(strncasecmp(opts->config[CONF_ENABLE_IPT_SNAT], "Y", 1) == 0)
         {
-            zero_cmd_buffers();
-
             /* Setup some parameter depending on whether we are using SNAT
              * or MASQUERADE.
             */
@@ -704,10 +1576,7 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                     "--to-ports %i", fst_port);
             }
 
-            snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_ADD_SNAT_RULE_ARGS,
-                opts->fw_config->fw_command,
-                snat_chain->table,
-                snat_chain->to_chain,
+            snprintf(rule_spec, MAX_IPT_RULE_SPEC_LEN-1, IPT_SNAT_RULE_SPEC,
                 fst_proto,
                 nat_ip,
                 nat_port,
@@ -716,24 +1585,11 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
                 snat_target
             );
 
-            res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
-            if(EXTCMD_IS_SUCCESS(res))
-            {
-                log_msg(LOG_INFO, "Added Source NAT Rule to %s for %s, %s expires at %u",
-                    snat_chain->to_chain, spadat->use_src_ip,
-                    spadat->spa_message_remain, exp_ts
-                );
-
-                snat_chain->active_rules++;
-
-                /* Reset the next expected expire time for this chain if it
-                * is warranted.
-                */
-            if(snat_chain->next_expire < now || exp_ts < snat_chain->next_expire)
-                    snat_chain->next_expire = exp_ts;
-            }
-            else
-                log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf); 
+            /* The SNAT rule does not match on the client address, so it is
+             * shared by every client granted access to the same NAT target.
+            */
+            res = grant_rule(snat_chain, "Source NAT ", spadat, fst_proto,
+                "", fst_port, nat_ip, nat_port, rule_spec, now, exp_ts);
         }
     }
 
@@ -751,12 +1607,51 @@ check_firewall_rules(fko_srv_options_t *opts)
     char            *ndx, *rn_start, *rn_end, *tmp_mark;
 
     int             i, res, rn_offset;
-    time_t          now, rule_exp, min_exp = 0;
+    time_t          now, rule_exp, min_exp;
 
     struct fw_chain *ch = opts->fw_config->chain;
 
     time(&now);
 
+    /* Every so often, make sure our chains and jump rules are still where
+     * we think they are.
+    */
+    if(now - fwc.last_audit >= IPT_CHAIN_AUDIT_INTERVAL)
+        audit_chains(now);
+
+    /* With batching, expired rules are removed by their specification
+     * straight from our grant list, and the queued changes are handed to
+     * the firewall executor once the batch window has passed.  New grants
+     * are only logged as added once the executor reports back.
+    */
+    if(fwc.batch_window > 0)
+    {
+        for(i = 0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+        {
+            if(ch[i].active_rules == 0 || ch[i].next_expire > now)
+                continue;
+
+            ch[i].next_expire = purge_expired_grants(&(ch[i]), now, 1);
+
+            if(ch[i].grants == NULL)
+                ch[i].active_rules = 0;
+        }
+
+        res = fw_batch_ready(&fwc.batch, fwc.batch_window);
+
+        if(fw_batch_done(&fwc.batch))
+            batch_applied();
+
+        if(res)
+        {
+            set_grants_pending(IPT_GRANT_QUEUED, IPT_GRANT_APPLYING, 0);
+            set_grants_pending(IPT_GRANT_DEL_QUEUED, IPT_GRANT_DELETING, 0);
+            fw_batch_exec(&fwc.batch, ipt_apply_batch);
+        }
+
+        return;
+    }
+
     /* Iterate over each chain and look for active rules to delete.
     */
     for(i = 0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
@@ -770,6 +1665,7 @@ check_firewall_rules(fko_srv_options_t *opts)
         zero_cmd_buffers();
 
         rn_offset = 0;
+        min_exp   = 0;
 
         /* There should be a rule to delete.  Get the current list of
          * rules for this chain and delete the ones that are expired.
@@ -780,7 +1676,7 @@ check_firewall_rules(fko_srv_options_t *opts)
             ch[i].to_chain
         );
 
-        res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
+        res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
 
         if(!EXTCMD_IS_SUCCESS(res))
         {
@@ -875,7 +1771,7 @@ check_firewall_rules(fko_srv_options_t *opts)
  
 
 //fprintf(stderr, "DELETE RULE CMD: %s\n", cmd_buf);
-                res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
+                res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
                 if(EXTCMD_IS_SUCCESS(res))
                 {
                     log_msg(LOG_INFO, "Removed rule %s from %s with expire time of %u.",
@@ -895,8 +1791,8 @@ check_firewall_rules(fko_srv_options_t *opts)
             {
                 /* Track the minimum future rule expire time.
                 */
-                if(rule_exp > now)
-                    min_exp = (min_exp < rule_exp) ? min_exp : rule_exp;
+                if(min_exp == 0 || rule_exp < min_exp)
+                    min_exp = rule_exp;
             }
 
             /* Push our tracking index forward beyond (just processed) _exp_
@@ -905,6 +1801,10 @@ check_firewall_rules(fko_srv_options_t *opts)
             ndx = strstr(tmp_mark, EXPIRE_COMMENT_PREFIX);
         }
 
+        /* Forget the grants whose rules were just removed.
+        */
+        purge_expired_grants(&(ch[i]), now, 0);
+
         /* Set the next pending expire time accordingly. 0 if there are no
          * more rules, or whatever the next expected (min_exp) time will be.
         */
@@ -33,19 +33,38 @@
 
 #define SNAT_TARGET_BUFSIZE         64
 
-/* iptables command args            
+/* iptables rule specifications (everything after the chain name).
 */
-#define IPT_ADD_RULE_ARGS "-t %s -A %s -p %i -s %s --dport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s 2>&1"
-#define IPT_ADD_OUT_RULE_ARGS "-t %s -A %s -p %i -d %s --sport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s 2>&1"
-#define IPT_ADD_FWD_RULE_ARGS "-t %s -A %s -p %i -s %s -d %s --dport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s 2>&1"
-#define IPT_ADD_DNAT_RULE_ARGS "-t %s -A %s -p %i -s %s --dport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s --to-destination %s:%i 2>&1"
-#define IPT_ADD_SNAT_RULE_ARGS "-t %s -A %s -p %i -d %s --dport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s %s 2>&1"
+#define IPT_RULE_SPEC "-p %i -s %s --dport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s"
+#define IPT_OUT_RULE_SPEC "-p %i -d %s --sport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s"
+#define IPT_FWD_RULE_SPEC "-p %i -s %s -d %s --dport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s"
+#define IPT_DNAT_RULE_SPEC "-p %i -s %s --dport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s --to-destination %s:%i"
+#define IPT_SNAT_RULE_SPEC "-p %i -d %s --dport %i -m comment --comment " EXPIRE_COMMENT_PREFIX "%u -j %s %s"
+
+/* iptables command args
+*/
+#define IPT_ADD_RULE_ARGS "-t %s -A %s %s 2>&1"
+#define IPT_DEL_RULE_SPEC_ARGS "-t %s -D %s %s 2>&1"
 #define IPT_DEL_RULE_ARGS "-t %s -D %s %i 2>&1"
+#define IPT_CHK_RULE_SPEC_ARGS "-t %.*s -C %s 2>&1"
 #define IPT_NEW_CHAIN_ARGS "-t %s -N %s 2>&1"
 #define IPT_FLUSH_CHAIN_ARGS "-t %s -F %s 2>&1"
 #define IPT_DEL_CHAIN_ARGS "-t %s -X %s 2>&1"
 #define IPT_ADD_JUMP_RULE_ARGS "-t %s -I %s %i -j %s 2>&1"
 #define IPT_LIST_RULES_ARGS "-t %s -L %s --line-numbers -n 2>&1"
+#define IPT_LIST_CHAIN_SPEC_ARGS "-t %s -S %s 2>&1"
+
+/* iptables-restore/iptables-save args and batch sizing.  The chain setup
+ * and teardown transactions are fed to iptables-restore on stdin.
+*/
+#define IPT_RESTORE_ARGS "--noflush"
+#define IPT_SAVE_ARGS "2>/dev/null"
+#define IPT_BATCH_BUFSIZE 8192
+
+/* How often (in seconds) we re-verify our cached chain and jump rule state
+ * against the live ruleset.
+*/
+#define IPT_CHAIN_AUDIT_INTERVAL 300
 
 #endif /* FW_UTIL_IPTABLES_H */
 
@@ -0,0 +1,318 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_util_mem.c
+ *
+ * Purpose: Fwknop routines for an in-memory (dry-run) firewall.  Access is
+ *          granted and expired in a table inside fwknopd with the same
+ *          semantics as the real backends, but no firewall is touched, so
+ *          the whole packet-to-grant path can be exercised and measured
+ *          without root.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+
+#if FIREWALL_MEM
+
+#include "fw_util.h"
+#include "utils.h"
+#include "log_msg.h"
+#include "access.h"
+
+static struct fw_config fwc;
+
+/* Hash a rule's source ip, proto and port to its table bucket.
+*/
+static unsigned int
+rule_hash(const char *ip, const unsigned int proto, const unsigned int port)
+{
+    unsigned int    h = 5381;
+
+    while(*ip != '\0')
+        h = (h * 33) + (unsigned char)*ip++;
+
+    h = (h * 33) + proto;
+    h = (h * 33) + port;
+
+    return(h % MEM_RULE_HASH_SIZE);
+}
+
+static void
+free_rules(void)
+{
+    int                 i;
+    struct mem_rule    *r, *next;
+
+    for(i=0; i<MEM_RULE_HASH_SIZE; i++)
+    {
+        for(r = fwc.rules[i]; r != NULL; r = next)
+        {
+            next = r->next;
+            free(r);
+        }
+
+        fwc.rules[i] = NULL;
+    }
+
+    fwc.active_rules = 0;
+}
+
+/* Print the rules and counters of the in-memory firewall to stdout.  Note
+ * that the rules only ever exist inside a running fwknopd.
+*/
+int
+fw_dump_rules(fko_srv_options_t *opts)
+{
+    int                 i;
+    struct mem_rule    *r;
+
+    printf("\nIn-memory (dry-run) firewall:\n"
+        "    requests:         %lu\n"
+        "    rules added:      %lu\n"
+        "    rules refreshed:  %lu\n"
+        "    rules expired:    %lu\n"
+        "    active rules:     %u (peak %u)\n",
+        fwc.requests, fwc.rules_added, fwc.rules_refreshed,
+        fwc.rules_expired, fwc.active_rules, fwc.peak_rules
+    );
+
+    for(i=0; i<MEM_RULE_HASH_SIZE; i++)
+        for(r = fwc.rules[i]; r != NULL; r = r->next)
+            printf("    proto %u from %s port %u%s%s expires %u\n",
+                r->proto, r->ip, r->port,
+                (r->nat_ip[0] != '\0') ? " nat to " : "",
+                r->nat_ip, (unsigned int)r->expires);
+
+    return(0);
+}
+
+void
+fw_config_init(fko_srv_options_t *opts)
+{
+    /* In case this is a re-config, drop the old table.
+    */
+    free_rules();
+
+    memset(&fwc, 0x0, sizeof(struct fw_config));
+
+    strlcpy(fwc.fw_command, opts->config[CONF_FIREWALL_EXE], MAX_PATH_LEN);
+
+    /* Let us find it via our opts struct as well.
+    */
+    opts->fw_config = &fwc;
+
+    return;
+}
+
+void
+fw_initialize(fko_srv_options_t *opts)
+{
+    log_msg(LOG_WARNING,
+        "Using the in-memory (dry-run) firewall: no real firewall rules will be changed.");
+}
+
+int
+fw_cleanup(void)
+{
+    log_msg(LOG_INFO,
+        "Dry-run firewall: %lu requests, %lu rules added, %lu refreshed, %lu expired, peak of %u active.",
+        fwc.requests, fwc.rules_added, fwc.rules_refreshed,
+        fwc.rules_expired, fwc.peak_rules
+    );
+
+    free_rules();
+
+    return(0);
+}
+
+/****************************************************************************/
+
+/* Grant access for the given source ip, proto and port (and NAT target),
+ * refreshing the expire time of an existing rule rather than adding a
+ * second one.
+*/
+static void
+grant_rule(spa_data_t *spadat, const unsigned int proto, const unsigned int port,
+    const char *nat_ip, const unsigned int nat_port, const time_t now,
+    const unsigned int exp_ts)
+{
+    unsigned int        h = rule_hash(spadat->use_src_ip, proto, port);
+    struct mem_rule    *r;
+
+    for(r = fwc.rules[h]; r != NULL; r = r->next)
+    {
+        if(r->proto == proto && r->port == port && r->nat_port == nat_port
+          && strcmp(r->ip, spadat->use_src_ip) == 0
+          && strcmp(r->nat_ip, nat_ip) == 0)
+            break;
+    }
+
+    if(r != NULL)
+    {
+        if(r->expires < exp_ts)
+            r->expires = exp_ts;
+
+        fwc.rules_refreshed++;
+
+        log_msg(LOG_INFO, "Refreshed rule for %s, %s expires at %u",
+            spadat->use_src_ip, spadat->spa_message_remain,
+            (unsigned int)r->expires
+        );
+    }
+    else
+    {
+        if((r = calloc(1, sizeof(struct mem_rule))) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory allocation error adding rule.");
+            exit(EXIT_FAILURE);
+        }
+
+        r->proto    = proto;
+        r->port     = port;
+        r->nat_port = nat_port;
+        r->expires  = exp_ts;
+        strlcpy(r->ip, spadat->use_src_ip, MAX_IP_STR_LEN);
+        strlcpy(r->nat_ip, nat_ip, MAX_IP_STR_LEN);
+
+        r->next       = fwc.rules[h];
+        fwc.rules[h]  = r;
+
+        fwc.rules_added++;
+
+        if(++fwc.active_rules > fwc.peak_rules)
+            fwc.peak_rules = fwc.active_rules;
+
+        log_msg(LOG_INFO, "Added rule for %s, %s expires at %u",
+            spadat->use_src_ip, spadat->spa_message_remain, exp_ts
+        );
+    }
+
+    /* Reset the next expected expire time if it is warranted.
+    */
+    if(fwc.next_expire < now || exp_ts < fwc.next_expire)
+        fwc.next_expire = exp_ts;
+}
+
+/* Rule Processing - Create an access request...
+*/
+int
+process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
+{
+    char             nat_ip[MAX_IP_STR_LEN] = {0};
+    char            *ndx;
+    unsigned int     nat_port = 0;
+
+    acc_port_list_t *port_list = NULL;
+    acc_port_list_t *ple;
+
+    time_t           now;
+    unsigned int     exp_ts;
+
+    fwc.requests++;
+
+    /* Parse and expand our access message.
+    */
+    expand_acc_port_list(&port_list, spadat->spa_message_remain);
+
+    if(port_list == NULL)
+        return(-1);
+
+    /* Set our expire time value.
+    */
+    time(&now);
+    exp_ts = now + spadat->fw_access_timeout;
+
+    if(spadat->message_type == FKO_ACCESS_MSG
+      || spadat->message_type == FKO_CLIENT_TIMEOUT_ACCESS_MSG)
+    {
+        for(ple = port_list; ple != NULL; ple = ple->next)
+            grant_rule(spadat, ple->proto, ple->port, "", 0, now, exp_ts);
+    }
+    else
+    {
+        /* NAT requests use the first proto/port and the NAT IP and port.
+        */
+        if(spadat->nat_access != NULL
+          && (ndx = strchr(spadat->nat_access, ',')) != NULL)
+        {
+            strlcpy(nat_ip, spadat->nat_access, (ndx-spadat->nat_access)+1);
+            nat_port = atoi(ndx+1);
+        }
+
+        grant_rule(spadat, port_list->proto, port_list->port, nat_ip,
+            nat_port, now, exp_ts);
+    }
+
+    free_acc_port_list(port_list);
+
+    return(0);
+}
+
+/* Remove any rules that have expired.
+*/
+void
+check_firewall_rules(fko_srv_options_t *opts)
+{
+    int                 i;
+    time_t              now, min_exp = 0;
+    struct mem_rule   **rp, *r;
+
+    time(&now);
+
+    /* If there are no active rules or we have not yet reached our expected
+     * next expire time, there is nothing to do.
+    */
+    if(fwc.active_rules == 0 || fwc.next_expire > now)
+        return;
+
+    for(i=0; i<MEM_RULE_HASH_SIZE; i++)
+    {
+        rp = &(fwc.rules[i]);
+
+        while((r = *rp) != NULL)
+        {
+            if(r->expires > now)
+            {
+                if(min_exp == 0 || r->expires < min_exp)
+                    min_exp = r->expires;
+
+                rp = &(r->next);
+                continue;
+            }
+
+            log_msg(LOG_INFO, "Removed rule for %s, proto %u port %u with expire time of %u.",
+                r->ip, r->proto, r->port, (unsigned int)r->expires
+            );
+
+            *rp = r->next;
+            free(r);
+
+            fwc.rules_expired++;
+            fwc.active_rules--;
+        }
+    }
+
+    fwc.next_expire = min_exp;
+}
+
+#endif /* FIREWALL_MEM */
+
+/***EOF***/
@@ -0,0 +1,36 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_util_mem.h
+ *
+ * Purpose: Header file for fw_util_mem.c.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FW_UTIL_MEM_H
+#define FW_UTIL_MEM_H
+
+/* The dry-run backend has no firewall commands of its own, so there is
+ * nothing else to define here.
+*/
+
+#endif /* FW_UTIL_MEM_H */
+
+/***EOF***/
@@ -52,6 +52,73 @@ zero_cmd_buffers(void)
     memset(cmd_out, 0x0, STANDARD_CMD_OUT_BUFSIZE);
 }
 
+/* Print the addresses in each of the tables in the fwknop anchor.
+*/
+static int
+dump_anchor_tables(fko_srv_options_t *opts)
+{
+    int     res, got_err = 0;
+    char   *ndx, *eol;
+    char    table_list[STANDARD_CMD_OUT_BUFSIZE] = {0};
+
+    zero_cmd_buffers();
+
+    if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " PF_LIST_ANCHOR_TABLES_ARGS,
+        opts->fw_config->fw_command,
+        opts->fw_config->anchor) >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR, "pfctl table list command is too long.");
+        return(1);
+    }
+
+    res = run_extcmd(cmd_buf, table_list, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
+
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, table_list);
+        return(1);
+    }
+
+    for(ndx = table_list; *ndx != '\0'; ndx = eol + 1)
+    {
+        if((eol = strchr(ndx, '\n')) == NULL)
+            break;
+
+        *eol = '\0';
+
+        while(isspace(*ndx))
+            ndx++;
+
+        if(*ndx == '\0')
+            continue;
+
+        zero_cmd_buffers();
+
+        if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " PF_SHOW_TABLE_ARGS,
+            opts->fw_config->fw_command,
+            opts->fw_config->anchor,
+            ndx) >= CMD_BUFSIZE-1)
+        {
+            log_msg(LOG_ERR, "pfctl command to show table '%s' is too long.", ndx);
+            got_err++;
+            continue;
+        }
+
+        printf("\nAddresses in PF table '%s':\n", ndx);
+        fflush(stdout);
+
+        res = system(cmd_buf);
+
+        if(! EXTCMD_IS_SUCCESS(res))
+        {
+            log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+            got_err++;
+        }
+    }
+
+    return(got_err);
+}
+
 /* Print all firewall rules currently instantiated by the running fwknopd
  * daemon to stdout.
 */
@@ -79,6 +146,9 @@ fw_dump_rules(fko_srv_options_t *opts)
         got_err++;
     }
 
+    if(opts->fw_config->use_tables)
+        got_err += dump_anchor_tables(opts);
+
     return(got_err);
 }
 
@@ -103,7 +173,7 @@ anchor_active(fko_srv_options_t *opts)
         opts->fw_config->fw_command
     );
 
-    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
+    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
 
     if(!EXTCMD_IS_SUCCESS(res))
     {
@@ -144,7 +214,7 @@ delete_all_anchor_rules(fko_srv_options_t *opts)
         fwc.anchor
     );
 
-    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, 0);
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
 
     /* Expect full success on this */
     if(! EXTCMD_IS_SUCCESS(res))
@@ -153,9 +223,536 @@ delete_all_anchor_rules(fko_srv_options_t *opts)
     return;
 }
 
+/* Append a batch of queued rules to the anchor with a single list and
+ * rewrite of the anchor (this runs in the executor process).
+*/
+static int
+pf_apply_batch(char *batch)
+{
+    int     res;
+    size_t  len;
+    char   *line, *eol;
+    char    write_cmd[CMD_BUFSIZE];
+
+    zero_cmd_buffers();
+
+    if(snprintf(write_cmd, CMD_BUFSIZE-1, "%s " PF_WRITE_ANCHOR_RULES_ARGS,
+        fwc.fw_command,
+        fwc.anchor) >= CMD_BUFSIZE-1
+      || snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " PF_LIST_ANCHOR_RULES_ARGS,
+        fwc.fw_command,
+        fwc.anchor) >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR, "pfctl anchor command is too long.");
+        return(-1);
+    }
+
+    /* Cache the current anchor rule set
+    */
+    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
+
+    if(!EXTCMD_IS_SUCCESS(res))
+    {
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, cmd_out);
+        return(-1);
+    }
+
+    /* Add as many of the new rules as we have room for.
+    */
+    for(line = batch; *line != '\0'; line = eol + 1)
+    {
+        if((eol = strchr(line, '\n')) == NULL)
+            break;
+
+        len = strlen(cmd_out);
+
+        if (len + (eol - line) + 1 >= STANDARD_CMD_OUT_BUFSIZE)
+        {
+            log_msg(LOG_WARNING, "Max anchor rules reached, try again later.");
+            break;
+        }
+
+        memcpy(cmd_out + len, line, (eol - line) + 1);
+        cmd_out[len + (eol - line) + 1] = '\0';
+    }
+
+    return(fw_batch_pipe(write_cmd, cmd_out, NULL, 0));
+}
+
+/* Release the table mode grant and table port lists.
+*/
+static void
+free_table_state(void)
+{
+    struct pf_grant *g, *next;
+
+    for(g = fwc.grants; g != NULL; g = next)
+    {
+        next = g->next;
+        free(g);
+    }
+
+    fwc.grants = NULL;
+
+    free_acc_port_list(fwc.table_ports);
+
+    fwc.table_ports = NULL;
+}
+
+/* Add (op "add") or remove (op "delete") an address in the table for a
+ * protocol/port, or queue the change for the firewall executor if batching
+ * is enabled.
+*/
+static int
+table_cmd(const char *op, const unsigned int proto, const unsigned int port,
+    const char *ip)
+{
+    int     res;
+
+    if(fwc.batch_window > 0)
+    {
+        fw_batch_add(&fwc.batch, "%u %u %s %s\n", proto, port, op, ip);
+        return(EXTCMD_SUCCESS_ALL_OUTPUT);
+    }
+
+    zero_cmd_buffers();
+
+    if(snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " PF_TABLE_ARGS " %s 2>&1",
+        fwc.fw_command,
+        fwc.anchor,
+        proto,
+        port,
+        op,
+        ip) >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR, "pfctl table command is too long.");
+        return(EXTCMD_EXECUTION_ERROR);
+    }
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
+    if(! EXTCMD_IS_SUCCESS(res))
+        log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd_buf, err_buf);
+
+    return(res);
+}
+
+/* Apply a batch of queued table updates (this runs in the executor
+ * process).  Consecutive updates to the same table with the same operation
+ * are merged into a single pfctl command.  If that command fails, each of
+ * its updates is reported back with fw_batch_failed().
+*/
+static int
+pf_apply_table_batch(char *batch)
+{
+    int             res, got_err = 0, n_lines;
+    unsigned int    proto, port, next_proto, next_port;
+    char            op[8], next_op[8];
+    char            ip[MAX_IP_STR_LEN], next_ip[MAX_IP_STR_LEN];
+    char           *line, *eol, *cmd, *first;
+    size_t          cmd_size = strlen(batch) + CMD_BUFSIZE;
+
+    if((cmd = malloc(cmd_size)) == NULL)
+    {
+        log_msg(LOG_ERR, "Memory allocation error in pf_apply_table_batch.");
+        return(-1);
+    }
+
+    line = batch;
+
+    while((eol = strchr(line, '\n')) != NULL)
+    {
+        *eol = '\0';
+
+        if(sscanf(line, "%u %u %7s %15s", &proto, &port, op, ip) != 4)
+        {
+            line = eol + 1;
+            continue;
+        }
+
+        snprintf(cmd, cmd_size, "%s " PF_TABLE_ARGS " %s",
+            fwc.fw_command, fwc.anchor, proto, port, op, ip);
+
+        first   = line;
+        n_lines = 1;
+
+        line = eol + 1;
+
+        while((eol = strchr(line, '\n')) != NULL)
+        {
+            *eol = '\0';
+
+            if(sscanf(line, "%u %u %7s %15s",
+                    &next_proto, &next_port, next_op, next_ip) != 4
+              || next_proto != proto || next_port != port
+              || strcmp(next_op, op) != 0)
+            {
+                *eol = '\n';
+                break;
+            }
+
+            strlcat(cmd, " ", cmd_size);
+            strlcat(cmd, next_ip, cmd_size);
+
+            n_lines++;
+
+            line = eol + 1;
+        }
+
+        strlcat(cmd, " 2>&1", cmd_size);
+
+        zero_cmd_buffers();
+
+        res = run_extcmd(cmd, err_buf, CMD_BUFSIZE, FW_CMD_TIMEOUT);
+        if(! EXTCMD_IS_SUCCESS(res))
+        {
+            log_msg(LOG_ERR, "Error %i from cmd:'%s': %s", res, cmd, err_buf);
+
+            /* The merged updates are the n_lines entries from first on,
+             * each one terminated by the NUL that replaced its newline.
+            */
+            for(; n_lines > 0; n_lines--, first += strlen(first) + 1)
+                fw_batch_failed(first);
+
+            got_err++;
+        }
+    }
+
+    free(cmd);
+
+    return(got_err);
+}
+
+/* Make sure the anchor has the pass rule for the table of the given
+ * protocol/port.  If not, the anchor ruleset is reloaded with it added.
+ * This only happens the first time a protocol/port is granted.
+*/
+static int
+add_table_rule(const unsigned int proto, const unsigned int port)
+{
+    acc_port_list_t *tp;
+    char             rules[STANDARD_CMD_OUT_BUFSIZE] = {0};
+    char             new_rule[MAX_PF_NEW_RULE_LEN];
+    char             write_cmd[CMD_BUFSIZE];
+
+    for(tp = fwc.table_ports; tp != NULL; tp = tp->next)
+        if(tp->proto == proto && tp->port == port)
+            return(0);
+
+    /* Build the full ruleset: the new rule followed by the existing ones.
+    */
+    snprintf(rules, MAX_PF_NEW_RULE_LEN-1, PF_TABLE_RULE_ARGS "\n",
+        proto, proto, port, port);
+
+    for(tp = fwc.table_ports; tp != NULL; tp = tp->next)
+    {
+        snprintf(new_rule, MAX_PF_NEW_RULE_LEN-1, PF_TABLE_RULE_ARGS "\n",
+            tp->proto, tp->proto, tp->port, tp->port);
+
+        if(strlcat(rules, new_rule, STANDARD_CMD_OUT_BUFSIZE) >= STANDARD_CMD_OUT_BUFSIZE)
+        {
+            log_msg(LOG_WARNING, "Max anchor rules reached, try again later.");
+            return(-1);
+        }
+    }
+
+    if(snprintf(write_cmd, CMD_BUFSIZE-1, "%s " PF_WRITE_ANCHOR_RULES_ARGS,
+        fwc.fw_command,
+        fwc.anchor) >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR, "pfctl anchor command is too long.");
+        return(-1);
+    }
+
+    if(fw_batch_pipe(write_cmd, rules, NULL, 0) != 0)
+        return(-1);
+
+    if((tp = calloc(1, sizeof(acc_port_list_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error adding pf table rule.");
+        exit(EXIT_FAILURE);
+    }
+
+    tp->proto = proto;
+    tp->port  = port;
+    tp->next  = fwc.table_ports;
+
+    fwc.table_ports = tp;
+
+    log_msg(LOG_INFO, "Added pf anchor rule for table " PF_TABLE_NAME, proto, port);
+
+    return(0);
+}
+
+/* The grant (not being deleted) for the address in the table of the
+ * given protocol/port, or NULL.
+*/
+static struct pf_grant *
+find_table_grant(const unsigned int proto, const unsigned int port,
+    const char *ip)
+{
+    struct pf_grant *g;
+
+    for(g = fwc.grants; g != NULL; g = g->next)
+        if(g->pending == PF_GRANT_ACTIVE && g->proto == proto
+          && g->port == port && strcmp(g->ip, ip) == 0)
+            return(g);
+
+    return(NULL);
+}
+
+/* Unlink a grant (prev is the one before it, or NULL) and free it.
+*/
+static void
+drop_table_grant(struct pf_grant *g, struct pf_grant *prev)
+{
+    if(prev == NULL)
+        fwc.grants = g->next;
+    else
+        prev->next = g->next;
+
+    free(g);
+
+    if (fwc.active_rules > 0)
+        fwc.active_rules--;
+}
+
+/* Drop a grant whose address has been removed from its table.
+*/
+static void
+remove_table_grant(struct pf_grant *g, struct pf_grant *prev)
+{
+    log_msg(LOG_INFO, "Removed %s from table " PF_TABLE_NAME " with expire time of %u.",
+        g->ip, g->proto, g->port, (unsigned int)g->expires
+    );
+
+    drop_table_grant(g, prev);
+}
+
+/* Grant access to each proto/port in the list by adding the source address
+ * to the table for that proto/port (PF_USE_TABLES mode).
+*/
+static int
+grant_table_access(spa_data_t *spadat, acc_port_list_t *port_list,
+    time_t now, unsigned int exp_ts)
+{
+    acc_port_list_t *ple;
+    struct pf_grant *g;
+    int              res = 0;
+
+    for(ple = port_list; ple != NULL; ple = ple->next)
+    {
+        if(add_table_rule(ple->proto, ple->port) != 0)
+        {
+            res = -1;
+            continue;
+        }
+
+        g = find_table_grant(ple->proto, ple->port, spadat->use_src_ip);
+
+        if(g != NULL)
+        {
+            /* The address is already in the table, so we just push its
+             * expire time out.
+            */
+            if(exp_ts > g->expires)
+                g->expires = exp_ts;
+
+            log_msg(LOG_INFO, "Refreshed table access for %s, %s expires at %u",
+                spadat->use_src_ip,
+                spadat->spa_message_remain,
+                (unsigned int)g->expires
+            );
+        }
+        else
+        {
+            res = table_cmd("add", ple->proto, ple->port, spadat->use_src_ip);
+            if(! EXTCMD_IS_SUCCESS(res))
+                continue;
+
+            if((g = calloc(1, sizeof(struct pf_grant))) == NULL)
+            {
+                log_msg(LOG_ERR, "Fatal memory allocation error adding grant.");
+                exit(EXIT_FAILURE);
+            }
+
+            g->proto   = ple->proto;
+            g->port    = ple->port;
+            g->expires = exp_ts;
+            strlcpy(g->ip, spadat->use_src_ip, MAX_IP_STR_LEN);
+
+            g->next    = fwc.grants;
+            fwc.grants = g;
+
+            fwc.active_rules++;
+
+            log_msg(LOG_INFO, "Added %s to table " PF_TABLE_NAME ", %s expires at %u",
+                spadat->use_src_ip,
+                ple->proto,
+                ple->port,
+                spadat->spa_message_remain,
+                exp_ts
+            );
+        }
+
+        /* Reset the next expected expire time if it is warranted.
+        */
+        if(fwc.next_expire < now || g->expires < fwc.next_expire)
+            fwc.next_expire = g->expires;
+    }
+
+    return(res);
+}
+
+/* Remove the addresses whose access has expired from their tables.  A
+ * grant stays until its address is known to be gone: if the delete fails,
+ * it is tried again in a second.  With batching, the grant is kept (being
+ * deleted) until table_batch_applied() has seen the delete through.
+*/
+static void
+expire_table_access(time_t now)
+{
+    struct pf_grant *g, *prev = NULL, *next;
+    time_t           min_exp = 0;
+    int              res;
+
+    for(g = fwc.grants; g != NULL; g = next)
+    {
+        next = g->next;
+
+        if(g->pending != PF_GRANT_ACTIVE)
+        {
+            prev = g;
+            continue;
+        }
+
+        if(g->expires > now)
+        {
+            if(min_exp == 0 || g->expires < min_exp)
+                min_exp = g->expires;
+
+            prev = g;
+            continue;
+        }
+
+        res = table_cmd("delete", g->proto, g->port, g->ip);
+
+        if(EXTCMD_IS_SUCCESS(res) && fwc.batch_window > 0)
+        {
+            g->pending = PF_GRANT_DEL_QUEUED;
+
+            prev = g;
+            continue;
+        }
+        else if(! EXTCMD_IS_SUCCESS(res))
+        {
+            if(min_exp == 0 || now + 1 < min_exp)
+                min_exp = now + 1;
+
+            prev = g;
+            continue;
+        }
+
+        remove_table_grant(g, prev);
+    }
+
+    fwc.next_expire = min_exp;
+}
+
+/* Set the state of every table grant that is in the from state.
+*/
+static void
+set_table_grants_pending(const int from, const int to)
+{
+    struct pf_grant *g;
+
+    for(g = fwc.grants; g != NULL; g = g->next)
+        if(g->pending == from)
+            g->pending = to;
+}
+
+/* The firewall executor is done with the last batch of table updates.  A
+ * grant whose address could not be added is dropped, so the next SPA
+ * packet asking for the same access adds it again.  A delete that failed
+ * is queued again (unless the address has since been granted access
+ * anew, in which case it is to stay in the table).  The grants whose
+ * deletes went through are released.
+*/
+static void
+table_batch_applied(void)
+{
+    struct pf_grant *g, *prev, *next;
+    unsigned int     proto, port;
+    char             op[8], ip[MAX_IP_STR_LEN];
+    char            *line, *eol;
+    int              del;
+
+    for(line = fwc.batch.failed; (eol = strchr(line, '\n')) != NULL; line = eol + 1)
+    {
+        *eol = '\0';
+
+        if(sscanf(line, "%u %u %7s %15s", &proto, &port, op, ip) != 4)
+            continue;
+
+        del = (strcmp(op, "delete") == 0);
+
+        for(prev = NULL, g = fwc.grants; g != NULL; prev = g, g = g->next)
+        {
+            if(g->proto != proto || g->port != port || strcmp(g->ip, ip) != 0)
+                continue;
+
+            if(del && g->pending == PF_GRANT_DELETING)
+                break;
+
+            if(!del && g->pending == PF_GRANT_ACTIVE)
+                break;
+        }
+
+        if(g == NULL)
+            continue;
+
+        if(!del)
+        {
+            log_msg(LOG_ERR, "Could not add %s to table " PF_TABLE_NAME ", dropping it.",
+                ip, proto, port);
+
+            drop_table_grant(g, prev);
+            continue;
+        }
+
+        if(find_table_grant(proto, port, ip) != NULL)
+        {
+            drop_table_grant(g, prev);
+            continue;
+        }
+
+        log_msg(LOG_WARNING, "Could not remove %s from table " PF_TABLE_NAME ", trying again.",
+            ip, proto, port);
+
+        g->pending = PF_GRANT_DEL_QUEUED;
+
+        fw_batch_add(&fwc.batch, "%s\n", line);
+    }
+
+    for(prev = NULL, g = fwc.grants; g != NULL; g = next)
+    {
+        next = g->next;
+
+        if(g->pending == PF_GRANT_DELETING)
+            remove_table_grant(g, prev);
+        else
+            prev = g;
+    }
+}
+
 void
 fw_config_init(fko_srv_options_t *opts)
 {
+    /* In case this is a re-config, let any running executor finish.
+    */
+    fw_batch_free(&fwc.batch);
+
+    free_table_state();
+
     memset(&fwc, 0x0, sizeof(struct fw_config));
 
     /* Set our firewall exe command path
@@ -166,6 +763,13 @@ fw_config_init(fko_srv_options_t *opts)
     */
     strlcpy(fwc.anchor, opts->config[CONF_PF_ANCHOR_NAME], MAX_PF_ANCHOR_LEN);
 
+    fwc.batch_window = atoi(opts->config[CONF_FW_BATCH_WINDOW]);
+
+    /* Grant access via pf tables rather than a rule per request.
+    */
+    if(strncasecmp(opts->config[CONF_PF_USE_TABLES], "Y", 1) == 0)
+        fwc.use_tables = 1;
+
     /* Let us find it via our opts struct as well.
     */
     opts->fw_config = &fwc;
@@ -193,6 +797,12 @@ fw_initialize(fko_srv_options_t *opts)
 int
 fw_cleanup(void)
 {
+    /* Let a running executor finish and drop anything still queued.
+    */
+    fw_batch_free(&fwc.batch);
+
+    free_table_state();
+
     return(0);
 }
 
@@ -243,10 +853,46 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
     if(spadat->message_type == FKO_ACCESS_MSG
       || spadat->message_type == FKO_CLIENT_TIMEOUT_ACCESS_MSG)
     {
+        if(fwc.use_tables)
+        {
+            res = grant_table_access(spadat, port_list, now, exp_ts);
+
+            free_acc_port_list(port_list);
+
+            return(res);
+        }
+
         /* Create an access command for each proto/port for the source ip.
         */
         while(ple != NULL)
         {
+            /* With batching, the rule is queued for the firewall executor,
+             * which adds all of the queued rules with one anchor rewrite.
+            */
+            if(fwc.batch_window > 0)
+            {
+                fw_batch_add(&fwc.batch, PF_ADD_RULE_ARGS "\n",
+                    ple->proto,
+                    spadat->use_src_ip,
+                    ple->port,
+                    exp_ts
+                );
+
+                log_msg(LOG_INFO, "Added Rule for %s, %s expires at %u",
+                    spadat->use_src_ip,
+                    spadat->spa_message_remain,
+                    exp_ts
+                );
+
+                fwc.active_rules++;
+
+                if(fwc.next_expire < now || exp_ts < fwc.next_expire)
+                    fwc.next_expire = exp_ts;
+
+                ple = ple->next;
+                continue;
+            }
+
             zero_cmd_buffers();
 
             snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " PF_LIST_ANCHOR_RULES_ARGS,
@@ -256,7 +902,7 @@ process_spa_request(fko_srv_options_t *opts, spa_data_t *spadat)
 
             /* Cache the current anchor rule set
             */
-            res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
+            res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
 
             /* Build the new rule string
             */
@@ -363,6 +1009,25 @@ check_firewall_rules(fko_srv_options_t *opts)
 
     FILE            *pfctl_fd = NULL;
 
+    /* Hand any queued rules to the firewall executor once the batch
+     * window has passed, after catching up with the results of the last
+     * batch of table updates.
+    */
+    if(fwc.batch_window > 0)
+    {
+        res = fw_batch_ready(&fwc.batch, fwc.batch_window);
+
+        if(fw_batch_done(&fwc.batch) && fwc.use_tables)
+            table_batch_applied();
+
+        if(res)
+        {
+            set_table_grants_pending(PF_GRANT_DEL_QUEUED, PF_GRANT_DELETING);
+            fw_batch_exec(&fwc.batch,
+                fwc.use_tables ? pf_apply_table_batch : pf_apply_batch);
+        }
+    }
+
     /* If we have not yet reached our expected next expire
        time, continue.
     */
@@ -374,6 +1039,21 @@ check_firewall_rules(fko_srv_options_t *opts)
     if (fwc.next_expire > now)
         return;
 
+    /* With tables, the expired addresses are known from our grant list,
+     * so there is no need to list and rewrite the anchor.
+    */
+    if(fwc.use_tables)
+    {
+        expire_table_access(now);
+        return;
+    }
+
+    /* The anchor is rewritten below, so wait until the executor is not in
+     * the middle of doing the same (we will be back on the next pass).
+    */
+    if(fw_batch_busy(&fwc.batch))
+        return;
+
     zero_cmd_buffers();
 
     /* There should be a rule to delete.  Get the current list of
@@ -384,7 +1064,7 @@ check_firewall_rules(fko_srv_options_t *opts)
         opts->fw_config->anchor
     );
 
-    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, 0);
+    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE, FW_CMD_TIMEOUT);
 
     if(!EXTCMD_IS_SUCCESS(res))
     {
@@ -492,8 +1172,8 @@ check_firewall_rules(fko_srv_options_t *opts)
 
             /* Track the minimum future rule expire time.
             */
-            if(rule_exp > now)
-                min_exp = (min_exp < rule_exp) ? min_exp : rule_exp;
+            if(min_exp == 0 || rule_exp < min_exp)
+                min_exp = rule_exp;
         }
 
         /* Push our tracking index forward beyond (just processed) _exp_
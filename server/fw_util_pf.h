@@ -43,6 +43,15 @@
 #define PF_LIST_ALL_RULES_ARGS        "-s rules 2>&1"  /* to check for fwknop anchor */
 #define PF_DEL_ALL_ANCHOR_RULES       "-a %s -F all 2>&1"
 
+/* pf table mode (PF_USE_TABLES).  Each protocol/port has its own table of
+ * client addresses, referenced by one fixed rule in the anchor.
+*/
+#define PF_TABLE_NAME                 "fwknop_%u_%u"
+#define PF_TABLE_RULE_ARGS            "pass in quick proto %u from <" PF_TABLE_NAME "> to any port %u keep state"
+#define PF_TABLE_ARGS                 "-a %s -t " PF_TABLE_NAME " -T %s"
+#define PF_LIST_ANCHOR_TABLES_ARGS    "-a %s -s Tables 2>&1"
+#define PF_SHOW_TABLE_ARGS            "-a %s -t %s -T show 2>&1"
+
 #endif /* FW_UTIL_PF_H */
 
 /***EOF***/
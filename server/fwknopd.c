@@ -39,6 +39,10 @@
 #include "sig_handler.h"
 #include "replay_cache.h"
 #include "tcp_server.h"
+#include "gpg_pool.h"
+#include "metrics.h"
+#include "src_limit.h"
+#include "admission.h"
 
 /* Prototypes
 */
@@ -237,6 +241,11 @@ main(int argc, char **argv)
             log_msg(LOG_INFO, "Re-starting %s", MY_NAME);
         }
 
+        /* Now that we are where we will stay, hand logging over to the
+         * log writer.
+        */
+        start_log_writer();
+
         if(opts.verbose > 1 && opts.foreground)
         {
             dump_config(&opts);
@@ -275,9 +284,29 @@ main(int argc, char **argv)
         */
         fw_initialize(&opts);
 
-        /* If the TCP server option was set, fire it up here.
+        /* Start the GPG decryption workers (if any access stanza uses
+         * GPG).  They are stopped again below whenever capture ends, so a
+         * SIGHUP gives us fresh workers with the new access.conf data.
         */
-        if(strncasecmp(opts.config[CONF_ENABLE_TCP_SERVER], "Y", 1) == 0)
+        gpg_pool_init(&opts);
+
+        /* Set the per-source packet limits.
+        */
+        src_limit_init(&opts);
+
+        /* Set up the admission queue for incoming SPA packets.
+        */
+        admit_init(&opts);
+
+        /* Start serving metrics (if so configured).
+        */
+        metrics_init(&opts);
+
+        /* If the TCP server option was set, fire it up here (but not when
+         * we are just replaying a capture file).
+        */
+        if(strncasecmp(opts.config[CONF_ENABLE_TCP_SERVER], "Y", 1) == 0
+          && opts.pcap_file[0] == '\0')
         {
             if(atoi(opts.config[CONF_TCPSERV_PORT]) <= 0
               || atoi(opts.config[CONF_TCPSERV_PORT]) >  65535)
@@ -296,6 +325,10 @@ main(int argc, char **argv)
         */
         pcap_capture(&opts);
 
+        gpg_pool_shutdown(&opts);
+        metrics_shutdown();
+        admit_shutdown();
+
         if(got_signal) {
             last_sig   = got_signal;
             got_signal = 0;
@@ -304,8 +337,7 @@ main(int argc, char **argv)
             {
                 log_msg(LOG_WARNING, "Got SIGHUP.  Re-reading configs.");
                 free_configs(&opts);
-                kill(opts.tcp_server_pid, SIGTERM);
-                usleep(1000000);
+                stop_tcp_server();
                 got_sighup = 0;
             }
             else if(got_sigint)
@@ -327,6 +359,12 @@ main(int argc, char **argv)
                 break;
             }
         }
+        else if (opts.pcap_file[0] != '\0')
+        {
+            log_msg(LOG_INFO, "Finished replaying '%s'.  Exiting...",
+                opts.pcap_file);
+            break;
+        }
         else if (opts.packet_ctr_limit > 0
             && opts.packet_ctr >= opts.packet_ctr_limit)
         {
@@ -345,21 +383,12 @@ main(int argc, char **argv)
 
     log_msg(LOG_INFO, "Shutting Down fwknopd.");
 
-    /* Kill the TCP server (if we have one running).
+    /* Shut down the TCP server (if we have one running).
     */
-    if(opts.tcp_server_pid > 0)
+    if(tcp_server_active())
     {
-        log_msg(LOG_INFO, "Killing the TCP server (pid=%i)",
-            opts.tcp_server_pid);
-
-        kill(opts.tcp_server_pid, SIGTERM);
-
-        /* --DSS XXX: This seems to be necessary if the tcp server
-         *            was restarted by this program.  We need to
-         *            investigate and fix this. For now, this works
-         *            (it is kludgy, but does no harm afaik).
-        */
-        kill(opts.tcp_server_pid, SIGKILL);
+        log_msg(LOG_INFO, "Stopping the TCP server.");
+        stop_tcp_server();
     }
 
     /* Other cleanup.
@@ -41,6 +41,10 @@
   #include <sys/stat.h>
 #endif
 
+#if HAVE_SYS_TIME_H
+  #include <sys/time.h>
+#endif
+
 #if HAVE_LIBPCAP
   #include <pcap.h>
 #endif
@@ -76,6 +80,7 @@
 /* More Conf defaults
 */
 #define DEF_PID_FILENAME                MY_NAME".pid"
+#define DEF_METRICS_SOCKET_FILENAME     MY_NAME".metrics"
 #if USE_FILE_CACHE
   #define DEF_DIGEST_CACHE_FILENAME       "digest.cache"
 #else
@@ -84,6 +89,7 @@
 
 #define DEF_INTERFACE                   "eth0"
 #define DEF_ENABLE_PCAP_PROMISC         "N"
+#define DEF_ENABLE_PCAP_AUTO_FILTER     "N"
 #define DEF_PCAP_FILTER                 "udp port 62201"
 #define DEF_ENABLE_SPA_PACKET_AGING     "Y"
 #define DEF_MAX_SPA_PACKET_AGE          "120"
@@ -93,10 +99,30 @@
 #define DEF_ENABLE_SPA_OVER_HTTP        "N"
 #define DEF_ENABLE_TCP_SERVER           "N"
 #define DEF_TCPSERV_PORT                "62201"
+#define DEF_TCPSERV_READ_TIMEOUT        "1000"
+#define DEF_TCPSERV_MAX_CONN            "4096"
+#define DEF_ENABLE_METRICS_SOCKET       "N"
 #define DEF_SYSLOG_IDENTITY             MY_NAME
 #define DEF_SYSLOG_FACILITY             "LOG_DAEMON"
+#define DEF_ENABLE_ASYNC_LOGGING        "Y"
+#define DEF_LOG_RATE_LIMIT              "5"
+#define DEF_LOG_RATE_BURST              "20"
+#define DEF_FW_BATCH_WINDOW             "5"
+#define DEF_CMD_EXEC_TIMEOUT            "15"
+#define DEF_CMD_EXEC_QUEUE_LIMIT        "16"
+#define DEF_GPG_WORKERS                 "2"
+#define DEF_GPG_QUEUE_LIMIT             "32"
+#define DEF_GPG_QUEUE_DROP              "OLDEST"
+#define DEF_GPG_JOB_TIMEOUT             "10"
+#define DEF_SRC_RATE_LIMIT              "0"
+#define DEF_SRC_RATE_BURST              "20"
+#define DEF_SRC_FAIL_LIMIT              "0"
+#define DEF_SRC_BLOCK_TIME              "60"
+#define DEF_ADMIT_QUEUE_LIMIT           "256"
+#define DEF_ADMIT_MAX_DELAY             "500"
 
 #define DEF_FW_ACCESS_TIMEOUT           30
+#define DEF_CMD_EXEC_MAX_RUNNING        1
 
 /* Iptables-specific defines
 */
@@ -130,6 +156,7 @@
 
   #define DEF_PF_ANCHOR_NAME "fwknop"
   #define DEF_PF_EXPIRE_INTERVAL "30"
+  #define DEF_PF_USE_TABLES "N"
 
 #elif FIREWALL_IPF
 
@@ -162,18 +189,40 @@ enum {
     CONF_PCAP_INTF,
     CONF_ENABLE_PCAP_PROMISC,
     CONF_PCAP_FILTER,
+    CONF_ENABLE_PCAP_AUTO_FILTER,
     CONF_MAX_SNIFF_BYTES,
     CONF_ENABLE_SPA_PACKET_AGING,
     CONF_MAX_SPA_PACKET_AGE,
     CONF_ENABLE_DIGEST_PERSISTENCE,
     CONF_CMD_EXEC_TIMEOUT,
+    CONF_CMD_EXEC_QUEUE_LIMIT,
+    CONF_GPG_WORKERS,
+    CONF_GPG_QUEUE_LIMIT,
+    CONF_GPG_QUEUE_DROP,
+    CONF_GPG_JOB_TIMEOUT,
+    CONF_SRC_RATE_LIMIT,
+    CONF_SRC_RATE_BURST,
+    CONF_SRC_FAIL_LIMIT,
+    CONF_SRC_BLOCK_TIME,
+    CONF_SRC_BLOCK_CMD,
+    CONF_ADMIT_QUEUE_LIMIT,
+    CONF_ADMIT_MAX_DELAY,
     //CONF_BLACKLIST,
     CONF_ENABLE_SPA_OVER_HTTP,
     CONF_ENABLE_TCP_SERVER,
     CONF_TCPSERV_PORT,
+    CONF_TCPSERV_READ_TIMEOUT,
+    CONF_TCPSERV_MAX_CONN,
+    CONF_ENABLE_METRICS_SOCKET,
+    CONF_METRICS_SOCKET,
     CONF_LOCALE,
     CONF_SYSLOG_IDENTITY,
     CONF_SYSLOG_FACILITY,
+    CONF_LOG_FILE,
+    CONF_ENABLE_ASYNC_LOGGING,
+    CONF_LOG_RATE_LIMIT,
+    CONF_LOG_RATE_BURST,
+    CONF_FW_BATCH_WINDOW,
     //CONF_IPT_EXEC_TRIES,
     //CONF_ENABLE_EXTERNAL_CMDS,
     //CONF_EXTERNAL_CMD_OPEN,
@@ -205,6 +254,7 @@ enum {
 #elif FIREWALL_PF
     CONF_PF_ANCHOR_NAME,
     CONF_PF_EXPIRE_INTERVAL,
+    CONF_PF_USE_TABLES,
 #elif FIREWALL_IPF
     /* --DSS Place-holder */
 #endif /* FIREWALL type */
@@ -267,6 +317,7 @@ typedef struct acc_stanza
     unsigned char       enable_cmd_exec;
     char                *cmd_exec_user;
     uid_t               cmd_exec_uid;
+    int                 cmd_exec_max_running;
     char                *require_username;
     unsigned char       require_source_address;
     char                *gpg_home_dir;
@@ -276,18 +327,42 @@ typedef struct acc_stanza
     unsigned char       gpg_ignore_sig_error;
     char                *gpg_remote_id;
     acc_string_list_t   *gpg_remote_id_list;
+    fko_gpg_cache_t     gpg_cache;
+    unsigned long       metric_packets;
+    unsigned long       metric_accepted;
     struct acc_stanza   *next;
 } acc_stanza_t;
 
 
 /* Firewall-related data and types. */
 
+/* Queue of firewall commands waiting to be applied in one batch by a
+ * forked executor (see fw_util.c).  The executor reports the entries it
+ * could not apply back over result_fd, and they are collected in failed.
+*/
+struct fw_batch {
+    char           *buf;
+    size_t          len;
+    size_t          size;
+    int             entries;
+    struct timeval  started;
+    pid_t           exec_pid;
+    int             result_fd;
+    char           *exec_buf;
+    size_t          exec_size;
+    char           *failed;
+    size_t          failed_len;
+    size_t          failed_size;
+    int             done;
+};
+
 #if FIREWALL_IPTABLES
   /* --DSS XXX: These are arbitrary. We should determine appropriate values.
   */
   #define MAX_TABLE_NAME_LEN      64
   #define MAX_CHAIN_NAME_LEN      64
   #define MAX_TARGET_NAME_LEN     64
+  #define MAX_IPT_RULE_SPEC_LEN   256
 
   /* Fwknop custom chain types
   */
@@ -301,6 +376,35 @@ typedef struct acc_stanza
       NUM_FWKNOP_ACCESS_TYPES  /* Leave this entry last */
   };
 
+  /* An access grant currently instantiated in one of the fwknop chains.
+   * A grant is identified by its chain and match fields (the expire time
+   * is not part of the key) so a repeated request for the same access
+   * refreshes the existing grant instead of adding another rule.  With
+   * batching, pending tracks a grant whose rule has not been applied (or
+   * removed) yet.
+  */
+  enum {
+      IPT_GRANT_APPLIED,
+      IPT_GRANT_QUEUED,
+      IPT_GRANT_APPLYING,
+      IPT_GRANT_DEL_QUEUED,
+      IPT_GRANT_DELETING
+  };
+
+  struct ipt_grant {
+      unsigned int        proto;
+      unsigned int        port;
+      char                ip[MAX_IP_STR_LEN];
+      char                nat_ip[MAX_IP_STR_LEN];
+      unsigned int        nat_port;
+      time_t              expires;
+      char                rule_spec[MAX_IPT_RULE_SPEC_LEN];
+      int                 pending;
+      const char         *label;
+      const char         *action;
+      struct ipt_grant   *next;
+  };
+
   /* Structure to define an fwknop firewall chain configuration.
   */
   struct fw_chain {
@@ -314,6 +418,8 @@ typedef struct acc_stanza
       int     rule_pos;
       int     active_rules;
       time_t  next_expire;
+      int     jump_ok;
+      struct ipt_grant *grants;
   };
 
   /* Based on the fw_chain fields (not counting type)
@@ -323,6 +429,11 @@ typedef struct acc_stanza
   struct fw_config {
       struct fw_chain chain[NUM_FWKNOP_ACCESS_TYPES];
       char            fw_command[MAX_PATH_LEN];
+      char            fw_restore_command[MAX_PATH_LEN];
+      char            fw_save_command[MAX_PATH_LEN];
+      int             batch_window;
+      struct fw_batch batch;
+      time_t          last_audit;
   };
 
 #elif FIREWALL_IPFW
@@ -336,26 +447,86 @@ typedef struct acc_stanza
       unsigned short    expire_set_num;
       unsigned short    purge_interval;
       unsigned char    *rule_map;
+      time_t           *rule_expire;
+      unsigned short   *free_list;
+      unsigned short    free_count;
       time_t            next_expire;
       time_t            last_purge;
       char              fw_command[MAX_PATH_LEN];
+      int               batch_window;
+      struct fw_batch   batch;
   };
 
 #elif FIREWALL_PF
 
   #define MAX_PF_ANCHOR_LEN 64
 
+  /* Access granted via a pf table (PF_USE_TABLES mode).  With batching,
+   * pending tracks an expired grant whose address has not been removed
+   * from its table yet.
+  */
+  enum {
+      PF_GRANT_ACTIVE,
+      PF_GRANT_DEL_QUEUED,
+      PF_GRANT_DELETING
+  };
+
+  struct pf_grant {
+      unsigned int      proto;
+      unsigned int      port;
+      char              ip[MAX_IP_STR_LEN];
+      time_t            expires;
+      int               pending;
+      struct pf_grant  *next;
+  };
+
   struct fw_config {
       unsigned short    active_rules;
       time_t            next_expire;
+      int               use_tables;
+      struct pf_grant  *grants;
+      acc_port_list_t  *table_ports;
       char              anchor[MAX_PF_ANCHOR_LEN];
       char              fw_command[MAX_PATH_LEN];
+      int               batch_window;
+      struct fw_batch   batch;
   };
 
 #elif FIREWALL_IPF
 
     /* --DSS Place-holder */
 
+#elif FIREWALL_MEM
+
+  #define MEM_RULE_HASH_SIZE 1024
+
+  /* A rule in the in-memory (dry-run) firewall.
+  */
+  struct mem_rule {
+      unsigned int      proto;
+      unsigned int      port;
+      char              ip[MAX_IP_STR_LEN];
+      char              nat_ip[MAX_IP_STR_LEN];
+      unsigned int      nat_port;
+      time_t            expires;
+      struct mem_rule  *next;
+  };
+
+  /* The rule table (hashed on source ip, proto and port) and the counters
+   * we keep for benchmarking.
+  */
+  struct fw_config {
+      struct mem_rule  *rules[MEM_RULE_HASH_SIZE];
+      unsigned int      active_rules;
+      unsigned int      peak_rules;
+      time_t            next_expire;
+      unsigned long     requests;
+      unsigned long     rules_added;
+      unsigned long     rules_refreshed;
+      unsigned long     rules_expired;
+      char              fw_command[MAX_PATH_LEN];
+  };
+
 #endif /* FIREWALL type */
 
 /* SPA Packet info struct.
@@ -408,7 +579,6 @@ typedef struct fko_srv_options
     unsigned char   verbose;            /* Verbose mode flag */
 
     int             data_link_offset;
-    int             tcp_server_pid;
     int             lock_fd;
 
 #if USE_FILE_CACHE
@@ -423,6 +593,11 @@ typedef struct fko_srv_options
     unsigned int    packet_ctr_limit;
     unsigned int    packet_ctr;  /* counts packets with >0 payload bytes */
 
+    /* Set from --pcap-file to replay a capture file instead of sniffing.
+    */
+    char            pcap_file[MAX_PATH_LEN];
+    unsigned char   replay_realtime;    /* Honor packet timestamps */
+
     /* This array holds all of the config file entry values as strings
      * indexed by their tag name.
     */
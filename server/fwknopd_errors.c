@@ -90,6 +90,18 @@ fwknopd_errstr(int err_code)
         case SPA_MSG_NOT_SUPPORTED:
             return("Unsupported SPA message operation");
 
+        case SPA_MSG_GPG_QUEUE_FULL:
+            return("GPG decryption queue is full");
+
+        case SPA_MSG_SOURCE_BLOCKED:
+            return("Source is blocked for sending too many (bad) SPA packets");
+
+        case SPA_MSG_RATE_LIMITED:
+            return("Dropped: source is over its SPA packet rate limit");
+
+        case SPA_MSG_OVERLOAD:
+            return("Dropped by admission control while overloaded");
+
         case SPA_MSG_ERROR:
             return("General SPA message processing error");
 
@@ -47,6 +47,10 @@ enum {
     SPA_MSG_ACCESS_DENIED,
     SPA_MSG_COMMAND_ERROR,
     SPA_MSG_NOT_SUPPORTED,
+    SPA_MSG_GPG_QUEUE_FULL,
+    SPA_MSG_SOURCE_BLOCKED,
+    SPA_MSG_RATE_LIMITED,
+    SPA_MSG_OVERLOAD,
     SPA_MSG_ERROR
 };
 
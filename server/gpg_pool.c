@@ -0,0 +1,641 @@
+/*
+ *****************************************************************************
+ *
+ * File:    gpg_pool.c
+ *
+ * Purpose: A bounded pool of worker processes that decrypt GPG-encrypted
+ *          SPA data, so slow GPG packets cannot starve Rijndael ones.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "netinet_common.h"
+#include "gpg_pool.h"
+#include "incoming_spa.h"
+#include "access.h"
+#include "tcp_server.h"
+#include "metrics.h"
+#include "log_msg.h"
+#include "src_limit.h"
+#include "utils.h"
+#include "fwknopd_errors.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#if HAVE_SYS_WAIT_H
+  #include <sys/wait.h>
+#endif
+
+/* Sizes of the decoded SPA fields passed back from a worker.  These match
+ * (or exceed) the limits libfko puts on the fields it decodes.
+*/
+#define GPG_RES_USERNAME_LEN    65
+#define GPG_RES_VERSION_LEN     16
+#define GPG_RES_MESSAGE_LEN     257
+#define GPG_RES_NAT_ACCESS_LEN  129
+#define GPG_RES_SERVER_AUTH_LEN 65
+#define GPG_RES_DIGEST_LEN      128
+
+/* What a worker sends back for each packet: the result of the decryption
+ * and, if it succeeded, the decoded fields the main process needs to
+ * carry on.  Empty nat_access/server_auth strings mean "not set".
+*/
+typedef struct gpg_result {
+    int             res;
+    unsigned int    decrypt_usec;   /* Time taken to decrypt the packet */
+    time_t          timestamp;
+    short           message_type;
+    unsigned int    client_timeout;
+    char            username[GPG_RES_USERNAME_LEN];
+    char            version[GPG_RES_VERSION_LEN];
+    char            spa_message[GPG_RES_MESSAGE_LEN];
+    char            nat_access[GPG_RES_NAT_ACCESS_LEN];
+    char            server_auth[GPG_RES_SERVER_AUTH_LEN];
+    char            digest[GPG_RES_DIGEST_LEN];
+} gpg_result_t;
+
+/* A worker process and the packet it is working on (if busy).  Each
+ * worker builds its own gpgme contexts (see fko_gpg_cache_new()) the
+ * first time it sees a packet for a given access stanza.
+*/
+typedef struct gpg_worker {
+    pid_t           pid;
+    int             fd;
+    int             busy;
+    time_t          deadline;       /* When the job has run too long */
+    time_t          next_start;     /* Earliest restart after a failure */
+    spa_pkt_info_t  job;
+} gpg_worker_t;
+
+static gpg_worker_t    *workers         = NULL;
+static int              num_workers     = 0;
+static int              job_timeout     = 0;
+
+/* GPG packets waiting for a free worker (a ring buffer).
+*/
+static spa_pkt_info_t  *job_queue       = NULL;
+static int              queue_limit     = 0;
+static int              queue_head      = 0;
+static int              queue_len       = 0;
+static int              drop_oldest     = 1;
+static unsigned long    jobs_dropped    = 0;
+
+/* Copy src into a fixed-size result field.  Returns 0 if it did not fit.
+*/
+static int
+copy_field(char *dst, size_t dst_size, const char *src)
+{
+    if(src == NULL)
+    {
+        *dst = '\0';
+        return(1);
+    }
+
+    return(strlcpy(dst, src, dst_size) < dst_size);
+}
+
+/* Pull what the main process needs out of a decrypted context.
+*/
+static int
+fill_result(fko_ctx_t ctx, gpg_result_t *result)
+{
+    spa_data_t  spadat;
+    char       *digest;
+    int         res;
+
+    res = get_spa_data_fields(ctx, &spadat);
+    if(res == FKO_SUCCESS)
+        res = fko_get_spa_digest(ctx, &digest);
+
+    if(res != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "Unexpected error pulling SPA data from the context: %s",
+            fko_errstr(res));
+        return(SPA_MSG_ERROR);
+    }
+
+    result->timestamp       = spadat.timestamp;
+    result->message_type    = spadat.message_type;
+    result->client_timeout  = spadat.client_timeout;
+
+    if(!copy_field(result->username, sizeof(result->username), spadat.username)
+      || !copy_field(result->version, sizeof(result->version), spadat.version)
+      || !copy_field(result->spa_message, sizeof(result->spa_message), spadat.spa_message)
+      || !copy_field(result->nat_access, sizeof(result->nat_access), spadat.nat_access)
+      || !copy_field(result->server_auth, sizeof(result->server_auth), spadat.server_auth)
+      || !copy_field(result->digest, sizeof(result->digest), digest))
+    {
+        log_msg(LOG_WARNING, "Decrypted GPG SPA data has an oversized field.");
+        return(SPA_MSG_BAD_DATA);
+    }
+
+    return(FKO_SUCCESS);
+}
+
+/* The worker process: decrypt each packet we are sent and send back the
+ * result, until the main process closes its end of the socket.
+*/
+static void
+worker_main(fko_srv_options_t *opts, int fd)
+{
+    spa_pkt_info_t  job;
+    gpg_result_t    result;
+    acc_stanza_t   *acc;
+    fko_ctx_t       ctx;
+    ssize_t         n;
+    struct timeval  start, end;
+
+    while(1)
+    {
+        n = recv(fd, &job, sizeof(job), 0);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n != sizeof(job))
+            break;
+
+        memset(&result, 0x0, sizeof(result));
+
+        ctx = NULL;
+        acc = acc_check_source(opts, job.packet_src_ip);
+
+        if(acc == NULL)
+            result.res = SPA_MSG_ACCESS_DENIED;
+        else
+        {
+            gettimeofday(&start, NULL);
+
+            result.res = decrypt_spa_data(opts, acc, (char *)job.packet_data,
+                FKO_ENCRYPTION_GPG, &ctx);
+
+            gettimeofday(&end, NULL);
+
+            result.decrypt_usec = (end.tv_sec - start.tv_sec) * 1000000
+                + (end.tv_usec - start.tv_usec);
+
+            if(result.res == FKO_SUCCESS)
+                result.res = fill_result(ctx, &result);
+        }
+
+        if(ctx != NULL)
+            fko_destroy(ctx);
+
+        while((n = send(fd, &result, sizeof(result), 0)) < 0 && errno == EINTR)
+            ;
+
+        if(n != sizeof(result))
+            break;
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+/* Fork a worker into the given slot.  Returns 0 on success.
+*/
+static int
+start_worker(fko_srv_options_t *opts, gpg_worker_t *w)
+{
+    int     sv[2], i;
+
+    w->pid          = 0;
+    w->fd           = -1;
+    w->busy         = 0;
+    w->next_start   = time(NULL) + 1;
+
+    if(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) < 0)
+    {
+        log_msg(LOG_ERR, "Unable to create GPG worker socket: %s",
+            strerror(errno));
+        return(-1);
+    }
+
+    w->pid = fork();
+
+    if(w->pid < 0)
+    {
+        log_msg(LOG_ERR, "Unable to fork GPG worker: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        w->pid = 0;
+        return(-1);
+    }
+
+    if(w->pid == 0)
+    {
+        /* We are the worker.  Signals that tell the main process to stop
+         * or re-read its config should simply end us.
+        */
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        close(sv[0]);
+
+        for(i=0; i<num_workers; i++)
+            if(workers[i].fd >= 0)
+                close(workers[i].fd);
+
+        /* Nor do we want our copies of the TCP server and metrics sockets
+         * keeping their client connections open.
+        */
+        stop_tcp_server();
+        metrics_close_fds();
+
+        worker_main(opts, sv[1]);
+    }
+
+    close(sv[1]);
+
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    w->fd = sv[0];
+
+    return(0);
+}
+
+/* Close our end of a worker's socket and reap it.
+*/
+static void
+stop_worker(gpg_worker_t *w)
+{
+    if(w->fd >= 0)
+        close(w->fd);
+
+    if(w->pid > 0)
+    {
+        kill(w->pid, SIGTERM);
+
+        while(waitpid(w->pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+    }
+
+    w->pid  = 0;
+    w->fd   = -1;
+    w->busy = 0;
+}
+
+/* Hand queued packets to idle workers.
+*/
+static void
+dispatch_jobs(void)
+{
+    gpg_worker_t   *w;
+    int             i;
+
+    for(i=0; i<num_workers && queue_len > 0; i++)
+    {
+        w = &(workers[i]);
+
+        if(w->fd < 0 || w->busy)
+            continue;
+
+        memcpy(&(w->job), &(job_queue[queue_head]), sizeof(w->job));
+
+        if(send(w->fd, &(w->job), sizeof(w->job), 0) != sizeof(w->job))
+            continue;
+
+        w->busy     = 1;
+        w->deadline = time(NULL) + job_timeout;
+        queue_head  = (queue_head + 1) % queue_limit;
+        queue_len--;
+    }
+}
+
+/* Finish processing a packet a worker has decrypted.
+*/
+static void
+handle_result(fko_srv_options_t *opts, gpg_worker_t *w, gpg_result_t *result)
+{
+    spa_data_t      spadat;
+    acc_stanza_t   *acc = NULL;
+    int             res = result->res;
+
+    memset(&spadat, 0x0, sizeof(spadat));
+
+    /* The rest of the stages are timed from here.
+    */
+    metrics_observe(METRIC_STAGE_DECRYPT_GPG, result->decrypt_usec);
+    metrics_packet_start();
+    log_set_source(w->job.packet_src_ip);
+
+    inet_ntop(AF_INET, &(w->job.packet_src_ip),
+        spadat.pkt_source_ip, sizeof(spadat.pkt_source_ip));
+
+    if(res == FKO_SUCCESS)
+    {
+        /* The replay cache records the packet addresses and ports from
+         * opts->spa_pkt, so put this packet's header back in place (the
+         * main loop is between packets when we get here).
+        */
+        opts->spa_pkt.packet_proto      = w->job.packet_proto;
+        opts->spa_pkt.packet_src_ip     = w->job.packet_src_ip;
+        opts->spa_pkt.packet_dst_ip     = w->job.packet_dst_ip;
+        opts->spa_pkt.packet_src_port   = w->job.packet_src_port;
+        opts->spa_pkt.packet_dst_port   = w->job.packet_dst_port;
+
+        result->username[sizeof(result->username)-1]         = '\0';
+        result->version[sizeof(result->version)-1]           = '\0';
+        result->spa_message[sizeof(result->spa_message)-1]   = '\0';
+        result->nat_access[sizeof(result->nat_access)-1]     = '\0';
+        result->server_auth[sizeof(result->server_auth)-1]   = '\0';
+        result->digest[sizeof(result->digest)-1]             = '\0';
+
+        spadat.username         = result->username;
+        spadat.timestamp        = result->timestamp;
+        spadat.version          = result->version;
+        spadat.message_type     = result->message_type;
+        spadat.spa_message      = result->spa_message;
+        spadat.nat_access       = (result->nat_access[0] != '\0')
+                                    ? result->nat_access : NULL;
+        spadat.server_auth      = (result->server_auth[0] != '\0')
+                                    ? result->server_auth : NULL;
+        spadat.client_timeout   = result->client_timeout;
+
+        acc = acc_check_source(opts, w->job.packet_src_ip);
+
+        if(acc == NULL)
+            res = SPA_MSG_ACCESS_DENIED;
+        else
+            res = process_decrypted_spa(opts, acc, &spadat, result->digest);
+
+        if(res == SPA_MSG_SUCCESS)
+            src_limit_clear(w->job.packet_src_ip);
+    }
+    else
+    {
+        acc = acc_check_source(opts, w->job.packet_src_ip);
+        src_limit_fail(opts, w->job.packet_src_ip);
+    }
+
+    metrics_spa_result(acc, res);
+
+    if(res != 0 && opts->verbose > 1)
+        log_msg(LOG_INFO, "GPG SPA packet from %s returned error %i: '%s'",
+            spadat.pkt_source_ip, res, get_errstr(res));
+
+    log_set_source(0);
+}
+
+/* Start the GPG worker pool if it is configured and any access stanza
+ * uses GPG.  Returns the number of workers.
+*/
+int
+gpg_pool_init(fko_srv_options_t *opts)
+{
+    acc_stanza_t   *acc;
+    int             want, i, started = 0;
+
+    want = atoi(opts->config[CONF_GPG_WORKERS]);
+
+    /* Replaying a capture file processes (and times) each packet in
+     * order, so GPG packets are decrypted inline there.
+    */
+    if(want <= 0 || opts->pcap_file[0] != '\0')
+        return(0);
+
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+        if(acc->gpg_decrypt_pw != NULL)
+            break;
+
+    if(acc == NULL)
+        return(0);
+
+    if(want > MAX_GPG_WORKERS)
+        want = MAX_GPG_WORKERS;
+
+    queue_limit = atoi(opts->config[CONF_GPG_QUEUE_LIMIT]);
+    if(queue_limit < 1)
+        queue_limit = 1;
+
+    drop_oldest = strncasecmp(opts->config[CONF_GPG_QUEUE_DROP], "NEWEST", 6) != 0;
+
+    job_timeout = atoi(opts->config[CONF_GPG_JOB_TIMEOUT]);
+    if(job_timeout < 0)
+        job_timeout = 0;
+
+    workers   = calloc(want, sizeof(gpg_worker_t));
+    job_queue = calloc(queue_limit, sizeof(spa_pkt_info_t));
+
+    if(workers == NULL || job_queue == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error in gpg_pool_init.");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i=0; i<want; i++)
+        workers[i].fd = -1;
+
+    queue_head      = 0;
+    queue_len       = 0;
+    jobs_dropped    = 0;
+
+    for(i=0; i<want; i++)
+    {
+        num_workers = i;
+        if(start_worker(opts, &(workers[i])) == 0)
+            started++;
+    }
+
+    num_workers = want;
+
+    log_msg(LOG_INFO, "Started %i GPG decryption worker(s).", started);
+
+    return(num_workers);
+}
+
+/* True if GPG packets should go to the pool rather than be decrypted
+ * inline.
+*/
+int
+gpg_pool_active(void)
+{
+    int i;
+
+    for(i=0; i<num_workers; i++)
+        if(workers[i].fd >= 0)
+            return(1);
+
+    return(0);
+}
+
+/* Queue a GPG packet for decryption.  If the queue is full, either the
+ * oldest waiting packet or this one is dropped (per GPG_QUEUE_DROP).
+*/
+int
+gpg_pool_submit(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
+{
+    char    src_ip[MAX_IP_STR_LEN];
+
+    if(queue_len == queue_limit)
+    {
+        jobs_dropped++;
+
+        if(drop_oldest)
+            inet_ntop(AF_INET, &(job_queue[queue_head].packet_src_ip),
+                src_ip, sizeof(src_ip));
+        else
+            inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
+                src_ip, sizeof(src_ip));
+
+        log_msg(LOG_WARNING,
+            "GPG queue is full (%i packets), dropping SPA packet from %s.",
+            queue_limit, src_ip);
+
+        if(!drop_oldest)
+            return(SPA_MSG_GPG_QUEUE_FULL);
+
+        metrics_spa_result(acc_check_source(opts,
+            job_queue[queue_head].packet_src_ip), SPA_MSG_GPG_QUEUE_FULL);
+
+        queue_head = (queue_head + 1) % queue_limit;
+        queue_len--;
+    }
+
+    memcpy(&(job_queue[(queue_head + queue_len) % queue_limit]), spa_pkt,
+        sizeof(spa_pkt_info_t));
+    queue_len++;
+
+    dispatch_jobs();
+
+    return(SPA_MSG_SUCCESS);
+}
+
+/* Called from the main loop: collect finished packets, replace workers
+ * that died or are stuck on a packet, and hand out queued packets.
+*/
+void
+gpg_pool_service(fko_srv_options_t *opts)
+{
+    gpg_worker_t   *w;
+    gpg_result_t    result;
+    ssize_t         n;
+    int             i, status;
+    char            src_ip[MAX_IP_STR_LEN];
+
+    for(i=0; i<num_workers; i++)
+    {
+        w = &(workers[i]);
+
+        if(w->busy)
+        {
+            n = recv(w->fd, &result, sizeof(result), 0);
+
+            if(n == sizeof(result))
+            {
+                w->busy = 0;
+                handle_result(opts, w, &result);
+            }
+            else if(job_timeout > 0 && time(NULL) >= w->deadline)
+            {
+                /* GPG may never come back from some inputs, and the worker
+                 * would be lost to us for good.
+                */
+                inet_ntop(AF_INET, &(w->job.packet_src_ip),
+                    src_ip, sizeof(src_ip));
+                log_msg(LOG_WARNING,
+                    "GPG worker (pid=%i) took over %i seconds on SPA packet from %s, restarting it.",
+                    w->pid, job_timeout, src_ip);
+
+                metrics_spa_result(acc_check_source(opts,
+                    w->job.packet_src_ip), SPA_MSG_ERROR);
+
+                kill(w->pid, SIGKILL);
+                stop_worker(w);
+            }
+        }
+
+        if(w->pid > 0 && waitpid(w->pid, &status, WNOHANG) == w->pid)
+        {
+            if(WIFSIGNALED(status))
+                log_msg(LOG_WARNING, "GPG worker (pid=%i) got signal: %i",
+                    w->pid, WTERMSIG(status));
+
+            if(w->busy)
+            {
+                inet_ntop(AF_INET, &(w->job.packet_src_ip),
+                    src_ip, sizeof(src_ip));
+                log_msg(LOG_WARNING,
+                    "GPG worker died while decrypting SPA packet from %s.",
+                    src_ip);
+
+                metrics_spa_result(acc_check_source(opts,
+                    w->job.packet_src_ip), SPA_MSG_ERROR);
+            }
+
+            w->pid = 0;
+            stop_worker(w);
+        }
+
+        if(w->pid == 0 && time(NULL) >= w->next_start)
+            start_worker(opts, w);
+    }
+
+    dispatch_jobs();
+}
+
+/* Let queued and in-flight packets finish (for a while), then stop the
+ * workers.
+*/
+void
+gpg_pool_shutdown(fko_srv_options_t *opts)
+{
+    time_t  deadline = time(NULL) + GPG_POOL_DRAIN_TIMEOUT;
+    int     i, busy;
+
+    if(num_workers == 0)
+        return;
+
+    while(time(NULL) < deadline)
+    {
+        gpg_pool_service(opts);
+
+        for(i=0, busy=0; i<num_workers; i++)
+            busy += workers[i].busy;
+
+        if(busy == 0 && queue_len == 0)
+            break;
+
+        usleep(10000);
+    }
+
+    for(i=0; i<num_workers; i++)
+        stop_worker(&(workers[i]));
+
+    if(queue_len > 0 || jobs_dropped > 0)
+        log_msg(LOG_WARNING,
+            "GPG worker pool stopped with %i packet(s) unprocessed; %lu dropped.",
+            queue_len, jobs_dropped);
+
+    free(workers);
+    free(job_queue);
+
+    workers     = NULL;
+    job_queue   = NULL;
+    num_workers = 0;
+    queue_len   = 0;
+}
+
+/***EOF***/
@@ -0,0 +1,49 @@
+/*
+ *****************************************************************************
+ *
+ * File:    gpg_pool.h
+ *
+ * Purpose: Header file for gpg_pool.c.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef GPG_POOL_H
+#define GPG_POOL_H
+
+/* Upper bound on GPG_WORKERS.
+*/
+#define MAX_GPG_WORKERS         32
+
+/* How long (in seconds) a shutdown waits for queued and in-flight GPG
+ * packets to finish.
+*/
+#define GPG_POOL_DRAIN_TIMEOUT  10
+
+/* Prototypes
+*/
+int gpg_pool_init(fko_srv_options_t *opts);
+int gpg_pool_active(void);
+int gpg_pool_submit(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt);
+void gpg_pool_service(fko_srv_options_t *opts);
+void gpg_pool_shutdown(fko_srv_options_t *opts);
+
+#endif  /* GPG_POOL_H */
+
+/***EOF***/
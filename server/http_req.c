@@ -0,0 +1,260 @@
+/*
+ *****************************************************************************
+ *
+ * File:    http_req.c
+ *
+ * Purpose: Incremental parser for SPA-over-HTTP requests.  It is fed the
+ *          request a piece at a time (as it arrives on a TCP connection,
+ *          or all at once from a captured packet), and pulls the SPA data
+ *          out of the request target without any intermediate copies.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "http_req.h"
+
+/* Parser states.
+*/
+enum {
+    HR_METHOD = 0,      /* Matching "GET " */
+    HR_TARGET,          /* First character of the request target */
+    HR_SCHEME,          /* Matching "http://" of an absolute (proxy) target */
+    HR_AUTHORITY,       /* Skipping the host[:port] of an absolute target */
+    HR_TOKEN,           /* The SPA data itself */
+    HR_REQ_LINE,        /* Rest of the request line */
+    HR_HDR_START,       /* Start of a header line (or the blank line) */
+    HR_HDR_NAME,        /* Matching "User-Agent:" */
+    HR_UA_VALUE,        /* Matching "Fwknop" at the start of its value */
+    HR_HDR_SKIP,        /* Rest of a header line we don't care about */
+    HR_END,             /* The CR of the blank line, want the LF */
+    HR_DONE,
+    HR_ERROR
+};
+
+static const char http_get[]    = "get ";
+static const char http_scheme[] = "http://";
+static const char http_ua[]     = "user-agent:";
+static const char http_fwknop[] = "fwknop";
+
+/* Does data look like the start of an HTTP GET request?  Returns 1 if so,
+ * 0 if not, and -1 if there is not enough of it to tell yet.
+*/
+int
+http_req_start(const char *data, const int len)
+{
+    int     i;
+
+    for(i=0; i<len && i<4; i++)
+        if(tolower((unsigned char)data[i]) != http_get[i])
+            return(0);
+
+    return(i == 4 ? 1 : -1);
+}
+
+void
+http_req_init(http_req_t *req, char *out, const int out_size)
+{
+    memset(req, 0x0, sizeof(http_req_t));
+
+    req->state      = HR_METHOD;
+    req->out        = out;
+    req->out_size   = out_size;
+}
+
+/* Add one character of the request target to the SPA token, translating
+ * the URL-safe base64 the fwknop client sends ('-' for '+' and '_' for
+ * '/') back as we go.
+*/
+static int
+add_token_char(http_req_t *req, unsigned char c)
+{
+    if(c == '-')
+        c = '+';
+    else if(c == '_')
+        c = '/';
+    else if(!(isalnum(c) || c == '/' || c == '+' || c == '='))
+        return(-1);
+
+    /* Leave room for the terminating NULL.
+    */
+    if(req->out_len >= req->out_size - 1)
+        return(-1);
+
+    req->out[req->out_len++] = c;
+
+    return(0);
+}
+
+/* Match c against the next character of a (lower case) literal.  Returns
+ * 1 when the literal is complete, 0 if it matched so far, -1 if not.
+*/
+static int
+match_literal(http_req_t *req, const char *lit, unsigned char c)
+{
+    if(tolower(c) != lit[req->pos])
+        return(-1);
+
+    if(lit[++req->pos] == '\0')
+    {
+        req->pos = 0;
+        return(1);
+    }
+
+    return(0);
+}
+
+/* Feed the next len bytes of the request to the parser.  The output buffer
+ * may be the very buffer the request is being read into, since the token
+ * never gets ahead of the input.  Returns HTTP_REQ_INCOMPLETE until the end
+ * of the request headers, then HTTP_REQ_DONE (or HTTP_REQ_ERROR as soon as
+ * the request cannot be SPA data).
+*/
+int
+http_req_feed(http_req_t *req, const char *data, const int len)
+{
+    int             i, m;
+    unsigned char   c;
+
+    for(i=0; i<len && req->state != HR_DONE && req->state != HR_ERROR; i++)
+    {
+        c = data[i];
+
+        if(++req->total > HTTP_REQ_MAX_LEN)
+        {
+            req->state = HR_ERROR;
+            break;
+        }
+
+        switch(req->state)
+        {
+            case HR_METHOD:
+                if((m = match_literal(req, http_get, c)) < 0)
+                    req->state = HR_ERROR;
+                else if(m > 0)
+                    req->state = HR_TARGET;
+                break;
+
+            case HR_TARGET:
+                if(c == '/')
+                    req->state = HR_TOKEN;
+                else if(match_literal(req, http_scheme, c) == 0)
+                    req->state = HR_SCHEME;
+                else
+                    req->state = HR_ERROR;
+                break;
+
+            case HR_SCHEME:
+                if((m = match_literal(req, http_scheme, c)) < 0)
+                    req->state = HR_ERROR;
+                else if(m > 0)
+                    req->state = HR_AUTHORITY;
+                break;
+
+            case HR_AUTHORITY:
+                if(c == '/')
+                    req->state = HR_TOKEN;
+                else if(isspace(c))
+                    req->state = HR_ERROR;
+                break;
+
+            case HR_TOKEN:
+                if(isspace(c))
+                {
+                    req->token_done = 1;
+                    req->out[req->out_len] = '\0';
+                    req->state = (c == '\n') ? HR_HDR_START : HR_REQ_LINE;
+                }
+                else if(add_token_char(req, c) < 0)
+                    req->state = HR_ERROR;
+                break;
+
+            case HR_REQ_LINE:
+            case HR_HDR_SKIP:
+                if(c == '\n')
+                    req->state = HR_HDR_START;
+                break;
+
+            case HR_HDR_START:
+                if(c == '\r')
+                    req->state = HR_END;
+                else if(c == '\n')
+                    req->state = HR_DONE;
+                else
+                {
+                    req->pos   = 0;
+                    req->state = HR_HDR_NAME;
+                    if(match_literal(req, http_ua, c) < 0)
+                        req->state = HR_HDR_SKIP;
+                }
+                break;
+
+            case HR_HDR_NAME:
+                if(c == '\n')
+                    req->state = HR_HDR_START;
+                else if((m = match_literal(req, http_ua, c)) < 0)
+                    req->state = HR_HDR_SKIP;
+                else if(m > 0)
+                    req->state = HR_UA_VALUE;
+                break;
+
+            case HR_UA_VALUE:
+                if(c == '\n')
+                    req->state = HR_HDR_START;
+                else if(req->pos == 0 && (c == ' ' || c == '\t'))
+                    break;
+                else if((m = match_literal(req, http_fwknop, c)) < 0)
+                {
+                    req->pos   = 0;
+                    req->state = HR_HDR_SKIP;
+                }
+                else if(m > 0)
+                {
+                    req->is_fwknop = 1;
+                    req->state = HR_HDR_SKIP;
+                }
+                break;
+
+            case HR_END:
+                req->state = (c == '\n') ? HR_DONE : HR_ERROR;
+                break;
+        }
+    }
+
+    if(req->state == HR_DONE)
+        return(HTTP_REQ_DONE);
+
+    if(req->state == HR_ERROR)
+        return(HTTP_REQ_ERROR);
+
+    return(HTTP_REQ_INCOMPLETE);
+}
+
+/* Have we seen enough of the request to hand its SPA data on?  That is
+ * a complete, non-empty token from a fwknop client, whether or not the
+ * rest of the headers made it.
+*/
+int
+http_req_has_spa(http_req_t *req)
+{
+    return(req->state != HR_ERROR && req->token_done
+        && req->is_fwknop && req->out_len > 0);
+}
+
+/***EOF***/
@@ -0,0 +1,68 @@
+/*
+ *****************************************************************************
+ *
+ * File:    http_req.h
+ *
+ * Purpose: Header file for http_req.c.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef HTTP_REQ_H
+#define HTTP_REQ_H
+
+/* Largest HTTP request (request line plus headers) we will look through
+ * for the SPA data.
+*/
+#define HTTP_REQ_MAX_LEN    8192
+
+/* Return values for http_req_feed().
+*/
+enum {
+    HTTP_REQ_INCOMPLETE = 0,    /* Need more data */
+    HTTP_REQ_DONE,              /* Got the end of the request headers */
+    HTTP_REQ_ERROR              /* Not an acceptable SPA request */
+};
+
+/* Incremental parser state for an SPA-over-HTTP request.  The SPA token
+ * from the request target is written to out (translated back from the
+ * URL-safe base64 the client sends) as the request is fed in.
+*/
+typedef struct http_req
+{
+    int             state;
+    int             pos;            /* Match position in the current literal */
+    int             total;          /* Bytes fed so far */
+    char           *out;
+    int             out_size;
+    int             out_len;        /* Length of the SPA token in out */
+    unsigned char   token_done;
+    unsigned char   is_fwknop;      /* Saw a "User-Agent: Fwknop..." header */
+} http_req_t;
+
+/* Function prototypes
+*/
+int http_req_start(const char *data, const int len);
+void http_req_init(http_req_t *req, char *out, const int out_size);
+int http_req_feed(http_req_t *req, const char *data, const int len);
+int http_req_has_spa(http_req_t *req);
+
+#endif /* HTTP_REQ_H */
+
+/***EOF***/
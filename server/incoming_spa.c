@@ -43,6 +43,10 @@
 #include "fw_util.h"
 #include "fwknopd_errors.h"
 #include "replay_cache.h"
+#include "gpg_pool.h"
+#include "http_req.h"
+#include "metrics.h"
+#include "src_limit.h"
 
 /* Validate and in some cases preprocess/reformat the SPA data.  Return an
  * error code value if there is any indication the data is not valid spa data.
@@ -55,6 +59,7 @@ preprocess_spa_data(fko_srv_options_t *opts, char *src_ip)
     char    *ndx = (char *)&(spa_pkt->packet_data);
     int      pkt_data_len = spa_pkt->packet_data_len;
     int      i;
+    http_req_t  req;
 
     /* At this point, we can reset the packet data length to 0.  This our
      * indicator to the rest of the program that we do not have a current
@@ -68,15 +73,21 @@ preprocess_spa_data(fko_srv_options_t *opts, char *src_ip)
         return(SPA_MSG_LEN_TOO_SMALL);
 
     /* Detect and parse out SPA data from an HTTP reqest. If the SPA data
-     * starts with "GET /" and the user agent starts with "Fwknop", then
-     * assume it is a SPA over HTTP request.
+     * is a GET request from a user agent that starts with "Fwknop", then
+     * assume it is a SPA over HTTP request.  The SPA data is pulled out of
+     * the request (and translated back from the URL-safe characters the
+     * client uses) in place.
     */
-    if(strncasecmp(ndx, "GET /", 5) == 0
-      && strstr(ndx, "User-Agent: Fwknop") != NULL)
+    if(http_req_start(ndx, pkt_data_len) == 1)
     {
+        http_req_init(&req, ndx, MAX_SPA_PACKET_LEN+1);
+        http_req_feed(&req, ndx, pkt_data_len);
+
+        if(! http_req_has_spa(&req))
+            return(SPA_MSG_NOT_SPA_DATA);
+
         /* This looks like an HTTP request, so let's see if we are
-         * configured to accept such request and if so, find the SPA
-         * data.
+         * configured to accept such request.
         */
         if(strncasecmp(opts->config[CONF_ENABLE_SPA_OVER_HTTP], "N", 1) == 0)
         {
@@ -85,29 +96,6 @@ preprocess_spa_data(fko_srv_options_t *opts, char *src_ip)
             );
             return(SPA_MSG_HTTP_NOT_ENABLED);
         }
-
-        /* Now extract, adjust (convert characters translated by the fwknop
-         * client), and reset the SPA message itself.
-        */
-        strlcpy((char *)spa_pkt->packet_data, ndx+5, pkt_data_len);
-
-        for(i=0; i<pkt_data_len; i++)
-        {
-            if(isspace(*ndx)) /* The first space marks the end of the req */
-            {
-                *ndx = '\0';
-                break;
-            }
-            else if(*ndx == '-') /* Convert '-' to '+' */
-                *ndx = '+';
-            else if(*ndx == '_') /* Convert '_' to '/' */
-                *ndx = '/';
-            /* Make sure it is a valid base64 char. */
-            else if(!(isalnum(*ndx) || *ndx == '/' || *ndx == '+' || *ndx == '='))
-                return(SPA_MSG_NOT_SPA_DATA);
-
-            ndx++;
-        }
     }
     else
     {
@@ -132,7 +120,7 @@ preprocess_spa_data(fko_srv_options_t *opts, char *src_ip)
 
 /* Popluate a spa_data struct from an initialized (and populated) FKO context.
 */
-static int
+int
 get_spa_data_fields(fko_ctx_t ctx, spa_data_t *spdat)
 {
     int res = FKO_SUCCESS;
@@ -172,65 +160,22 @@ get_spa_data_fields(fko_ctx_t ctx, spa_data_t *spdat)
     return(res);
 }
 
-/* Process the SPA packet data
+/* Create an FKO context (in *ctx) for the given SPA data and decrypt it
+ * with the key or GPG settings of the matching access stanza.  For GPG
+ * data this also enforces GPG_REMOTE_ID.  The caller destroys *ctx (if it
+ * was created) whatever the outcome.
 */
 int
-incoming_spa(fko_srv_options_t *opts)
+decrypt_spa_data(fko_srv_options_t *opts, acc_stanza_t *acc,
+    char *spa_data, int enc_type, fko_ctx_t *ctx)
 {
-    /* Always a good idea to initialize ctx to null if it will be used
-     * repeatedly (especially when using fko_new_with_data().
-    */
-    fko_ctx_t       ctx = NULL;
-
-    char            *spa_ip_demark, *gpg_id;
-    time_t          now_ts;
-    int             res, status, ts_diff, enc_type;
-
-    spa_pkt_info_t *spa_pkt = &(opts->spa_pkt);
-
-    /* This will hold our pertinent SPA data.
-    */
-    spa_data_t spadat;
-
-    /* Get the access.conf data for the stanza that matches this incoming
-     * source IP address.
-    */
-    acc_stanza_t   *acc = acc_check_source(opts, spa_pkt->packet_src_ip);
-
-    inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
-        spadat.pkt_source_ip, sizeof(spadat.pkt_source_ip));
-
-    /* At this point, we want to validate and (if needed) preprocess the
-     * SPA data and/or to be reasonably sure we have a SPA packet (i.e
-     * try to eliminate obvious non-spa packets).
-    */
-    res = preprocess_spa_data(opts, spadat.pkt_source_ip);
-    if(res != FKO_SUCCESS)
-        return(SPA_MSG_NOT_SPA_DATA);
-
-    log_msg(LOG_INFO, "SPA Packet from IP: %s received.", spadat.pkt_source_ip);
-
-    if(acc == NULL)
-    {
-        log_msg(LOG_WARNING,
-            "No access data found for source IP: %s", spadat.pkt_source_ip
-        );
-
-        return(SPA_MSG_ACCESS_DENIED);
-    }
-
-    if(opts->verbose > 1)
-        log_msg(LOG_INFO, "SPA Packet: '%s'\n", spa_pkt->packet_data);
-
-    /* Get encryption type and try its decoding routine first (if the key
-     * for that type is set)
-    */
-    enc_type = fko_encryption_type((char *)spa_pkt->packet_data);
+    char            *gpg_id;
+    int             res;
 
     if(enc_type == FKO_ENCRYPTION_RIJNDAEL)
     {
         if(acc->key != NULL)
-            res = fko_new_with_data(&ctx, (char *)spa_pkt->packet_data, acc->key);
+            res = fko_new_with_data(ctx, spa_data, acc->key);
         else 
         {
             log_msg(LOG_ERR,
@@ -245,7 +190,7 @@ incoming_spa(fko_srv_options_t *opts)
         */
         if(acc->gpg_decrypt_pw != NULL)
         {
-            res = fko_new_with_data(&ctx, (char *)spa_pkt->packet_data, NULL);
+            res = fko_new_with_data(ctx, spa_data, NULL);
             if(res != FKO_SUCCESS)
             {
                 log_msg(LOG_WARNING,
@@ -255,22 +200,47 @@ incoming_spa(fko_srv_options_t *opts)
                 return(SPA_MSG_FKO_CTX_ERROR);
             }
 
-            /* Set whatever GPG parameters we have.
+            /* The gpgme context and decrypt key for this stanza are set
+             * up on first use and then reused for every packet until the
+             * access stanzas are freed (on SIGHUP or exit).
             */
-            if(acc->gpg_home_dir != NULL)
-                res = fko_set_gpg_home_dir(ctx, acc->gpg_home_dir);
+            if(acc->gpg_cache == NULL)
+            {
+                res = fko_gpg_cache_new(&(acc->gpg_cache), NULL,
+                    acc->gpg_home_dir, acc->gpg_decrypt_id);
+
+                /* A GPG_DECRYPT_ID that cannot be found has never been
+                 * fatal (gpg picks the key itself), so try without it.
+                */
+                if(res != FKO_SUCCESS && acc->gpg_decrypt_id != NULL)
+                {
+                    log_msg(LOG_WARNING,
+                        "Unable to find GPG key '%s': %s",
+                        acc->gpg_decrypt_id, fko_errstr(res)
+                    );
+                    res = fko_gpg_cache_new(&(acc->gpg_cache), NULL,
+                        acc->gpg_home_dir, NULL);
+                }
+
                 if(res != FKO_SUCCESS)
                 {
                     log_msg(LOG_WARNING,
-                        "Error setting GPG keyring path to %s: %s",
-                        acc->gpg_home_dir,
+                        "Unable to set up GPG context for keyring %s: %s",
+                        (acc->gpg_home_dir == NULL) ? "<default>" : acc->gpg_home_dir,
                         fko_errstr(res)
                     );
+                    acc->gpg_cache = NULL;
                     return(SPA_MSG_FKO_CTX_ERROR);
                 }
+            }
 
-            if(acc->gpg_decrypt_id != NULL)
-                fko_set_gpg_recipient(ctx, acc->gpg_decrypt_id);
+            res = fko_set_gpg_cache(*ctx, acc->gpg_cache);
+            if(res != FKO_SUCCESS)
+            {
+                log_msg(LOG_WARNING,
+                    "Error setting GPG context: %s", fko_errstr(res));
+                return(SPA_MSG_FKO_CTX_ERROR);
+            }
 
             /* If GPG_REQUIRE_SIG is set for this acc stanza, then set
              * the FKO context accordingly and check the other GPG Sig-
@@ -279,21 +249,21 @@ incoming_spa(fko_srv_options_t *opts)
             */
             if(acc->gpg_require_sig)
             {
-                fko_set_gpg_signature_verify(ctx, 1);
+                fko_set_gpg_signature_verify(*ctx, 1);
 
                 /* Set whether or not to ignore signature verification errors.
                 */
-                fko_set_gpg_ignore_verify_error(ctx, acc->gpg_ignore_sig_error);
+                fko_set_gpg_ignore_verify_error(*ctx, acc->gpg_ignore_sig_error);
             }
             else
             {
-                fko_set_gpg_signature_verify(ctx, 0);
-                fko_set_gpg_ignore_verify_error(ctx, 1);
+                fko_set_gpg_signature_verify(*ctx, 0);
+                fko_set_gpg_ignore_verify_error(*ctx, 1);
             }
 
             /* Now decrypt the data.
             */
-            res = fko_decrypt_spa_data(ctx, acc->gpg_decrypt_pw);
+            res = fko_decrypt_spa_data(*ctx, acc->gpg_decrypt_pw);
         }
         else
         {
@@ -318,16 +288,16 @@ incoming_spa(fko_srv_options_t *opts)
 
         if(IS_GPG_ERROR(res))
             log_msg(LOG_WARNING, " - GPG ERROR: %s",
-                fko_gpg_errstr(ctx));
+                fko_gpg_errstr(*ctx));
 
-        goto clean_and_bail;
+        return(res);
     }
 
     /* At this point, we assume the SPA data is valid.  Now we need to see
      * if it meets our access criteria.
     */
     if(opts->verbose > 2)
-        log_msg(LOG_INFO, "SPA Decode (res=%i):\n%s", res, dump_ctx(ctx));
+        log_msg(LOG_INFO, "SPA Decode (res=%i):\n%s", res, dump_ctx(*ctx));
 
     /* First, if this is a GPG message, and GPG_REMOTE_ID list is not empty,
      * then we need to make sure this incoming message is signer ID matches
@@ -335,12 +305,12 @@ incoming_spa(fko_srv_options_t *opts)
     */
     if(enc_type == FKO_ENCRYPTION_GPG && acc->gpg_require_sig)
     {
-        res = fko_get_gpg_signature_id(ctx, &gpg_id);
+        res = fko_get_gpg_signature_id(*ctx, &gpg_id);
         if(res != FKO_SUCCESS)
         {
             log_msg(LOG_WARNING, "Error pulling the GPG signature ID from the context: %s",
-                fko_gpg_errstr(ctx));
-            goto clean_and_bail;
+                fko_gpg_errstr(*ctx));
+            return(res);
         }
 
         if(opts->verbose)
@@ -351,41 +321,48 @@ incoming_spa(fko_srv_options_t *opts)
             log_msg(LOG_WARNING,
                 "Incoming SPA packet signed by ID: %s, but that ID is not the GPG_REMOTE_ID list.",
                 gpg_id);
-            goto clean_and_bail;
+            return(SPA_MSG_ACCESS_DENIED);
         }
     }
 
+    return(FKO_SUCCESS);
+}
+
+/* Everything that follows a successful decryption: the replay, age,
+ * source address, username and port checks, and finally the command or
+ * firewall action.  spadat must already hold the decoded SPA fields and
+ * digest is the SPA digest used for replay detection.
+*/
+int
+process_decrypted_spa(fko_srv_options_t *opts, acc_stanza_t *acc,
+    spa_data_t *spadat, char *digest)
+{
+    char            *spa_ip_demark;
+    time_t          now_ts;
+    int             res = SPA_MSG_SUCCESS, ts_diff;
+    uid_t           cmd_uid;
+
     /* Check for replays if so configured.
     */
     if(strncasecmp(opts->config[CONF_ENABLE_DIGEST_PERSISTENCE], "Y", 1) == 0)
     {
-        res = replay_check(opts, ctx);
+        res = replay_check(opts, digest);
         if(res != 0) /* non-zero means we have seen this packet before. */
-            goto clean_and_bail;
+            return(res);
     }
 
-    /* Populate our spa data struct for future reference.
-    */
-    res = get_spa_data_fields(ctx, &spadat);
+    metrics_stage_done(METRIC_STAGE_REPLAY);
 
     /* Figure out what our timeout will be. If it is specified in the SPA
      * data, then use that.  If not, try the FW_ACCESS_TIMEOUT from the
      * access.conf file (if there is one).  Otherwise use the default.
     */
-    if(spadat.client_timeout > 0)
-        spadat.fw_access_timeout = spadat.client_timeout;
+    if(spadat->client_timeout > 0)
+        spadat->fw_access_timeout = spadat->client_timeout;
     else if(acc->fw_access_timeout > 0)
-        spadat.fw_access_timeout = acc->fw_access_timeout;
+        spadat->fw_access_timeout = acc->fw_access_timeout;
     else
-        spadat.fw_access_timeout = DEF_FW_ACCESS_TIMEOUT;
-
-    if(res != FKO_SUCCESS)
-    {
-        log_msg(LOG_ERR, "Unexpected error pulling SPA data from the context: %s",
-            fko_errstr(res));
-        res = SPA_MSG_ERROR;
-        goto clean_and_bail;
-    }
+        spadat->fw_access_timeout = DEF_FW_ACCESS_TIMEOUT;
 
     /* Check packet age if so configured.
     */
@@ -393,14 +370,13 @@ incoming_spa(fko_srv_options_t *opts)
     {
         time(&now_ts);
 
-        ts_diff = now_ts - spadat.timestamp;
+        ts_diff = now_ts - spadat->timestamp;
 
         if(ts_diff > atoi(opts->config[CONF_MAX_SPA_PACKET_AGE]))
         {
             log_msg(LOG_WARNING, "SPA data is too old (%i seconds).",
                 ts_diff);
-            res = SPA_MSG_TOO_OLD;
-            goto clean_and_bail;
+            return(SPA_MSG_TOO_OLD);
         }
     }
 
@@ -408,50 +384,47 @@ incoming_spa(fko_srv_options_t *opts)
      * IP address against the defined access rights.  We start by splitting
      * the spa msg source IP from the remainder of the message.
     */
-    spa_ip_demark = strchr(spadat.spa_message, ',');
+    spa_ip_demark = strchr(spadat->spa_message, ',');
     if(spa_ip_demark == NULL)
     {
         log_msg(LOG_WARNING, "Error parsing SPA message string: %s",
             fko_errstr(res));
-        res = SPA_MSG_ERROR;
-        goto clean_and_bail;
+        return(SPA_MSG_ERROR);
     }
 
-    strlcpy(spadat.spa_message_src_ip, spadat.spa_message, (spa_ip_demark-spadat.spa_message)+1);
-    strlcpy(spadat.spa_message_remain, spa_ip_demark+1, 1024);
+    strlcpy(spadat->spa_message_src_ip, spadat->spa_message, (spa_ip_demark-spadat->spa_message)+1);
+    strlcpy(spadat->spa_message_remain, spa_ip_demark+1, 1024);
 
     /* If use source IP was requested (embedded IP of 0.0.0.0), make sure it
      * is allowed.
     */
-    if(strcmp(spadat.spa_message_src_ip, "0.0.0.0") == 0)
+    if(strcmp(spadat->spa_message_src_ip, "0.0.0.0") == 0)
     {
         if(acc->require_source_address)
         {
             log_msg(LOG_WARNING,
                 "Got 0.0.0.0 when valid source IP was required."
             );
-            res = SPA_MSG_ACCESS_DENIED;
-            goto clean_and_bail;
+            return(SPA_MSG_ACCESS_DENIED);
         }
 
-        spadat.use_src_ip = spadat.pkt_source_ip;
+        spadat->use_src_ip = spadat->pkt_source_ip;
     }
     else
-        spadat.use_src_ip = spadat.spa_message_src_ip;
+        spadat->use_src_ip = spadat->spa_message_src_ip;
 
     /* If REQUIRE_USERNAME is set, make sure the username in this SPA data
      * matches.
     */
     if(acc->require_username != NULL)
     {
-        if(strcmp(spadat.username, acc->require_username) != 0)
+        if(strcmp(spadat->username, acc->require_username) != 0)
         {
             log_msg(LOG_WARNING,
                 "Username in SPA data (%s) does not match required username: %s",
-                spadat.username, acc->require_username
+                spadat->username, acc->require_username
             );
-            res = SPA_MSG_ACCESS_DENIED;
-            goto clean_and_bail;
+            return(SPA_MSG_ACCESS_DENIED);
         }
     }
 
@@ -459,7 +432,7 @@ incoming_spa(fko_srv_options_t *opts)
 
     /* Command messages.
     */
-    if(spadat.message_type == FKO_COMMAND_MSG)
+    if(spadat->message_type == FKO_COMMAND_MSG)
     {
         if(!acc->enable_cmd_exec)
         {
@@ -472,41 +445,40 @@ incoming_spa(fko_srv_options_t *opts)
         {
             log_msg(LOG_INFO,
                 "Processing SPA Command message: command='%s'.",
-                spadat.spa_message_remain
+                spadat->spa_message_remain
             );
 
-            /* Do we need to become another user? If so, we call
-             * run_extcmd_as and pass the cmd_exec_uid.
+            /* Do we need to become another user? If so, we pass the
+             * cmd_exec_uid along.
             */
+            cmd_uid = 0;
             if(acc->cmd_exec_user != NULL && strncasecmp(acc->cmd_exec_user, "root", 4) != 0)
             {
                 if(opts->verbose)
                     log_msg(LOG_INFO, "Setting effective user to %s (UID=%i) before running command.",
                         acc->cmd_exec_user, acc->cmd_exec_uid);
 
-
-                res = run_extcmd_as(acc->cmd_exec_uid,
-                                    spadat.spa_message_remain, NULL, 0, 0);
+                cmd_uid = acc->cmd_exec_uid;
             }
-            else /* Just run it as we are (root that is). */
-                res = run_extcmd(spadat.spa_message_remain, NULL, 0, 5);
 
-            /* --DSS XXX: I have found that the status (and res for that
-             *            matter) have been unreliable indicators of the
-             *            actual exit status of some commands.  Not sure
-             *            why yet.  For now, we will take what we get.
+            /* The command runs (or waits its turn) in the background, so we
+             * never hold up packet processing on it.  Its completion is
+             * logged by extcmd_service().
             */
-            status = WEXITSTATUS(res);
+            res = extcmd_queue(acc, acc->cmd_exec_max_running,
+                atoi(opts->config[CONF_CMD_EXEC_QUEUE_LIMIT]), cmd_uid,
+                spadat->spa_message_remain,
+                atoi(opts->config[CONF_CMD_EXEC_TIMEOUT]));
 
             if(opts->verbose > 2)
                 log_msg(LOG_WARNING,
-                    "CMD_EXEC: command returned %i", status);
+                    "CMD_EXEC: extcmd_queue returned %i", res);
 
-            if(status != 0)
+            if(res != EXTCMD_SUCCESS_ALL_OUTPUT)
                 res = SPA_MSG_COMMAND_ERROR;
         }
 
-        goto clean_and_bail;
+        return(res);
     }
 
     /* From this point forward, we have some kind of access message. So
@@ -515,20 +487,219 @@ incoming_spa(fko_srv_options_t *opts)
      *
      *  --DSS TODO: We should add BLACKLIST support here as well.
     */
-    if(! acc_check_port_access(acc, spadat.spa_message_remain))
+    if(! acc_check_port_access(acc, spadat->spa_message_remain))
     {
         log_msg(LOG_WARNING,
             "One or more requested protocol/ports was denied per access.conf."
         );
 
-        res = SPA_MSG_ACCESS_DENIED;
-
-        goto clean_and_bail;       
+        return(SPA_MSG_ACCESS_DENIED);
     }
 
+    metrics_stage_done(METRIC_STAGE_ACCESS);
+
     /* At this point, we can process the SPA request.
     */
-    res = process_spa_request(opts, &spadat);
+    res = process_spa_request(opts, spadat);
+
+    metrics_stage_done(METRIC_STAGE_FIREWALL);
+
+    return(res);
+}
+
+/* Find the stanza whose KEY fits the given Rijndael SPA data when more
+ * than one stanza allows its source.  The first match (acc) is tried first,
+ * then the others in access.conf order.  Only the first cipher block is
+ * decrypted for each, so a wrong key costs little more than the key
+ * setup.  Returns NULL if no key fits.  The number of keys tried is
+ * returned in *tried.  If acc is the only stanza with a key, there is
+ * nothing to choose, so acc is returned untried and the full decryption
+ * has the say.
+*/
+static acc_stanza_t*
+rijndael_key_stanza(fko_srv_options_t *opts, acc_stanza_t *acc,
+    char *spa_data, uint32_t ip, int *tried)
+{
+    acc_stanza_t   *cand;
+
+    *tried = 0;
+
+    for(cand = opts->acc_stanzas; cand != NULL; cand = cand->next)
+        if(cand != acc && cand->key != NULL
+          && acc_stanza_allows_source(cand, ip))
+            break;
+
+    if(cand == NULL)
+        return((acc->key != NULL) ? acc : NULL);
+
+    if(acc->key != NULL)
+    {
+        (*tried)++;
+        if(fko_rijndael_key_check(spa_data, acc->key) == FKO_SUCCESS)
+            return(acc);
+    }
+
+    for(cand = opts->acc_stanzas; cand != NULL; cand = cand->next)
+    {
+        if(cand == acc || cand->key == NULL
+          || !acc_stanza_allows_source(cand, ip))
+            continue;
+
+        (*tried)++;
+        if(fko_rijndael_key_check(spa_data, cand->key) == FKO_SUCCESS)
+            return(cand);
+    }
+
+    return(NULL);
+}
+
+/* Process the SPA packet data.  The access stanza that matched (if any) is
+ * returned in *acc_out, and *queued is set if the packet was handed to the
+ * GPG worker pool to finish.
+*/
+static int
+process_spa_packet(fko_srv_options_t *opts, acc_stanza_t **acc_out,
+    int *queued)
+{
+    /* Always a good idea to initialize ctx to null if it will be used
+     * repeatedly (especially when using fko_new_with_data().
+    */
+    fko_ctx_t       ctx = NULL;
+
+    char            *digest;
+    char            key_id[FKO_KEY_ID_SIZE+1];
+    int             res, enc_type, tried;
+
+    acc_stanza_t   *key_acc = NULL;
+    spa_pkt_info_t *spa_pkt = &(opts->spa_pkt);
+
+    /* This will hold our pertinent SPA data.
+    */
+    spa_data_t spadat;
+
+    /* Get the access.conf data for the stanza that matches this incoming
+     * source IP address.
+    */
+    acc_stanza_t   *acc = acc_check_source(opts, spa_pkt->packet_src_ip);
+
+    *acc_out = acc;
+
+    inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
+        spadat.pkt_source_ip, sizeof(spadat.pkt_source_ip));
+
+    /* At this point, we want to validate and (if needed) preprocess the
+     * SPA data and/or to be reasonably sure we have a SPA packet (i.e
+     * try to eliminate obvious non-spa packets).
+    */
+    res = preprocess_spa_data(opts, spadat.pkt_source_ip);
+    if(res != FKO_SUCCESS)
+        return(SPA_MSG_NOT_SPA_DATA);
+
+    metrics_stage_done(METRIC_STAGE_PREPROCESS);
+
+    /* Drop packets from sources that have been sending us too many (or
+     * too many undecryptable) packets before spending any time on them.
+    */
+    res = src_limit_check(opts, spa_pkt->packet_src_ip);
+    if(res != SPA_MSG_SUCCESS)
+        return(res);
+
+    log_msg(LOG_INFO, "SPA Packet from IP: %s received.", spadat.pkt_source_ip);
+
+    /* Rijndael data can lead with the ID of its key, which tells us which
+     * stanza to use whatever the order of those that allow this source.
+    */
+    fko_spa_data_key_id((char *)spa_pkt->packet_data, key_id);
+    if(key_id[0] != '\0')
+    {
+        key_acc = acc_check_key_id(opts, key_id, spa_pkt->packet_src_ip);
+        if(key_acc != NULL)
+            acc = *acc_out = key_acc;
+        else if(opts->verbose)
+            log_msg(LOG_INFO, "No stanza for key ID '%s' from %s.",
+                key_id, spadat.pkt_source_ip);
+    }
+
+    if(acc == NULL)
+    {
+        log_msg(LOG_WARNING,
+            "No access data found for source IP: %s", spadat.pkt_source_ip
+        );
+
+        return(SPA_MSG_ACCESS_DENIED);
+    }
+
+    if(opts->verbose > 1)
+        log_msg(LOG_INFO, "SPA Packet: '%s'\n", spa_pkt->packet_data);
+
+    /* Get encryption type and try its decoding routine first (if the key
+     * for that type is set)
+    */
+    enc_type = fko_encryption_type((char *)spa_pkt->packet_data);
+
+    /* GPG decryption is slow enough that it is handed to the worker pool
+     * (when there is one) so it cannot hold up Rijndael packets.  The
+     * rest of the processing happens when the result comes back.
+    */
+    if(enc_type == FKO_ENCRYPTION_GPG && acc->gpg_decrypt_pw != NULL
+      && gpg_pool_active())
+    {
+        res = gpg_pool_submit(opts, spa_pkt);
+        *queued = (res == SPA_MSG_SUCCESS);
+        return(res);
+    }
+
+    /* Unless the key ID already told us, find the stanza with the right
+     * key among those that allow this source.
+    */
+    if(enc_type == FKO_ENCRYPTION_RIJNDAEL && key_acc == NULL)
+    {
+        key_acc = rijndael_key_stanza(opts, acc,
+            (char *)spa_pkt->packet_data, spa_pkt->packet_src_ip, &tried);
+
+        if(key_acc != NULL)
+            acc = *acc_out = key_acc;
+        else if(acc->key != NULL)
+        {
+            log_msg(LOG_WARNING,
+                "No stanza key matches SPA data from %s (%i candidates).",
+                spadat.pkt_source_ip, tried);
+            src_limit_fail(opts, spa_pkt->packet_src_ip);
+            return(FKO_ERROR_DECRYPTION_FAILURE);
+        }
+    }
+
+    res = decrypt_spa_data(opts, acc, (char *)spa_pkt->packet_data,
+        enc_type, &ctx);
+    if(res != FKO_SUCCESS)
+    {
+        src_limit_fail(opts, spa_pkt->packet_src_ip);
+        goto clean_and_bail;
+    }
+
+    metrics_stage_done(enc_type == FKO_ENCRYPTION_GPG
+        ? METRIC_STAGE_DECRYPT_GPG : METRIC_STAGE_DECRYPT_RIJNDAEL);
+
+    /* Populate our spa data struct for future reference.
+    */
+    res = get_spa_data_fields(ctx, &spadat);
+    if(res == FKO_SUCCESS)
+        res = fko_get_spa_digest(ctx, &digest);
+
+    if(res != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "Unexpected error pulling SPA data from the context: %s",
+            fko_errstr(res));
+        res = SPA_MSG_ERROR;
+        goto clean_and_bail;
+    }
+
+    metrics_stage_done(METRIC_STAGE_DIGEST);
+
+    res = process_decrypted_spa(opts, acc, &spadat, digest);
+
+    if(res == SPA_MSG_SUCCESS)
+        src_limit_clear(spa_pkt->packet_src_ip);
 
 clean_and_bail:
     if(ctx != NULL)
@@ -537,4 +708,28 @@ clean_and_bail:
     return(res);
 }
 
+/* Process the SPA packet data in opts->spa_pkt, keeping count of the
+ * outcome.
+*/
+int
+incoming_spa(fko_srv_options_t *opts)
+{
+    acc_stanza_t   *acc = NULL;
+    int             res, queued = 0;
+
+    metrics_packet_start();
+    log_set_source(opts->spa_pkt.packet_src_ip);
+
+    res = process_spa_packet(opts, &acc, &queued);
+
+    log_set_source(0);
+
+    /* Packets queued for the GPG workers are counted when they are done.
+    */
+    if(!queued)
+        metrics_spa_result(acc, res);
+
+    return(res);
+}
+
 /***EOF***/
@@ -34,5 +34,10 @@
 /* Prototypes
 */
 int incoming_spa(fko_srv_options_t *opts);
+int decrypt_spa_data(fko_srv_options_t *opts, acc_stanza_t *acc,
+    char *spa_data, int enc_type, fko_ctx_t *ctx);
+int get_spa_data_fields(fko_ctx_t ctx, spa_data_t *spdat);
+int process_decrypted_spa(fko_srv_options_t *opts, acc_stanza_t *acc,
+    spa_data_t *spadat, char *digest);
 
 #endif  /* INCOMING_SPA_H */
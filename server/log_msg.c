@@ -5,8 +5,11 @@
  *
  * Author:  Damien S. Stuart
  *
- * Purpose: General logging routine that can write to syslog and/or stderr
- *          and can take varibale number of args.
+ * Purpose: General logging routine that can write to syslog, stderr, or a
+ *          log file and can take varibale number of args.  Messages from
+ *          the main process are queued in a ring and written out in
+ *          batches by a writer thread, and messages logged while handling
+ *          a packet are rate limited per message and source IP.
  *
  * Copyright 2010 Damien Stuart (dstuart@dstuart.org)
  *
@@ -33,6 +36,30 @@
 #include "utils.h"
 #include "log_msg.h"
 
+#include <fcntl.h>
+
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+
+#if HAVE_PTHREAD_H
+  #include <pthread.h>
+  #include <signal.h>
+#endif
+
+#define LOG_RING_MASK       (LOG_RING_SIZE - 1)
+#define LOG_WRITE_BUF_SIZE  16384
+
+/* Size of the rate limiting table (must be a power of 2) and how many
+ * slots are searched for a message class before one is reused.
+*/
+#define LOG_RL_SLOTS        256
+#define LOG_RL_PROBES       8
+
+/* Full memory barrier between the ring producer and its consumer.
+*/
+#define LOG_BARRIER()       __sync_synchronize()
+
 /* The default log facility (can be overridden via config file directive).
 */
 static int  syslog_fac      = LOG_DAEMON;
@@ -47,13 +74,552 @@ static int  static_log_flag = 0;
 */
 static char *log_name = NULL;
 
+/* Messages that would go to syslog are appended to this file instead
+ * when LOG_FILE is set.
+*/
+static int  log_fd          = -1;
+
+/* A queued message.
+*/
+typedef struct log_entry
+{
+    int     level;
+    time_t  ts;
+    char    msg[LOG_MSG_MAX_LEN];
+} log_entry_t;
+
+/* The log ring.  The main thread is its only producer and the writer its
+ * only consumer, and each of them only ever moves its own index, so no
+ * lock is needed.  When the ring is full, messages are counted and
+ * dropped rather than making the capture loop wait.
+*/
+static log_entry_t              log_ring[LOG_RING_SIZE];
+static volatile unsigned int    ring_head       = 0;
+static volatile unsigned int    ring_tail       = 0;
+static volatile unsigned long   ring_dropped    = 0;
+static unsigned long            drops_reported  = 0;
+
+/* Whether the ring is wanted (ENABLE_ASYNC_LOGGING), whether it is in
+ * use, and the process that owns it.  Forked children log synchronously.
+*/
+static int      async_enabled   = 0;
+static int      writer_running  = 0;
+static pid_t    writer_pid      = 0;
+static int      exit_hook_set   = 0;
+
+#if HAVE_PTHREAD_H
+static pthread_t        writer_thread;
+static volatile int     writer_stop = 0;
+static int              atfork_set  = 0;
+
+/* Held by the writer while it writes a batch so that fork() never
+ * happens in the middle of a syslog() call (which would leave its lock
+ * held in the child).
+*/
+static pthread_mutex_t  out_lock    = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Output buffers for stderr and the log file, so a batch of messages
+ * goes out with one write() each.  The writer and the synchronous path
+ * each have their own.
+*/
+typedef struct log_batch
+{
+    char    err[LOG_WRITE_BUF_SIZE];
+    size_t  err_len;
+    char    file[LOG_WRITE_BUF_SIZE];
+    size_t  file_len;
+} log_batch_t;
+
+static log_batch_t  writer_batch;
+static log_batch_t  sync_batch;
+
+/* Token bucket for one message class (the format string passed to
+ * log_msg()) and source IP (0 for the class as a whole).  Tokens are
+ * kept in thousandths of a message.
+*/
+typedef struct log_bucket
+{
+    const char     *class;
+    unsigned int    src_ip;
+    int             level;
+    long            tokens;
+    struct timeval  last;
+    unsigned long   suppressed;
+} log_bucket_t;
+
+static log_bucket_t     buckets[LOG_RL_SLOTS];
+static int              rl_rate         = 0;
+static int              rl_burst        = 0;
+static unsigned int     cur_src_ip      = 0;
+static time_t           last_summary    = 0;
+
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+
+    while(len > 0)
+    {
+        res = write(fd, buf, len);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        buf += res;
+        len -= res;
+    }
+}
+
+static void
+batch_flush(log_batch_t *b)
+{
+    if(b->err_len > 0)
+        write_all(STDERR_FILENO, b->err, b->err_len);
+
+    if(b->file_len > 0 && log_fd >= 0)
+        write_all(log_fd, b->file, b->file_len);
+
+    b->err_len  = 0;
+    b->file_len = 0;
+}
+
+/* Send one message to wherever its level says it should go.  Anything for
+ * stderr or the log file is only added to the batch (see batch_flush()).
+*/
+static void
+emit_msg(log_batch_t *b, int level, time_t ts, pid_t pid, const char *msg)
+{
+    size_t      len = strlen(msg);
+    char        tstr[32];
+    struct tm   tm;
+    int         n;
+
+    if(LOG_STDERR & level)
+    {
+        if(b->err_len + len + 1 > sizeof(b->err))
+            batch_flush(b);
+
+        memcpy(b->err + b->err_len, msg, len);
+        b->err_len += len;
+        b->err[b->err_len++] = '\n';
+
+        if((LOG_STDERR_ONLY & level) == LOG_STDERR_ONLY)
+            return;
+    }
+
+    if(log_fd >= 0)
+    {
+        if(localtime_r(&ts, &tm) == NULL
+          || strftime(tstr, sizeof(tstr), "%b %e %H:%M:%S", &tm) == 0)
+            tstr[0] = '\0';
+
+        if(b->file_len + len + sizeof(tstr) + MAX_PATH_LEN + 16 > sizeof(b->file))
+            batch_flush(b);
+
+        n = snprintf(b->file + b->file_len, sizeof(b->file) - b->file_len,
+            "%s %s[%i]: %s\n", tstr, log_name == NULL ? MY_NAME : log_name,
+            (int)pid, msg);
+
+        if(n > 0)
+            b->file_len += ((size_t)n < sizeof(b->file) - b->file_len)
+                ? (size_t)n : sizeof(b->file) - b->file_len - 1;
+        return;
+    }
+
+    openlog(log_name, LOG_PID, syslog_fac);
+    syslog(level & LOG_STDERR_MASK, "%s", msg);
+}
+
+/* Write out everything in the ring (this is the consumer side).
+*/
+static void
+ring_drain(void)
+{
+    unsigned int    tail = ring_tail;
+    unsigned int    head;
+    unsigned long   dropped;
+    log_entry_t    *e;
+    char            buf[128];
+
+    head = ring_head;
+    LOG_BARRIER();
+
+    dropped = ring_dropped;
+
+    if(head == tail && dropped == drops_reported)
+        return;
+
+#if HAVE_PTHREAD_H
+    pthread_mutex_lock(&out_lock);
+#endif
+
+    while(tail != head)
+    {
+        e = &(log_ring[tail & LOG_RING_MASK]);
+        emit_msg(&writer_batch, e->level, e->ts, writer_pid, e->msg);
+        tail++;
+    }
+
+    /* The slots are free for reuse once we are done reading them.
+    */
+    LOG_BARRIER();
+    ring_tail = tail;
+
+    if(dropped != drops_reported)
+    {
+        snprintf(buf, sizeof(buf),
+            "Log ring full: %lu message(s) dropped.", dropped - drops_reported);
+        emit_msg(&writer_batch, LOG_WARNING | static_log_flag,
+            time(NULL), writer_pid, buf);
+        drops_reported = dropped;
+    }
+
+    batch_flush(&writer_batch);
+
+#if HAVE_PTHREAD_H
+    pthread_mutex_unlock(&out_lock);
+#endif
+}
+
+/* Queue a message on the ring (this is the producer side).
+*/
+static void
+ring_put(int level, const char *msg)
+{
+    unsigned int    head = ring_head;
+    log_entry_t    *e;
+
+    if(head - ring_tail >= LOG_RING_SIZE)
+    {
+        ring_dropped++;
+        return;
+    }
+
+    /* Make sure the writer is done with this slot before we reuse it.
+    */
+    LOG_BARRIER();
+
+    e = &(log_ring[head & LOG_RING_MASK]);
+
+    e->level = level;
+    e->ts    = time(NULL);
+    strlcpy(e->msg, msg, sizeof(e->msg));
+
+    LOG_BARRIER();
+    ring_head = head + 1;
+}
+
+/* Log an already formatted message - on the ring if we own it, and
+ * directly otherwise.
+*/
+static void
+log_line(int level, const char *msg)
+{
+    if(writer_running && getpid() == writer_pid)
+    {
+        ring_put(level, msg);
+        return;
+    }
+
+    emit_msg(&sync_batch, level, time(NULL), getpid(), msg);
+    batch_flush(&sync_batch);
+}
+
+/* Report (and reset) the number of messages a bucket has suppressed.
+*/
+static void
+log_summary(log_bucket_t *b)
+{
+    char    src[INET_ADDRSTRLEN] = {0};
+    char    class[128];
+    char    buf[LOG_MSG_MAX_LEN];
+    size_t  len;
+
+    if(b->src_ip != 0)
+        inet_ntop(AF_INET, &(b->src_ip), src, sizeof(src));
+    else
+        strlcpy(src, "all sources", sizeof(src));
+
+    /* Show the message format itself, minus any trailing newlines.
+    */
+    strlcpy(class, b->class, sizeof(class));
+    len = strlen(class);
+    while(len > 0 && (class[len-1] == '\n' || class[len-1] == ' '))
+        class[--len] = '\0';
+
+    snprintf(buf, sizeof(buf), "%lu similar message(s) from %s suppressed: \"%s\"",
+        b->suppressed, src, class);
+
+    log_line(b->level, buf);
+
+    b->suppressed = 0;
+}
+
+/* Find (or set up) the token bucket for a message class and source.
+*/
+static log_bucket_t *
+get_bucket(const char *class, unsigned int src_ip, int burst, struct timeval *now)
+{
+    log_bucket_t   *b, *victim = NULL;
+    unsigned int    hash, i;
+
+    hash = (unsigned int)((unsigned long)class >> 3) * 2654435761U;
+    hash ^= src_ip * 2246822519U;
+    hash ^= hash >> 15;
+
+    for(i = 0; i < LOG_RL_PROBES; i++)
+    {
+        b = &(buckets[(hash + i) & (LOG_RL_SLOTS - 1)]);
+
+        if(b->class == class && b->src_ip == src_ip)
+            return(b);
+
+        if(b->class == NULL)
+        {
+            victim = b;
+            break;
+        }
+
+        /* Otherwise reuse the slot that has been quiet the longest.
+        */
+        if(victim == NULL || timercmp(&(b->last), &(victim->last), <))
+            victim = b;
+    }
+
+    if(victim->class != NULL && victim->suppressed > 0)
+        log_summary(victim);
+
+    victim->class       = class;
+    victim->src_ip      = src_ip;
+    victim->tokens      = (long)burst * 1000;
+    victim->last        = *now;
+    victim->suppressed  = 0;
+
+    return(victim);
+}
+
+/* Take a token from a bucket.  Returns 1 if the message may be logged.
+*/
+static int
+take_token(log_bucket_t *b, int level, int rate, int burst, struct timeval *now)
+{
+    long    elapsed_ms;
+
+    elapsed_ms = (now->tv_sec - b->last.tv_sec) * 1000
+        + (now->tv_usec - b->last.tv_usec) / 1000;
+
+    if(elapsed_ms > 0)
+    {
+        if(elapsed_ms > (long)burst * 1000)
+            elapsed_ms = (long)burst * 1000;
+
+        b->tokens += elapsed_ms * rate;
+        if(b->tokens > (long)burst * 1000)
+            b->tokens = (long)burst * 1000;
+
+        b->last = *now;
+    }
+
+    b->level = level;
+
+    if(b->tokens < 1000)
+    {
+        b->suppressed++;
+        return(0);
+    }
+
+    b->tokens -= 1000;
+
+    /* We are letting this class through again, so first say how much of
+     * it we held back.
+    */
+    if(b->suppressed > 0)
+        log_summary(b);
+
+    return(1);
+}
+
+/* Apply the per-source and the per-class limit to a message logged while
+ * handling a packet from cur_src_ip.
+*/
+static int
+rate_ok(int level, const char *class)
+{
+    struct timeval  now;
+    log_bucket_t   *b;
+
+    gettimeofday(&now, NULL);
+
+    b = get_bucket(class, cur_src_ip, rl_burst, &now);
+    if(! take_token(b, level, rl_rate, rl_burst, &now))
+        return(0);
+
+    b = get_bucket(class, 0, rl_burst * LOG_CLASS_RATE_MULT, &now);
+    return(take_token(b, level, rl_rate * LOG_CLASS_RATE_MULT,
+        rl_burst * LOG_CLASS_RATE_MULT, &now));
+}
+
+#if HAVE_PTHREAD_H
+static void *
+log_writer(void *arg)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = 0;
+    ts.tv_nsec = LOG_WRITER_INTERVAL * 1000L;
+
+    while(! writer_stop)
+    {
+        ring_drain();
+        nanosleep(&ts, NULL);
+    }
+
+    return(NULL);
+}
+
+static void
+atfork_prepare(void)
+{
+    pthread_mutex_lock(&out_lock);
+}
+
+static void
+atfork_release(void)
+{
+    pthread_mutex_unlock(&out_lock);
+}
+#endif
+
+/* Stop the log writer and write out whatever is still queued.  Later
+ * messages are logged synchronously.
+*/
+void
+stop_log_writer(void)
+{
+    if(! writer_running || getpid() != writer_pid)
+        return;
+
+#if HAVE_PTHREAD_H
+    writer_stop = 1;
+    pthread_join(writer_thread, NULL);
+#endif
+
+    ring_drain();
+    writer_running = 0;
+}
+
+/* Start queueing messages on the log ring (when ENABLE_ASYNC_LOGGING is
+ * set).  This has to happen after we have become a daemon.
+*/
+void
+start_log_writer(void)
+{
+#if HAVE_PTHREAD_H
+    sigset_t    all, old;
+    int         res;
+#endif
+
+    if(! async_enabled || writer_running)
+        return;
+
+    ring_head       = 0;
+    ring_tail       = 0;
+    ring_dropped    = 0;
+    drops_reported  = 0;
+    writer_pid      = getpid();
+
+#if HAVE_PTHREAD_H
+    if(! atfork_set)
+    {
+        pthread_atfork(atfork_prepare, atfork_release, atfork_release);
+        atfork_set = 1;
+    }
+
+    writer_stop = 0;
+
+    /* Signals are for the main thread only.
+    */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    res = pthread_create(&writer_thread, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(res != 0)
+    {
+        log_msg(LOG_WARNING,
+            "Unable to start the log writer thread (error %i). Logging synchronously.",
+            res);
+        return;
+    }
+#endif
+
+    writer_running = 1;
+
+    /* Make sure queued messages (say, the reason for a fatal error) are
+     * written out when we exit.
+    */
+    if(! exit_hook_set)
+    {
+        atexit(stop_log_writer);
+        exit_hook_set = 1;
+    }
+}
+
+/* Periodic logging chores for the main loop: report suppressed message
+ * counts, and (without a writer thread) empty the log ring.
+*/
+void
+log_service(void)
+{
+    time_t  now;
+    int     i;
+
+#if ! HAVE_PTHREAD_H
+    if(writer_running && getpid() == writer_pid)
+        ring_drain();
+#endif
+
+    now = time(NULL);
+    if(now - last_summary < LOG_SUMMARY_INTERVAL)
+        return;
+
+    last_summary = now;
+
+    for(i = 0; i < LOG_RL_SLOTS; i++)
+        if(buckets[i].class != NULL && buckets[i].suppressed > 0)
+            log_summary(&(buckets[i]));
+}
+
+/* Set the source IP (in network byte order) of the packet being handled,
+ * or 0 when done with it.  Messages logged in between are rate limited.
+*/
+void
+log_set_source(unsigned int src_ip)
+{
+    cur_src_ip = src_ip;
+}
+
 /* Free resources allocated for logging.
 */
 void
 free_logging(void)
 {
+    stop_log_writer();
+
+    if(log_fd >= 0)
+    {
+        close(log_fd);
+        log_fd = -1;
+    }
+
     if(log_name != NULL)
+    {
         free(log_name);
+        log_name = NULL;
+    }
 }
 
 /* Initialize logging sets the name used for syslog.
@@ -127,6 +693,39 @@ init_logging(fko_srv_options_t *opts) {
         else if(!strcasecmp(opts->config[CONF_SYSLOG_FACILITY], "LOG_LOCAL7"))
             syslog_fac = LOG_LOCAL7;
     }
+
+    /* Log to a file instead of syslog if so configured (this does not
+     * apply in the foreground, where everything goes to stderr).
+    */
+    if(opts->foreground == 0
+      && opts->config[CONF_LOG_FILE] != NULL
+      && opts->config[CONF_LOG_FILE][0] != '\0')
+    {
+        log_fd = open(opts->config[CONF_LOG_FILE],
+            O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+        if(log_fd < 0)
+            fprintf(stderr, "Unable to open log file '%s': %s. Using syslog.\n",
+                opts->config[CONF_LOG_FILE], strerror(errno));
+    }
+
+    async_enabled = (opts->config[CONF_ENABLE_ASYNC_LOGGING] != NULL
+        && strncasecmp(opts->config[CONF_ENABLE_ASYNC_LOGGING], "Y", 1) == 0);
+
+    /* Rate limiting of packet related messages (a rate of 0 turns it off).
+    */
+    rl_rate  = (opts->config[CONF_LOG_RATE_LIMIT] != NULL)
+        ? atoi(opts->config[CONF_LOG_RATE_LIMIT]) : 0;
+    rl_burst = (opts->config[CONF_LOG_RATE_BURST] != NULL)
+        ? atoi(opts->config[CONF_LOG_RATE_BURST]) : 0;
+
+    if(rl_rate < 0)
+        rl_rate = 0;
+    if(rl_burst < 1)
+        rl_burst = 1;
+
+    memset(buckets, 0x0, sizeof(buckets));
+    cur_src_ip = 0;
 }
 
 /* Set the log facility value.
@@ -143,41 +742,21 @@ set_log_facility(int fac)
 void
 log_msg(int level, char* msg, ...)
 {
-    va_list ap, apse;
-
-    va_start(ap, msg);
+    va_list ap;
+    char    buf[LOG_MSG_MAX_LEN];
 
     level |= static_log_flag;
 
-    /* Print msg to stderr if the level was or'ed with LOG_STDERR
+    /* Floods of packet related messages are cut down to a trickle.
     */
-    if(LOG_STDERR & level)
-    {
-        /* Need to make a copy of our va_list so we don't screw
-         * up the message going to syslog after we print it to stderr.
-        */
-        va_copy(apse, ap);
-
-        vfprintf(stderr, msg, apse);
-        fprintf(stderr, "\n");
-
-        va_end(apse);
-
-        if(LOG_STDERR_ONLY & level)
-            return;
-
-        /* Remove the log to stderr flag from the log level value.
-        */
-        level &= LOG_STDERR_MASK;
-    }
-
-    /* Send the message to syslog.
-    */
-    openlog(log_name, LOG_PID, syslog_fac);
-
-    vsyslog(level, msg, ap);
+    if(cur_src_ip != 0 && rl_rate > 0 && ! rate_ok(level, msg))
+        return;
 
+    va_start(ap, msg);
+    vsnprintf(buf, sizeof(buf), msg, ap);
     va_end(ap);
+
+    log_line(level, buf);
 }
 
 /***EOF***/
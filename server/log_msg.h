@@ -43,7 +43,29 @@
 #define LOG_STDERR_ONLY 0x3000
 #define LOG_STDERR_MASK 0x0FFF
 
+/* Longest message we log (longer ones are truncated) and the number of
+ * messages the asynchronous log ring can hold (must be a power of 2).
+*/
+#define LOG_MSG_MAX_LEN         1024
+#define LOG_RING_SIZE           512
+
+/* How often (in microseconds) the log writer empties the ring.
+*/
+#define LOG_WRITER_INTERVAL     50000
+
+/* Rate limiting of messages logged while handling a packet: the limit
+ * for a message class (all sources together) is this many times the
+ * per-source limit, and suppressed message counts are reported at least
+ * this often (in seconds).
+*/
+#define LOG_CLASS_RATE_MULT     4
+#define LOG_SUMMARY_INTERVAL    10
+
 void init_logging(fko_srv_options_t *opts);
+void start_log_writer(void);
+void stop_log_writer(void);
+void log_service(void);
+void log_set_source(unsigned int src_ip);
 void free_logging(void);
 void set_log_facility(int fac);
 void log_msg(int, char*, ...);
@@ -0,0 +1,697 @@
+/*
+ *****************************************************************************
+ *
+ * File:    metrics.c
+ *
+ * Purpose: Operational counters and latency histograms for fwknopd.  The
+ *          figures are served in Prometheus text format over a local UNIX
+ *          socket (when enabled) and dumped to the log on SIGUSR1.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "metrics.h"
+#include "pcap_replay.h"
+#include "fwknopd_errors.h"
+#include "log_msg.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* Latency histograms are log-linear (in the style of HdrHistogram): each
+ * power of two is split into HIST_SUB linear sub-buckets, which keeps the
+ * error of any reported value within 1/HIST_SUB of it from one microsecond
+ * up to over an hour.
+*/
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct metric_hist {
+    unsigned long   count;
+    double          sum_usec;
+    unsigned int    max_usec;
+    unsigned long   buckets[HIST_BUCKETS];
+};
+
+static const char *stage_names[METRIC_STAGE_COUNT] = {
+    "capture",
+    "queue",
+    "preprocess",
+    "decrypt_rijndael",
+    "decrypt_gpg",
+    "digest",
+    "replay",
+    "access",
+    "firewall"
+};
+
+/* The replay mode timing stage (if any) each of ours feeds.  Time spent in
+ * a stage with none is counted in the next replay stage, as before.
+*/
+static const int replay_stages[METRIC_STAGE_COUNT] = {
+    -1,
+    -1,
+    SPA_STAGE_PARSE,
+    SPA_STAGE_DECRYPT,
+    SPA_STAGE_DECRYPT,
+    -1,
+    SPA_STAGE_REPLAY,
+    SPA_STAGE_ACCESS,
+    SPA_STAGE_FIREWALL
+};
+
+/* Result counters: one per SPA_MSG_* code (SPA_MSG_SUCCESS first), then
+ * libfko errors and firewall rule errors.
+*/
+#define NUM_SPA_MSG_RESULTS (SPA_MSG_ERROR - SPA_MSG_BAD_DATA + 2)
+#define RESULT_FKO_ERROR    NUM_SPA_MSG_RESULTS
+#define RESULT_FW_ERROR     (NUM_SPA_MSG_RESULTS + 1)
+#define NUM_RESULTS         (NUM_SPA_MSG_RESULTS + 2)
+
+static const char *result_names[NUM_RESULTS] = {
+    "success",
+    "bad_data",
+    "len_too_small",
+    "not_spa_data",
+    "http_not_enabled",
+    "fko_ctx_error",
+    "digest_error",
+    "digest_cache_error",
+    "replay",
+    "too_old",
+    "access_denied",
+    "command_error",
+    "not_supported",
+    "gpg_queue_full",
+    "source_blocked",
+    "rate_limited",
+    "overload",
+    "error",
+    "fko_error",
+    "fw_rule_error"
+};
+
+/* Upper bounds (in microseconds) of the histogram buckets we export.
+*/
+static const unsigned int export_bounds[] = {
+    10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+#define NUM_EXPORT_BOUNDS   (sizeof(export_bounds) / sizeof(export_bounds[0]))
+
+static struct metric_hist   stages[METRIC_STAGE_COUNT];
+static unsigned long        results[NUM_RESULTS];
+static unsigned long        spa_packets;
+static time_t               metrics_start;
+static struct timeval       stage_mark;
+
+/* The metrics socket and the clients we are about to answer.
+*/
+struct metrics_client {
+    int             fd;
+    struct timeval  started;
+    char           *buf;
+    size_t          len;
+    size_t          sent;
+};
+
+static int                      srv_sock = -1;
+static char                     sock_path[MAX_PATH_LEN];
+static struct metrics_client    clients[MAX_METRICS_CLIENTS];
+
+/* Output buffer for the Prometheus text.
+*/
+static char    *out_buf  = NULL;
+static size_t   out_len  = 0;
+static size_t   out_size = 0;
+
+static long
+usec_since(const struct timeval *tv)
+{
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+
+    return((now.tv_sec - tv->tv_sec) * 1000000L
+        + (now.tv_usec - tv->tv_usec));
+}
+
+static int
+hist_index(unsigned int v)
+{
+    int     e = HIST_SUB_BITS;
+
+    if(v < HIST_SUB)
+        return(v);
+
+    while((v >> e) > 1)
+        e++;
+
+    return((e - HIST_SUB_BITS + 1) * HIST_SUB
+        + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1)));
+}
+
+/* Largest value that lands in the given bucket.
+*/
+static unsigned int
+hist_upper(int idx)
+{
+    int     shift;
+
+    if(idx < HIST_SUB)
+        return(idx);
+
+    shift = idx / HIST_SUB - 1;
+
+    return((((unsigned int)(HIST_SUB + idx % HIST_SUB)) << shift)
+        + ((1U << shift) - 1));
+}
+
+static void
+hist_add(struct metric_hist *h, long usec)
+{
+    unsigned int    v;
+
+    if(usec < 0)
+        usec = 0;
+
+    v = (usec > 0xFFFFFFFFL) ? 0xFFFFFFFF : (unsigned int)usec;
+
+    h->count++;
+    h->sum_usec += v;
+    h->buckets[hist_index(v)]++;
+
+    if(v > h->max_usec)
+        h->max_usec = v;
+}
+
+/* Value at the given percentile (the top of the bucket it falls in).
+*/
+static unsigned int
+hist_percentile(const struct metric_hist *h, const int pct)
+{
+    unsigned long   rank, seen = 0;
+    int             i;
+
+    rank = (h->count * pct + 99) / 100;
+    if(rank == 0)
+        rank = 1;
+
+    for(i=0; i<HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if(seen >= rank)
+            break;
+    }
+
+    if(i == HIST_BUCKETS || hist_upper(i) > h->max_usec)
+        return(h->max_usec);
+
+    return(hist_upper(i));
+}
+
+/* Start the stage clock for a new SPA packet.
+*/
+void
+metrics_packet_start(void)
+{
+    gettimeofday(&stage_mark, NULL);
+}
+
+/* Record the time spent in the given stage of the current packet (since
+ * the previous stage finished).
+*/
+void
+metrics_stage_done(const int stage)
+{
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+
+    hist_add(&(stages[stage]), (now.tv_sec - stage_mark.tv_sec) * 1000000L
+        + (now.tv_usec - stage_mark.tv_usec));
+
+    stage_mark = now;
+
+    if(replay_stages[stage] >= 0)
+        replay_stage_done(replay_stages[stage]);
+}
+
+/* Record a latency measured elsewhere.
+*/
+void
+metrics_observe(const int stage, const long usec)
+{
+    hist_add(&(stages[stage]), usec);
+}
+
+/* Count the final result of processing an SPA packet, and the access
+ * stanza it matched (if any).
+*/
+void
+metrics_spa_result(acc_stanza_t *acc, const int res)
+{
+    spa_packets++;
+
+    if(res == SPA_MSG_SUCCESS)
+        results[0]++;
+    else if(res >= SPA_MSG_BAD_DATA && res <= SPA_MSG_ERROR)
+        results[res - SPA_MSG_BAD_DATA + 1]++;
+    else if(res >= FW_RULE_ADD_ERROR && res <= FW_RULE_UNKNOWN_ERROR)
+        results[RESULT_FW_ERROR]++;
+    else
+        results[RESULT_FKO_ERROR]++;
+
+    if(acc != NULL)
+    {
+        acc->metric_packets++;
+        if(res == SPA_MSG_SUCCESS)
+            acc->metric_accepted++;
+    }
+}
+
+static void
+out_printf(const char *fmt, ...)
+{
+    va_list     ap;
+    int         n;
+    char       *new_buf;
+
+    while(1)
+    {
+        va_start(ap, fmt);
+        n = vsnprintf(out_buf + out_len, out_size - out_len, fmt, ap);
+        va_end(ap);
+
+        if(n < 0)
+            return;
+
+        if(out_len + n < out_size)
+        {
+            out_len += n;
+            return;
+        }
+
+        if((new_buf = realloc(out_buf, out_size + n + 8192)) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory allocation error in metrics.");
+            exit(EXIT_FAILURE);
+        }
+
+        out_buf   = new_buf;
+        out_size += n + 8192;
+    }
+}
+
+/* Write a label value with the quoting Prometheus wants.
+*/
+static void
+out_label(const char *val)
+{
+    for(; *val != '\0'; val++)
+    {
+        if(*val == '"' || *val == '\\')
+            out_printf("\\%c", *val);
+        else if(*val == '\n')
+            out_printf("\\n");
+        else
+            out_printf("%c", *val);
+    }
+}
+
+/* Build the Prometheus text exposition of everything we have.
+*/
+static void
+build_prometheus(fko_srv_options_t *opts)
+{
+    struct metric_hist *h;
+    acc_stanza_t       *acc;
+    unsigned long       cum;
+    int                 i, j, b;
+
+    if(out_buf == NULL)
+    {
+        if((out_buf = malloc(16384)) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory allocation error in metrics.");
+            exit(EXIT_FAILURE);
+        }
+        out_size = 16384;
+    }
+    out_len = 0;
+    out_buf[0] = '\0';
+
+    out_printf("# HELP fwknopd_start_time_seconds When the counters were started.\n"
+        "# TYPE fwknopd_start_time_seconds gauge\n"
+        "fwknopd_start_time_seconds %lu\n", (unsigned long)metrics_start);
+
+    out_printf("# HELP fwknopd_packets_total Packets with payload data seen by fwknopd.\n"
+        "# TYPE fwknopd_packets_total counter\n"
+        "fwknopd_packets_total %u\n", opts->packet_ctr);
+
+    out_printf("# HELP fwknopd_spa_packets_total Packets handed to SPA processing.\n"
+        "# TYPE fwknopd_spa_packets_total counter\n"
+        "fwknopd_spa_packets_total %lu\n", spa_packets);
+
+    out_printf("# HELP fwknopd_spa_results_total SPA packets by processing result.\n"
+        "# TYPE fwknopd_spa_results_total counter\n");
+    for(i=0; i<NUM_RESULTS; i++)
+        out_printf("fwknopd_spa_results_total{result=\"%s\"} %lu\n",
+            result_names[i], results[i]);
+
+    out_printf("# HELP fwknopd_stanza_packets_total SPA packets matched by each access.conf stanza.\n"
+        "# TYPE fwknopd_stanza_packets_total counter\n");
+    for(acc = opts->acc_stanzas, i = 1; acc != NULL; acc = acc->next, i++)
+    {
+        out_printf("fwknopd_stanza_packets_total{stanza=\"%i\",source=\"", i);
+        out_label(acc->source);
+        out_printf("\"} %lu\n", acc->metric_packets);
+    }
+
+    out_printf("# HELP fwknopd_stanza_accepted_total SPA packets granted access by each access.conf stanza.\n"
+        "# TYPE fwknopd_stanza_accepted_total counter\n");
+    for(acc = opts->acc_stanzas, i = 1; acc != NULL; acc = acc->next, i++)
+    {
+        out_printf("fwknopd_stanza_accepted_total{stanza=\"%i\",source=\"", i);
+        out_label(acc->source);
+        out_printf("\"} %lu\n", acc->metric_accepted);
+    }
+
+    out_printf("# HELP fwknopd_stage_latency_seconds Time spent in each SPA processing stage.\n"
+        "# TYPE fwknopd_stage_latency_seconds histogram\n");
+    for(i=0; i<METRIC_STAGE_COUNT; i++)
+    {
+        h   = &(stages[i]);
+        cum = 0;
+        b   = 0;
+
+        for(j=0; j<(int)NUM_EXPORT_BOUNDS; j++)
+        {
+            for(; b<HIST_BUCKETS && hist_upper(b) <= export_bounds[j]; b++)
+                cum += h->buckets[b];
+
+            out_printf("fwknopd_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+                stage_names[i], export_bounds[j] / 1000000.0, cum);
+        }
+
+        out_printf("fwknopd_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n"
+            "fwknopd_stage_latency_seconds_sum{stage=\"%s\"} %.6f\n"
+            "fwknopd_stage_latency_seconds_count{stage=\"%s\"} %lu\n",
+            stage_names[i], h->count,
+            stage_names[i], h->sum_usec / 1000000.0,
+            stage_names[i], h->count);
+    }
+}
+
+/* Dump the figures to the log (on SIGUSR1).
+*/
+void
+metrics_log(fko_srv_options_t *opts)
+{
+    struct metric_hist *h;
+    acc_stanza_t       *acc;
+    int                 i;
+
+    log_msg(LOG_INFO, "Metrics: %u packets, %lu SPA packets in the last %lu seconds.",
+        opts->packet_ctr, spa_packets, (unsigned long)(time(NULL) - metrics_start));
+
+    for(i=0; i<METRIC_STAGE_COUNT; i++)
+    {
+        h = &(stages[i]);
+
+        if(h->count == 0)
+            continue;
+
+        log_msg(LOG_INFO,
+            "Metrics: stage %-16s count=%lu p50=%uus p90=%uus p99=%uus max=%uus",
+            stage_names[i], h->count, hist_percentile(h, 50),
+            hist_percentile(h, 90), hist_percentile(h, 99), h->max_usec);
+    }
+
+    for(i=0; i<NUM_RESULTS; i++)
+        if(results[i] > 0)
+            log_msg(LOG_INFO, "Metrics: result %-18s %lu",
+                result_names[i], results[i]);
+
+    for(acc = opts->acc_stanzas, i = 1; acc != NULL; acc = acc->next, i++)
+        log_msg(LOG_INFO, "Metrics: stanza %i (%s) packets=%lu accepted=%lu",
+            i, acc->source, acc->metric_packets, acc->metric_accepted);
+}
+
+/* Hang up on a client.
+*/
+static void
+drop_client(struct metrics_client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+
+    if(c->buf != NULL)
+        free(c->buf);
+
+    c->buf  = NULL;
+    c->len  = 0;
+    c->sent = 0;
+}
+
+/* Send as much of a client's pending output as its socket will take right
+ * now, and hang up once it has all gone (or the client has gone away).
+*/
+static void
+send_client(struct metrics_client *c)
+{
+    ssize_t n;
+
+    while(c->sent < c->len)
+    {
+        n = send(c->fd, c->buf + c->sent, c->len - c->sent, MSG_NOSIGNAL);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+
+        if(n <= 0)
+            break;
+
+        c->sent += n;
+    }
+
+    drop_client(c);
+}
+
+/* Queue the figures for a client.  A client that sent an HTTP request gets
+ * an HTTP response, anything else just gets the text.  The socket stays
+ * non-blocking: whatever it does not take at once is sent from
+ * metrics_service() until the client deadline.
+*/
+static void
+answer_client(fko_srv_options_t *opts, struct metrics_client *c, int http)
+{
+    char            hdr[128];
+    size_t          hdr_len = 0;
+
+    build_prometheus(opts);
+
+    if(http)
+        hdr_len = snprintf(hdr, sizeof(hdr),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: %lu\r\n\r\n", (unsigned long)out_len);
+
+    if((c->buf = malloc(hdr_len + out_len)) == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error in metrics.");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(c->buf, hdr, hdr_len);
+    memcpy(c->buf + hdr_len, out_buf, out_len);
+
+    c->len  = hdr_len + out_len;
+    c->sent = 0;
+
+    send_client(c);
+}
+
+/* Set up the metrics socket if it is enabled.  The counters themselves
+ * carry on across SIGHUP.  Returns 0 unless the socket could not be set up.
+*/
+int
+metrics_init(fko_srv_options_t *opts)
+{
+    struct sockaddr_un  saddr;
+    int                 i;
+
+    if(metrics_start == 0)
+        metrics_start = time(NULL);
+
+    for(i=0; i<MAX_METRICS_CLIENTS; i++)
+        clients[i].fd = -1;
+
+    if(strncasecmp(opts->config[CONF_ENABLE_METRICS_SOCKET], "Y", 1) != 0
+      || opts->pcap_file[0] != '\0')
+        return(0);
+
+    if(strlen(opts->config[CONF_METRICS_SOCKET]) >= sizeof(saddr.sun_path))
+    {
+        log_msg(LOG_ERR, "METRICS_SOCKET path '%s' is too long.",
+            opts->config[CONF_METRICS_SOCKET]);
+        return(-1);
+    }
+
+    if((srv_sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        log_msg(LOG_ERR, "metrics_init: socket() failed: %s",
+            strerror(errno));
+        return(-1);
+    }
+
+    fcntl(srv_sock, F_SETFL, fcntl(srv_sock, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(srv_sock, F_SETFD, FD_CLOEXEC);
+
+    memset(&saddr, 0x0, sizeof(saddr));
+    saddr.sun_family = AF_UNIX;
+    strlcpy(saddr.sun_path, opts->config[CONF_METRICS_SOCKET],
+        sizeof(saddr.sun_path));
+
+    /* Clear out a socket left behind by an earlier run.
+    */
+    unlink(saddr.sun_path);
+
+    if(bind(srv_sock, (struct sockaddr *)&saddr, sizeof(saddr)) < 0
+      || chmod(saddr.sun_path, S_IRUSR|S_IWUSR) < 0
+      || listen(srv_sock, MAX_METRICS_CLIENTS) < 0)
+    {
+        log_msg(LOG_ERR, "Unable to set up metrics socket '%s': %s",
+            saddr.sun_path, strerror(errno));
+        close(srv_sock);
+        srv_sock = -1;
+        unlink(saddr.sun_path);
+        return(-1);
+    }
+
+    strlcpy(sock_path, saddr.sun_path, sizeof(sock_path));
+
+    log_msg(LOG_INFO, "Serving metrics on '%s'.", sock_path);
+
+    return(0);
+}
+
+/* Called from the main loop: accept new metrics clients and answer the
+ * ones that have sent their request (or had long enough to).
+*/
+void
+metrics_service(fko_srv_options_t *opts)
+{
+    struct metrics_client  *c;
+    char                    req[16];
+    ssize_t                 n;
+    int                     fd, i;
+
+    if(srv_sock < 0)
+        return;
+
+    while((fd = accept(srv_sock, NULL, NULL)) >= 0)
+    {
+        for(i=0; i<MAX_METRICS_CLIENTS && clients[i].fd >= 0; i++)
+            ;
+
+        if(i == MAX_METRICS_CLIENTS)
+        {
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+        clients[i].fd = fd;
+        gettimeofday(&(clients[i].started), NULL);
+    }
+
+    for(i=0; i<MAX_METRICS_CLIENTS; i++)
+    {
+        c = &(clients[i]);
+
+        if(c->fd < 0)
+            continue;
+
+        if(usec_since(&(c->started)) >= METRICS_CLIENT_DEADLINE * 1000L)
+        {
+            drop_client(c);
+            continue;
+        }
+
+        if(c->buf != NULL)
+        {
+            send_client(c);
+            continue;
+        }
+
+        n = recv(c->fd, req, sizeof(req), MSG_PEEK);
+
+        if(n >= 4 || n == 0)
+            answer_client(opts, c, (n >= 4 && strncasecmp(req, "GET ", 4) == 0));
+        else if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            drop_client(c);
+        else if(usec_since(&(c->started)) >= METRICS_REQ_WAIT * 1000L)
+            answer_client(opts, c, 0);
+    }
+}
+
+/* Close the metrics socket descriptors without removing the socket file
+ * (for forked children).
+*/
+void
+metrics_close_fds(void)
+{
+    int     i;
+
+    if(srv_sock < 0)
+        return;
+
+    for(i=0; i<MAX_METRICS_CLIENTS; i++)
+        if(clients[i].fd >= 0)
+            drop_client(&(clients[i]));
+
+    close(srv_sock);
+    srv_sock = -1;
+}
+
+/* Stop serving metrics (on SIGHUP or exit).
+*/
+void
+metrics_shutdown(void)
+{
+    if(srv_sock >= 0)
+        unlink(sock_path);
+
+    metrics_close_fds();
+}
+
+/***EOF***/
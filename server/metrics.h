@@ -0,0 +1,68 @@
+/*
+ *****************************************************************************
+ *
+ * File:    metrics.h
+ *
+ * Purpose: Header file for metrics.c.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+/* The SPA processing stages we keep latency histograms for.
+*/
+enum {
+    METRIC_STAGE_CAPTURE = 0,       /* Packet arrival to processing */
+    METRIC_STAGE_QUEUE,             /* Wait in the admission queue */
+    METRIC_STAGE_PREPROCESS,        /* SPA data validation/HTTP parsing */
+    METRIC_STAGE_DECRYPT_RIJNDAEL,
+    METRIC_STAGE_DECRYPT_GPG,
+    METRIC_STAGE_DIGEST,            /* Decoding the fields and digest */
+    METRIC_STAGE_REPLAY,            /* Digest (replay) check */
+    METRIC_STAGE_ACCESS,            /* access.conf checks */
+    METRIC_STAGE_FIREWALL,          /* Firewall rule processing */
+    METRIC_STAGE_COUNT
+};
+
+/* The most metrics socket clients we serve at once, how long (in
+ * milliseconds) we give each one to send an HTTP request line before we
+ * just send it the plain text, and how long (also in milliseconds) a
+ * client may take in all before we hang up on it.
+*/
+#define MAX_METRICS_CLIENTS     8
+#define METRICS_REQ_WAIT        50
+#define METRICS_CLIENT_DEADLINE 2000
+
+/* Prototypes
+*/
+int metrics_init(fko_srv_options_t *opts);
+void metrics_service(fko_srv_options_t *opts);
+void metrics_packet_start(void);
+void metrics_stage_done(const int stage);
+void metrics_observe(const int stage, const long usec);
+void metrics_spa_result(acc_stanza_t *acc, const int res);
+void metrics_log(fko_srv_options_t *opts);
+void metrics_close_fds(void);
+void metrics_shutdown(void);
+
+#endif  /* METRICS_H */
+
+/***EOF***/
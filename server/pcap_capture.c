@@ -40,11 +40,124 @@
 #include "fwknopd_errors.h"
 #include "sig_handler.h"
 #include "tcp_server.h"
+#include "extcmd.h"
+#include "pcap_replay.h"
+#include "gpg_pool.h"
+#include "metrics.h"
+#include "admission.h"
 
 #if HAVE_SYS_WAIT_H
   #include <sys/wait.h>
 #endif
 
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+
+/* Process the SPA packet in opts->spa_pkt.
+*/
+static void
+handle_spa(fko_srv_options_t *opts)
+{
+    int     res;
+
+    res = incoming_spa(opts);
+
+    replay_result(res);
+
+    if(res != 0 && opts->verbose > 1)
+        log_msg(LOG_INFO, "incoming_spa returned error %i: '%s' for incoming packet.",
+            res, get_errstr(res));
+}
+
+/* Build the capture filter for ENABLE_PCAP_AUTO_FILTER: PCAP_FILTER
+ * narrowed down to IPv4 UDP or TCP packets with a payload of a size SPA
+ * data can have, from a source some access stanza allows, and not sent to
+ * our own TCP server.  The returned string is to be freed by the caller.
+*/
+static char *
+auto_pcap_filter(fko_srv_options_t *opts)
+{
+    acc_stanza_t   *acc;
+    acc_int_list_t *sle;
+    char           *filter, *p;
+    char            net[INET_ADDRSTRLEN];
+    size_t          size;
+    int             any = 0, nets = 0, bits;
+    uint32_t        addr, m;
+
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+        for(sle = acc->source_list; sle != NULL; sle = sle->next)
+        {
+            if(sle->mask == 0)
+                any = 1;
+            nets++;
+        }
+
+    size = strlen(opts->config[CONF_PCAP_FILTER]) + nets * 40 + 512;
+
+    if((filter = malloc(size)) == NULL)
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error in auto_pcap_filter.");
+        exit(EXIT_FAILURE);
+    }
+
+    p = filter;
+
+    if(opts->config[CONF_PCAP_FILTER][0] != '\0')
+        p += sprintf(p, "(%s) and ", opts->config[CONF_PCAP_FILTER]);
+
+    /* The payload of a UDP packet is its length less the 8 byte header.
+     * For TCP, we take the IP and TCP header lengths off the IP length.
+     * There is no upper bound for TCP since an SPA over HTTP request may
+     * carry headers past the SPA data that process_packet() truncates.
+    */
+    p += sprintf(p, "ip and ((udp and udp[4:2] >= %i and udp[4:2] <= %i)"
+        " or (tcp and ip[2:2] - ((ip[0] & 0xf) << 2)"
+        " - ((tcp[12] & 0xf0) >> 2) >= %i))",
+        MIN_SPA_DATA_SIZE + 8, MAX_SPA_PACKET_LEN + 8, MIN_SPA_DATA_SIZE);
+
+    /* A stanza with SOURCE ANY lets everyone through.
+    */
+    if(! any && nets > 0)
+    {
+        p += sprintf(p, " and (");
+
+        for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+            for(sle = acc->source_list; sle != NULL; sle = sle->next)
+            {
+                for(bits = 0, m = sle->mask; m != 0; m <<= 1)
+                    bits++;
+
+                addr = htonl(sle->maddr);
+                inet_ntop(AF_INET, &addr, net, sizeof(net));
+
+                p += sprintf(p, "%ssrc net %s/%i",
+                    (p[-1] == '(') ? "" : " or ", net, bits);
+            }
+
+        p += sprintf(p, ")");
+    }
+
+    if(tcp_server_active())
+        sprintf(p, " and not (tcp and dst port %u)", tcp_server_port());
+
+    return(filter);
+}
+
+/* Whether more than ms milliseconds have passed since start.
+*/
+static int
+time_is_up(struct timeval *start, int ms)
+{
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+
+    return((now.tv_sec - start->tv_sec) * 1000
+        + (now.tv_usec - start->tv_usec) / 1000 >= ms);
+}
+
 /* The pcap capture routine.
 */
 int
@@ -53,12 +166,13 @@ pcap_capture(fko_srv_options_t *opts)
     pcap_t              *pcap;
     char                errstr[PCAP_ERRBUF_SIZE] = {0};
     struct bpf_program  fp;
-    int                 res;
+    int                 res, n, batch, busy;
     int                 pcap_errcnt = 0;
     int                 pending_break = 0;
+    struct timeval      pass_start;
     int                 promisc = 0;
-    int                 status;
-    pid_t               child_pid;
+    pcap_handler        handler = (pcap_handler)&process_packet;
+    char               *filter = opts->config[CONF_PCAP_FILTER];
 
 #if FIREWALL_IPFW
     time_t              now;
@@ -69,24 +183,46 @@ pcap_capture(fko_srv_options_t *opts)
     if(opts->config[CONF_ENABLE_PCAP_PROMISC][0] == 'Y')
         promisc = 1;
 
-    pcap = pcap_open_live(
-        opts->config[CONF_PCAP_INTF],
-        atoi(opts->config[CONF_MAX_SNIFF_BYTES]),
-        promisc, 100, errstr
-    );
-
-    if(pcap == NULL)
+    /* With --pcap-file we read the packets from a capture file instead,
+     * and time how long each one takes to process.
+    */
+    if(opts->pcap_file[0] != '\0')
     {
-        log_msg(LOG_ERR, "* pcap_open_live error: %s\n", errstr);
-        exit(EXIT_FAILURE);
+        pcap = pcap_open_offline(opts->pcap_file, errstr);
+
+        if(pcap == NULL)
+        {
+            log_msg(LOG_ERR, "* pcap_open_offline error: %s\n", errstr);
+            exit(EXIT_FAILURE);
+        }
+
+        replay_init(opts);
+        handler = (pcap_handler)&replay_packet;
+
+        log_msg(LOG_INFO, "Replaying packets from '%s' (%s speed).",
+            opts->pcap_file, opts->replay_realtime ? "realtime" : "max");
     }
+    else
+    {
+        pcap = pcap_open_live(
+            opts->config[CONF_PCAP_INTF],
+            atoi(opts->config[CONF_MAX_SNIFF_BYTES]),
+            promisc, 100, errstr
+        );
 
-    /* We are only interested on seeing packets coming into the interface.
-    */
-    if (pcap_setdirection(pcap, PCAP_D_IN) < 0)
-        if(opts->verbose)
-            log_msg(LOG_WARNING, "* Warning: pcap error on setdirection: %s.",
-                pcap_geterr(pcap));
+        if(pcap == NULL)
+        {
+            log_msg(LOG_ERR, "* pcap_open_live error: %s\n", errstr);
+            exit(EXIT_FAILURE);
+        }
+
+        /* We are only interested on seeing packets coming into the interface.
+        */
+        if (pcap_setdirection(pcap, PCAP_D_IN) < 0)
+            if(opts->verbose)
+                log_msg(LOG_WARNING, "* Warning: pcap error on setdirection: %s.",
+                    pcap_geterr(pcap));
+    }
 
     if (pcap == NULL)
     {
@@ -94,11 +230,15 @@ pcap_capture(fko_srv_options_t *opts)
         exit(EXIT_FAILURE);
     }
 
-    /* Set pcap filters, if any. 
+    /* Set pcap filters, if any.  With ENABLE_PCAP_AUTO_FILTER, the filter
+     * is tightened so the kernel drops what can never be SPA data.
     */
-    if (opts->config[CONF_PCAP_FILTER][0] != '\0')
+    if(strncasecmp(opts->config[CONF_ENABLE_PCAP_AUTO_FILTER], "Y", 1) == 0)
+        filter = auto_pcap_filter(opts);
+
+    if (filter[0] != '\0')
     {
-        if(pcap_compile(pcap, &fp, opts->config[CONF_PCAP_FILTER], 1, 0) == -1)
+        if(pcap_compile(pcap, &fp, filter, 1, 0) == -1)
         {
             log_msg(LOG_ERR, "[*] Error compiling pcap filter: %s",
                 pcap_geterr(pcap)
@@ -114,11 +254,14 @@ pcap_capture(fko_srv_options_t *opts)
             exit(EXIT_FAILURE);
         }
 
-        log_msg(LOG_INFO, "PCAP filter is: %s", opts->config[CONF_PCAP_FILTER]);
+        log_msg(LOG_INFO, "PCAP filter is: %s", filter);
 
         pcap_freecode(&fp);
     }
 
+    if(filter != opts->config[CONF_PCAP_FILTER])
+        free(filter);
+
     /* Determine and set the data link encapsulation offset.
     */
     switch(pcap_datalink(pcap)) {
@@ -165,35 +308,10 @@ pcap_capture(fko_srv_options_t *opts)
     */
     while(1)
     {
-        /* If we got a SIGCHLD and it was the tcp server, then handle it here.
+        /* Children (external commands, firewall batch executors and GPG
+         * workers) are reaped by their own service routines below.
         */
-        if(got_sigchld)
-        {
-            if(opts->tcp_server_pid > 0)
-            {
-                child_pid = waitpid(0, &status, WNOHANG);
-
-                if(child_pid == opts->tcp_server_pid)
-                {
-                    if(WIFSIGNALED(status))
-                        log_msg(LOG_WARNING, "TCP server got signal: %i",  WTERMSIG(status));
-
-                    log_msg(LOG_WARNING,
-                        "TCP server exited with status of %i. Attempting restart.",
-                        WEXITSTATUS(status)
-                    );
-
-                    opts->tcp_server_pid = 0;
-
-                    /* Attempt to restart tcp server ? */
-                    usleep(1000000);
-                    run_tcp_server(opts);
-                }
-            }
-
-            got_sigchld = 0;
-        }
-
+        got_sigchld = 0;
 
         /* Any signal except USR1, USR2, and SIGCHLD mean break the loop.
         */
@@ -206,8 +324,12 @@ pcap_capture(fko_srv_options_t *opts)
             }
             else if(got_sigusr1 || got_sigusr2)
             {
-                /* Not doing anything with these yet.
+                /* SIGUSR1 dumps our metrics to the log.  Nothing is done
+                 * with SIGUSR2 yet.
                 */
+                if(got_sigusr1)
+                    metrics_log(opts);
+
                 got_sigusr1 = got_sigusr2 = 0;
                 got_signal = 0;
             }
@@ -215,18 +337,29 @@ pcap_capture(fko_srv_options_t *opts)
                 got_signal = 0;
         }
 
-        res = pcap_dispatch(pcap, 1, (pcap_handler)&process_packet, (unsigned char *)opts);
-
-        /* If there was a packet and it was processed without error, then
-         * keep going.
+        /* Without admission control, we take one packet per pass and
+         * process it right away.  With it, we read everything pcap has
+         * for us (up to a batch) into the admission queue, then process
+         * the queued packets, best first, for the rest of the pass.
         */
-        if(res > 0 && opts->spa_pkt.packet_data_len > 0)
+        batch = admit_active() ? ADMIT_READ_BATCH : 1;
+        res   = 0;
+        gettimeofday(&pass_start, NULL);
+
+        for(n = 0; n < batch && pending_break == 0; n++)
         {
-            res = incoming_spa(opts);
+            res = pcap_dispatch(pcap, 1, handler, (unsigned char *)opts);
 
-            if(res != 0 && opts->verbose > 1)
-                log_msg(LOG_INFO, "incoming_spa returned error %i: '%s' for incoming packet.",
-                    res, get_errstr(res));
+            if(res <= 0)
+                break;
+
+            if(opts->spa_pkt.packet_data_len == 0)
+                continue;
+
+            if(admit_active())
+                admit_enqueue(opts);
+            else
+                handle_spa(opts);
 
             /* Count this packet since it has at least one byte of payload
              * data - we use this as a comparison for --packet-limit regardless
@@ -244,10 +377,20 @@ pcap_capture(fko_srv_options_t *opts)
                 pending_break = 1;
             }
         }
+
+        /* Everything counted towards --packet-limit gets processed before
+         * we leave.
+        */
+        while((pending_break || ! time_is_up(&pass_start, ADMIT_PASS_TIME))
+          && admit_next(opts))
+            handle_spa(opts);
+
+        busy = (n == batch && batch > 1) || admit_pending() > 0;
+
         /* If there was an error, complain and go on (to an extent before
          * giving up).
         */
-        else if(res == -1)
+        if(res == -1)
         {
             log_msg(LOG_ERR, "[*] Error from pcap_dispatch: %s",
                 pcap_geterr(pcap)
@@ -267,6 +410,12 @@ pcap_capture(fko_srv_options_t *opts)
             log_msg(LOG_INFO, "Gracefully leaving the fwknopd event loop.");
             break;
         }
+        else if(res == 0 && opts->pcap_file[0] != '\0')
+        {
+            /* End of the capture file.
+            */
+            break;
+        }
         else
             pcap_errcnt = 0;
 
@@ -289,9 +438,50 @@ pcap_capture(fko_srv_options_t *opts)
         }
 #endif
 
-        usleep(10000);
+        /* Reap or time out any external commands running in the background.
+        */
+        extcmd_service();
+
+        /* Pick up GPG packets the worker pool has finished decrypting.
+        */
+        gpg_pool_service(opts);
+
+        /* Answer anyone asking for our metrics.
+        */
+        metrics_service(opts);
+
+        /* Report suppressed log messages.
+        */
+        log_service();
+
+        /* Give the TCP server a turn.  When it is running, the pause
+         * between passes is spent waiting on its connections instead of
+         * sleeping, and any SPA data it read counts towards --packet-limit
+         * just like sniffed packets do.
+        */
+        if(tcp_server_active())
+        {
+            opts->packet_ctr += tcp_server_service(opts, busy ? 0 : 10);
+
+            if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit
+              && pending_break == 0)
+            {
+                log_msg(LOG_WARNING,
+                    "* Incoming packet count limit of %i reached",
+                    opts->packet_ctr_limit
+                );
+
+                pcap_breakloop(pcap);
+                pending_break = 1;
+            }
+        }
+        else if(opts->pcap_file[0] == '\0' && ! busy)
+            usleep(10000);
     }
 
+    if(opts->pcap_file[0] != '\0')
+        replay_report(opts);
+
     pcap_close(pcap);
 
     return(0);
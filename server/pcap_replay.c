@@ -0,0 +1,235 @@
+/*
+ *****************************************************************************
+ *
+ * File:    pcap_replay.c
+ *
+ * Purpose: Offline replay of a pcap file through the SPA processing path
+ *          (--pcap-file), with per-stage latency and throughput reporting.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "pcap_replay.h"
+#include "process_packet.h"
+#include "log_msg.h"
+
+static const char *stage_names[SPA_STAGE_COUNT] = {
+    "parse",
+    "decrypt",
+    "replay check",
+    "access check",
+    "firewall"
+};
+
+/* Latency samples (in microseconds) for one processing stage.
+*/
+struct stage_samples {
+    unsigned int   *usec;
+    size_t          count;
+    size_t          size;
+};
+
+static int                  replaying = 0;
+static int                  realtime  = 0;
+static struct stage_samples samples[SPA_STAGE_COUNT];
+static struct timeval       stage_mark;
+static struct timeval       replay_start;
+static struct timeval       first_pkt_ts;
+static unsigned long        pkts_read;
+static unsigned long        spa_valid;
+static unsigned long        spa_invalid;
+
+static long
+usec_between(const struct timeval *start, const struct timeval *end)
+{
+    return((end->tv_sec - start->tv_sec) * 1000000L
+        + (end->tv_usec - start->tv_usec));
+}
+
+/* Turn on stage timing for a replay run.
+*/
+void
+replay_init(fko_srv_options_t *opts)
+{
+    replaying   = 1;
+    realtime    = opts->replay_realtime;
+    pkts_read   = 0;
+    spa_valid   = 0;
+    spa_invalid = 0;
+
+    memset(samples, 0x0, sizeof(samples));
+
+    gettimeofday(&replay_start, NULL);
+}
+
+/* The pcap callback in replay mode.  In realtime mode we wait until the
+ * packet is due (relative to the first one in the file), then start the
+ * clock on it and hand it to process_packet().
+*/
+void
+replay_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
+    const unsigned char *packet)
+{
+    struct timeval  now;
+    long            due;
+
+    if(pkts_read++ == 0)
+    {
+        first_pkt_ts = packet_header->ts;
+        gettimeofday(&replay_start, NULL);
+    }
+    else if(realtime)
+    {
+        gettimeofday(&now, NULL);
+
+        due = usec_between(&first_pkt_ts, &(packet_header->ts))
+            - usec_between(&replay_start, &now);
+
+        if(due > 0)
+            usleep(due);
+    }
+
+    gettimeofday(&stage_mark, NULL);
+
+    process_packet(args, packet_header, packet);
+}
+
+/* Record the time spent in the given stage of the current packet (since
+ * the previous stage finished).  This is a no-op unless we are replaying.
+*/
+void
+replay_stage_done(const int stage)
+{
+    struct timeval          now;
+    struct stage_samples   *s = &(samples[stage]);
+    unsigned int           *new_usec;
+    size_t                  new_size;
+
+    if(!replaying)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    if(s->count == s->size)
+    {
+        new_size = (s->size == 0) ? 1024 : s->size * 2;
+
+        if((new_usec = realloc(s->usec, new_size * sizeof(unsigned int))) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory allocation error in replay_stage_done.");
+            exit(EXIT_FAILURE);
+        }
+
+        s->usec = new_usec;
+        s->size = new_size;
+    }
+
+    s->usec[s->count++] = (unsigned int)usec_between(&stage_mark, &now);
+
+    stage_mark = now;
+}
+
+/* Count the result of incoming_spa() for a replayed packet.
+*/
+void
+replay_result(const int res)
+{
+    if(!replaying)
+        return;
+
+    if(res == 0)
+        spa_valid++;
+    else
+        spa_invalid++;
+}
+
+static int
+cmp_usec(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a;
+    unsigned int y = *(const unsigned int *)b;
+
+    return((x > y) - (x < y));
+}
+
+/* Nearest-rank percentile of a sorted sample set.
+*/
+static unsigned int
+percentile(const struct stage_samples *s, const int pct)
+{
+    size_t  rank = (s->count * pct + 99) / 100;
+
+    return(s->usec[(rank > 0) ? rank - 1 : 0]);
+}
+
+/* Print the throughput and per-stage latency figures for the replay run
+ * to stdout.
+*/
+void
+replay_report(fko_srv_options_t *opts)
+{
+    int                     i;
+    struct timeval          now;
+    struct stage_samples   *s;
+    double                  secs;
+
+    gettimeofday(&now, NULL);
+
+    secs = usec_between(&replay_start, &now) / 1000000.0;
+
+    printf("\nReplay of '%s' at %s speed:\n"
+        "    packets read:     %lu in %.3f seconds (%.1f packets/s)\n"
+        "    SPA candidates:   %u\n"
+        "    valid:            %lu\n"
+        "    invalid:          %lu\n\n",
+        opts->pcap_file, realtime ? "realtime" : "max",
+        pkts_read, secs, (secs > 0) ? pkts_read / secs : 0.0,
+        opts->packet_ctr, spa_valid, spa_invalid
+    );
+
+    printf("    %-16s %10s %10s %10s %10s %10s\n",
+        "latency (usec)", "count", "p50", "p90", "p99", "max");
+
+    for(i=0; i<SPA_STAGE_COUNT; i++)
+    {
+        s = &(samples[i]);
+
+        if(s->count == 0)
+        {
+            printf("    %-16s %10u %10s %10s %10s %10s\n",
+                stage_names[i], 0, "-", "-", "-", "-");
+            continue;
+        }
+
+        qsort(s->usec, s->count, sizeof(unsigned int), cmp_usec);
+
+        printf("    %-16s %10lu %10u %10u %10u %10u\n",
+            stage_names[i], (unsigned long)s->count,
+            percentile(s, 50), percentile(s, 90), percentile(s, 99),
+            s->usec[s->count - 1]);
+
+        free(s->usec);
+        memset(s, 0x0, sizeof(struct stage_samples));
+    }
+
+    printf("\n");
+}
+
+/***EOF***/
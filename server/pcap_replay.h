@@ -0,0 +1,51 @@
+/*
+ *****************************************************************************
+ *
+ * File:    pcap_replay.h
+ *
+ * Purpose: Header file for pcap_replay.c.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef PCAP_REPLAY_H
+#define PCAP_REPLAY_H
+
+/* The stages of SPA packet processing we time in replay mode.
+*/
+enum {
+    SPA_STAGE_PARSE = 0,    /* Packet decode and SPA data preprocessing */
+    SPA_STAGE_DECRYPT,      /* FKO context creation and decryption */
+    SPA_STAGE_REPLAY,       /* Digest (replay) check */
+    SPA_STAGE_ACCESS,       /* access.conf checks */
+    SPA_STAGE_FIREWALL,     /* Firewall rule processing */
+    SPA_STAGE_COUNT
+};
+
+/* Prototypes
+*/
+void replay_init(fko_srv_options_t *opts);
+void replay_packet(unsigned char *args, const struct pcap_pkthdr *packet_header, const unsigned char *packet);
+void replay_stage_done(const int stage);
+void replay_result(const int res);
+void replay_report(fko_srv_options_t *opts);
+
+#endif  /* PCAP_REPLAY_H */
+
+/***EOF***/
@@ -36,6 +36,8 @@
 #include "fwknopd_common.h"
 #include "netinet_common.h"
 #include "process_packet.h"
+#include "tcp_server.h"
+#include "metrics.h"
 #include "utils.h"
 
 void
@@ -62,6 +64,8 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
 
     unsigned short      eth_type;
 
+    struct timeval      now;
+
     fko_srv_options_t   *opts = (fko_srv_options_t *)args;
 
     int                 offset = opts->data_link_offset;
@@ -167,6 +171,12 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
     else
         return;
 
+    /* SPA data sent to our own TCP server is read from the connection by
+     * the server itself, so we don't want to process it a second time.
+    */
+    if(proto == IPPROTO_TCP && dst_port == tcp_server_port())
+        return;
+
     /* 
      * Now we have data. For now, we are not checking IP or port values. We
      * are relying on the pcap filter. This may change so we do retain the IP
@@ -190,6 +200,17 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
     opts->spa_pkt.packet_src_port = src_port; 
     opts->spa_pkt.packet_dst_port = dst_port; 
 
+    /* Note how long the packet waited between capture and now (this is
+     * meaningless for packets read from a capture file).
+    */
+    if(opts->pcap_file[0] == '\0')
+    {
+        gettimeofday(&now, NULL);
+        metrics_observe(METRIC_STAGE_CAPTURE,
+            (now.tv_sec - packet_header->ts.tv_sec) * 1000000L
+            + (now.tv_usec - packet_header->ts.tv_usec));
+    }
+
     return;
 }
 
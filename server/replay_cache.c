@@ -416,45 +416,38 @@ replay_db_cache_init(fko_srv_options_t *opts)
 }
 #endif /* USE_FILE_CACHE */
 
-/* Take an fko context, pull the digest and use it as the key to check the
+/* Use the digest of a decrypted SPA message as the key to check the
  * replay db (digest cache). Returns 1 if there was a match (a replay),
  * 0 for no match, and -1 on error.
 */
 int
-replay_check(fko_srv_options_t *opts, fko_ctx_t ctx)
+replay_check(fko_srv_options_t *opts, char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return(-1);
 #else
 
 #if USE_FILE_CACHE
-    return replay_check_file_cache(opts, ctx);
+    return replay_check_file_cache(opts, digest);
 #else
-    return replay_check_dbm_cache(opts, ctx);
+    return replay_check_dbm_cache(opts, digest);
 #endif
 #endif /* NO_DIGEST_CACHE */
 }
 
 #if USE_FILE_CACHE
 int
-replay_check_file_cache(fko_srv_options_t *opts, fko_ctx_t ctx)
+replay_check_file_cache(fko_srv_options_t *opts, char *digest)
 {
-    char       *digest = NULL;
     char        src_ip[INET_ADDRSTRLEN+1] = {0};
     char        dst_ip[INET_ADDRSTRLEN+1] = {0};
-    int         res = 0, digest_len = 0;
+    int         digest_len = 0;
     FILE       *digest_file_ptr = NULL;
 
     struct digest_cache_list *digest_list_ptr = NULL, *digest_elm = NULL;
 
-    res = fko_get_spa_digest(ctx, &digest);
-    if(res != FKO_SUCCESS)
-    {
-        log_msg(LOG_WARNING, "Error getting digest from SPA data: %s",
-            fko_errstr(res));
-
+    if(digest == NULL || *digest == '\0')
         return(SPA_MSG_DIGEST_ERROR);
-    }
 
     digest_len = strlen(digest);
 
@@ -534,7 +527,7 @@ replay_check_file_cache(fko_srv_options_t *opts, fko_ctx_t ctx)
 
 #if !USE_FILE_CACHE
 int
-replay_check_dbm_cache(fko_srv_options_t *opts, fko_ctx_t ctx)
+replay_check_dbm_cache(fko_srv_options_t *opts, char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return 0;
@@ -547,19 +540,12 @@ replay_check_dbm_cache(fko_srv_options_t *opts, fko_ctx_t ctx)
 #endif
     datum       db_key, db_ent;
 
-    char       *digest;
     int         digest_len, res;
 
     digest_cache_info_t dc_info;
 
-    res = fko_get_spa_digest(ctx, &digest);
-    if(res != FKO_SUCCESS)
-    {
-        log_msg(LOG_WARNING, "Error getting digest from SPA data: %s",
-            fko_errstr(res));
-
+    if(digest == NULL || *digest == '\0')
         return(SPA_MSG_DIGEST_ERROR);
-    }
 
     digest_len = strlen(digest);
 
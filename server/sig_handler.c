@@ -52,7 +52,6 @@ sigset_t    *csmask;
 void
 sig_handler(int sig)
 {
-    int o_errno;
     got_signal = sig;
 
     switch(sig) {
@@ -72,10 +71,10 @@ sig_handler(int sig)
             got_sigusr2 = 1;
             return;
         case SIGCHLD:
-            o_errno = errno; /* Save errno */
+            /* Children are reaped by whoever started them (by pid), so
+             * that their exit status is not lost to us here.
+            */
             got_sigchld = 1;
-            waitpid(-1, NULL, WNOHANG);
-            errno = o_errno; /* restore errno (in case reset by waitpid) */
             return;
     }
 }
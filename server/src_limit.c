@@ -0,0 +1,342 @@
+/*
+ *****************************************************************************
+ *
+ * File:    src_limit.c
+ *
+ * Purpose: Per-source limits on how much decryption work we do.  Each
+ *          source IP gets a token bucket for the SPA packets it may send
+ *          and a (decaying) count of packets that failed to decrypt.  A
+ *          source that goes over either limit is blocked for a while, and
+ *          its packets are dropped before decryption is attempted.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "src_limit.h"
+#include "extcmd.h"
+#include "fwknopd_errors.h"
+#include "log_msg.h"
+#include "utils.h"
+
+#if HAVE_ARPA_INET_H
+  #include <arpa/inet.h>
+#endif
+
+typedef struct src_entry
+{
+    unsigned int    ip;             /* 0 for an unused slot */
+    long            tokens;         /* In thousandths of a packet */
+    struct timeval  last_fill;
+    time_t          seen;
+    unsigned int    fails;
+    time_t          fail_time;      /* When fails was last decayed */
+    time_t          blocked_until;
+    time_t          last_ok;        /* When a packet was last accepted */
+} src_entry_t;
+
+static src_entry_t  src_table[SRC_LIMIT_SLOTS];
+
+/* Limits from fwknopd.conf.
+*/
+static int  rate        = 0;
+static int  burst       = 0;
+static int  fail_limit  = 0;
+static int  block_time  = 0;
+
+/* Owner of the SRC_BLOCK_CMD commands we queue (see extcmd_queue()).
+*/
+static int  block_cmd_owner;
+
+/* Set the limits from the config.  The table itself is kept across a
+ * SIGHUP, so a source that is blocked stays blocked.
+*/
+void
+src_limit_init(fko_srv_options_t *opts)
+{
+    rate        = atoi(opts->config[CONF_SRC_RATE_LIMIT]);
+    burst       = atoi(opts->config[CONF_SRC_RATE_BURST]);
+    fail_limit  = atoi(opts->config[CONF_SRC_FAIL_LIMIT]);
+    block_time  = atoi(opts->config[CONF_SRC_BLOCK_TIME]);
+
+    if(rate < 0)
+        rate = 0;
+    if(burst < 1)
+        burst = 1;
+    if(fail_limit < 0)
+        fail_limit = 0;
+    if(block_time < 1)
+        block_time = 1;
+
+    if(opts->verbose && (rate > 0 || fail_limit > 0))
+        log_msg(LOG_INFO,
+            "Source limits: %i packets/sec (burst %i), %i failed decryptions, blocked for %i seconds.",
+            rate, burst, fail_limit, block_time);
+}
+
+/* Whether slot a is a better one to reuse than slot b.
+*/
+static int
+better_victim(src_entry_t *a, src_entry_t *b, time_t now)
+{
+    int a_blocked = a->blocked_until > now;
+    int b_blocked = b->blocked_until > now;
+
+    if(a_blocked != b_blocked)
+        return(b_blocked);
+
+    return(a->seen < b->seen);
+}
+
+/* Find the entry for src_ip, setting up a new one (if create is set) when
+ * there is none.
+*/
+static src_entry_t *
+src_lookup(unsigned int src_ip, struct timeval *now, int create)
+{
+    src_entry_t    *e, *victim = NULL;
+    unsigned int    hash, i;
+
+    hash  = src_ip * 2654435761U;
+    hash ^= hash >> 16;
+
+    for(i = 0; i < SRC_LIMIT_PROBES; i++)
+    {
+        e = &(src_table[(hash + i) & (SRC_LIMIT_SLOTS - 1)]);
+
+        if(e->ip == src_ip)
+            return(e);
+
+        if(e->ip == 0)
+        {
+            victim = e;
+            break;
+        }
+
+        if(victim == NULL || better_victim(e, victim, now->tv_sec))
+            victim = e;
+    }
+
+    if(! create)
+        return(NULL);
+
+    memset(victim, 0x0, sizeof(*victim));
+
+    victim->ip          = src_ip;
+    victim->tokens      = (long)burst * 1000;
+    victim->last_fill   = *now;
+    victim->fail_time   = now->tv_sec;
+
+    return(victim);
+}
+
+/* Run SRC_BLOCK_CMD (if set) for a newly blocked source, with $SRC and
+ * $TIMEOUT replaced by its IP and the block time.
+*/
+static void
+run_block_cmd(fko_srv_options_t *opts, const char *ip)
+{
+    char        cmd[SRC_BLOCK_CMD_LEN];
+    char        timeout[16];
+    const char *p = opts->config[CONF_SRC_BLOCK_CMD];
+    size_t      len = 0;
+
+    if(p == NULL || *p == '\0')
+        return;
+
+    snprintf(timeout, sizeof(timeout), "%i", block_time);
+
+    while(*p != '\0' && len < sizeof(cmd) - 1)
+    {
+        if(strncmp(p, "$SRC", 4) == 0)
+        {
+            len += strlcpy(cmd + len, ip, sizeof(cmd) - len);
+            p   += 4;
+        }
+        else if(strncmp(p, "$TIMEOUT", 8) == 0)
+        {
+            len += strlcpy(cmd + len, timeout, sizeof(cmd) - len);
+            p   += 8;
+        }
+        else
+            cmd[len++] = *p++;
+    }
+
+    if(len >= sizeof(cmd) - 1 && *p != '\0')
+    {
+        log_msg(LOG_WARNING, "SRC_BLOCK_CMD is too long, not running it.");
+        return;
+    }
+
+    cmd[len] = '\0';
+
+    extcmd_queue(&block_cmd_owner, 1,
+        atoi(opts->config[CONF_CMD_EXEC_QUEUE_LIMIT]), 0, cmd,
+        atoi(opts->config[CONF_CMD_EXEC_TIMEOUT]));
+}
+
+static void
+src_block(fko_srv_options_t *opts, src_entry_t *e, time_t now, const char *why)
+{
+    char    ip[INET_ADDRSTRLEN] = {0};
+
+    e->blocked_until = now + block_time;
+    e->fails         = 0;
+
+    inet_ntop(AF_INET, &(e->ip), ip, sizeof(ip));
+
+    log_msg(LOG_WARNING, "Blocking SPA packets from %s for %i seconds (%s).",
+        ip, block_time, why);
+
+    run_block_cmd(opts, ip);
+}
+
+/* Called for each packet before it is decrypted.  Returns
+ * SPA_MSG_SOURCE_BLOCKED if packets from src_ip are to be dropped.
+*/
+int
+src_limit_check(fko_srv_options_t *opts, unsigned int src_ip)
+{
+    struct timeval  now;
+    src_entry_t    *e;
+    long            elapsed_ms;
+
+    if((rate == 0 && fail_limit == 0) || src_ip == 0)
+        return(SPA_MSG_SUCCESS);
+
+    gettimeofday(&now, NULL);
+
+    e = src_lookup(src_ip, &now, 1);
+    e->seen = now.tv_sec;
+
+    if(e->blocked_until > now.tv_sec)
+        return(SPA_MSG_SOURCE_BLOCKED);
+
+    if(rate == 0)
+        return(SPA_MSG_SUCCESS);
+
+    elapsed_ms = (now.tv_sec - e->last_fill.tv_sec) * 1000
+        + (now.tv_usec - e->last_fill.tv_usec) / 1000;
+
+    if(elapsed_ms > 0)
+    {
+        if(elapsed_ms > (long)burst * 1000)
+            elapsed_ms = (long)burst * 1000;
+
+        e->tokens += elapsed_ms * rate;
+        if(e->tokens > (long)burst * 1000)
+            e->tokens = (long)burst * 1000;
+
+        e->last_fill = now;
+    }
+
+    if(e->tokens < 1000)
+    {
+        /* As in src_limit_fail(), a flood sent in the name of a user we
+         * have recently let in must not lock that user out (or get
+         * SRC_BLOCK_CMD run against them).  We just shed the packets
+         * that go over the rate.
+        */
+        if(e->last_ok != 0 && now.tv_sec - e->last_ok <= SRC_OK_EXEMPT_TIME)
+            return(SPA_MSG_RATE_LIMITED);
+
+        src_block(opts, e, now.tv_sec, "too many SPA packets");
+        return(SPA_MSG_SOURCE_BLOCKED);
+    }
+
+    e->tokens -= 1000;
+
+    return(SPA_MSG_SUCCESS);
+}
+
+/* Count a packet from src_ip that could not be decrypted.
+*/
+void
+src_limit_fail(fko_srv_options_t *opts, unsigned int src_ip)
+{
+    struct timeval  now;
+    src_entry_t    *e;
+    time_t          halvings;
+
+    if(fail_limit == 0 || src_ip == 0)
+        return;
+
+    /* The source address is easily forged, so junk sent in the name of a
+     * user we have recently let in must not lock that user out.
+    */
+    if(src_limit_recent_ok(src_ip, SRC_OK_EXEMPT_TIME))
+        return;
+
+    gettimeofday(&now, NULL);
+
+    e = src_lookup(src_ip, &now, 1);
+    e->seen = now.tv_sec;
+
+    halvings = (now.tv_sec - e->fail_time) / SRC_FAIL_HALF_LIFE;
+    if(halvings > 0)
+    {
+        e->fails = (halvings >= 32) ? 0 : e->fails >> halvings;
+        e->fail_time += halvings * SRC_FAIL_HALF_LIFE;
+    }
+
+    if(++(e->fails) >= (unsigned int)fail_limit
+      && e->blocked_until <= now.tv_sec)
+        src_block(opts, e, now.tv_sec, "too many failed decryptions");
+}
+
+/* A packet from src_ip was accepted, so forget its failures (and note
+ * when it was).
+*/
+void
+src_limit_clear(unsigned int src_ip)
+{
+    struct timeval  now;
+    src_entry_t    *e;
+
+    if(src_ip == 0)
+        return;
+
+    gettimeofday(&now, NULL);
+
+    e = src_lookup(src_ip, &now, 1);
+
+    e->fails    = 0;
+    e->seen     = now.tv_sec;
+    e->last_ok  = now.tv_sec;
+}
+
+/* Whether a packet from src_ip was accepted within the last secs seconds.
+*/
+int
+src_limit_recent_ok(unsigned int src_ip, int secs)
+{
+    struct timeval  now;
+    src_entry_t    *e;
+
+    if(src_ip == 0)
+        return(0);
+
+    gettimeofday(&now, NULL);
+
+    e = src_lookup(src_ip, &now, 0);
+
+    return(e != NULL && e->last_ok != 0 && now.tv_sec - e->last_ok <= secs);
+}
+
+/***EOF***/
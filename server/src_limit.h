@@ -0,0 +1,61 @@
+/*
+ *****************************************************************************
+ *
+ * File:    src_limit.h
+ *
+ * Purpose: Header file for src_limit.c.
+ *
+ *  License (GNU Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SRC_LIMIT_H
+#define SRC_LIMIT_H
+
+/* Number of sources we keep track of (must be a power of 2), and how many
+ * slots are searched for a source before the one seen least recently is
+ * reused.
+*/
+#define SRC_LIMIT_SLOTS     4096
+#define SRC_LIMIT_PROBES    8
+
+/* A source's count of failed decryptions is halved every this many
+ * seconds.
+*/
+#define SRC_FAIL_HALF_LIFE  60
+
+/* A source that had a packet accepted within this many seconds is never
+ * blocked (see src_limit_fail() and src_limit_check()).
+*/
+#define SRC_OK_EXEMPT_TIME  3600
+
+/* Longest SRC_BLOCK_CMD (after substitutions) we will run.
+*/
+#define SRC_BLOCK_CMD_LEN   1024
+
+/* Prototypes
+*/
+void src_limit_init(fko_srv_options_t *opts);
+int src_limit_check(fko_srv_options_t *opts, unsigned int src_ip);
+void src_limit_fail(fko_srv_options_t *opts, unsigned int src_ip);
+void src_limit_clear(unsigned int src_ip);
+int src_limit_recent_ok(unsigned int src_ip, int secs);
+
+#endif /* SRC_LIMIT_H */
+
+/***EOF***/
@@ -5,8 +5,11 @@
  *
  * Author:  Damien Stuart (dstuart@dstuart.org)
  *
- * Purpose: Spawns off a dummy tcp server for fwknopd.  Its purpose is
- *          to accept a tcp connection, then drop it after the first packet.
+ * Purpose: The fwknopd TCP server.  It accepts TCP connections on the
+ *          TCPSERV_PORT, reads the SPA data each client sends (within a
+ *          short deadline) and hands it to the SPA processing code.  It
+ *          runs inside the main event loop and uses epoll where available
+ *          (poll otherwise), so it can juggle many clients at once.
  *
  * Copyright 2010 Damien Stuart (dstuart@dstuart.org)
  *
@@ -31,8 +34,13 @@
 */
 #include "fwknopd_common.h"
 #include "tcp_server.h"
+#include "incoming_spa.h"
+#include "http_req.h"
+#include "metrics.h"
+#include "admission.h"
 #include "log_msg.h"
 #include "utils.h"
+#include "fwknopd_errors.h"
 #include <errno.h>
 
 #if HAVE_SYS_SOCKET_H
@@ -46,80 +54,433 @@
 #endif
 
 #include <fcntl.h>
-#include <sys/select.h>
+#include <sys/time.h>
 
-/* Fork off and run a "dummy" TCP server. The return value is the PID of
- * the child process or -1 if there is a fork error.
+#if HAVE_SYS_EPOLL_H
+  #include <sys/epoll.h>
+#else
+  #include <poll.h>
+#endif
+
+/* The event id we use for the listening socket (connections use their
+ * slot number).
 */
-int
-run_tcp_server(fko_srv_options_t *opts)
+#define LISTEN_EVENT_ID     0xFFFFFFFF
+
+/* A client connection we are reading SPA data from.
+*/
+typedef struct tcp_conn
 {
-    pid_t               pid, ppid;
-    int                 s_sock, c_sock, sfd_flags, clen, selval;
-    int                 reuse_addr = 1;
-    fd_set              sfd_set;
-    struct sockaddr_in  saddr, caddr;
-    struct timeval      tv;
-    char                sipbuf[MAX_IP_STR_LEN];
+    int             fd;             /* -1 when the slot is free */
+    unsigned int    src_ip;
+    unsigned int    dst_ip;
+    unsigned short  src_port;
+    unsigned short  dst_port;
+    struct timeval  started;
+    unsigned int    data_len;
+    unsigned char  *data;           /* MAX_SPA_PACKET_LEN+1 bytes */
+    int             is_http;        /* -1 until we can tell */
+    http_req_t      req;
+} tcp_conn_t;
 
-    unsigned short      port = atoi(opts->config[CONF_TCPSERV_PORT]);
+static int              srv_sock        = -1;
+static unsigned short   srv_port        = 0;
+static int              read_timeout    = 0;
+static int              http_enabled    = 0;
+static int              max_conns       = 0;
+static int              num_conns       = 0;
+static int              accept_paused   = 0;
+static struct timeval   last_sweep;
 
-    log_msg(LOG_INFO, "Kicking off TCP server to listen on port %i.", port);
+static tcp_conn_t      *conns           = NULL;
+static int             *free_slots      = NULL;
+static int              num_free        = 0;
+
+#if HAVE_SYS_EPOLL_H
+static int                  ev_fd       = -1;
+static struct epoll_event  *ev_list     = NULL;
+#else
+static struct pollfd       *ev_list     = NULL;
+static unsigned int        *ev_ids      = NULL;
+#endif
+
+/* Milliseconds since tv.
+*/
+static long
+elapsed_ms(struct timeval *tv)
+{
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+
+    return((now.tv_sec - tv->tv_sec) * 1000
+        + (now.tv_usec - tv->tv_usec) / 1000);
+}
+
+static int
+set_nonblock(int fd)
+{
+    int flags;
+
+    if((flags = fcntl(fd, F_GETFL, 0)) < 0)
+        return(-1);
+
+    if(fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return(-1);
+
+    return(fcntl(fd, F_SETFD, FD_CLOEXEC));
+}
+
+/* Start or stop watching the listening socket for new connections.  We
+ * stop while we are at our connection limit (or out of descriptors) so
+ * the pending connections wait in the kernel backlog instead of waking
+ * us up on every pass.
+*/
+static void
+watch_listener(int on)
+{
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event  ev;
+
+    memset(&ev, 0x0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.u32 = LISTEN_EVENT_ID;
+
+    epoll_ctl(ev_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, srv_sock, &ev);
+#endif
+
+    accept_paused = !on;
+}
 
-    /* Fork off a child process to run the command and provide its outputs.
+static void
+close_conn(int slot)
+{
+    tcp_conn_t  *c = &(conns[slot]);
+
+    /* Closing the socket also drops it from the epoll set.
     */
-    pid = fork();
+    close(c->fd);
+
+    c->fd       = -1;
+    c->data_len = 0;
+
+    free_slots[num_free++] = slot;
+    num_conns--;
 
-    /* Non-zero pid means we are the parent or there was a fork error.
-     * in either case we simply return that value to the caller.
+    if(accept_paused)
+        watch_listener(1);
+}
+
+/* Hand the data read from a connection to incoming_spa() as though it had
+ * just come off the wire, then close the connection.  Returns 1 if there
+ * was any data to process.
+*/
+static int
+finish_conn(fko_srv_options_t *opts, int slot)
+{
+    tcp_conn_t  *c = &(conns[slot]);
+    int          res, got_data = 0;
+
+    /* For an HTTP request, data holds just the SPA data the parser pulled
+     * out of it - if it found any.
     */
-    if (pid != 0)
+    if(c->is_http == 1 && ! http_req_has_spa(&(c->req)))
+        c->data_len = 0;
+
+    if(c->data_len > 0)
     {
-        opts->tcp_server_pid = pid;
-        return(pid);
+        memcpy(opts->spa_pkt.packet_data, c->data, c->data_len);
+        opts->spa_pkt.packet_data[c->data_len] = '\0';
+
+        opts->spa_pkt.packet_data_len = c->data_len;
+        opts->spa_pkt.packet_proto    = IPPROTO_TCP;
+        opts->spa_pkt.packet_src_ip   = c->src_ip;
+        opts->spa_pkt.packet_dst_ip   = c->dst_ip;
+        opts->spa_pkt.packet_src_port = c->src_port;
+        opts->spa_pkt.packet_dst_port = c->dst_port;
+
+        /* For TCP, "capture" covers the wait for the client's data.
+        */
+        metrics_observe(METRIC_STAGE_CAPTURE, elapsed_ms(&(c->started)) * 1000L);
+
+        /* With admission control, the data waits its turn along with
+         * sniffed packets.
+        */
+        if(admit_active())
+            admit_enqueue(opts);
+        else
+        {
+            res = incoming_spa(opts);
+
+            if(res != 0 && opts->verbose > 1)
+                log_msg(LOG_INFO, "incoming_spa returned error %i: '%s' for TCP connection data.",
+                    res, get_errstr(res));
+        }
+
+        got_data = 1;
     }
 
-    /* Get our parent PID so we can periodically check for it. We want to 
-     * know when it goes away so we can to.
-    */
-    ppid = getppid();
+    close_conn(slot);
 
-    /* We are the child.  The first thing to do is close our copy of the
-     * parent PID file so we don't end up holding the lock if the parent
-     * suffers a sudden death that doesn't take us out too.
-    */
-    close(opts->lock_fd);
+    return(got_data);
+}
 
-    /* Now, let's make a TCP server
-    */
-    if ((s_sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+/* Accept everything waiting in the backlog (up to our connection limit).
+*/
+static void
+accept_conns(fko_srv_options_t *opts)
+{
+    int                 c_sock, slot;
+    socklen_t           clen;
+    struct sockaddr_in  caddr, laddr;
+    tcp_conn_t         *c;
+    char                sipbuf[MAX_IP_STR_LEN];
+#if HAVE_SYS_EPOLL_H
+    struct epoll_event  ev;
+#endif
+
+    while(num_free > 0)
     {
-        log_msg(LOG_ERR, "run_tcp_server: socket() failed: %s",
-            strerror(errno));
-        exit(EXIT_FAILURE);
+        clen = sizeof(caddr);
+
+        if((c_sock = accept(srv_sock, (struct sockaddr *) &caddr, &clen)) < 0)
+        {
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                log_msg(LOG_WARNING,
+                    "tcp_server: Out of file descriptors, not accepting new connections for now.");
+                watch_listener(0);
+            }
+            else if(errno != EAGAIN && errno != EWOULDBLOCK
+              && errno != EINTR && errno != ECONNABORTED)
+                log_msg(LOG_ERR, "tcp_server: accept() failed: %s",
+                    strerror(errno));
+            return;
+        }
+
+        clen = sizeof(laddr);
+
+        if(set_nonblock(c_sock) < 0
+          || getsockname(c_sock, (struct sockaddr *) &laddr, &clen) < 0)
+        {
+            close(c_sock);
+            continue;
+        }
+
+        slot = free_slots[--num_free];
+        c    = &(conns[slot]);
+
+        if(c->data == NULL
+          && (c->data = malloc(MAX_SPA_PACKET_LEN+1)) == NULL)
+        {
+            log_msg(LOG_ERR, "Fatal memory allocation error in tcp_server.");
+            exit(EXIT_FAILURE);
+        }
+
+        c->fd       = c_sock;
+        c->src_ip   = caddr.sin_addr.s_addr;
+        c->src_port = ntohs(caddr.sin_port);
+        c->dst_ip   = laddr.sin_addr.s_addr;
+        c->dst_port = ntohs(laddr.sin_port);
+        c->data_len = 0;
+        c->is_http  = http_enabled ? -1 : 0;
+        gettimeofday(&(c->started), NULL);
+
+        num_conns++;
+
+#if HAVE_SYS_EPOLL_H
+        memset(&ev, 0x0, sizeof(ev));
+        ev.events   = EPOLLIN;
+        ev.data.u32 = slot;
+
+        if(epoll_ctl(ev_fd, EPOLL_CTL_ADD, c_sock, &ev) < 0)
+        {
+            log_msg(LOG_ERR, "tcp_server: epoll_ctl() failed: %s",
+                strerror(errno));
+            close_conn(slot);
+            continue;
+        }
+#endif
+
+        if(opts->verbose)
+        {
+            memset(sipbuf, 0x0, MAX_IP_STR_LEN);
+            inet_ntop(AF_INET, &(caddr.sin_addr.s_addr), sipbuf, MAX_IP_STR_LEN);
+            log_msg(LOG_INFO, "tcp_server: Got TCP connection from %s.", sipbuf);
+        }
     }
-      
-    /* So that we can re-bind to it without TIME_WAIT problems
+
+    /* At the connection limit - leave the rest in the backlog until a
+     * slot frees up.
     */
-	setsockopt(s_sock, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+    watch_listener(0);
+}
+
+/* Run newly read data through the HTTP request parser.  The SPA data it
+ * extracts is written back over the start of the connection's buffer, so
+ * data_len ends up as the length of that alone and the request headers
+ * never take up room.  Returns the parser result.
+*/
+static int
+parse_http(tcp_conn_t *c, unsigned int start)
+{
+    int     res;
+
+    if(c->is_http < 0)
+    {
+        if((c->is_http = http_req_start((char *)c->data, c->data_len)) < 0)
+            return(HTTP_REQ_INCOMPLETE);
+
+        if(c->is_http == 0)
+            return(HTTP_REQ_DONE);
+
+        http_req_init(&(c->req), (char *)c->data, MAX_SPA_PACKET_LEN+1);
+        start = 0;
+    }
+
+    res = http_req_feed(&(c->req), (char *)c->data + start, c->data_len - start);
+
+    c->data_len = c->req.out_len;
+
+    return(res);
+}
+
+/* Read whatever the client has sent us.  The SPA data is complete once
+ * the client closes its side of the connection or we have a full packet's
+ * worth (or, for SPA over HTTP, the end of the request headers).  Returns
+ * 1 if data was handed to incoming_spa().
+*/
+static int
+read_conn(fko_srv_options_t *opts, int slot)
+{
+    tcp_conn_t  *c = &(conns[slot]);
+    ssize_t      res;
+    unsigned int start;
+
+    while(c->data_len < MAX_SPA_PACKET_LEN)
+    {
+        start = c->data_len;
+
+        res = read(c->fd, c->data + c->data_len,
+            MAX_SPA_PACKET_LEN - c->data_len);
+
+        if(res > 0)
+        {
+            c->data_len += res;
+
+            if(c->is_http == 0)
+                continue;
+
+            switch(parse_http(c, start))
+            {
+                case HTTP_REQ_INCOMPLETE:
+                    continue;
+                case HTTP_REQ_ERROR:
+                    close_conn(slot);
+                    return(0);
+                default:
+                    /* End of the HTTP request (or it is not HTTP at all).
+                    */
+                    if(c->is_http == 1)
+                        return(finish_conn(opts, slot));
+                    continue;
+            }
+        }
+
+        if(res == 0)
+            return(finish_conn(opts, slot));
+
+        if(errno == EINTR)
+            continue;
+
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return(0);
+
+        /* Connection reset or some other error - drop whatever we have.
+        */
+        c->data_len = 0;
+        close_conn(slot);
+        return(0);
+    }
+
+    return(finish_conn(opts, slot));
+}
+
+/* Deal with connections that have used up their read deadline.  A client
+ * that sent something but did not close the connection still gets its data
+ * processed.
+*/
+static int
+expire_conns(fko_srv_options_t *opts)
+{
+    int     i, processed = 0;
+
+    for(i=0; i<max_conns && num_conns > 0; i++)
+    {
+        if(conns[i].fd < 0 || elapsed_ms(&(conns[i].started)) < read_timeout)
+            continue;
+
+        if(opts->verbose > 1)
+            log_msg(LOG_INFO, "tcp_server: Read deadline reached with %u bytes from client.",
+                conns[i].data_len);
+
+        processed += finish_conn(opts, i);
+    }
 
-    /* Make our main socket non-blocking so we don't have to be stuck on
-     * listening for incoming connections.
+    /* Try again if we stopped accepting because we ran out of descriptors.
     */
-    if((sfd_flags = fcntl(s_sock, F_GETFL, 0)) < 0)
+    if(accept_paused && num_free > 0)
+        watch_listener(1);
+
+    return(processed);
+}
+
+/* Set up the TCP server listening socket and connection table.  Returns 0
+ * on success or -1 if the server could not be started.
+*/
+int
+run_tcp_server(fko_srv_options_t *opts)
+{
+    int                 i, reuse_addr = 1;
+    struct sockaddr_in  saddr;
+
+    unsigned short      port = atoi(opts->config[CONF_TCPSERV_PORT]);
+
+    if(srv_sock >= 0)
+        stop_tcp_server();
+
+    read_timeout = atoi(opts->config[CONF_TCPSERV_READ_TIMEOUT]);
+    if(read_timeout <= 0)
+        read_timeout = atoi(DEF_TCPSERV_READ_TIMEOUT);
+
+    http_enabled = strncasecmp(opts->config[CONF_ENABLE_SPA_OVER_HTTP], "Y", 1) == 0;
+
+    max_conns = atoi(opts->config[CONF_TCPSERV_MAX_CONN]);
+    if(max_conns <= 0)
+        max_conns = atoi(DEF_TCPSERV_MAX_CONN);
+
+    log_msg(LOG_INFO, "Kicking off TCP server to listen on port %i.", port);
+
+    if ((srv_sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
     {
-        log_msg(LOG_ERR, "run_tcp_server: fcntl F_GETFL error: %s",
+        log_msg(LOG_ERR, "run_tcp_server: socket() failed: %s",
             strerror(errno));
-        exit(EXIT_FAILURE);
+        return(-1);
     }
 
-    sfd_flags |= O_NONBLOCK;
+    /* So that we can re-bind to it without TIME_WAIT problems
+    */
+    setsockopt(srv_sock, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
 
-    if(fcntl(s_sock, F_SETFL, sfd_flags) < 0)
+    /* The listening socket is non-blocking so that accepting never holds
+     * up the main loop.
+    */
+    if(set_nonblock(srv_sock) < 0)
     {
-        log_msg(LOG_ERR, "run_tcp_server: fcntl F_SETFL error setting )_NONBLOCK: %s",
+        log_msg(LOG_ERR, "run_tcp_server: fcntl error setting O_NONBLOCK: %s",
             strerror(errno));
-        exit(EXIT_FAILURE);
+        stop_tcp_server();
+        return(-1);
     }
 
     /* Construct local address structure */
@@ -129,88 +490,218 @@ run_tcp_server(fko_srv_options_t *opts)
     saddr.sin_port        = htons(port);       /* Local port */
 
     /* Bind to the local address */
-    if (bind(s_sock, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    if (bind(srv_sock, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
     {
         log_msg(LOG_ERR, "run_tcp_server: bind() failed: %s",
             strerror(errno));
-        exit(EXIT_FAILURE);
+        stop_tcp_server();
+        return(-1);
     }
 
-    /* Mark the socket so it will listen for incoming connections
-     * (but only one at a time)
+    /* Mark the socket so it will listen for incoming connections with
+     * as deep a backlog as the system allows.
     */
-    if (listen(s_sock, 1) < 0)
+    if (listen(srv_sock, SOMAXCONN) < 0)
     {
         log_msg(LOG_ERR, "run_tcp_server: listen() failed: %s",
             strerror(errno));
-        exit(EXIT_FAILURE);
+        stop_tcp_server();
+        return(-1);
     }
 
-    clen = sizeof(caddr);
+    conns       = calloc(max_conns, sizeof(tcp_conn_t));
+    free_slots  = calloc(max_conns, sizeof(int));
+#if HAVE_SYS_EPOLL_H
+    ev_list     = calloc(TCPSERV_MAX_EVENTS, sizeof(struct epoll_event));
+#else
+    ev_list     = calloc(max_conns+1, sizeof(struct pollfd));
+    ev_ids      = calloc(max_conns+1, sizeof(unsigned int));
+#endif
 
-    /* Now loop and accept and drop connections after the first packet or a
-     * short timeout.
+    if(conns == NULL || free_slots == NULL || ev_list == NULL
+#if !HAVE_SYS_EPOLL_H
+      || ev_ids == NULL
+#endif
+    )
+    {
+        log_msg(LOG_ERR, "Fatal memory allocation error in run_tcp_server.");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Hand out the low slots first.
     */
-    while(1)
+    for(i=0; i<max_conns; i++)
     {
-        /* Initialize and setup the socket for select.
-        */
-        FD_ZERO(&sfd_set);
-        FD_SET(s_sock, &sfd_set);
+        conns[i].fd = -1;
+        free_slots[i] = max_conns - 1 - i;
+    }
+    num_free  = max_conns;
+    num_conns = 0;
 
-        /* Set our select timeout to 200 ms.
-        */
-        tv.tv_sec = 0;
-        tv.tv_usec = 200000;
+#if HAVE_SYS_EPOLL_H
+    if((ev_fd = epoll_create(max_conns+1)) < 0)
+    {
+        log_msg(LOG_ERR, "run_tcp_server: epoll_create() failed: %s",
+            strerror(errno));
+        stop_tcp_server();
+        return(-1);
+    }
+    fcntl(ev_fd, F_SETFD, FD_CLOEXEC);
+#endif
 
-        selval = select(s_sock+1, &sfd_set, NULL, NULL, &tv);
+    watch_listener(1);
 
-        if(selval == -1)
-        {
-            /* Select error - so kill the child and bail.
-            */
-            log_msg(LOG_ERR, "run_tcp_server: select error socket: %s",
-                strerror(errno));
-            exit(EXIT_FAILURE);
-        }
+    srv_port = port;
+    gettimeofday(&last_sweep, NULL);
 
-        if(selval == 0)
-        {
-            /* Timeout - So we check to make sure our parent is still there by simply
-             *           using kill(ppid, 0) and checking the return value.
-            */
-            if(kill(ppid, 0) != 0 && errno == ESRCH)
-                exit(EXIT_FAILURE);
+    return(0);
+}
+
+/* Accept new connections, read from the ones that have data and expire
+ * those past their deadline.  We wait up to wait_ms for something to
+ * happen if nothing is ready.  Returns the number of SPA payloads passed
+ * to incoming_spa().
+*/
+int
+tcp_server_service(fko_srv_options_t *opts, int wait_ms)
+{
+    int             i, nev, processed = 0;
+    unsigned int    id;
+#if !HAVE_SYS_EPOLL_H
+    int             slot;
+#endif
 
+    if(srv_sock < 0)
+        return(0);
+
+#if HAVE_SYS_EPOLL_H
+    nev = epoll_wait(ev_fd, ev_list, TCPSERV_MAX_EVENTS, wait_ms);
+
+    for(i=0; i<nev; i++)
+    {
+        id = ev_list[i].data.u32;
+#else
+    nev = 0;
+
+    if(!accept_paused)
+    {
+        ev_list[nev].fd     = srv_sock;
+        ev_list[nev].events = POLLIN;
+        ev_ids[nev++]       = LISTEN_EVENT_ID;
+    }
+
+    for(slot=0; slot<max_conns; slot++)
+    {
+        if(conns[slot].fd < 0)
             continue;
-        }
 
-        /* Wait for a client to connect
-        */
-        if((c_sock = accept(s_sock, (struct sockaddr *) &caddr, (socklen_t *)&clen)) < 0)
-        {
-            log_msg(LOG_ERR, "run_tcp_server: accept() failed: %s",
-                strerror(errno));
-            exit(EXIT_FAILURE); /* Should this be fatal? */
-        }
+        ev_list[nev].fd     = conns[slot].fd;
+        ev_list[nev].events = POLLIN;
+        ev_ids[nev++]       = slot;
+    }
 
-        if(opts->verbose)
+    if(poll(ev_list, nev, wait_ms) <= 0)
+        nev = 0;
+
+    for(i=0; i<nev; i++)
+    {
+        if(ev_list[i].revents == 0)
+            continue;
+
+        id = ev_ids[i];
+#endif
+
+        if(id == LISTEN_EVENT_ID)
+            accept_conns(opts);
+        else if(conns[id].fd >= 0)
+            processed += read_conn(opts, id);
+    }
+
+    /* Checking the read deadlines every tenth of a second is plenty.
+    */
+    if(elapsed_ms(&last_sweep) >= 100)
+    {
+        processed += expire_conns(opts);
+        gettimeofday(&last_sweep, NULL);
+    }
+
+    return(processed);
+}
+
+/* Is the TCP server running?
+*/
+int
+tcp_server_active(void)
+{
+    return(srv_sock >= 0);
+}
+
+/* The port the TCP server is listening on, or 0 if it is not running.
+*/
+unsigned short
+tcp_server_port(void)
+{
+    return(srv_sock >= 0 ? srv_port : 0);
+}
+
+/* Close the listening socket and every client connection and free the
+ * connection table.  This is also used by forked children that must not
+ * hold on to the server's descriptors.
+*/
+void
+stop_tcp_server(void)
+{
+    int     i;
+
+    if(conns != NULL)
+    {
+        for(i=0; i<max_conns; i++)
         {
-            memset(sipbuf, 0x0, MAX_IP_STR_LEN);
-            inet_ntop(AF_INET, &(caddr.sin_addr.s_addr), sipbuf, MAX_IP_STR_LEN);
-            log_msg(LOG_INFO, "tcp_server: Got TCP connection from %s.", sipbuf);
+            if(conns[i].fd >= 0)
+                close(conns[i].fd);
+            if(conns[i].data != NULL)
+                free(conns[i].data);
         }
+        free(conns);
+        conns = NULL;
+    }
 
-        /* Though hacky and clunky, we just sleep for a second then
-         * close the socket.  No need to read or write anything.  This
-         * just gives the client a sufficient window to send their
-         * request on this socket. In any case the socket is closed
-         * after that time.
-        */
-        usleep(1000000);
-        shutdown(c_sock, SHUT_RDWR);
-        close(c_sock);
+    if(free_slots != NULL)
+    {
+        free(free_slots);
+        free_slots = NULL;
+    }
+
+    if(ev_list != NULL)
+    {
+        free(ev_list);
+        ev_list = NULL;
+    }
+
+#if HAVE_SYS_EPOLL_H
+    if(ev_fd >= 0)
+    {
+        close(ev_fd);
+        ev_fd = -1;
     }
+#else
+    if(ev_ids != NULL)
+    {
+        free(ev_ids);
+        ev_ids = NULL;
+    }
+#endif
+
+    if(srv_sock >= 0)
+    {
+        close(srv_sock);
+        srv_sock = -1;
+    }
+
+    srv_port      = 0;
+    num_conns     = 0;
+    num_free      = 0;
+    accept_paused = 0;
 }
 
 /***EOF***/
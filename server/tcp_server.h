@@ -31,9 +31,17 @@
 #ifndef TCP_SERVER_H
 #define TCP_SERVER_H
 
+/* Most connection events we handle in one pass of the main loop.
+*/
+#define TCPSERV_MAX_EVENTS  256
+
 /* Function prototypes
 */
 int run_tcp_server(fko_srv_options_t *opts);
+int tcp_server_service(fko_srv_options_t *opts, int wait_ms);
+int tcp_server_active(void);
+unsigned short tcp_server_port(void);
+void stop_tcp_server(void);
 
 #endif /* TCP_SERVER_H */
 